@@ -0,0 +1,111 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_BENCH_H
+#define RDPMUX_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+/**
+ * @brief Damage patterns a simulated VM can produce.
+ */
+typedef enum bench_pattern {
+    PATTERN_IDLE,       ///< Nothing changes at all.
+    PATTERN_TYPING,     ///< One glyph-sized cell changes about every 100 ms, like someone typing into an editor.
+    PATTERN_SCROLLING,  ///< The whole screen moves up by a line of text every frame.
+    PATTERN_VIDEO,      ///< Every pixel changes every frame.
+} bench_pattern;
+
+/**
+ * @brief Size of the marker square the latency probe toggles, in the top-left corner of the screen.
+ */
+#define BENCH_MARKER_SIZE 16
+
+/**
+ * @brief Where the latency probe moves the mouse to. The parity of the x-coordinate selects the marker color.
+ */
+#define BENCH_PROBE_X 100
+#define BENCH_PROBE_Y 100
+
+/**
+ * @brief Maximum number of latency samples kept per client.
+ */
+#define BENCH_MAX_SAMPLES 4096
+
+typedef struct bench_config {
+    int vms;                ///< Number of simulated VMs.
+    int clients;            ///< Number of RDP clients per VM.
+    bench_pattern pattern;  ///< What the VMs draw.
+    int duration;           ///< How long to measure for, in s.
+    int width;              ///< Width of the VM framebuffers in px.
+    int height;             ///< Height of the VM framebuffers in px.
+    uint16_t port;          ///< Port of the first VM's listener. VM i is told to listen on port + i.
+    const char *host;       ///< Host the RDP clients connect to.
+    const char *username;   ///< Credentials for the RDP clients, NULL to connect without NLA.
+    const char *password;
+    int server_pid;         ///< Process ID of the RDPMux server, to measure its CPU time. 0 if unknown.
+} bench_config;
+
+/**
+ * @brief What a simulated VM reports back. Lives in memory shared between the parent and the VM processes.
+ */
+typedef struct bench_vm_stats {
+    volatile bool ready;    ///< Set once the VM is registered with the server and connected.
+    volatile bool failed;   ///< Set if the VM could not register or connect.
+    volatile bool stop;     ///< Set by the parent to make the VM exit.
+    uint64_t ticks;         ///< Number of times the VM refreshed its display.
+    uint64_t updates;       ///< Number of those that had damage to report.
+    uint64_t pixels;        ///< Number of pixels damaged.
+    struct rusage usage;    ///< CPU time the VM process used, filled in by the parent once it exited.
+} bench_vm_stats;
+
+/**
+ * @brief What an RDP client measured.
+ */
+typedef struct bench_client_stats {
+    bool connected;
+    uint64_t frames;                        ///< Number of frames received while measuring.
+    uint64_t probes;                        ///< Number of latency probes sent.
+    uint64_t timeouts;                      ///< Number of those the screen didn't reflect within a second.
+    uint32_t samples;                       ///< Number of latency samples taken.
+    uint32_t latency_us[BENCH_MAX_SAMPLES]; ///< Time from sending a probe to receiving the frame showing it.
+} bench_client_stats;
+
+/**
+ * @brief Runs a simulated VM until the parent sets stats->stop. Meant to be the only thing a forked child process does,
+ * since librdpmux only supports a single display per process.
+ *
+ * @returns The exit status for the process.
+ */
+int bench_vm_run(const bench_config *config, int index, bench_vm_stats *stats);
+
+/**
+ * @brief Connects a headless RDP client to a VM and measures it.
+ *
+ * @param measuring Set while the measurement is running. Frames and probes outside of it aren't counted.
+ * @param stop Set when the client should disconnect.
+ */
+void bench_client_run(const bench_config *config, int index, bench_client_stats *stats, volatile bool *measuring,
+                      volatile bool *stop);
+
+/**
+ * @brief Gets the current time on the monotonic clock, in µs.
+ */
+uint64_t bench_now_us(void);
+
+#endif //RDPMUX_BENCH_H
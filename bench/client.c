@@ -0,0 +1,222 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file Headless RDP client. Decodes everything it receives into a GDI framebuffer like a real client would, counts the
+ * frames, and measures input latency by moving the mouse and waiting for the simulated VM's marker to change color.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <freerdp/freerdp.h>
+#include <freerdp/gdi/gdi.h>
+#include <freerdp/input.h>
+#include <winpr/synch.h>
+#include "bench.h"
+
+/**
+ * @brief How long a probe may take before it counts as lost, and how long to wait between probes, in µs.
+ */
+#define PROBE_TIMEOUT 1000000
+#define PROBE_INTERVAL 250000
+
+/**
+ * @brief How often to try connecting before giving up. The listener only comes up once the VM registered.
+ */
+#define CONNECT_ATTEMPTS 10
+
+typedef struct bench_context {
+    rdpContext context;
+    bench_client_stats *stats;
+    volatile bool *measuring;
+
+    int marker_seen;        ///< Marker color in the last frame, -1 before the first one.
+    int probe_color;        ///< Marker color the outstanding probe asked for, -1 if there's none.
+    uint64_t probe_sent;
+} bench_context;
+
+/**
+ * @brief Reads the marker color off the framebuffer.
+ */
+static int bench_marker_color(rdpGdi *gdi)
+{
+    const int offset = BENCH_MARKER_SIZE / 2;
+    if (gdi->width <= offset || gdi->height <= offset)
+        return -1;
+
+    const BYTE *pixel = gdi->primary_buffer + offset * gdi->stride + offset * GetBytesPerPixel(gdi->dstFormat);
+    int luminance = (pixel[0] + pixel[1] + pixel[2]) / 3; // lossy codecs won't give us exactly black and white
+
+    return luminance >= 128 ? 1 : 0;
+}
+
+static BOOL bench_begin_paint(rdpContext *context)
+{
+    HGDI_WND hwnd = context->gdi->primary->hdc->hwnd;
+    hwnd->invalid->null = TRUE;
+    hwnd->ninvalid = 0;
+    return TRUE;
+}
+
+static BOOL bench_end_paint(rdpContext *context)
+{
+    bench_context *bench = (bench_context *) context;
+
+    // updates that didn't draw anything, e.g. a bare frame marker, aren't frames
+    if (context->gdi->primary->hdc->hwnd->invalid->null)
+        return TRUE;
+
+    if (*bench->measuring)
+        bench->stats->frames++;
+
+    bench->marker_seen = bench_marker_color(context->gdi);
+    if (bench->probe_color >= 0 && bench->marker_seen == bench->probe_color) {
+        bench_client_stats *stats = bench->stats;
+        if (*bench->measuring && stats->samples < BENCH_MAX_SAMPLES)
+            stats->latency_us[stats->samples++] = (uint32_t) (bench_now_us() - bench->probe_sent);
+        bench->probe_color = -1;
+    }
+
+    return TRUE;
+}
+
+static BOOL bench_pre_connect(freerdp *instance)
+{
+    return TRUE;
+}
+
+static BOOL bench_post_connect(freerdp *instance)
+{
+    if (!gdi_init(instance, PIXEL_FORMAT_BGRX32))
+        return FALSE;
+
+    // nothing is shown anywhere, so all painting amounts to is resetting what GDI tracks as invalid
+    instance->update->BeginPaint = bench_begin_paint;
+    instance->update->EndPaint = bench_end_paint;
+    return TRUE;
+}
+
+static void bench_client_free(freerdp *instance)
+{
+    gdi_free(instance);
+    freerdp_context_free(instance);
+    freerdp_free(instance);
+}
+
+/**
+ * @brief Creates a client and connects it.
+ *
+ * @returns The connected client, NULL if it couldn't connect.
+ */
+static freerdp *bench_client_connect(const bench_config *config, int index, bench_client_stats *stats,
+                                     volatile bool *measuring)
+{
+    freerdp *instance = freerdp_new();
+    if (instance == NULL)
+        return NULL;
+
+    instance->ContextSize = sizeof(bench_context);
+    instance->PreConnect = bench_pre_connect;
+    instance->PostConnect = bench_post_connect;
+    if (!freerdp_context_new(instance)) {
+        freerdp_free(instance);
+        return NULL;
+    }
+
+    bench_context *bench = (bench_context *) instance->context;
+    bench->stats = stats;
+    bench->measuring = measuring;
+    bench->marker_seen = -1;
+    bench->probe_color = -1;
+
+    rdpSettings *settings = instance->settings;
+    settings->ServerHostname = _strdup(config->host);
+    settings->ServerPort = config->port + index;
+    settings->IgnoreCertificate = TRUE;
+    settings->SoftwareGdi = TRUE;
+    settings->ColorDepth = 32;
+    settings->RemoteFxCodec = TRUE;
+    settings->FastPathOutput = TRUE;
+    settings->FrameMarkerCommandEnabled = TRUE;
+    settings->SurfaceFrameMarkerEnabled = TRUE;
+
+    if (config->username) {
+        settings->Username = _strdup(config->username);
+        settings->Password = _strdup(config->password ? config->password : "");
+    } else {
+        settings->NlaSecurity = FALSE;
+    }
+
+    if (!freerdp_connect(instance)) {
+        bench_client_free(instance);
+        return NULL;
+    }
+    return instance;
+}
+
+void bench_client_run(const bench_config *config, int index, bench_client_stats *stats, volatile bool *measuring,
+                      volatile bool *stop)
+{
+    freerdp *instance = NULL;
+    for (int attempt = 0; attempt < CONNECT_ATTEMPTS && !*stop; attempt++) {
+        if ((instance = bench_client_connect(config, index, stats, measuring)) != NULL)
+            break;
+        sleep(1);
+    }
+
+    if (instance == NULL) {
+        fprintf(stderr, "client for vm %d: could not connect to %s:%u\n", index, config->host,
+                (unsigned int) (config->port + index));
+        return;
+    }
+    stats->connected = true;
+
+    bench_context *bench = (bench_context *) instance->context;
+    uint64_t next_probe = bench_now_us() + PROBE_INTERVAL;
+
+    while (!*stop && !freerdp_shall_disconnect(instance)) {
+        HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+        DWORD count = freerdp_get_event_handles(instance->context, handles, MAXIMUM_WAIT_OBJECTS);
+        if (count == 0)
+            break;
+
+        if (WaitForMultipleObjects(count, handles, FALSE, 10) == WAIT_FAILED)
+            break;
+        if (!freerdp_check_event_handles(instance->context))
+            break;
+
+        uint64_t now = bench_now_us();
+        if (bench->probe_color >= 0 && now - bench->probe_sent > PROBE_TIMEOUT) {
+            if (*measuring)
+                stats->timeouts++;
+            bench->probe_color = -1;
+        }
+
+        // always ask for the opposite of what's on screen, so a late answer to a lost probe can't pass for this one
+        if (bench->probe_color < 0 && bench->marker_seen >= 0 && now >= next_probe) {
+            bench->probe_color = !bench->marker_seen;
+            bench->probe_sent = now;
+            if (*measuring)
+                stats->probes++;
+            freerdp_input_send_mouse_event(instance->input, PTR_FLAGS_MOVE,
+                                           (UINT16) (BENCH_PROBE_X + bench->probe_color), BENCH_PROBE_Y);
+            next_probe = now + PROBE_INTERVAL;
+        }
+    }
+
+    freerdp_disconnect(instance);
+    bench_client_free(instance);
+}
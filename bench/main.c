@@ -0,0 +1,368 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file End-to-end benchmark. Forks one simulated VM per process, since librdpmux only handles a single display per
+ * process just like QEMU, connects headless RDP clients to them through a running RDPMux server, and reports frame
+ * rates, input latency and CPU usage as key=value lines.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+/**
+ * @brief How long to wait for the VMs to register and the clients to connect, in s.
+ */
+#define STARTUP_TIMEOUT 15
+
+/**
+ * @brief How long to let things settle after everyone connected before measuring, in s.
+ */
+#define WARMUP 2
+
+typedef struct bench_client_thread {
+    pthread_t thread;
+    const bench_config *config;
+    int vm;
+    bool started;
+    bench_client_stats stats;
+} bench_client_thread;
+
+static volatile bool measuring = false;
+static volatile bool stopping = false;
+
+uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *bench_client_thread_run(void *arg)
+{
+    bench_client_thread *client = (bench_client_thread *) arg;
+    bench_client_run(client->config, client->vm, &client->stats, &measuring, &stopping);
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n, --vms N           number of simulated VMs (default 1)\n"
+            "  -c, --clients N       RDP clients per VM (default 1)\n"
+            "  -P, --pattern NAME    idle, typing, scrolling or video (default typing)\n"
+            "  -d, --duration S      seconds to measure for (default 30)\n"
+            "  -W, --width PX        framebuffer width (default 1024)\n"
+            "  -H, --height PX       framebuffer height (default 768)\n"
+            "  -p, --port PORT       port of the first VM's listener (default 3901)\n"
+            "  -h, --host HOST       host the RDPMux server listens on (default 127.0.0.1)\n"
+            "  -u, --username USER   connect with NLA as USER\n"
+            "  -w, --password PASS   password for --username\n"
+            "  -s, --server-pid PID  measure the CPU time of the RDPMux server as well\n",
+            name);
+}
+
+static bool parse_pattern(const char *name, bench_pattern *pattern)
+{
+    if (strcmp(name, "idle") == 0)
+        *pattern = PATTERN_IDLE;
+    else if (strcmp(name, "typing") == 0)
+        *pattern = PATTERN_TYPING;
+    else if (strcmp(name, "scrolling") == 0)
+        *pattern = PATTERN_SCROLLING;
+    else if (strcmp(name, "video") == 0)
+        *pattern = PATTERN_VIDEO;
+    else
+        return false;
+    return true;
+}
+
+static const char *pattern_name(bench_pattern pattern)
+{
+    switch (pattern) {
+        case PATTERN_IDLE:
+            return "idle";
+        case PATTERN_TYPING:
+            return "typing";
+        case PATTERN_SCROLLING:
+            return "scrolling";
+        default:
+            return "video";
+    }
+}
+
+/**
+ * @brief Gets the CPU time a process used so far, in s.
+ *
+ * @returns The CPU time, or a negative value if the process couldn't be looked at.
+ */
+static double process_cpu_time(int pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    // the command name may contain spaces, the fields we want are counted from the parenthesis closing it
+    char *fields = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (fields == NULL ||
+        sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double rusage_cpu_time(const struct rusage *usage)
+{
+    return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 +
+           usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_sleep_s(double s)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) s;
+    ts.tv_nsec = (long) ((s - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+int main(int argc, char **argv)
+{
+    bench_config config = {1, 1, PATTERN_TYPING, 30, 1024, 768, 3901, "127.0.0.1", NULL, NULL, 0};
+
+    static const struct option options[] = {
+            {"vms", required_argument, NULL, 'n'},
+            {"clients", required_argument, NULL, 'c'},
+            {"pattern", required_argument, NULL, 'P'},
+            {"duration", required_argument, NULL, 'd'},
+            {"width", required_argument, NULL, 'W'},
+            {"height", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"host", required_argument, NULL, 'h'},
+            {"username", required_argument, NULL, 'u'},
+            {"password", required_argument, NULL, 'w'},
+            {"server-pid", required_argument, NULL, 's'},
+            {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:c:P:d:W:H:p:h:u:w:s:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'n': config.vms = atoi(optarg); break;
+            case 'c': config.clients = atoi(optarg); break;
+            case 'd': config.duration = atoi(optarg); break;
+            case 'W': config.width = atoi(optarg); break;
+            case 'H': config.height = atoi(optarg); break;
+            case 'p': config.port = (uint16_t) atoi(optarg); break;
+            case 'h': config.host = optarg; break;
+            case 'u': config.username = optarg; break;
+            case 'w': config.password = optarg; break;
+            case 's': config.server_pid = atoi(optarg); break;
+            case 'P':
+                if (!parse_pattern(optarg, &config.pattern)) {
+                    fprintf(stderr, "Unknown pattern %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // the probe has to land on the framebuffer
+    if (config.vms < 1 || config.clients < 0 || config.duration < 1 ||
+        config.width <= BENCH_PROBE_X + 1 || config.height <= BENCH_PROBE_Y) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bench_vm_stats *vms = mmap(NULL, sizeof(bench_vm_stats) * config.vms, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (vms == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(vms, 0, sizeof(bench_vm_stats) * config.vms);
+
+    // fork before any threads exist
+    pid_t *pids = calloc(config.vms, sizeof(pid_t));
+    for (int i = 0; i < config.vms; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            signal(SIGINT, SIG_IGN); // the parent decides when we stop
+            _exit(bench_vm_run(&config, i, &vms[i]));
+        } else if (pids[i] < 0) {
+            perror("fork");
+            config.vms = i;
+            break;
+        }
+    }
+
+    uint64_t deadline = bench_now_us() + STARTUP_TIMEOUT * 1000000ULL;
+    int ready = 0;
+    while (bench_now_us() < deadline) {
+        ready = 0;
+        int failed = 0;
+        for (int i = 0; i < config.vms; i++) {
+            ready += vms[i].ready;
+            failed += vms[i].failed;
+        }
+        if (ready + failed == config.vms)
+            break;
+        bench_sleep_s(0.1);
+    }
+    if (ready < config.vms)
+        fprintf(stderr, "Only %d of %d VMs came up\n", ready, config.vms);
+
+    int client_count = config.vms * config.clients;
+    bench_client_thread *clients = calloc(client_count ? client_count : 1, sizeof(bench_client_thread));
+    for (int i = 0; i < client_count; i++) {
+        clients[i].config = &config;
+        clients[i].vm = i / config.clients;
+        if (!vms[clients[i].vm].ready)
+            continue;
+        clients[i].started = pthread_create(&clients[i].thread, NULL, bench_client_thread_run, &clients[i]) == 0;
+    }
+
+    int connected = 0;
+    while (bench_now_us() < deadline) {
+        connected = 0;
+        for (int i = 0; i < client_count; i++)
+            connected += clients[i].stats.connected;
+        if (connected == client_count)
+            break;
+        bench_sleep_s(0.1);
+    }
+    bench_sleep_s(WARMUP);
+
+    // CPU time is measured over the measurement period only, so startup doesn't skew it
+    struct rusage self_start, self_end;
+    getrusage(RUSAGE_SELF, &self_start);
+    double server_start = config.server_pid ? process_cpu_time(config.server_pid) : -1;
+    uint64_t vm_start_ticks = 0;
+    for (int i = 0; i < config.vms; i++)
+        vm_start_ticks += vms[i].ticks;
+
+    uint64_t start = bench_now_us();
+    measuring = true;
+    bench_sleep_s(config.duration);
+    measuring = false;
+    double elapsed = (bench_now_us() - start) / 1e6;
+
+    getrusage(RUSAGE_SELF, &self_end);
+    double server_end = config.server_pid ? process_cpu_time(config.server_pid) : -1;
+
+    stopping = true;
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].started)
+            pthread_join(clients[i].thread, NULL);
+    }
+    for (int i = 0; i < config.vms; i++) {
+        vms[i].stop = true;
+        wait4(pids[i], NULL, 0, &vms[i].usage);
+    }
+
+    // the VMs run for longer than the measurement, so their CPU time is scaled to their ticks within it
+    uint64_t vm_ticks = 0, vm_updates = 0, vm_pixels = 0;
+    double vm_cpu = 0;
+    for (int i = 0; i < config.vms; i++) {
+        vm_ticks += vms[i].ticks;
+        vm_updates += vms[i].updates;
+        vm_pixels += vms[i].pixels;
+        vm_cpu += rusage_cpu_time(&vms[i].usage);
+    }
+    double vm_share = vm_ticks ? (double) (vm_ticks - vm_start_ticks) / vm_ticks : 0;
+
+    uint64_t frames = 0, probes = 0, timeouts = 0;
+    double fps_min = -1;
+    uint32_t samples = 0;
+    for (int i = 0; i < client_count; i++) {
+        bench_client_stats *stats = &clients[i].stats;
+        if (!stats->connected)
+            continue;
+        double fps = stats->frames / elapsed;
+        if (fps_min < 0 || fps < fps_min)
+            fps_min = fps;
+        frames += stats->frames;
+        probes += stats->probes;
+        timeouts += stats->timeouts;
+        samples += stats->samples;
+    }
+
+    uint32_t *latency = calloc(samples ? samples : 1, sizeof(uint32_t));
+    uint32_t n = 0;
+    for (int i = 0; i < client_count; i++) {
+        memcpy(latency + n, clients[i].stats.latency_us, clients[i].stats.samples * sizeof(uint32_t));
+        n += clients[i].stats.samples;
+    }
+    qsort(latency, samples, sizeof(uint32_t), compare_u32);
+
+    printf("pattern=%s\n", pattern_name(config.pattern));
+    printf("vms=%d vms_ready=%d\n", config.vms, ready);
+    printf("clients=%d clients_connected=%d\n", client_count, connected);
+    printf("resolution=%dx%d\n", config.width, config.height);
+    printf("duration_s=%.2f\n", elapsed);
+    printf("fps_mean=%.2f\n", connected ? frames / elapsed / connected : 0);
+    printf("fps_min=%.2f\n", fps_min < 0 ? 0 : fps_min);
+    printf("vm_refresh_rate=%.2f\n", config.vms ? vm_ticks * vm_share / elapsed / config.vms : 0);
+    printf("vm_updates=%llu vm_pixels=%llu\n", (unsigned long long) vm_updates, (unsigned long long) vm_pixels);
+    printf("probes=%llu probes_lost=%llu\n", (unsigned long long) probes, (unsigned long long) timeouts);
+    if (samples > 0) {
+        printf("latency_p50_ms=%.2f\n", latency[samples / 2] / 1000.0);
+        printf("latency_p95_ms=%.2f\n", latency[(uint32_t) (samples * 0.95)] / 1000.0);
+        printf("latency_p99_ms=%.2f\n", latency[(uint32_t) (samples * 0.99)] / 1000.0);
+        printf("latency_max_ms=%.2f\n", latency[samples - 1] / 1000.0);
+    }
+
+    // CPU usage as a percentage of a single core
+    printf("cpu_clients_pct=%.1f\n",
+           (rusage_cpu_time(&self_end) - rusage_cpu_time(&self_start)) / elapsed * 100);
+    printf("cpu_vms_pct=%.1f\n", vm_cpu * vm_share / elapsed * 100);
+    if (server_start >= 0 && server_end >= 0)
+        printf("cpu_server_pct=%.1f\n", (server_end - server_start) / elapsed * 100);
+
+    free(latency);
+    free(clients);
+    free(pids);
+    munmap(vms, sizeof(bench_vm_stats) * config.vms);
+
+    return ready == config.vms && connected == client_count ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../../lib/src/common.h"
+#include "../../lib/src/copy.h"
+#include "../../lib/src/damage.h"
+#include "../../lib/src/diff.h"
+#include "../../lib/src/msgpack.h"
+#include "../../lib/src/wire.h"
+#include "kernels.h"
+
+// normally defined in rdpmux.c, which drags in 0mq and DBus
+InputEventCallbacks callbacks;
+MuxDisplay *display;
+
+static MuxDisplay bench_display;
+static MuxUpdate update;
+static nnStr msgpack_msg;
+static uint8_t wire_buf[MUX_WIRE_MAX_SIZE];
+static display_update rects[MUX_MAX_UPDATE_RECTS];
+
+static void bench_receive_kb(uint32_t keycode, uint32_t flags)
+{
+}
+
+static void bench_receive_mouse(uint32_t x, uint32_t y, uint32_t flags)
+{
+}
+
+void kernels_init(void)
+{
+    display = &bench_display;
+    callbacks.mux_receive_kb = bench_receive_kb;
+    callbacks.mux_receive_mouse = bench_receive_mouse;
+    mux_diff_init();
+}
+
+void kernels_copy_pixels(uint8_t *dst, int dst_step, int x, int y, int width, int height, uint8_t *src, int src_step)
+{
+    mux_copy_pixels(dst, dst_step, x, y, width, height, src, src_step, x, y, 32);
+}
+
+bool kernels_copy_pixels_diff(uint8_t *dst, int dst_step, int x, int y, int width, int height, const uint8_t *src,
+                              int src_step)
+{
+    return mux_copy_pixels_diff(dst, dst_step, x, y, width, height, src, src_step, 32);
+}
+
+MuxDamage *kernels_damage_new(int width, int height)
+{
+    MuxDamage *damage = g_malloc0(sizeof(MuxDamage));
+    if (!mux_damage_resize(damage, width, height)) {
+        g_free(damage);
+        return NULL;
+    }
+    return damage;
+}
+
+void kernels_damage_free(MuxDamage *damage)
+{
+    mux_damage_free(damage);
+    g_free(damage);
+}
+
+void kernels_damage_add(MuxDamage *damage, int x, int y, int width, int height)
+{
+    mux_damage_add(damage, x, y, width, height);
+}
+
+void kernels_damage_add_all(MuxDamage *damage)
+{
+    mux_damage_add_all(damage);
+}
+
+int kernels_damage_collect(MuxDamage *damage)
+{
+    return mux_damage_collect(damage, rects, MUX_MAX_UPDATE_RECTS);
+}
+
+void kernels_sync_damaged_tiles(MuxDamage *damage, uint8_t *dst, int dst_step, uint8_t *src, int src_step)
+{
+    mux_sync_damaged_tiles(damage, dst, dst_step, src, src_step, 32);
+}
+
+void kernels_prepare_update(int count)
+{
+    memset(&update, 0, sizeof(update));
+    update.type = DISPLAY_UPDATE_RECTS;
+    update.disp_rects.count = MIN(count, MUX_MAX_UPDATE_RECTS);
+    for (uint32_t i = 0; i < update.disp_rects.count; i++) {
+        display_update *r = &update.disp_rects.rects[i];
+        r->x1 = (i % 8) * MUX_TILE_SIZE * 2;
+        r->y1 = (i / 8) * MUX_TILE_SIZE * 2;
+        r->x2 = r->x1 + MUX_TILE_SIZE;
+        r->y2 = r->y1 + MUX_TILE_SIZE;
+    }
+}
+
+size_t kernels_write_update_msgpack(const void **data)
+{
+    size_t len = mux_write_outgoing_msg(&update, &msgpack_msg);
+    *data = msgpack_msg.buf;
+    return len;
+}
+
+size_t kernels_write_update_wire(const void **data)
+{
+    *data = wire_buf;
+    return mux_wire_write_msg(&update, wire_buf, sizeof(wire_buf));
+}
+
+void kernels_process_incoming(const void *data, size_t size)
+{
+    mux_process_incoming_msg(data, (int) size);
+}
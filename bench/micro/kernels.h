@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_BENCH_KERNELS_H
+#define RDPMUX_BENCH_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file Thin wrappers around the librdpmux internals the microbenchmarks measure. The library's private headers are C
+ * and pull in most of its dependencies, so they stay behind this header rather than being included from C++.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mux_damage MuxDamage;
+
+/**
+ * @brief Sets up the library state the message kernels touch, with input callbacks that do nothing.
+ */
+void kernels_init(void);
+
+void kernels_copy_pixels(uint8_t *dst, int dst_step, int x, int y, int width, int height, uint8_t *src, int src_step);
+bool kernels_copy_pixels_diff(uint8_t *dst, int dst_step, int x, int y, int width, int height, const uint8_t *src,
+                              int src_step);
+
+MuxDamage *kernels_damage_new(int width, int height);
+void kernels_damage_free(MuxDamage *damage);
+void kernels_damage_add(MuxDamage *damage, int x, int y, int width, int height);
+void kernels_damage_add_all(MuxDamage *damage);
+
+/**
+ * @brief Collects the damage into rectangles, the way a refresh does.
+ *
+ * @returns The number of rectangles.
+ */
+int kernels_damage_collect(MuxDamage *damage);
+void kernels_sync_damaged_tiles(MuxDamage *damage, uint8_t *dst, int dst_step, uint8_t *src, int src_step);
+
+/**
+ * @brief Sets up the DISPLAY_UPDATE_RECTS the write kernels serialize, with count rectangles spread over the screen.
+ */
+void kernels_prepare_update(int count);
+
+/**
+ * @brief Serializes the prepared update with msgpack or as a binary message.
+ *
+ * @returns Size of the message in bytes. data is pointed at the message, which stays valid until the next call.
+ */
+size_t kernels_write_update_msgpack(const void **data);
+size_t kernels_write_update_wire(const void **data);
+
+/**
+ * @brief Processes a message from the server, msgpack or binary.
+ */
+void kernels_process_incoming(const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RDPMUX_BENCH_KERNELS_H
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file Microbenchmarks of the librdpmux kernels run on every refresh tick of the hypervisor: copying damage into shared
+ * memory, diffing it, tracking it in tiles, and the messages exchanged with the server.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "kernels.h"
+#include "micro.h"
+
+#define TILE_SIZE 64
+
+/**
+ * @brief Copies a whole frame, which takes the single memcpy() path since both buffers are tightly packed.
+ */
+static void BM_CopyPixelsFrame(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    std::vector<uint8_t> src(width * height * 4, 0x55), dst(width * height * 4);
+
+    for (auto _ : state) {
+        kernels_copy_pixels(dst.data(), width * 4, 0, 0, width, height, src.data(), width * 4);
+        benchmark::ClobberMemory();
+    }
+    SetFrameCounters(state, width, height);
+}
+BENCHMARK(BM_CopyPixelsFrame)->Apply(Resolutions);
+
+/**
+ * @brief Copies a whole frame one tile at a time, the row-by-row path a refresh with scattered damage takes.
+ */
+static void BM_CopyPixelsTiles(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    std::vector<uint8_t> src(width * height * 4, 0x55), dst(width * height * 4);
+
+    for (auto _ : state) {
+        for (int y = 0; y < height; y += TILE_SIZE) {
+            for (int x = 0; x < width; x += TILE_SIZE) {
+                kernels_copy_pixels(dst.data(), width * 4, x, y, std::min(TILE_SIZE, width - x),
+                                    std::min(TILE_SIZE, height - y), src.data(), width * 4);
+            }
+        }
+        benchmark::ClobberMemory();
+    }
+    SetFrameCounters(state, width, height);
+}
+BENCHMARK(BM_CopyPixelsTiles)->Apply(Resolutions);
+
+/**
+ * @brief Diffs a whole frame against an identical copy, the common case of damage reported for pixels that didn't
+ * change.
+ */
+static void BM_CopyPixelsDiffUnchanged(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    std::vector<uint8_t> src(width * height * 4, 0x55), dst(src);
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(kernels_copy_pixels_diff(dst.data(), width * 4, 0, 0, width, height, src.data(),
+                                                          width * 4));
+    SetFrameCounters(state, width, height);
+}
+BENCHMARK(BM_CopyPixelsDiffUnchanged)->Apply(Resolutions);
+
+/**
+ * @brief Diffs a whole frame that changed everywhere, so every byte is compared and copied.
+ */
+static void BM_CopyPixelsDiffChanged(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    std::vector<uint8_t> src(width * height * 4), dst(width * height * 4);
+    uint8_t value = 0;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        memset(src.data(), ++value, src.size());
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(kernels_copy_pixels_diff(dst.data(), width * 4, 0, 0, width, height, src.data(),
+                                                          width * 4));
+    }
+    SetFrameCounters(state, width, height);
+}
+BENCHMARK(BM_CopyPixelsDiffChanged)->Apply(Resolutions);
+
+/**
+ * @brief Records a refresh tick's worth of small scattered updates, like text being typed in several places, and
+ * collects them into rectangles.
+ */
+static void BM_DamageScattered(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    MuxDamage *damage = kernels_damage_new(width, height);
+
+    for (auto _ : state) {
+        for (int i = 0; i < 32; i++)
+            kernels_damage_add(damage, (i * 397) % (width - 16), (i * 211) % (height - 16), 9, 16);
+        benchmark::DoNotOptimize(kernels_damage_collect(damage));
+    }
+    kernels_damage_free(damage);
+}
+BENCHMARK(BM_DamageScattered)->Apply(Resolutions);
+
+/**
+ * @brief Records a full screen update and collects it, which merges into a single band.
+ */
+static void BM_DamageFullScreen(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    MuxDamage *damage = kernels_damage_new(width, height);
+
+    for (auto _ : state) {
+        kernels_damage_add_all(damage);
+        benchmark::DoNotOptimize(kernels_damage_collect(damage));
+    }
+    kernels_damage_free(damage);
+}
+BENCHMARK(BM_DamageFullScreen)->Apply(Resolutions);
+
+/**
+ * @brief Syncs a fully damaged frame tile by tile where only every 8th tile really changed, the whole refresh path with
+ * the content diff enabled.
+ */
+static void BM_SyncDamagedTiles(benchmark::State &state)
+{
+    int width = state.range(0), height = state.range(1);
+    std::vector<uint8_t> src(width * height * 4, 0x55), dst(src);
+    MuxDamage *damage = kernels_damage_new(width, height);
+    uint8_t value = 0;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        value++;
+        for (int y = 0; y < height; y += TILE_SIZE * 2) {
+            for (int x = 0; x < width; x += TILE_SIZE * 4)
+                src[(y * width + x) * 4] = value;
+        }
+        state.ResumeTiming();
+
+        kernels_damage_add_all(damage);
+        kernels_sync_damaged_tiles(damage, dst.data(), width * 4, src.data(), width * 4);
+        benchmark::DoNotOptimize(kernels_damage_collect(damage));
+    }
+    SetFrameCounters(state, width, height);
+    kernels_damage_free(damage);
+}
+BENCHMARK(BM_SyncDamagedTiles)->Apply(Resolutions);
+
+/**
+ * @brief Serializes a DISPLAY_UPDATE_RECTS with msgpack, for servers that don't speak binary messages.
+ */
+static void BM_WriteUpdateMsgpack(benchmark::State &state)
+{
+    kernels_prepare_update(state.range(0));
+    const void *data;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(kernels_write_update_msgpack(&data));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WriteUpdateMsgpack)->ArgName("rects")->Arg(1)->Arg(16)->Arg(64);
+
+/**
+ * @brief Serializes a DISPLAY_UPDATE_RECTS as a binary message.
+ */
+static void BM_WriteUpdateWire(benchmark::State &state)
+{
+    kernels_prepare_update(state.range(0));
+    const void *data;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(kernels_write_update_wire(&data));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WriteUpdateWire)->ArgName("rects")->Arg(1)->Arg(16)->Arg(64);
+
+/**
+ * @brief Processes the DISPLAY_UPDATE_COMPLETE the server answers every update with.
+ */
+static void BM_ProcessAckMsgpack(benchmark::State &state)
+{
+    // [DISPLAY_UPDATE_COMPLETE, success, framerate] as msgpack'd by the server
+    std::vector<uint8_t> msg = {0x93, 0x05, 0x01, 0x1e};
+
+    for (auto _ : state)
+        kernels_process_incoming(msg.data(), msg.size());
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ProcessAckMsgpack);
+
+/**
+ * @brief Processes a batch of input events, as msgpack and as a binary message.
+ */
+static void BM_ProcessInputMsgpack(benchmark::State &state)
+{
+    std::vector<uint8_t> msg = bench_input_batch(state.range(0), false);
+
+    for (auto _ : state)
+        kernels_process_incoming(msg.data(), msg.size());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ProcessInputMsgpack)->ArgName("events")->Arg(1)->Arg(16)->Arg(64);
+
+static void BM_ProcessInputWire(benchmark::State &state)
+{
+    std::vector<uint8_t> msg = bench_input_batch(state.range(0), true);
+
+    for (auto _ : state)
+        kernels_process_incoming(msg.data(), msg.size());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ProcessInputWire)->ArgName("events")->Arg(1)->Arg(16)->Arg(64);
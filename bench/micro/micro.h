@@ -0,0 +1,55 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_BENCH_MICRO_H
+#define RDPMUX_BENCH_MICRO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+/**
+ * @brief Runs a benchmark taking width and height as its first two arguments at the resolutions VMs commonly run at.
+ */
+inline void Resolutions(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"width", "height"});
+    b->Args({1024, 768});
+    b->Args({1280, 1024});
+    b->Args({1920, 1080});
+    b->Args({2560, 1440});
+    b->Args({3840, 2160});
+}
+
+/**
+ * @brief Reports the throughput of a benchmark that touched every pixel of a 32 bpp frame once per iteration.
+ */
+inline void SetFrameCounters(benchmark::State &state, int width, int height)
+{
+    state.SetItemsProcessed((int64_t) state.iterations() * width * height);
+    state.SetBytesProcessed((int64_t) state.iterations() * width * height * 4);
+}
+
+/**
+ * @brief Builds a batch of input events the way the server sends it to a VM.
+ *
+ * @param count Number of events, alternating between mouse and keyboard.
+ * @param binary Whether to build a binary message rather than msgpack.
+ */
+std::vector<uint8_t> bench_input_batch(size_t count, bool binary);
+
+#endif //RDPMUX_BENCH_MICRO_H
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file Microbenchmarks of the server's inner loops: decoding and encoding the messages exchanged with VMs in the broker
+ * shards, and converting framebuffers in the subsystem.
+ */
+
+#include <cstring>
+#include <msgpack/object.hpp>
+#include <msgpack/pack.hpp>
+#include <msgpack/unpack.hpp>
+#include <freerdp/codec/color.h>
+#include "rdp/PixelConverter.h"
+#include "util/WireFormat.h"
+#include "kernels.h"
+#include "micro.h"
+
+std::vector<uint8_t> bench_input_batch(size_t count, bool binary)
+{
+    std::vector<InputRecord> records(count);
+    for (size_t i = 0; i < count; i++) {
+        InputRecord &record = records[i];
+        memset(&record, 0, sizeof(record));
+        record.type = i % 2 ? KEYBOARD : MOUSE;
+        record.code = 0x1e;
+        record.x = (uint16_t) (i * 7);
+        record.y = (uint16_t) (i * 3);
+        record.flags = 0x0800;
+    }
+
+    if (binary) {
+        std::vector<uint8_t> msg(WIRE_MAX_SIZE);
+        msg.resize(wire_encode_input(records.data(), count, (char *) msg.data(), msg.size()));
+        return msg;
+    }
+
+    msgpack::sbuffer buf;
+    msgpack_encode_input(records.data(), count, buf);
+    return std::vector<uint8_t>(buf.data(), buf.data() + buf.size());
+}
+
+/**
+ * @brief Decodes a DISPLAY_UPDATE_RECTS as msgpack'd by the library, the way BrokerShard::decodeMessage() does.
+ */
+static void BM_DecodeUpdateMsgpack(benchmark::State &state)
+{
+    const void *data;
+    kernels_prepare_update(state.range(0));
+    size_t size = kernels_write_update_msgpack(&data);
+    std::vector<char> msg((const char *) data, (const char *) data + size);
+    std::vector<uint32_t> incoming;
+
+    for (auto _ : state) {
+        msgpack::unpacked unpacked;
+        msgpack::unpack(&unpacked, msg.data(), msg.size());
+        unpacked.get().convert(&incoming);
+        benchmark::DoNotOptimize(incoming.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeUpdateMsgpack)->ArgName("rects")->Arg(1)->Arg(16)->Arg(64);
+
+/**
+ * @brief Decodes the same update sent as a binary message.
+ */
+static void BM_DecodeUpdateWire(benchmark::State &state)
+{
+    const void *data;
+    kernels_prepare_update(state.range(0));
+    size_t size = kernels_write_update_wire(&data);
+    std::vector<char> msg((const char *) data, (const char *) data + size);
+    std::vector<uint32_t> incoming;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(wire_decode(msg.data(), msg.size(), incoming));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeUpdateWire)->ArgName("rects")->Arg(1)->Arg(16)->Arg(64);
+
+/**
+ * @brief Encodes a DISPLAY_UPDATE_COMPLETE, which goes out for every frame, the way BrokerShard::sendMessage() does.
+ */
+static void BM_EncodeAckMsgpack(benchmark::State &state)
+{
+    std::vector<uint16_t> vec = {DISPLAY_UPDATE_COMPLETE, 1, 30};
+
+    for (auto _ : state) {
+        msgpack::sbuffer sbuf;
+        msgpack::pack(&sbuf, vec);
+        benchmark::DoNotOptimize(sbuf.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeAckMsgpack);
+
+static void BM_EncodeAckWire(benchmark::State &state)
+{
+    std::vector<uint16_t> vec = {DISPLAY_UPDATE_COMPLETE, 1, 30};
+    char buf[WIRE_MAX_SIZE];
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(wire_encode(vec, buf, sizeof(buf)));
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EncodeAckWire);
+
+/**
+ * @brief Encodes a batch of input events, the way BrokerShard::flushInput() does.
+ */
+static void BM_EncodeInputMsgpack(benchmark::State &state)
+{
+    std::vector<InputRecord> records(state.range(0));
+    for (auto &record : records) {
+        memset(&record, 0, sizeof(record));
+        record.type = MOUSE;
+    }
+    msgpack::sbuffer buf;
+
+    for (auto _ : state) {
+        msgpack_encode_input(records.data(), records.size(), buf);
+        benchmark::DoNotOptimize(buf.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeInputMsgpack)->ArgName("events")->Arg(1)->Arg(16)->Arg(64);
+
+static void BM_EncodeInputWire(benchmark::State &state)
+{
+    std::vector<InputRecord> records(state.range(0));
+    for (auto &record : records) {
+        memset(&record, 0, sizeof(record));
+        record.type = MOUSE;
+    }
+    char buf[WIRE_MAX_SIZE];
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(wire_encode_input(records.data(), records.size(), buf, sizeof(buf)));
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeInputWire)->ArgName("events")->Arg(1)->Arg(16)->Arg(64);
+
+/**
+ * @brief A pixel format pair the subsystem converts between.
+ */
+struct FormatPair
+{
+    const char *name;
+    uint32_t src;
+    uint32_t dst;
+    int bpp;
+};
+
+/**
+ * @brief Every pair RDPListener::GetRDPFormat() maps a pixman format to. Keep in sync.
+ */
+static const FormatPair format_pairs[] = {
+        {"XBGR32", PIXEL_FORMAT_XBGR32, PIXEL_FORMAT_XBGR32, 4},
+        {"XRGB32", PIXEL_FORMAT_XRGB32, PIXEL_FORMAT_XRGB32, 4},
+        {"BGR24", PIXEL_FORMAT_BGR24, PIXEL_FORMAT_XRGB32, 3},
+        {"RGB24", PIXEL_FORMAT_RGB24, PIXEL_FORMAT_XRGB32, 3},
+        {"BGR16", PIXEL_FORMAT_BGR16, PIXEL_FORMAT_XRGB32, 2},
+        {"ABGR15", PIXEL_FORMAT_ABGR15, PIXEL_FORMAT_XRGB32, 2},
+};
+
+static void FormatsAndResolutions(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"format", "width", "height"});
+    for (size_t i = 0; i < sizeof(format_pairs) / sizeof(format_pairs[0]); i++) {
+        b->Args({(int64_t) i, 1024, 768});
+        b->Args({(int64_t) i, 1920, 1080});
+        b->Args({(int64_t) i, 3840, 2160});
+    }
+}
+
+/**
+ * @brief Copies a whole frame into the shadow surface with freerdp_image_copy(), what the subsystem falls back to for
+ * the pairs the PixelConverter doesn't handle.
+ */
+static void BM_ImageCopy(benchmark::State &state)
+{
+    const FormatPair &pair = format_pairs[state.range(0)];
+    int width = state.range(1), height = state.range(2);
+    std::vector<uint8_t> src(width * height * pair.bpp, 0x55), dst(width * height * 4);
+    state.SetLabel(pair.name);
+
+    for (auto _ : state) {
+        freerdp_image_copy(dst.data(), pair.dst, width * 4, 0, 0, width, height, src.data(), pair.src,
+                           width * pair.bpp, 0, 0, NULL, FREERDP_FLIP_NONE);
+        benchmark::ClobberMemory();
+    }
+    SetFrameCounters(state, width, height);
+}
+BENCHMARK(BM_ImageCopy)->Apply(FormatsAndResolutions);
+
+/**
+ * @brief Same as BM_ImageCopy with the PixelConverter, for the pairs it handles.
+ */
+static void BM_PixelConverter(benchmark::State &state)
+{
+    const FormatPair &pair = format_pairs[state.range(0)];
+    int width = state.range(1), height = state.range(2);
+    std::vector<uint8_t> src(width * height * pair.bpp, 0x55), dst(width * height * 4);
+    PixelConverter converter;
+    state.SetLabel(pair.name);
+
+    if (!converter.Prepare(pair.src, pair.dst)) {
+        state.SkipWithError("not handled by the PixelConverter");
+        return;
+    }
+
+    for (auto _ : state) {
+        converter.Convert(dst.data(), width * 4, src.data(), width * pair.bpp, 0, 0, width, height);
+        benchmark::ClobberMemory();
+    }
+    SetFrameCounters(state, width, height);
+}
+BENCHMARK(BM_PixelConverter)->Apply(FormatsAndResolutions);
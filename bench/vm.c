@@ -0,0 +1,231 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file Plays the part QEMU plays for a real VM: registers with the server, hands it a framebuffer, and reports damage
+ * to it the way a guest's display would, following one of the scripted patterns.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <czmq.h>
+#include <rdpmux.h>
+#include "bench.h"
+
+/**
+ * @brief Size of a glyph cell for the typing and scrolling patterns.
+ */
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+
+/**
+ * @brief How often a glyph is typed, in ms.
+ */
+#define TYPING_INTERVAL 100
+
+static pixman_image_t *surface = NULL;
+static uint32_t *pixels = NULL;
+static int width, height, stride;
+
+/**
+ * @brief Marker color the last latency probe asked for, 0 for black and 1 for white, and the one on screen. Written by
+ * the mouse callback on the librdpmux thread, read by the tick loop.
+ */
+static int marker_wanted = 0;
+static int marker_drawn = -1;
+
+static void bench_receive_mouse(uint32_t x, uint32_t y, uint32_t flags)
+{
+    if (y == BENCH_PROBE_Y && (x == BENCH_PROBE_X || x == BENCH_PROBE_X + 1))
+        __atomic_store_n(&marker_wanted, (int) (x & 1), __ATOMIC_RELAXED);
+}
+
+static void bench_receive_kb(uint32_t keycode, uint32_t flags)
+{
+}
+
+static void fill_rect(int x, int y, int w, int h, uint32_t color)
+{
+    for (int row = y; row < y + h; row++) {
+        uint32_t *line = pixels + row * stride + x;
+        for (int col = 0; col < w; col++)
+            line[col] = color;
+    }
+}
+
+/**
+ * @brief Gets a color that differs from one glyph to the next, so the content diff in the library never drops one.
+ */
+static uint32_t glyph_color(uint64_t n)
+{
+    return (uint32_t) ((n * 0x9E3779B1u) & 0x00FFFFFF);
+}
+
+/**
+ * @brief Draws whatever the pattern calls for this frame.
+ *
+ * @returns The number of pixels damaged.
+ */
+static uint64_t bench_draw(bench_pattern pattern, uint64_t frame, uint64_t elapsed_ms, uint64_t *typed)
+{
+    switch (pattern) {
+        case PATTERN_IDLE:
+            return 0;
+
+        case PATTERN_TYPING: {
+            // the first row of cells is left alone, that's where the marker lives
+            int columns = width / GLYPH_WIDTH;
+            int rows = height / GLYPH_HEIGHT - 1;
+            uint64_t target = elapsed_ms / TYPING_INTERVAL;
+            uint64_t damaged = 0;
+
+            if (columns <= 0 || rows <= 0)
+                return 0;
+
+            for (; *typed < target; (*typed)++) {
+                int cell = (int) (*typed % (uint64_t) (columns * rows));
+                int x = (cell % columns) * GLYPH_WIDTH;
+                int y = (cell / columns + 1) * GLYPH_HEIGHT;
+
+                fill_rect(x, y, GLYPH_WIDTH, GLYPH_HEIGHT, glyph_color(*typed));
+                mux_display_update(x, y, GLYPH_WIDTH, GLYPH_HEIGHT);
+                damaged += GLYPH_WIDTH * GLYPH_HEIGHT;
+            }
+            return damaged;
+        }
+
+        case PATTERN_SCROLLING: {
+            // a guest without any 2D acceleration has to repaint everything when it scrolls
+            memmove(pixels, pixels + GLYPH_HEIGHT * stride, (size_t) (height - GLYPH_HEIGHT) * stride * 4);
+            for (int x = 0; x + GLYPH_WIDTH <= width; x += GLYPH_WIDTH)
+                fill_rect(x, height - GLYPH_HEIGHT, GLYPH_WIDTH, GLYPH_HEIGHT, glyph_color(frame * width + x));
+
+            marker_drawn = -1;
+            mux_display_update(0, 0, width, height);
+            return (uint64_t) width * height;
+        }
+
+        case PATTERN_VIDEO: {
+            uint32_t shift = (uint32_t) frame * 4;
+            for (int y = 0; y < height; y++) {
+                uint32_t *line = pixels + y * stride;
+                for (int x = 0; x < width; x++)
+                    line[x] = (((x + shift) ^ (y + shift / 2)) & 0xFF) * 0x010101u;
+            }
+
+            marker_drawn = -1;
+            mux_display_update(0, 0, width, height);
+            return (uint64_t) width * height;
+        }
+    }
+    return 0;
+}
+
+static void bench_sleep_us(uint64_t us)
+{
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+int bench_vm_run(const bench_config *config, int index, bench_vm_stats *stats)
+{
+    char uuid[37];
+    char *path = NULL;
+    pthread_t loop;
+
+    width = config->width;
+    height = config->height;
+
+    snprintf(uuid, sizeof(uuid), "b3cc%04x-0000-4000-8000-%012x", index & 0xFFFF, (unsigned int) getpid());
+
+    MuxDisplay *display = mux_init_display_struct(uuid);
+    if (display == NULL) {
+        stats->failed = true;
+        return 1;
+    }
+
+    if (!mux_get_socket_path("org.RDPMux.RDPMux", "/org/RDPMux/RDPMux", &path, index, config->port + index, "")) {
+        fprintf(stderr, "vm %d: could not register with the server\n", index);
+        stats->failed = true;
+        return 1;
+    }
+
+    if (!mux_connect(path)) {
+        fprintf(stderr, "vm %d: could not connect to %s\n", index, path);
+        stats->failed = true;
+        return 1;
+    }
+
+    InputEventCallbacks callbacks = {bench_receive_kb, bench_receive_mouse};
+    mux_register_event_callbacks(callbacks);
+
+    surface = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, width * 4);
+    if (surface == NULL) {
+        fprintf(stderr, "vm %d: could not allocate a %dx%d framebuffer\n", index, width, height);
+        stats->failed = true;
+        return 1;
+    }
+    pixels = pixman_image_get_data(surface);
+    stride = pixman_image_get_stride(surface) / 4;
+    memset(pixels, 0x40, (size_t) stride * 4 * height);
+
+    mux_display_switch(surface);
+    if (pthread_create(&loop, NULL, mux_mainloop, NULL) != 0) {
+        fprintf(stderr, "vm %d: could not start the librdpmux thread\n", index);
+        stats->failed = true;
+        return 1;
+    }
+    stats->ready = true;
+
+    uint64_t start = bench_now_us();
+    uint64_t typed = 0;
+    while (!stats->stop) {
+        uint64_t tick = bench_now_us();
+        uint64_t damaged = bench_draw(config->pattern, stats->ticks, (tick - start) / 1000, &typed);
+
+        int wanted = __atomic_load_n(&marker_wanted, __ATOMIC_RELAXED);
+        if (wanted != marker_drawn) {
+            fill_rect(0, 0, BENCH_MARKER_SIZE, BENCH_MARKER_SIZE, wanted ? 0x00FFFFFF : 0);
+            mux_display_update(0, 0, BENCH_MARKER_SIZE, BENCH_MARKER_SIZE);
+            if (damaged < (uint64_t) width * height)
+                damaged += BENCH_MARKER_SIZE * BENCH_MARKER_SIZE;
+            marker_drawn = wanted;
+        }
+
+        // the server lowers the rate to 0 while nobody is connected, QEMU keeps ticking once a second then
+        uint32_t framerate = mux_display_refresh();
+        stats->ticks++;
+        if (damaged > 0) {
+            stats->updates++;
+            stats->pixels += damaged;
+        }
+
+        uint64_t interval = framerate > 0 ? 1000000 / framerate : 1000000;
+        uint64_t spent = bench_now_us() - tick;
+        if (spent < interval)
+            bench_sleep_us(interval - spent);
+    }
+
+    // makes the librdpmux thread leave its loop and say goodbye to the server
+    zsys_interrupted = 1;
+    pthread_join(loop, NULL);
+    mux_cleanup(display);
+    pixman_image_unref(surface);
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+# - Find LZ4
+# Find the LZ4 libraries
+#
+#  This module defines the following variables:
+#     LZ4_FOUND           - true if LZ4_INCLUDE_DIR & LZ4_LIBRARY are found
+#     LZ4_LIBRARIES       - Set when LZ4_LIBRARY is found
+#     LZ4_INCLUDE_DIRS    - Set when LZ4_INCLUDE_DIR is found
+#
+#     LZ4_INCLUDE_DIR     - where to find lz4.h
+#     LZ4_LIBRARY         - the LZ4 library
+#
+
+#=============================================================================
+# Copyright 2016 Datto Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#=============================================================================
+
+find_path(LZ4_INCLUDE_DIR NAMES lz4.h)
+
+find_library(LZ4_LIBRARY NAMES lz4)
+
+find_package_handle_standard_args(LZ4 DEFAULT_MSG LZ4_LIBRARY LZ4_INCLUDE_DIR)
+
+if(LZ4_FOUND)
+    set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+    set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+endif()
+
+mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARY)
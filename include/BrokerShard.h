@@ -0,0 +1,363 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_BROKERSHARD_H
+#define RDPMUX_BROKERSHARD_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include "common.h"
+#include "util/Affinity.h"
+#include "util/CurveKeys.h"
+#include "util/MessageQueue.h"
+#include "util/InputQueue.h"
+#include "util/WireFormat.h"
+#include "util/zmq_addon.hpp"
+#include "rdp/RDPListener.h"
+#include "VmIndex.h"
+
+/**
+ * @brief Snapshot of the counters of a BrokerShard, for checking how evenly the VMs spread over the shards.
+ */
+struct BrokerShardStats
+{
+    std::string endpoint;   ///< ZeroMQ endpoint of the shard.
+    uint32_t vms;           ///< Number of VMs currently assigned to the shard.
+    uint64_t received;      ///< Messages received from VMs.
+    uint64_t sent;          ///< Messages sent to VMs.
+    uint64_t dropped;       ///< Messages that could not be delivered in either direction.
+    uint64_t queued;        ///< Messages waiting to be sent to VMs.
+    uint64_t input_queued;  ///< Input events waiting to be sent to VMs.
+};
+
+/**
+ * @brief One I/O thread of the RDPServerWorker, owning the ZeroMQ socket and descriptor socket a subset of the VMs
+ * talks to.
+ *
+ * Each shard runs its own message loop on its own ROUTER socket, so a VM flooding display updates only ever delays the
+ * VMs sharing its shard. The RDPServerWorker decides which shard a VM belongs to, and hands its listener to the shard
+ * with AddListener() on registration.
+ *
+ * The message loop finds the VM a message belongs to in a VmIndex, without ever taking a lock. VMs speaking
+ * RDPMUX_PROTOCOL_VERSION are told the handle the index registered them under with a VM_HANDLE message, and address
+ * their messages with it from then on instead of their UUID.
+ *
+ * A shard can also be bound to a TCP endpoint for VMs running on other hosts, which register through a REMOTE_REGISTER
+ * message on the socket itself instead of over DBus, and send their framebuffer as DISPLAY_TILES messages.
+ */
+class BrokerShard
+{
+public:
+    /**
+     * @brief Called on the message loop with the UUID and decoded REMOTE_REGISTER message of a VM the shard doesn't
+     * know yet. Must not add the VM to the shard itself, the loop would wait for itself.
+     */
+    typedef std::function<void(const std::string &uuid, const std::vector<uint32_t> &msg)> RegisterHandler;
+
+    /**
+     * @brief Creates the shard's sockets and binds them. The message loop isn't started until Start().
+     *
+     * @param context ZeroMQ context to create the socket in.
+     * @param endpoint Endpoint for the ROUTER socket. For ipc:// endpoints, the descriptor socket is bound next to it,
+     * at the same path with ".fd" appended. Other endpoints have none.
+     * @param keys Keys to authenticate the VMs connecting with, if any. The shard then answers the context's ZAP
+     * requests, which only one shard per context can.
+     */
+    BrokerShard(zmq::context_t &context, std::string endpoint, const CurveKeys &keys = CurveKeys());
+
+    /**
+     * @brief Stops the message loop, waits for it to finish and closes the sockets.
+     */
+    ~BrokerShard();
+
+    /**
+     * @brief Starts the message loop on a new thread.
+     *
+     * @param cpus CPUs the thread runs on, empty for any.
+     */
+    void Start(const CpuSet &cpus = CpuSet());
+
+    /**
+     * @brief Makes REMOTE_REGISTER messages of unknown VMs go to a handler instead of being dropped. Must be called
+     * before Start().
+     *
+     * @param handler The handler.
+     */
+    void SetRegisterHandler(RegisterHandler handler);
+
+    /**
+     * @brief Gets the endpoint VMs in this shard connect to.
+     *
+     * @returns The ZeroMQ endpoint of the shard.
+     */
+    const std::string &Endpoint() const;
+
+    /**
+     * @brief Makes messages from the VM with the given UUID go to the given listener, and gives the listener the slot
+     * and generation of its handle to queue input events for the VM with.
+     *
+     * @param uuid UUID of the VM.
+     * @param listener The VM's RDP listener.
+     */
+    void AddListener(std::string uuid, std::shared_ptr<RDPListener> listener);
+
+    /**
+     * @brief Forgets about the VM with the given UUID. Waits for the message loop to be done with its listener, so it
+     * must not be called from the loop itself.
+     *
+     * @param uuid UUID of the VM.
+     */
+    void RemoveListener(std::string uuid);
+
+    /**
+     * @brief Queues a message for a VM in this shard.
+     *
+     * @param item QueueItem to be sent.
+     */
+    void queueOutgoingMessage(QueueItem item);
+
+    /**
+     * @brief Queues an input event for a VM in this shard, without locking or allocating. Safe to call from any thread.
+     *
+     * @returns Whether there was room for the event.
+     *
+     * @param record The event, with the slot and generation the listener got from AddListener().
+     */
+    bool queueInput(const InputRecord &record);
+
+    /**
+     * @brief Gets the current values of the shard's counters.
+     *
+     * @returns Snapshot of the counters.
+     */
+    BrokerShardStats Stats();
+
+private:
+    /**
+     * @brief ZeroMQ endpoint the socket is bound to.
+     */
+    std::string endpoint;
+
+    /**
+     * @brief ZeroMQ socket.
+     */
+    zmq::socket_t zsocket;
+
+    /**
+     * @brief Listening Unix socket VMs pass the descriptors of their shared memory regions through. -1 if it couldn't
+     * be set up, in which case VMs fall back to named shared memory.
+     */
+    int fd_socket;
+
+    /**
+     * @brief A connection accepted on the descriptor socket whose message hasn't arrived yet.
+     */
+    struct DescriptorConnection
+    {
+        int conn;               ///< The connection, non-blocking.
+        uint64_t accepted;      ///< When it was accepted, from metrics_now_us().
+    };
+
+    /**
+     * @brief Connections accepted on the descriptor socket, polled by the message loop along with everything else
+     * until their message arrives, so a VM that's slow to send never holds up the other VMs of the shard. Only
+     * touched by the message loop.
+     */
+    std::vector<DescriptorConnection> fd_conns;
+
+    /**
+     * @brief Socket ZeroMQ asks whether a VM's host may connect on, nullptr if the shard doesn't authenticate.
+     */
+    std::unique_ptr<zmq::socket_t> zap_socket;
+
+    /**
+     * @brief Public keys of the hosts allowed to connect, binary. Only touched by the message loop.
+     */
+    std::set<std::string> client_keys;
+
+    /**
+     * @brief Thread running the message loop.
+     */
+    std::thread thread;
+
+    /**
+     * @brief Set to make the message loop exit.
+     */
+    std::atomic<bool> stop;
+
+    /**
+     * @brief Hashmap from UUID to the RDPListeners of the VMs in this shard. Keeps the listeners in index alive, the
+     * message loop never touches it.
+     */
+    std::map<std::string, std::shared_ptr<RDPListener>> listener_map;
+
+    /**
+     * @brief Mutex guarding listener_map. Registration happens on the DBus thread.
+     */
+    std::mutex listener_lock;
+
+    /**
+     * @brief The VMs in this shard, by handle and UUID. The message loop is its reader.
+     */
+    VmIndex index;
+
+    /**
+     * @brief The ZeroMQ connection a VM last sent a message from.
+     */
+    struct Connection
+    {
+        uint32_t handle;    ///< Handle of the VM, 0 if the slot has no connection yet.
+        std::string id;     ///< ZeroMQ connection id.
+        bool announced;     ///< Whether the VM was sent its handle on this connection.
+    };
+
+    /**
+     * @brief Connections by slot of the VM's handle. Only touched by the message loop.
+     */
+    std::vector<Connection> connections;
+
+    /**
+     * @brief Queue containing outbound messages.
+     */
+    MessageQueue out_queue;
+
+    /**
+     * @brief Queue containing outbound input events.
+     */
+    InputQueue input_queue;
+
+    /**
+     * @brief Scratch buffer input events are serialized into. Only touched by the message loop.
+     */
+    msgpack::sbuffer input_buf;
+
+    /**
+     * @brief Scratch buffer binary messages are encoded into. Only touched by the message loop.
+     */
+    char wire_buf[WIRE_MAX_SIZE];
+
+    /**
+     * @brief Handler for REMOTE_REGISTER messages of unknown VMs, empty if they're dropped.
+     */
+    RegisterHandler register_handler;
+
+    /**
+     * @brief Scratch vector incoming messages are decoded into, reused so decoding stops allocating once it has grown
+     * to fit the largest message. Only touched by the message loop.
+     */
+    std::vector<uint32_t> incoming;
+
+    /**
+     * @brief Input events collected per slot while draining input_queue. Only touched by the message loop.
+     */
+    std::vector<std::vector<InputRecord>> input_batches;
+
+    /**
+     * @brief VMs that have events in input_batches, in the order their first event arrived. Only valid while draining
+     * input_queue.
+     */
+    std::vector<const VmEntry *> input_vms;
+
+    std::atomic<uint64_t> received; ///< Messages received from VMs.
+    std::atomic<uint64_t> sent;     ///< Messages sent to VMs.
+    std::atomic<uint64_t> dropped;  ///< Messages that could not be delivered.
+
+    /**
+     * @brief Remembers the connection a message from a VM came in on, and tells the VM its handle if it addresses its
+     * messages by UUID but could use the handle.
+     *
+     * @param vm The VM.
+     * @param id ZeroMQ connection id the message came in on.
+     * @param by_uuid Whether the message was addressed by UUID.
+     */
+    void updateConnection(const VmEntry *vm, const std::string &id, bool by_uuid);
+
+    /**
+     * @brief Decodes a message from a VM, binary or msgpack, into incoming.
+     *
+     * @returns Whether the message could be decoded.
+     *
+     * @param data The message.
+     * @param size Size of the message in bytes.
+     */
+    bool decodeMessage(const char *data, size_t size);
+
+    /**
+     * @brief Send a message to the VM with the identity espoused by the UUID, in whichever wire format the VM speaks.
+     *
+     * @param vec Vector containing the data to be serialized.
+     * @param uuid The UUID of the VM to send this message to.
+     */
+    void sendMessage(const std::vector<uint16_t> &vec, const std::string &uuid);
+
+    /**
+     * @brief Send an already serialized message to a VM, addressed with its handle once the VM knows it and with its
+     * UUID before that.
+     *
+     * @param vm The VM to send this message to.
+     * @param data The binary or msgpack'd message.
+     * @param size Size of data in bytes.
+     *
+     * @returns Whether the message was sent.
+     */
+    bool sendPacked(const VmEntry *vm, const char *data, size_t size);
+
+    /**
+     * @brief Sends every event currently in input_queue.
+     *
+     * Events are grouped per VM into a single INPUT_BATCH message, and runs of plain mouse moves are coalesced into the
+     * last one of them.
+     */
+    void sendInput();
+
+    /**
+     * @brief Sends the events collected in input_batches for a VM, and empties its batch.
+     */
+    void flushInput(const VmEntry *vm);
+
+    /**
+     * @brief Accepts the connections waiting on the descriptor socket, and adds them to fd_conns.
+     */
+    void acceptDescriptors();
+
+    /**
+     * @brief Reads the message off a connection in fd_conns, and dispatches the display switch message and shared
+     * memory descriptor it carries to the right RDP listener.
+     *
+     * @returns Whether the connection is done with. False if its message hasn't arrived yet.
+     *
+     * @param conn The connection.
+     */
+    bool receiveDescriptor(int conn);
+
+    /**
+     * @brief Answers a ZAP request, letting the handshake of a VM's host go through if its public key is one of
+     * client_keys.
+     */
+    void authenticate();
+
+    /**
+     * @brief Main loop function that receives messages and processes them for dispatch to the RDP listener.
+     *
+     * The loop sleeps in poll() until a VM sends something or a message is queued for sending through out_queue, whose
+     * eventfd is part of the poll set. Outgoing messages are then sent in one batch. The loop goes offline in index
+     * while it sleeps.
+     */
+    void run();
+};
+
+#endif //RDPMUX_BROKERSHARD_H
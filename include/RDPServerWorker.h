@@ -22,14 +22,21 @@
 #include "util/MessageQueue.h"
 #include "util/zmq_addon.hpp"
 #include "rdp/RDPListener.h"
+#include "BrokerShard.h"
+#include "util/EventLoop.h"
+#include "util/PortAllocator.h"
 
 /**
- * @brief The RDPServerWorker class manages the lifetime of the ZeroMQ socket. It also manages the lifetimes of all
- * associated VM connections and RDP listeners.
+ * @brief The RDPServerWorker class manages the lifetime of the ZeroMQ broker shards. It also manages the lifetimes of
+ * all associated VM connections and RDP listeners.
  *
- * The RDPServerWorker is created and initialized during RDPMux startup. It manages the lifecycle of the ZeroMQ
- * socket. In addition, the RDPServerworker manages the deserialization of messages from the VM, and dispatching
- * messages to and from the appropriate RDP listener.
+ * The RDPServerWorker is created and initialized during RDPMux startup. It manages the lifecycle of the broker shards,
+ * each of which runs its own ZeroMQ socket on its own thread. VMs are assigned to a shard by a hash of their UUID, and
+ * the shard manages the deserialization of messages from the VM, and dispatching messages to and from the
+ * appropriate RDP listener.
+ *
+ * VMs running on other hosts all share one more shard, bound to a TCP endpoint, if the RDPServerWorker was given one.
+ * They register through that shard instead of over DBus.
  */
 class RDPServerWorker
 {
@@ -37,13 +44,26 @@ public:
     /**
      * @brief Creates a new RDPServerWorker.
      *
-     * Upon creation, a new ZeroMQ ROUTER socket is created and/or bound to. No events are processed until
-     * a VM has registered using RegisterNewVM();
+     * Upon creation, a new ZeroMQ ROUTER socket is created and/or bound to for every shard. No events are processed
+     * until a VM has registered using RegisterNewVM();
      *
      * @param port The starting port for new RDP listener connections
      * @param auth Whether to start listeners with NLA authentication enabled.
-     */
-    RDPServerWorker(uint16_t port, bool auth);
+     * @param num_shards Number of broker shards, i.e. I/O threads, to spread the VMs over.
+     * @param listener_threads Number of event loops to run the listeners on. 0 runs every listener on threads of its
+     * own.
+     * @param last_port The last port new RDP listeners are started on.
+     * @param broker_cpus CPUs the shards' threads run on, empty for any.
+     * @param listener_cpus CPUs the event loops run on, empty for any. Listeners with threads of their own pin them
+     * themselves.
+     * @param remote_endpoint Endpoint VMs on other hosts connect to, e.g. tcp://0.0.0.0:7000. Empty for none.
+     * @param remote_keys Keys the hosts of remote VMs are authenticated with.
+     * @param remote_auth Path to the auth file the listeners of remote VMs authenticate clients with, if auth is set.
+     */
+    RDPServerWorker(uint16_t port, bool auth, unsigned int num_shards = 1, unsigned int listener_threads = 0,
+                    uint16_t last_port = 65534, const CpuSet &broker_cpus = CpuSet(),
+                    const CpuSet &listener_cpus = CpuSet(), const std::string &remote_endpoint = std::string(),
+                    const CurveKeys &remote_keys = CurveKeys(), const std::string &remote_auth = std::string());
 
     /**
      * @brief Initializes the run loop. After this function returns successfully, the ServerWorker is ready to process
@@ -62,21 +82,40 @@ public:
     /**
      * @brief Registers and initializes new VM connection.
      *
-     * Register and initialize a new VM connection. Set up and initialize RDP listener.
+     * Register and initialize a new VM connection. Set up and initialize RDP listener. The listener is started once
+     * this returns, without holding up other registrations.
      *
      * @param uuid UUID of incoming VM connection.
      * @param vm_id Unique ID of VM fb.
      * @param auth Path to auth file for RDP session. Empty if no file.
-     * @param port Preferred port for RDP server to be listening on.
+     * @param port Port for RDP server to be listening on. 0 picks a free one, anything else must not be in use by
+     * another listener.
+     * @param protocol Protocol version the VM registered with, which decides how messages to it are encoded.
+     * @param pid PID of the VM's process, to place the listener's threads next to it. 0 if unknown.
+     *
+     * @returns bool Success
+     */
+    bool RegisterNewVM(std::string uuid, int vm_id, std::string auth, uint16_t port, int protocol, pid_t pid = 0);
+
+    /**
+     * @brief Registers a VM running on another host, which introduced itself with a REMOTE_REGISTER message on the
+     * remote shard. Its listener authenticates clients against the remote auth file, unless the server doesn't
+     * authenticate at all. Nothing happens if the VM is registered already; a local VM's UUID is refused.
+     *
+     * @param uuid UUID of the VM.
+     * @param vm_id ID of the VM.
+     * @param port Port for the RDP listener, 0 for a free one. Refused if it's not in the range ports are handed out
+     * from.
+     * @param protocol Protocol version the VM speaks.
      *
      * @returns bool Success
      */
-    bool RegisterNewVM(std::string uuid, int vm_id, std::string auth, uint16_t port);
+    bool RegisterRemoteVM(std::string uuid, int vm_id, uint16_t port, int protocol);
 
     /**
      * @brief Unregisters VM.
      *
-     * Removes listener port from open ports list and removes the shared_ptr wrapping the RDPListener object.
+     * Releases the listener's port and removes the shared_ptr wrapping the RDPListener object.
      * Everything will self-destruct as that shared_ptr goes out of scope, so be careful when you invoke this!
      */
     void UnregisterVM(std::string uuid, uint16_t port);
@@ -89,25 +128,40 @@ public:
     void setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn);
 
     /**
-     * @brief Send a message to the VM with the identity espoused by the UUID.
+     * @brief Queues outgoing message on the shard of the VM it is addressed to.
+     *
+     * @param item QueueItem to be sent.
+     */
+    void queueOutgoingMessage(QueueItem item);
+
+    /**
+     * @brief Gets the ZeroMQ endpoint the VM with the given UUID should connect to.
+     *
+     * @param uuid UUID of the VM.
      *
-     * @param vec Vector containing the data to be serialized.
-     * @param uuid The UUID of the VM to send this message to.
+     * @returns The endpoint of the VM's shard.
      */
-    void sendMessage(std::vector<uint16_t> vec, std::string uuid);
+    std::string ShardEndpoint(const std::string &uuid);
 
     /**
-     * @brief Queues outgoing message.
+     * @brief Gets the counters of every shard.
      *
-     * @param item QueueItem to be sent.
+     * @returns One snapshot per shard, in shard order, followed by the remote shard if there is one.
      */
-    void queueOutgoingMessage(QueueItem item);
+    std::vector<BrokerShardStats> ShardStats();
+
+    /**
+     * @brief Writes the metrics of every shard and listener in the Prometheus text exposition format.
+     *
+     * @param out Stream to write to.
+     */
+    void ExportMetrics(std::ostream &out);
 
 protected:
     /**
-     * @brief Starting port for new connections.
+     * @brief Ports of the listeners, and where new ones are picked from.
      */
-    uint16_t starting_port;
+    PortAllocator port_allocator;
 
     /**
      * @brief Lock guarding stop.
@@ -125,22 +179,23 @@ protected:
     bool initialized;
 
     /**
-     * @brief Hashmap from UUID to RDPListeners.
+     * @brief CPUs the shards' threads run on, empty for any.
      */
-    std::map<std::string, std::shared_ptr<RDPListener>> listener_map;
+    CpuSet broker_cpus;
 
     /**
-     * @brief Hashmap from UUID to current ZeroMQ connection id
+     * @brief Event loops the listeners are started, run and torn down on. nullptr if every listener gets threads of its
+     * own. Declared before listener_map, so the loops outlive the listeners they hold on to.
      */
-    std::map<std::string, std::string> connection_map;
+    std::unique_ptr<EventLoopPool> listener_pool;
 
     /**
-     * @brief Set containing all in-use ports. Used to intelligently re-use ports as VMs come and go.
+     * @brief Hashmap from UUID to RDPListeners.
      */
-    std::set<uint16_t> ports;
+    std::map<std::string, std::shared_ptr<RDPListener>> listener_map;
 
     /**
-     * @brief mutex on ports so that concurrent accesses are okay.
+     * @brief mutex on listener_map so that concurrent accesses are okay.
      */
     std::mutex container_lock;
 
@@ -150,19 +205,24 @@ protected:
     Glib::RefPtr<Gio::DBus::Connection> dbus_conn;
 
     /**
-     * @brief Queue containing outbound messages.
+     * @brief ZeroMQ context shared by all shards.
      */
-    MessageQueue out_queue;
+    zmq::context_t context;
 
     /**
-     * @brief ZeroMQ context.
+     * @brief The broker shards. Never changes size after construction, so it can be read without a lock.
      */
-    zmq::context_t context;
+    std::vector<std::unique_ptr<BrokerShard>> shards;
+
+    /**
+     * @brief The shard VMs on other hosts talk to, nullptr if there is no remote endpoint.
+     */
+    std::unique_ptr<BrokerShard> remote_shard;
 
     /**
-     * @brief ZeroMQ socket.
+     * @brief ID of the main loop timeout stopping the listeners of remote VMs that went silent, 0 if there is none.
      */
-    zmq::socket_t zsocket;
+    guint remote_timeout_id;
 
     /**
      * @brief whether RDPMux should authenticate peer connections.
@@ -170,9 +230,25 @@ protected:
     bool authenticating;
 
     /**
-     * @brief Main loop function that receives messages and processes them for dispatch to the RDP listener.
+     * @brief Path to the auth file the listeners of remote VMs authenticate clients with.
+     */
+    std::string remote_auth;
+
+    /**
+     * @brief Picks the shard the VM with the given UUID belongs to.
+     */
+    BrokerShard &shardFor(const std::string &uuid);
+
+    /**
+     * @brief Creates, registers and starts the listener of a VM. Shared by RegisterNewVM() and RegisterRemoteVM().
+     */
+    bool registerVM(std::string uuid, int vm_id, std::string auth, uint16_t port, int protocol, pid_t pid,
+                    BrokerShard &shard, bool remote);
+
+    /**
+     * @brief Stops the listeners of remote VMs that haven't been heard from in a while. Runs on the main loop.
      */
-    void run();
+    static gboolean checkRemoteVMs(gpointer data);
 };
 
 
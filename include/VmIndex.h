@@ -0,0 +1,179 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_VMINDEX_H
+#define RDPMUX_VMINDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class RDPListener;
+struct ListenerMetrics;
+
+/**
+ * @brief Number of bits of a VM handle holding its slot. The rest hold the slot's generation.
+ */
+#define VM_HANDLE_SLOT_BITS 16
+
+/**
+ * @brief Most VMs a single index can hold.
+ */
+#define VM_INDEX_MAX_SLOTS (1u << VM_HANDLE_SLOT_BITS)
+
+/**
+ * @brief Slot of a VM handle.
+ */
+inline uint32_t vm_handle_slot(uint32_t handle)
+{
+    return handle & (VM_INDEX_MAX_SLOTS - 1);
+}
+
+/**
+ * @brief Generation of a VM handle.
+ */
+inline uint32_t vm_handle_generation(uint32_t handle)
+{
+    return handle >> VM_HANDLE_SLOT_BITS;
+}
+
+/**
+ * @brief A VM registered with an index. Never changes once it's in the index.
+ */
+struct VmEntry
+{
+    uint32_t handle;            ///< Handle the VM was registered under. Never 0.
+    std::string uuid;           ///< UUID of the VM.
+    RDPListener *listener;      ///< The VM's listener. Kept alive by whoever registered the VM until it's removed.
+    ListenerMetrics *metrics;   ///< Metrics of the listener.
+    bool binary;                ///< Whether the VM speaks the binary wire format.
+    bool handles;               ///< Whether the VM addresses its messages with its handle instead of its UUID.
+};
+
+/**
+ * @brief Read-mostly index of the VMs of a broker shard, by handle and by UUID.
+ *
+ * The shard's message loop is the only reader, and looks VMs up for every message without taking a lock: it reads an
+ * immutable table through an atomic pointer. Registering and unregistering VMs publishes a new table, then waits for
+ * the reader to finish whatever it might be doing with the old one before freeing it, RCU style. The reader tells
+ * writers when it can't be holding on to anything by going Offline() while it waits for messages, so writers never
+ * wait for longer than the reader takes for a single pass of its loop.
+ *
+ * A handle is the slot of the VM in the table and the slot's generation, which is bumped whenever the slot gets a new
+ * owner, so a stale handle never finds the wrong VM.
+ */
+class VmIndex
+{
+public:
+    VmIndex();
+    ~VmIndex();
+
+    /**
+     * @brief Registers a VM. Safe to call from any thread but the reader's.
+     *
+     * @returns The VM's handle, 0 if the index is full.
+     *
+     * @param uuid UUID of the VM.
+     * @param listener Listener of the VM. Must stay alive until the VM is removed.
+     */
+    uint32_t Insert(const std::string &uuid, RDPListener *listener);
+
+    /**
+     * @brief Unregisters a VM. Safe to call from any thread but the reader's. Once this returns, the reader is done
+     * with the VM's entry and its listener.
+     *
+     * @returns Whether the VM was registered.
+     *
+     * @param uuid UUID of the VM.
+     */
+    bool Remove(const std::string &uuid);
+
+    /**
+     * @brief Gets the number of registered VMs. Safe to call from any thread.
+     */
+    size_t Size() const;
+
+    /**
+     * @brief Looks up a VM by handle. Reader only; the entry stays valid until the reader goes Offline().
+     *
+     * @returns The VM's entry, nullptr if no VM is registered under the handle.
+     */
+    const VmEntry *Find(uint32_t handle) const;
+
+    /**
+     * @brief Looks up a VM by UUID. Reader only; the entry stays valid until the reader goes Offline().
+     *
+     * @returns The VM's entry, nullptr if no VM with the UUID is registered.
+     */
+    const VmEntry *Find(const std::string &uuid) const;
+
+    /**
+     * @brief Tells writers the reader doesn't hold on to any entries, e.g. because it's about to wait for something.
+     */
+    void Offline();
+
+    /**
+     * @brief Tells writers the reader may be looking up entries again.
+     */
+    void Online();
+
+private:
+    /**
+     * @brief A snapshot of the index. Only ever changed before it's published.
+     */
+    struct Table
+    {
+        std::vector<const VmEntry *> slots;                 ///< Entries by slot, nullptr for free slots.
+        std::unordered_map<std::string, uint32_t> by_uuid;  ///< Slots by UUID.
+    };
+
+    /**
+     * @brief Replaces the current table and waits until the reader can't be using the old one anymore, then frees it.
+     */
+    void publish(Table *next);
+
+    /**
+     * @brief Waits until the reader went through a pass of its loop, or found it offline.
+     */
+    void synchronize();
+
+    std::atomic<const Table *> table;
+
+    /**
+     * @brief Bumped by the reader whenever it goes online or offline, so it's odd while the reader is offline.
+     */
+    std::atomic<uint64_t> reader_epoch;
+
+    /**
+     * @brief Serializes writers. Guards generations.
+     */
+    std::mutex writer_lock;
+
+    /**
+     * @brief Generation of every slot ever used.
+     */
+    std::vector<uint16_t> generations;
+
+    std::atomic<size_t> size;
+
+    VmIndex(const VmIndex &) = delete;
+    VmIndex &operator=(const VmIndex &) = delete;
+};
+
+#endif //RDPMUX_VMINDEX_H
@@ -19,10 +19,93 @@
 
 #include <memory>
 #include <cstdbool>
+#include <cstdint>
 #include "util/logging.h"
 #include <giomm-2.4/giomm.h>
 
-#define RDPMUX_PROTOCOL_VERSION 5
+#define RDPMUX_PROTOCOL_VERSION 17
+
+/**
+ * @brief Last protocol version without REMOTE_REGISTER and DISPLAY_TILES, so a VM has to run on the same host as the
+ * server. Still accepted for older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_TRACE 16
+
+/**
+ * @brief Last protocol version whose binary DISPLAY_UPDATE_RECTS messages don't end in a MuxWireTrace, so their
+ * latency can't be told. Still accepted for older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_HEADS 15
+
+/**
+ * @brief Last protocol version without the HEAD_SWITCH message, so a VM has a single display head. Still accepted for
+ * older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_COPY 14
+
+/**
+ * @brief Last protocol version without the DISPLAY_COPY message. Still accepted for older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_CURSOR 13
+
+/**
+ * @brief Last protocol version without the CURSOR_DEFINE and CURSOR_MOVE messages. Already addresses messages by VM
+ * handle, and is still accepted for older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_HANDLES 12
+
+/**
+ * @brief Last protocol version that addresses every message with the VM's UUID rather than the handle it's told in a
+ * VM_HANDLE message. Already speaks the binary messages, and is still accepted for older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_BINARY 11
+
+/**
+ * @brief Last protocol version that encodes every message with msgpack. Still accepted for older librdpmux builds.
+ */
+#define RDPMUX_PROTOCOL_VERSION_MSGPACK 10
+
+/**
+ * @brief Magic number at the start of the shared memory region, "RDMX" in little-endian byte order.
+ */
+#define MUX_SHM_MAGIC 0x584d4452
+
+/**
+ * @brief Size in bytes of the header at the start of the shared memory region. The framebuffer follows it.
+ */
+#define MUX_SHM_HEADER_SIZE 4096
+
+/**
+ * @brief Largest width and height of a cursor shape in px, the most an RDP alpha pointer can have.
+ */
+#define MUX_CURSOR_MAX_SIZE 96
+
+/**
+ * @brief Most copies a single DISPLAY_COPY message carries.
+ */
+#define MUX_MAX_COPY_RECTS 16
+
+/**
+ * @brief Most display heads a VM can have.
+ */
+#define MUX_MAX_HEADS 8
+
+/**
+ * @brief Side length in px of the tiles a remote VM sends its framebuffer in. Tiles at the right and bottom edges of a
+ * head may be smaller.
+ */
+#define MUX_REMOTE_TILE_SIZE 64
+
+/**
+ * @brief Most tiles a single DISPLAY_TILES message carries.
+ */
+#define MUX_REMOTE_MAX_TILES 1024
+
+/**
+ * @brief Flag of a REMOTE_REGISTER message asking the server for a REMOTE_RESYNC, because the VM just connected or
+ * lost track of what the server has.
+ */
+#define MUX_REMOTE_REGISTER_RESYNC 1
 
 /**
  * @brief enum of message types.
@@ -34,9 +117,256 @@ enum message_type {
     MOUSE,
     KEYBOARD,
     DISPLAY_UPDATE_COMPLETE,
-    SHUTDOWN
+    SHUTDOWN,
+    DISPLAY_UPDATE_RECTS,
+    INPUT_BATCH,
+    VM_HANDLE,
+    CURSOR_DEFINE,
+    CURSOR_MOVE,
+    DISPLAY_COPY,
+    HEAD_SWITCH,
+    REMOTE_REGISTER,
+    DISPLAY_TILES,
+    REMOTE_CREDIT,
+    REMOTE_RESYNC
+};
+
+/**
+ * @brief Header at the start of the shared memory region.
+ *
+ * Access to the framebuffer following the header is synchronized with a seqlock: librdpmux makes seq odd before it
+ * writes to the framebuffer and even again when it's done. Readers never block the VM; they check with shm_read_begin()
+ * and shm_read_valid() whether their copy was consistent and retry if it wasn't.
+ *
+ * The layout is shared with librdpmux and must be kept in sync with its copy.
+ */
+struct MuxShmHeader {
+    uint32_t magic;       ///< Always MUX_SHM_MAGIC.
+    uint32_t version;     ///< Protocol version the region was created with.
+    uint32_t header_size; ///< Offset of the framebuffer from the start of the region, in bytes.
+    uint32_t reserved;    ///< Unused, keeps seq 8-byte aligned.
+    uint64_t seq;         ///< Seqlock generation counter. Odd while the VM is writing.
+    uint32_t width;       ///< Width of the framebuffer in px.
+    uint32_t height;      ///< Height of the framebuffer in px.
+    uint32_t stride;      ///< Scanline of the framebuffer in bytes.
+    uint32_t format;      ///< pixman format code of the framebuffer.
+};
+
+/**
+ * @brief Header of a binary message, spoken from RDPMUX_PROTOCOL_VERSION_BINARY on instead of msgpack.
+ *
+ * A binary message is this header followed by count records of the layout belonging to the message type: MuxWireRect
+ * for DISPLAY_UPDATE and DISPLAY_UPDATE_RECTS, MuxWireSwitch for DISPLAY_SWITCH, MuxWireInput for MOUSE, KEYBOARD and
+ * INPUT_BATCH, MuxWireAck for DISPLAY_UPDATE_COMPLETE, MuxWireHandle for VM_HANDLE, MuxWireCursor for CURSOR_DEFINE,
+ * MuxWireCursorPos for CURSOR_MOVE, MuxWireCopy for DISPLAY_COPY, MuxWireHeadSwitch for HEAD_SWITCH,
+ * MuxWireRemoteRegister for REMOTE_REGISTER, MuxWireTile for DISPLAY_TILES, MuxWireCredit for REMOTE_CREDIT and
+ * REMOTE_RESYNC, and nothing for SHUTDOWN. All fields are little-endian. Since message types are small, the first byte
+ * of a binary message can never be mistaken for the start of a msgpack array.
+ *
+ * The layouts are shared with librdpmux and must be kept in sync with its copy.
+ */
+struct __attribute__((packed)) MuxWireHeader {
+    uint16_t type;
+    uint16_t count;   ///< Number of records following the header.
+};
+
+/**
+ * @brief A rectangle in a binary display update.
+ */
+struct __attribute__((packed)) MuxWireRect {
+    uint32_t x;   ///< X-coordinate of the top left corner in px.
+    uint32_t y;   ///< Y-coordinate of the top left corner in px.
+    uint32_t w;   ///< Width in px.
+    uint32_t h;   ///< Height in px.
+};
+
+/**
+ * @brief Trailer of a binary DISPLAY_UPDATE_RECTS message from RDPMUX_PROTOCOL_VERSION on, after its count rects.
+ *
+ * Times are the low 32 bits of the VM's CLOCK_MONOTONIC in µs. The VM and the server share that clock since they run
+ * on the same host, and the low bits are enough as long as differences are taken modulo 2^32.
+ */
+struct __attribute__((packed)) MuxWireTrace {
+    uint32_t seq;         ///< Number of the update, counting up per VM.
+    uint32_t refresh_us;  ///< When the VM started looking for the damage of the update.
+    uint32_t sent_us;     ///< When the message was put on the wire.
+};
+
+/**
+ * @brief Body of a binary display switch.
+ */
+struct __attribute__((packed)) MuxWireSwitch {
+    uint32_t format;      ///< pixman format code of the framebuffer.
+    uint32_t w;           ///< Width of the framebuffer in px.
+    uint32_t h;           ///< Height of the framebuffer in px.
+    uint32_t shm_size;    ///< Size of the shared memory region in bytes.
+};
+
+/**
+ * @brief Body of a binary HEAD_SWITCH message: a display switch of one head of the VM's display, which also places the
+ * head on the desktop the clients are shown.
+ */
+struct __attribute__((packed)) MuxWireHeadSwitch {
+    uint32_t head;        ///< Index of the head, below MUX_MAX_HEADS.
+    uint32_t x;           ///< X-coordinate of the head's top left corner on the desktop, in px.
+    uint32_t y;           ///< Y-coordinate of the head's top left corner on the desktop, in px.
+    uint32_t format;      ///< pixman format code of the head's framebuffer.
+    uint32_t w;           ///< Width of the head's framebuffer in px.
+    uint32_t h;           ///< Height of the head's framebuffer in px.
+    uint32_t shm_size;    ///< Size of the head's shared memory region in bytes.
+};
+
+/**
+ * @brief An input event in a binary MOUSE, KEYBOARD or INPUT_BATCH message.
+ */
+struct __attribute__((packed)) MuxWireInput {
+    uint16_t type;    ///< MOUSE or KEYBOARD.
+    uint16_t a;       ///< Scancode of a keyboard event, x-coordinate of a mouse event.
+    uint16_t b;       ///< Flags of a keyboard event, y-coordinate of a mouse event.
+    uint16_t c;       ///< 0 for a keyboard event, flags of a mouse event.
+};
+
+/**
+ * @brief Body of a binary DISPLAY_UPDATE_COMPLETE message.
+ */
+struct __attribute__((packed)) MuxWireAck {
+    uint32_t success;     ///< Always 1.
+    uint32_t framerate;   ///< New target framerate of the VM.
+};
+
+/**
+ * @brief Body of a binary VM_HANDLE message.
+ *
+ * The handle replaces the 36 byte UUID frame of every message between the VM and the server once the VM got it, in
+ * both directions. It's only valid on the connection it was sent on.
+ */
+struct __attribute__((packed)) MuxWireHandle {
+    uint32_t handle;  ///< Handle of the VM in its broker shard. Never 0.
 };
 
+/**
+ * @brief Body of a binary CURSOR_DEFINE message. Followed by w * h pixels of the cursor shape, row by row, each an
+ * a8r8g8b8 uint32_t with straight alpha.
+ */
+struct __attribute__((packed)) MuxWireCursor {
+    uint32_t hot_x;   ///< X-coordinate of the hotspot in the shape, in px.
+    uint32_t hot_y;   ///< Y-coordinate of the hotspot in the shape, in px.
+    uint32_t w;       ///< Width of the shape in px, MUX_CURSOR_MAX_SIZE at most.
+    uint32_t h;       ///< Height of the shape in px, MUX_CURSOR_MAX_SIZE at most.
+};
+
+/**
+ * @brief Body of a binary CURSOR_MOVE message.
+ */
+struct __attribute__((packed)) MuxWireCursorPos {
+    uint32_t x;       ///< X-coordinate of the hotspot on the framebuffer, in px.
+    uint32_t y;       ///< Y-coordinate of the hotspot on the framebuffer, in px.
+    uint32_t visible; ///< 0 if the cursor is hidden, 1 otherwise.
+};
+
+/**
+ * @brief A copy in a binary DISPLAY_COPY message: the VM moved a w x h block of the framebuffer from (src_x, src_y) to
+ * (dst_x, dst_y), as if with memmove(), e.g. to scroll. The shared framebuffer already holds the result.
+ */
+struct __attribute__((packed)) MuxWireCopy {
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t dst_x;
+    uint32_t dst_y;
+    uint32_t w;
+    uint32_t h;
+};
+
+/**
+ * @brief Body of a binary REMOTE_REGISTER message, which a VM running on another host sends to the server's remote
+ * endpoint instead of calling Register over DBus. Sent again as a heartbeat while the VM has nothing else to say.
+ */
+struct __attribute__((packed)) MuxWireRemoteRegister {
+    uint32_t version;     ///< Protocol version the VM speaks.
+    uint32_t id;          ///< Internal ID of the VM.
+    uint32_t port;        ///< Port the VM's listener is asked to run on, 0 for the next free one.
+    uint32_t flags;       ///< MUX_REMOTE_REGISTER_RESYNC or 0.
+};
+
+/**
+ * @brief A tile in a binary DISPLAY_TILES message. Followed by size bytes: the w x h pixels of the tile, row by row
+ * without padding, compressed as a single LZ4 block.
+ */
+struct __attribute__((packed)) MuxWireTile {
+    uint32_t head;        ///< Index of the head the tile belongs to.
+    uint32_t x;           ///< X-coordinate of the tile's top left corner on the head, in px.
+    uint32_t y;           ///< Y-coordinate of the tile's top left corner on the head, in px.
+    uint32_t w;           ///< Width of the tile in px, MUX_REMOTE_TILE_SIZE at most.
+    uint32_t h;           ///< Height of the tile in px, MUX_REMOTE_TILE_SIZE at most.
+    uint32_t size;        ///< Size of the compressed pixels in bytes.
+};
+
+/**
+ * @brief Body of a binary REMOTE_CREDIT or REMOTE_RESYNC message.
+ *
+ * The server hands a remote VM credits for the tiles it may have in flight, so a slow link makes the VM hold back
+ * damage instead of queueing up stale tiles. REMOTE_CREDIT gives back credits for tiles the server applied;
+ * REMOTE_RESYNC tells the VM to forget what it had in flight, start over with credits tiles and send every head in
+ * full, e.g. after the server lost tiles.
+ */
+struct __attribute__((packed)) MuxWireCredit {
+    uint32_t credits;
+};
+
+/**
+ * @brief Starts a seqlock read of the shared framebuffer.
+ *
+ * @returns The generation to hand to shm_read_valid() once the read is done. Odd if the VM is writing right now, in
+ * which case the read is bound to fail validation.
+ *
+ * @param header The header of the shared memory region.
+ */
+inline uint64_t shm_read_begin(const MuxShmHeader *header)
+{
+    return __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Finishes a seqlock read of the shared framebuffer.
+ *
+ * @returns Whether everything read since shm_read_begin() returned seq is consistent, i.e. the VM didn't touch the
+ * framebuffer in the meantime.
+ *
+ * @param header The header of the shared memory region.
+ * @param seq The generation returned by shm_read_begin().
+ */
+inline bool shm_read_valid(const MuxShmHeader *header, uint64_t seq)
+{
+    // keep the framebuffer reads from being reordered past the second load of the counter
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) == 0 && __atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * @brief Starts writing to a framebuffer the server keeps itself, i.e. that of a remote VM. Readers see the write as
+ * if the VM did it.
+ *
+ * @param header The header of the region.
+ */
+inline void shm_write_begin(MuxShmHeader *header)
+{
+    uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    // keep the framebuffer writes from being reordered before the counter goes odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finishes a write started with shm_write_begin().
+ *
+ * @param header The header of the region.
+ */
+inline void shm_write_end(MuxShmHeader *header)
+{
+    uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
 /**
  * @brief std::make_unique from C++14
  *
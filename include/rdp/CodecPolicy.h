@@ -0,0 +1,161 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_CODECPOLICY_H
+#define RDPMUX_CODECPOLICY_H
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <freerdp/server/shadow.h>
+
+/**
+ * @brief Codecs the policy picks from, and the policies a listener can be configured with.
+ *
+ * CODEC_AUTO is only ever a policy: it lets the listener pick one of the others from the workload.
+ */
+enum codec_choice {
+    CODEC_AUTO = 0,
+    CODEC_PLANAR,   ///< Lossless planar bitmaps. Cheapest for small updates, e.g. typing into an office document.
+    CODEC_REMOTEFX, ///< RemoteFX. Good all-round choice for larger updates.
+    CODEC_H264      ///< H.264 over the graphics pipeline. Lowest bandwidth for video and other full-screen motion.
+};
+
+/**
+ * @brief Picks the codec a listener's clients are sent frames with, and switches them over to it.
+ *
+ * With a fixed policy the codec is simply the one configured. With CODEC_AUTO it follows the workload, judged by how
+ * much of the screen changes per frame, the frame rate, the bandwidth the clients use and how long frames take to
+ * encode. A codec has to win several updates in a row before the listener switches to it, so a single burst of
+ * activity doesn't make clients flip back and forth. Once H.264 took longer to encode than the frame rate allows, it
+ * isn't picked again for a while, since the cheaper codec's encode times say nothing about whether H.264 would fit now.
+ *
+ * The codecs are switched by adjusting the codec flags in the settings of each client, which the shadow server checks
+ * on every frame. That happens under the surface lock, which the client's thread holds for as long as it works on a
+ * frame. A client is only ever switched to codecs it negotiated; anything else falls back to the next best codec the
+ * client does support.
+ *
+ * Everything except Codec() is meant to be called from the subsystem thread only.
+ */
+class CodecPolicy
+{
+public:
+    CodecPolicy();
+
+    /**
+     * @brief Parses the name of a policy, as used on the command line and over DBus.
+     *
+     * @returns Whether the name was valid.
+     *
+     * @param name One of "auto", "planar", "remotefx" or "h264".
+     * @param policy Set to the policy.
+     */
+    static bool Parse(const std::string &name, codec_choice &policy);
+
+    /**
+     * @brief Gets the name of a policy or codec.
+     *
+     * @returns The name Parse() accepts for it.
+     */
+    static const char *Name(codec_choice policy);
+
+    /**
+     * @brief Records a frame.
+     *
+     * @param changed Share of the screen that changed in the frame, between 0 and 1.
+     * @param frame_ms Time it took to produce the frame, in ms.
+     */
+    void FrameProduced(double changed, uint64_t frame_ms);
+
+    /**
+     * @brief Re-evaluates which codec to use.
+     *
+     * @returns The codec to use from now on.
+     *
+     * @param policy The policy the listener is configured with.
+     * @param fps Current frame rate.
+     * @param bandwidth Bytes per second sent to the busiest client.
+     */
+    codec_choice Update(codec_choice policy, uint32_t fps, uint64_t bandwidth);
+
+    /**
+     * @brief Switches the given clients over to the current codec. Takes the list lock and the surface lock.
+     *
+     * @param clients The shadow server's client list.
+     * @param surface The surface the clients are sent.
+     */
+    void Apply(wArrayList *clients, rdpShadowSurface *surface);
+
+    /**
+     * @brief Gets the codec picked by the last Update(). Safe to call from any thread.
+     */
+    codec_choice Codec() const;
+
+private:
+    /**
+     * @brief Codec flags a client negotiated, saved before we first touch them.
+     */
+    struct ClientCodecs
+    {
+        bool saved;     ///< Whether the non-GFX flags below have been saved.
+        bool gfxSaved;  ///< Whether the GFX flags below have been saved. Only known once the client sent its GFX caps.
+        BOOL remoteFx;
+        BOOL nsCodec;
+        BOOL gfxH264;
+        BOOL gfxAVC444;
+        BOOL gfxAVC444v2;
+        codec_choice applied; ///< Codec the client was last switched to, CODEC_AUTO if none yet.
+    };
+
+    /**
+     * @brief Saved codec flags per client.
+     */
+    std::map<rdpShadowClient *, ClientCodecs> clients;
+
+    /**
+     * @brief Codec in use.
+     */
+    std::atomic<int> current;
+
+    /**
+     * @brief Codec that would have been picked by the last updates, and how many updates in a row it was.
+     */
+    codec_choice candidate;
+    unsigned int streak;
+
+    /**
+     * @brief Moving averages of the changed share of the screen and of the frame time in ms.
+     */
+    double changed;
+    double frame_time;
+
+    /**
+     * @brief Tick until which H.264 isn't picked, because encoding it took too long. 0 if it may be.
+     */
+    UINT64 h264_held_until;
+
+    /**
+     * @brief Picks the codec that suits the workload best, not taking the streak into account.
+     */
+    codec_choice pick(uint32_t fps, uint64_t bandwidth);
+
+    /**
+     * @brief Switches a client over to a codec. The caller must hold the surface lock.
+     */
+    static void switchClient(ClientCodecs &caps, rdpShadowClient *client, codec_choice codec);
+};
+
+#endif //RDPMUX_CODECPOLICY_H
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_FRAMERATECONTROLLER_H
+#define RDPMUX_FRAMERATECONTROLLER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Picks the frame rate a listener should run at, and thereby the rate the VM should refresh its display at.
+ *
+ * The rate follows an additive-increase, multiplicative-decrease scheme. It is capped by the slowest client's preferred
+ * frame rate and by how long producing a frame takes, and halved whenever the clients fall behind acknowledging
+ * frames. Nobody connected means nobody to produce frames for, so the rate drops to 0 then.
+ *
+ * Update(), FrameProduced() and SetMaxRate() are meant to be called from the subsystem thread only. Rate() may be
+ * called from anywhere.
+ */
+class FrameRateController
+{
+public:
+    /**
+     * @brief Creates a controller that never goes above the given frame rate.
+     *
+     * @param max_fps Highest frame rate the controller is allowed to pick.
+     */
+    FrameRateController(uint32_t max_fps);
+
+    /**
+     * @brief Records how long it took to produce a frame, i.e. to hand it to every client and have it encoded.
+     *
+     * @param frame_ms Duration in ms.
+     */
+    void FrameProduced(uint64_t frame_ms);
+
+    /**
+     * @brief Recomputes the frame rate from the current state of the connected clients.
+     *
+     * @returns The new frame rate.
+     *
+     * @param peers Number of connected clients.
+     * @param inflight Largest number of frames sent to a single client it has not acknowledged yet.
+     * @param client_fps Lowest frame rate preferred by a client's encoder, 0 if none of them has a preference.
+     */
+    uint32_t Update(size_t peers, uint32_t inflight, uint32_t client_fps);
+
+    /**
+     * @brief Gets the current frame rate.
+     *
+     * @returns The frame rate picked by the last Update().
+     */
+    uint32_t Rate() const;
+
+    /**
+     * @brief Changes the highest frame rate the controller may pick. Takes effect with the next Update().
+     *
+     * @param max_fps The new upper bound.
+     */
+    void SetMaxRate(uint32_t max_fps);
+
+private:
+    /**
+     * @brief Upper bound for the frame rate.
+     */
+    uint32_t max_fps;
+
+    /**
+     * @brief Current frame rate.
+     */
+    std::atomic<uint32_t> rate;
+
+    /**
+     * @brief Moving average of the time it takes to produce a frame, in ms. 0 until the first frame was produced.
+     */
+    double frame_time;
+};
+
+#endif //RDPMUX_FRAMERATECONTROLLER_H
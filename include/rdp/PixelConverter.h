@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_PIXELCONVERTER_H
+#define RDPMUX_PIXELCONVERTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Converts 16 and 24 bpp framebuffers to 32 bpp a lot faster than freerdp_image_copy(), which goes through
+ * ReadColor() and WriteColor() for every single pixel when the formats differ.
+ *
+ * Rather than hardcoding what each FreeRDP pixel format looks like in memory, the converter asks
+ * freerdp_image_copy() once per format pair: for 24 bpp it converts a probe pixel and derives a byte shuffle from the
+ * result, which is then applied 4 pixels at a time with SSSE3 where the CPU has it. For 16 bpp it converts every one of
+ * the 65536 possible pixels into a lookup table. Either way the output is exactly what freerdp_image_copy() would have
+ * produced.
+ *
+ * Not thread-safe; meant to be owned by the subsystem thread.
+ */
+class PixelConverter
+{
+public:
+    PixelConverter();
+
+    /**
+     * @brief Sets the converter up for a format pair. Cheap if the pair didn't change since the last call.
+     *
+     * @returns Whether the converter handles the pair. If it doesn't, use freerdp_image_copy().
+     *
+     * @param src_format FreeRDP pixel format of the source.
+     * @param dst_format FreeRDP pixel format of the destination.
+     */
+    bool Prepare(uint32_t src_format, uint32_t dst_format);
+
+    /**
+     * @brief Converts a rectangle. Prepare() must have returned true for the formats involved.
+     *
+     * @param dst Destination framebuffer.
+     * @param dst_stride Scanline of dst in bytes.
+     * @param src Source framebuffer.
+     * @param src_stride Scanline of src in bytes.
+     * @param x X-coordinate of the rectangle, the same in both framebuffers.
+     * @param y Y-coordinate of the rectangle, the same in both framebuffers.
+     * @param width Width of the rectangle in px.
+     * @param height Height of the rectangle in px.
+     */
+    void Convert(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t x, size_t y,
+                 size_t width, size_t height);
+
+private:
+    /**
+     * @brief Format pair the converter was last prepared for, and whether it handles it.
+     */
+    uint32_t src_format;
+    uint32_t dst_format;
+    bool ready;
+
+    /**
+     * @brief Bytes per pixel of the source.
+     */
+    size_t src_bpp;
+
+    /**
+     * @brief For 24 bpp sources: index of the source byte each destination byte comes from, or -1 for a byte that is
+     * always the same, e.g. the alpha channel. Those are taken from fill.
+     */
+    int8_t shuffle[4];
+    uint8_t fill[4];
+
+    /**
+     * @brief For 16 bpp sources: the destination pixel for every source pixel.
+     */
+    std::vector<uint32_t> lut;
+
+    /**
+     * @brief Whether the CPU supports SSSE3.
+     */
+    bool ssse3;
+
+    bool prepare24();
+    bool prepare16();
+};
+
+#endif //RDPMUX_PIXELCONVERTER_H
@@ -23,13 +23,171 @@
 #include <pixman.h>
 #include <msgpack/sbuffer.hpp>
 #include <winpr/winsock.h>
+#include <winpr/synch.h>
 #include <freerdp/server/shadow.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include "rdp/CodecPolicy.h"
+#include "util/Metrics.h"
+#include "util/Affinity.h"
+#include "util/EventLoop.h"
+#include "util/WireFormat.h"
 
 class RDPPeer; // I'm very bad at organizing C++ code.
 class RDPServerWorker; // I continue to get worse at organizing C++ code.
+class BrokerShard; // It's a lifestyle at this point.
 
 extern BOOL start_peerloop(freerdp_listener *instance, freerdp_peer *client);
 
+/**
+ * @brief Counters and histograms of a listener. Updated from the broker shard, the subsystem and the client threads.
+ */
+struct ListenerMetrics
+{
+    std::atomic<uint64_t> display_updates;  ///< Display update messages received from the VM.
+    std::atomic<uint64_t> dirty_rects;      ///< Rects in those messages.
+    std::atomic<uint64_t> dirty_pixels;     ///< Pixels copied out of the VM's framebuffer, or encoded straight from it.
+    std::atomic<uint64_t> frames;           ///< Frames handed to the clients.
+    std::atomic<uint64_t> frames_deferred;  ///< Frames put off because the VM drew while they were read.
+    std::atomic<uint64_t> copies;           ///< Copies within the framebuffer sent to the clients as blits.
+    std::atomic<uint64_t> copies_damaged;   ///< Copies that had to be sent as damage at their destination instead.
+    std::atomic<uint64_t> bytes_sent;       ///< Bytes sent to clients, all of them together.
+    std::atomic<uint64_t> input_events;     ///< Input events received from clients.
+    std::atomic<uint64_t> input_slow;       ///< Input events that bypassed the input queue, full or held back.
+    std::atomic<uint64_t> dropped;          ///< Messages from the VM that could not be processed.
+    std::atomic<uint64_t> remote_tiles;     ///< Tiles a remote VM sent of its framebuffer.
+    std::atomic<uint64_t> remote_bytes;     ///< Compressed bytes of those tiles.
+    Histogram encode_time;                  ///< Time it took the clients to encode a frame, in µs.
+    Histogram input_latency;                ///< Time from an input event arriving to it being sent to the VM, in µs.
+    Histogram frame_latency;                ///< Time from the VM looking for damage to the frame holding it being sent
+                                            ///< to the clients, in µs. Only VMs that time their updates count.
+
+    ListenerMetrics() : display_updates(0), dirty_rects(0), dirty_pixels(0), frames(0), frames_deferred(0), copies(0),
+                        copies_damaged(0), bytes_sent(0), input_events(0), input_slow(0), dropped(0), remote_tiles(0),
+                        remote_bytes(0)
+    {
+    }
+};
+
+/**
+ * @brief Traffic of a connected client.
+ */
+struct PeerStats
+{
+    std::string address;    ///< Address the client connected from.
+    uint64_t bytes_sent;    ///< Bytes sent to the client since it connected.
+};
+
+/**
+ * @brief Cursor of the VM, as defined and moved by CURSOR_DEFINE and CURSOR_MOVE messages.
+ */
+struct CursorState
+{
+    uint32_t shape_serial;          ///< Bumped whenever the shape changes. 0 until the VM defined one.
+    uint32_t hot_x;                 ///< X-coordinate of the hotspot in the shape, in px.
+    uint32_t hot_y;                 ///< Y-coordinate of the hotspot in the shape, in px.
+    uint32_t width;                 ///< Width of the shape in px.
+    uint32_t height;                ///< Height of the shape in px.
+    std::vector<uint32_t> pixels;   ///< a8r8g8b8 pixels of the shape with straight alpha, row by row.
+    uint32_t x;                     ///< X-coordinate of the hotspot on the framebuffer, in px.
+    uint32_t y;                     ///< Y-coordinate of the hotspot on the framebuffer, in px.
+    bool visible;                   ///< Whether the cursor is shown at all. Hidden until the VM first moved it.
+};
+
+/**
+ * @brief A block of the framebuffer the VM moved elsewhere, as announced in a DISPLAY_COPY message.
+ */
+struct ScreenCopy
+{
+    RECTANGLE_16 src;   ///< Where the block was copied from.
+    UINT16 dst_x;       ///< X-coordinate of the top left corner the block was copied to, in px.
+    UINT16 dst_y;       ///< Y-coordinate of the top left corner the block was copied to, in px.
+};
+
+/**
+ * @brief The display updates whose damage ends up in a frame, as far as the VM numbered and timed them.
+ */
+struct DamageTrace
+{
+    bool valid;             ///< Whether any of the updates was timed. The other fields are meaningless if not.
+    uint32_t seq;           ///< Number of the latest update.
+    uint64_t refresh_us;    ///< When the VM started looking for the damage of the oldest update, from metrics_now_us().
+
+    DamageTrace() : valid(false), seq(0), refresh_us(0)
+    {
+    }
+
+    /**
+     * @brief Adds the updates of another trace, e.g. of damage piling up while a frame was put off.
+     */
+    void Merge(const DamageTrace &other)
+    {
+        if (!other.valid)
+            return;
+        refresh_us = valid ? std::min(refresh_us, other.refresh_us) : other.refresh_us;
+        seq = other.seq;
+        valid = true;
+    }
+};
+
+/**
+ * @brief Settings of a listener that can be changed while it runs, through the Configure DBus method.
+ */
+struct ListenerConfig
+{
+    bool authenticating;            ///< Whether clients have to authenticate. Applies to clients connecting later.
+    std::string credential_file;    ///< SAM file clients authenticate against. Applies to clients connecting later.
+    bool shared_encoding;           ///< Whether clients with compatible settings share one encoding of each frame.
+    codec_choice codec_policy;      ///< Codec policy, applied with the next codec policy update.
+    uint32_t max_frame_rate;        ///< Highest frame rate the listener runs at, 0 for the subsystem's default.
+    bool shm_passthrough;           ///< Whether clients may encode straight from the VM's framebuffer.
+    unsigned int idle_timeout;      ///< Seconds without clients before the listener hibernates, 0 for never.
+};
+
+/**
+ * @brief A read-only mapping of a head's shm region, unmapped once the last reference to it is gone.
+ *
+ * The subsystem takes a reference for every frame, so a display switch can replace the mapping right away instead of
+ * waiting for the frame to be encoded from it.
+ */
+struct ShmMapping
+{
+    const MuxShmHeader *header; ///< Header at the start of the region.
+    size_t size;                ///< Size of the region in bytes, header included.
+
+    ShmMapping(const MuxShmHeader *header, size_t size) : header(header), size(size)
+    {
+    }
+    ~ShmMapping();
+
+    ShmMapping(const ShmMapping &) = delete;
+    ShmMapping &operator=(const ShmMapping &) = delete;
+};
+
+/**
+ * @brief A head of the VM's display: a framebuffer of its own in a shared memory region of its own, placed somewhere on
+ * the desktop the clients are shown.
+ */
+struct DisplayHead
+{
+    const MuxShmHeader *shm_header; ///< Header at the start of the region, nullptr while the region isn't mapped.
+    void *shm_buffer;               ///< The framebuffer inside the region, right after shm_header.
+    std::shared_ptr<const ShmMapping> shm_mapping; ///< Mapping shm_header points into, shared with copies of the head.
+    size_t shm_size;                ///< Size of the region in bytes, header included.
+    int shm_fd;                     ///< Descriptor of the region, kept to map it again. -1 until the VM switched the
+                                    ///< head on.
+    uint32_t x;                     ///< X-coordinate of the head's top left corner on the desktop, in px.
+    uint32_t y;                     ///< Y-coordinate of the head's top left corner on the desktop, in px.
+    uint32_t width;                 ///< Width of the framebuffer in px.
+    uint32_t height;                ///< Height of the framebuffer in px.
+    pixman_format_code_t format;    ///< pixman format code of the framebuffer.
+    MuxShmHeader *local_header;     ///< Writable mapping of the region if the listener keeps the framebuffer itself
+                                    ///< for a remote VM, nullptr if the VM shares it.
+    uint32_t switch_serial;         ///< Layout serial of the head's last display switch, 0 if it never had one.
+};
+
 /**
  * @brief C++ class wrapping the freerdp_listener struct associated with the RDP server.
  *
@@ -48,19 +206,58 @@ public:
      * @param parent A pointer to the RDPServerWorker for (LIMITED) use // todo: not so limited
      * @param auth Path to auth file. Empty if no auth.
      * @param conn Reference to the process's DBus connection for exposing the Listener object
+     * @param protocol Protocol version the VM registered with.
+     * @param pid PID of the VM's process, 0 if unknown.
+     * @param remote Whether the VM runs on another host and sends its framebuffer as DISPLAY_TILES messages.
+     * @param port_probe Socket bound to the port to keep it from being taken until the listener binds it, -1 if none.
+     * The listener takes ownership of it.
      */
     RDPListener(std::string uuid, int vm_id, uint16_t port, RDPServerWorker *parent, std::string auth,
-                Glib::RefPtr<Gio::DBus::Connection> conn);
+                Glib::RefPtr<Gio::DBus::Connection> conn, int protocol, pid_t pid = 0, bool remote = false,
+                int port_probe = -1);
     /**
      * @brief Safely cleans up the freerdp_listener struct and frees all WinPR objects.
      */
     ~RDPListener();
 
     /**
-     * @brief starts the listener subroutine and loops forever on incoming connections.
+     * @brief Starts the listener and waits on the calling thread until it's told to stop, then unregisters it.
      */
     void RunServer();
 
+    /**
+     * @brief Starts the listener: sets up the shadow server, exposes the listener on DBus and starts accepting
+     * connections. Returns right away; the listener runs until StopEvent() is signalled.
+     *
+     * The threads the shadow server starts for the listener, and for every client connecting, run on the listener's
+     * CPUs. So does the subsystem thread, unless frames are produced on an event loop.
+     *
+     * @returns Whether the listener could be started. If it couldn't, it has to be unregistered with shutdown().
+     */
+    bool Start();
+
+    /**
+     * @brief Gets the event signalled once the listener has to stop, because the VM shut down or somebody told it to.
+     *
+     * @returns The manual-reset stop event.
+     */
+    HANDLE StopEvent();
+
+    /**
+     * @brief Makes the listener produce its frames on the given event loop instead of a thread of its own. Must be set
+     * before the listener is started.
+     *
+     * @param loop The event loop. It has to outlive the listener.
+     */
+    void SetEventLoop(EventLoop *loop);
+
+    /**
+     * @brief Gets the event loop the listener produces its frames on.
+     *
+     * @returns The event loop, nullptr if the listener produces them on a thread of its own.
+     */
+    EventLoop *Loop();
+
     /**
      * @brief Processes outgoing messages from the RDP client to the VM.
      *
@@ -68,6 +265,36 @@ public:
      */
     void processOutgoingMessage(std::vector<uint16_t> vec);
 
+    /**
+     * @brief Processes outgoing input events from the RDP client to the VM.
+     *
+     * Input events take a fast path through the broker shard's lock-free input queue, and only fall back to
+     * processOutgoingMessage() if that is full. Once one has, the ones after it follow it there until the broker sent
+     * it, so none of them overtakes it through the input queue.
+     *
+     * @param type MOUSE or KEYBOARD.
+     * @param code Scancode of a keyboard event, ignored for mouse events.
+     * @param x X-coordinate of a mouse event, ignored for keyboard events.
+     * @param y Y-coordinate of a mouse event, ignored for keyboard events.
+     * @param flags RDP event flags.
+     */
+    void processInputEvent(uint16_t type, uint16_t code, uint16_t x, uint16_t y, uint16_t flags);
+
+    /**
+     * @brief Tells the listener the broker shard is sending one of the input events processInputEvent() fell back to
+     * processOutgoingMessage() with. Safe to call from any thread.
+     */
+    void InputFallbackSent();
+
+    /**
+     * @brief Sets where processInputEvent() queues input events. Called by the broker shard when it takes on the VM.
+     *
+     * @param shard The broker shard the VM belongs to.
+     * @param slot Slot of this listener in the shard.
+     * @param generation Generation of the slot.
+     */
+    void setInputRoute(BrokerShard *shard, uint32_t slot, uint32_t generation);
+
     /**
      * @brief Processes incoming messages from the VM.
      *
@@ -75,61 +302,212 @@ public:
      *
      * @param rvec Deserialized vector of uint32_ts comprising the message
      */
-    void processIncomingMessage(std::vector<uint32_t> rvec);
+    void processIncomingMessage(const std::vector<uint32_t> &rvec);
 
     /**
      * @brief Processes display updates and sends them to peers.
      *
-     * The listener first retrieves the update parameters from the deserialized message passed in. It then sends a
-     * display update to all connected peers (which are sharing the same VM session and framebuffer) in a thread-safe
-     * manner. This prevents connection threads from updating the list of connected peers while an update is in-flight.
-     * It then sends back the DISPLAY_UPDATE_COMPLETE message to the VM.
+     * The listener retrieves the damaged rectangles from the deserialized message passed in, adds them to the current
+     * dirty region and signals the update event, so the shadow subsystem picks them up on its next frame. Both the
+     * single-rectangle DISPLAY_UPDATE message and the multi-rectangle DISPLAY_UPDATE_RECTS message are accepted.
      *
      * @param msg The deserialized update message. Should be guaranteed by caller to be from a message of type
-     * DISPLAY_UPDATE.
+     * DISPLAY_UPDATE or DISPLAY_UPDATE_RECTS.
      */
-    void processDisplayUpdate(std::vector<uint32_t> msg);
+    void processDisplayUpdate(const std::vector<uint32_t> &msg);
 
     /**
      * @brief Processes display switch events and sends them to peers.
      *
-     * The listener first retrieves the framebuffer format, width, and height from the deserialized message passed in.
-     * It then mmaps() the shared memory region containing the new framebuffer if necessary (usually only happens the
-     * first time a display switch event is received, during initialization) and notifies all connected peers
+     * The listener first retrieves the framebuffer format, width, and height from the deserialized message passed in,
+     * and for a HEAD_SWITCH message which head it belongs to and where the head goes on the desktop. A DISPLAY_SWITCH
+     * message switches head 0, at the top left corner. Heads must not overlap.
+     * It then mmaps() the shared memory region containing the new framebuffer if necessary (the first time a display
+     * switch event is received, and whenever the VM replaced the region with one of a different size), checks that its
+     * header was written by a compatible library version, and notifies all connected peers
      * to perform a full screen refresh using RDPPeer::FullDisplayUpdate.
      *
+     * If the VM passed the region along as a file descriptor, that descriptor is mapped instead of opening the region
+     * by name. The listener takes ownership of shm_fd either way.
+     *
      * @param msg The deserialized display switch message. Should be guaranteed by caller to be from a message of type
-     * DISPLAY_SWITCH.
+     * DISPLAY_SWITCH or HEAD_SWITCH.
+     * @param shm_fd Descriptor of the shared memory region received with the message, -1 if it came without one.
+     */
+    void processDisplaySwitch(const std::vector<uint32_t> &msg, int shm_fd = -1);
+
+    /**
+     * @brief Processes copies within the framebuffer, e.g. scrolling, and queues them for the subsystem.
+     *
+     * A copy only does any good if what the clients show at its source is what the VM copied. If damage to the
+     * source is still pending, the subsystem couldn't know, so the copy is turned into damage at its destination
+     * right away instead.
+     *
+     * @param msg The deserialized DISPLAY_COPY message: [type, count] followed by src_x, src_y, dst_x, dst_y, w and h
+     * of every copy.
      */
-    void processDisplaySwitch(std::vector<uint32_t> msg);
+    void processDisplayCopy(const std::vector<uint32_t> &msg);
 
     /**
-     * @brief Gets the width of the framebuffer.
+     * @brief Processes a new cursor shape from the VM, and wakes up the subsystem to hand it to the clients as an RDP
+     * pointer.
      *
-     * @returns The width of the framebuffer.
+     * @param msg The deserialized CURSOR_DEFINE message: [type, hot_x, hot_y, w, h] followed by w * h pixels.
+     */
+    void processCursorDefine(const std::vector<uint32_t> &msg);
+
+    /**
+     * @brief Processes a cursor move from the VM, and wakes up the subsystem to hand it to the clients.
+     *
+     * @param msg The deserialized CURSOR_MOVE message: [type, x, y, visible].
+     */
+    void processCursorMove(const std::vector<uint32_t> &msg);
+
+    /**
+     * @brief Processes a DISPLAY_TILES message of a remote VM: decompresses its tiles into the framebuffer the listener
+     * keeps for the VM, adds them to the dirty region, and gives the VM its credits back.
+     *
+     * If a tile doesn't fit any head, e.g. because it was sent before a display switch that got lost, what the
+     * listener has can't be trusted anymore, and the VM is told to start over with a REMOTE_RESYNC.
+     *
+     * @param data The binary message.
+     * @param size Size of the message in bytes.
+     */
+    void processTiles(const char *data, size_t size);
+
+    /**
+     * @brief Tells whether the VM runs on another host.
+     */
+    bool Remote() const;
+
+    /**
+     * @brief Gets when the VM was last heard from, from metrics_now_us(). Only kept for remote VMs, which can't tell
+     * the server they're gone if their host or the network goes down.
+     */
+    uint64_t LastHeard() const;
+
+    /**
+     * @brief Tells whether the VM speaks the binary wire format or msgpack.
+     *
+     * @returns Whether messages to the VM should be sent as binary messages.
+     */
+    bool BinaryWire() const;
+
+    /**
+     * @brief Tells whether the VM can address its messages with the handle its broker shard gives it, instead of its
+     * UUID.
+     *
+     * @returns Whether the VM should be sent a VM_HANDLE message.
+     */
+    bool VmHandles() const;
+
+    /**
+     * @brief Gets the width of the desktop, which spans every head.
+     *
+     * @returns The width of the desktop.
      */
     size_t Width();
 
     /**
-     * @brief Gets the height of the framebuffer.
+     * @brief Gets the height of the desktop, which spans every head.
      *
-     * @returns The height of the framebuffer.
+     * @returns The height of the desktop.
      */
     size_t Height();
 
     /**
-     * @brief Gets the RDP pixel format of the framebuffer.
+     * @brief Gets the number of display switches processed so far, to tell whether the heads changed since.
+     *
+     * @returns The layout serial.
+     */
+    uint32_t LayoutSerial();
+
+    /**
+     * @brief Unmaps the framebuffers of every head, keeping what it takes to map them again with
+     * RestoreSharedMemory(). Only called by the subsystem, while nobody is connected.
+     */
+    void ReleaseSharedMemory();
+
+    /**
+     * @brief Maps the framebuffers unmapped by ReleaseSharedMemory() again. A head whose region can't be mapped
+     * anymore stays dark until the VM switches it again.
+     */
+    void RestoreSharedMemory();
+
+    /**
+     * @brief Gets how long the listener waits without clients before it hibernates.
      *
-     * @returns The RDP pixel format of the framebuffer.
+     * @returns The time in seconds, 0 if the listener never hibernates.
      */
-    std::tuple<int, int, int> GetRDPFormat();
+    unsigned int IdleTimeout();
 
     /**
-     * @brief Gets the dimensions of the dirty region in thread-safe manner.
+     * @brief Gets the ID of the VM's framebuffer, which trace points are recorded under.
+     */
+    int VmId() const;
+
+    /**
+     * @brief Gets the RDP pixel formats to copy a framebuffer of the given pixman format with.
+     *
+     * @returns Format of the framebuffer, format of the surface to copy it to and bytes per pixel of the framebuffer,
+     * all -1 if the format isn't supported.
      *
-     * @returns The dimensions in this order: x, y, w, h.
+     * @param format pixman format code of the framebuffer.
      */
-    std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> GetDirtyRegion();
+    static std::tuple<int, int, int> GetRDPFormat(pixman_format_code_t format);
+
+    /**
+     * @brief Takes the rectangles making up the dirty region, and the copies queued along with them, in thread-safe
+     * manner.
+     *
+     * Both are emptied and the update event reset, so every damaged rectangle and copy is handed out exactly once. The
+     * copies are meant to be applied before the damage: none of them has damage taken along with it at its source.
+     *
+     * @returns The damaged rectangles accumulated since the last call, in framebuffer coordinates.
+     *
+     * @param copies Set to the copies accumulated since the last call, in the order the VM made them.
+     * @param trace Set to the updates the damage came with.
+     */
+    std::vector<RECTANGLE_16> TakeDirtyRegion(std::vector<ScreenCopy> &copies, DamageTrace &trace);
+
+    /**
+     * @brief Gets the event signalled whenever there is something new for the subsystem to pick up: damage, a display
+     * switch, or the listener stopping.
+     *
+     * @returns The manual-reset update event.
+     */
+    HANDLE UpdateEvent();
+
+    /**
+     * @brief Copies the VM's cursor in a thread-safe manner, and resets the cursor event.
+     *
+     * @param cursor Updated to the current cursor. The shape is only copied if its shape_serial is out of date.
+     */
+    void TakeCursor(CursorState &cursor);
+
+    /**
+     * @brief Gets the event signalled whenever the VM moved its cursor or gave it a new shape.
+     *
+     * @returns The manual-reset cursor event.
+     */
+    HANDLE CursorEvent();
+
+    /**
+     * @brief Sets the frame rate the VM should refresh its display at, and lets the VM know if it changed.
+     *
+     * The new rate goes out to the VM in a DISPLAY_UPDATE_COMPLETE message. A rate of 0 tells the VM nobody is looking,
+     * so it can stop refreshing altogether.
+     *
+     * @param fps The new frame rate.
+     */
+    void SetFrameRate(uint32_t fps);
+
+    /**
+     * @brief Gets the frame rate the VM was last told to refresh its display at.
+     *
+     * @returns The current target frame rate.
+     */
+    uint32_t FrameRate();
 
     /**
      * @brief See whether the listener was configured to authenticate connections
@@ -139,12 +517,112 @@ public:
     bool Authenticating();
 
     /**
-     * @brief Set authentication on or off for this listener.
+     * @brief Set authentication on or off for this listener. Clients already connecting may still get the old setting.
      *
      * @param auth True or false.
      */
     void Authenticating(bool auth);
 
+    /**
+     * @brief See whether clients with compatible settings share one encoding of each frame.
+     *
+     * @returns shared encoding status
+     */
+    bool SharedEncoding();
+
+    /**
+     * @brief Turn shared encoding on or off for this listener. Takes effect on the next frame.
+     *
+     * @param shared True or false.
+     */
+    void SharedEncoding(bool shared);
+
+    /**
+     * @brief Gets the counters and histograms of the listener, to update or read them.
+     */
+    ListenerMetrics &Metrics();
+
+    /**
+     * @brief Replaces the traffic stats of the connected clients. Only called by the subsystem.
+     *
+     * @param peers One entry per connected client.
+     */
+    void SetPeerStats(std::vector<PeerStats> peers);
+
+    /**
+     * @brief Gets the traffic stats of the connected clients, as last reported by the subsystem.
+     */
+    std::vector<PeerStats> PeerStatsSnapshot();
+
+    /**
+     * @brief Gets the counters and current state of the listener under the names GetStats reports them with.
+     *
+     * @returns Name and value of every counter, gauge and histogram summary.
+     */
+    std::vector<std::pair<std::string, uint64_t>> Stats();
+
+    /**
+     * @brief Gets the UUID of the VM the listener belongs to.
+     */
+    const std::string &UUID() const;
+
+    /**
+     * @brief See whether clients may encode straight from the VM's framebuffer when its format matches the surface's.
+     *
+     * @returns shm passthrough status
+     */
+    bool ShmPassthrough();
+
+    /**
+     * @brief Gets the codec policy the listener is configured with.
+     *
+     * @returns The policy, CODEC_AUTO if the codec is picked from the workload.
+     */
+    codec_choice CodecPolicySetting();
+
+    /**
+     * @brief Sets the codec policy for this listener. Takes effect with the next codec policy update.
+     *
+     * @param policy The policy.
+     */
+    void CodecPolicySetting(codec_choice policy);
+
+    /**
+     * @brief Records the codec the subsystem's codec policy settled on. Only called by the subsystem.
+     *
+     * @param codec The codec in use.
+     */
+    void SetCodec(codec_choice codec);
+
+    /**
+     * @brief Gets the codec in use, as last reported by the subsystem.
+     *
+     * @returns The codec in use.
+     */
+    codec_choice Codec();
+
+    /**
+     * @brief Stages new settings, which the subsystem applies all at once at its next frame boundary, without
+     * restarting the listener or dropping any client. Settings staged before but not applied yet are kept unless
+     * they're changed again. Safe to call from any thread.
+     *
+     * @returns Whether every setting was known and valid. Nothing is staged otherwise.
+     *
+     * @param settings The settings to change by name, as listed in USAGE.md.
+     * @param error Set to what's wrong with the settings if they're rejected.
+     */
+    bool Configure(const std::map<Glib::ustring, Glib::VariantBase> &settings, Glib::ustring &error);
+
+    /**
+     * @brief Applies the settings staged by Configure(), if there are any. Only called by the subsystem, in between
+     * two frames.
+     *
+     * @returns Whether there were settings to apply.
+     *
+     * @param applied Set to the settings now in effect, for the subsystem to apply its share of them.
+     */
+    bool ApplyConfig(ListenerConfig &applied);
+
     /**
      * @brief Retrieve the currently set credential path.
      *
@@ -157,6 +635,12 @@ public:
      */
     void shutdown();
 
+    /**
+     * @brief Flags the listener for shutdown and wakes up whoever waits for it to stop, and the subsystem so it
+     * notices.
+     */
+    void requestStop();
+
     /**
      * @brief The freerdp_listener struct this object manages.
      *
@@ -166,9 +650,14 @@ public:
     rdpShadowServer *server;
 
     /**
-     * @brief The shared memory region containing the framebuffer. Always 32 MB big.
+     * @brief The heads of the VM's display, by index. Guarded by shmMutex. Copying a head keeps its mapping alive.
      */
-    void *shm_buffer;
+    DisplayHead heads[MUX_MAX_HEADS];
+
+    /**
+     * @brief Mutex guarding the heads against being remapped or moved while the subsystem takes a copy of them.
+     */
+    std::mutex shmMutex;
 
     bool listenerRunning();
 
@@ -191,11 +680,37 @@ private:
      */
     RDPServerWorker *parent;
 
+    /**
+     * @brief Broker shard input events are queued on. nullptr until the VM was assigned to one.
+     */
+    BrokerShard *input_shard;
+
+    /**
+     * @brief Slot of this listener in input_shard.
+     */
+    uint32_t input_slot;
+
+    /**
+     * @brief Generation of input_slot.
+     */
+    uint32_t input_generation;
+
+    /**
+     * @brief Input events handed to processOutgoingMessage() the broker shard hasn't sent yet. The input queue is
+     * bypassed while there are any.
+     */
+    std::atomic<uint32_t> input_fallback;
+
     /**
      * @brief Port number to listen on.
      */
     uint16_t port;
 
+    /**
+     * @brief Socket holding on to port until the shadow server binds it, -1 once it's closed.
+     */
+    int port_probe;
+
     /**
      * @brief UUID of the VM associated with the listener.
      */
@@ -206,50 +721,159 @@ private:
      */
     std::string samfile;
 
+    /**
+     * @brief SAM file paths the shadow server's settings held before the credential file was changed. The shadow
+     * server thread may still be copying one into a client it just accepted, so they're only freed with the listener.
+     */
+    std::vector<char *> retiredSamFiles;
+
     /**
      * @brief Unique ID of VM framebuffer.
      */
     int vm_id;
 
+    /**
+     * @brief Protocol version the VM registered with.
+     */
+    int protocol_version;
+
+    /**
+     * @brief Maps the shared memory region of a head, replacing the head's current mapping.
+     *
+     * @returns Whether the region could be mapped and has a valid header.
+     *
+     * @param shm_fd Descriptor of the region. Kept by the head if the region could be mapped, closed otherwise.
+     * @param expected_size Size of the region announced by the VM.
+     * @param head The head.
+     * @param local Writable mapping of the region if the listener created it, taken over by the head either way.
+     */
+    bool mapSharedMemory(int shm_fd, size_t expected_size, DisplayHead &head, MuxShmHeader *local = nullptr);
+
+    /**
+     * @brief Maps a shared memory region read-only and checks its header.
+     *
+     * @returns The header at the start of the mapping, nullptr if the region couldn't be mapped or has an unknown
+     * header.
+     *
+     * @param shm_fd Descriptor of the region.
+     * @param size Size of the region in bytes.
+     */
+    const MuxShmHeader *mapRegion(int shm_fd, size_t size);
+
     /**
      * @brief mutex guarding dirty region dimensions
      */
     std::mutex dimMutex;
 
     /**
-     * @brief X coordinate of current dirty region
+     * @brief Rectangles making up the current dirty region
+     */
+    std::vector<RECTANGLE_16> dirty_rects;
+
+    /**
+     * @brief Copies not handed to the subsystem yet, guarded by dimMutex.
      */
-    uint32_t x;
+    std::vector<ScreenCopy> copies;
 
     /**
-     * @brief Y coordinate of the current dirty region
+     * @brief Updates the damage in dirty_rects came with, guarded by dimMutex.
      */
-    uint32_t y;
+    DamageTrace dirty_trace;
 
     /**
-     * @brief width of the current dirty region
+     * @brief Manual-reset event telling the subsystem thread there is work to do. Set together with dirty_rects and
+     * copies.
      */
-    uint32_t w;
+    HANDLE updateEvent;
 
     /**
-     * @brief height of the current dirty region
+     * @brief Manual-reset event telling the subsystem thread the cursor changed. Set together with cursor.
      */
-    uint32_t h;
+    HANDLE cursorEvent;
 
     /**
-     * @brief The width of the framebuffer. Accessed via GetWidth().
+     * @brief The VM's cursor, guarded by cursorMutex.
      */
-    size_t width;
+    CursorState cursor;
+    std::mutex cursorMutex;
 
     /**
-     * @brief The height of the framebuffer. Accessed via GetHeight().
+     * @brief Manual-reset event signalled together with listener_running being cleared.
      */
-    size_t height;
+    HANDLE stopEvent;
 
     /**
-     * @brief The pixel format of the framebuffer. Accessed via GetFormat().
+     * @brief Event loop frames are produced on, nullptr for a thread of their own.
      */
-    pixman_format_code_t format;
+    EventLoop *loop;
+
+    /**
+     * @brief Whether the VM runs on another host.
+     */
+    bool remote;
+
+    /**
+     * @brief Tiles a remote VM may have in flight, as handed out with REMOTE_RESYNC.
+     */
+    uint32_t remoteWindow;
+
+    /**
+     * @brief When the VM was last heard from. Only kept for remote VMs.
+     */
+    std::atomic<uint64_t> lastHeard;
+
+    /**
+     * @brief Scratch vector DISPLAY_TILES messages are decoded into. Only touched by the broker shard.
+     */
+    std::vector<WireTile> incomingTiles;
+
+    /**
+     * @brief Scratch buffer tiles are decompressed into. Only touched by the broker shard.
+     */
+    std::vector<char> tileScratch;
+
+    /**
+     * @brief Creates the region the listener keeps a remote VM's head in, and maps it like a region shared by the VM.
+     *
+     * @returns Whether the region could be created.
+     *
+     * @param size Size of the region in bytes, header included.
+     * @param head The head.
+     */
+    bool createLocalRegion(size_t size, DisplayHead &head);
+
+    /**
+     * @brief Tells a remote VM to forget about the tiles it has in flight and send every head in full.
+     */
+    void sendResync();
+
+    /**
+     * @brief Closes port_probe if it's still open, which lets the port be bound again.
+     */
+    void closePortProbe();
+
+    /**
+     * @brief Adds damage to the dirty region and wakes up the subsystem.
+     *
+     * @param rects The damage, in desktop coordinates.
+     * @param trace The updates the damage came with.
+     */
+    void addDamage(std::vector<RECTANGLE_16> &rects, const DamageTrace &trace);
+
+    /**
+     * @brief The width of the desktop. Accessed via Width().
+     */
+    std::atomic<size_t> width;
+
+    /**
+     * @brief The height of the desktop. Accessed via Height().
+     */
+    std::atomic<size_t> height;
+
+    /**
+     * @brief Bumped by every display switch. Accessed via LayoutSerial().
+     */
+    std::atomic<uint32_t> layoutSerial;
 
     /**
      * @brief Mutex guarding stop.
@@ -265,14 +889,89 @@ private:
     guint registered_id = 0;
 
     /**
-     * @brief Whether the listener is configured to authenticate peers.
+     * @brief Whether the listener is configured to authenticate peers. Read over DBus while the subsystem applies new
+     * settings.
+     */
+    std::atomic<bool> authenticating;
+
+    /**
+     * @brief Whether clients with compatible settings share one encoding of each frame.
+     */
+    std::atomic<bool> sharedEncoding;
+
+    /**
+     * @brief Whether clients may encode straight from the VM's framebuffer. Only touched by the subsystem once the
+     * listener runs.
+     */
+    bool shmPassthrough;
+
+    /**
+     * @brief Seconds without clients before the listener hibernates, 0 for never. Only touched by the subsystem once
+     * the listener runs.
+     */
+    unsigned int idleTimeout;
+
+    /**
+     * @brief Guards config and staged.
+     */
+    std::mutex configMutex;
+
+    /**
+     * @brief Settings last applied, or staged to be applied.
+     */
+    ListenerConfig config;
+
+    /**
+     * @brief Settings staged by Configure() for the subsystem to apply.
+     */
+    ListenerConfig staged;
+
+    /**
+     * @brief Whether staged holds settings the subsystem hasn't applied yet.
+     */
+    std::atomic<bool> configPending;
+
+    /**
+     * @brief CPUs the listener's threads run on, empty for any. Fixed for the lifetime of the listener.
+     */
+    CpuSet affinity;
+
+    /**
+     * @brief Counters and histograms.
+     */
+    ListenerMetrics metrics;
+
+    /**
+     * @brief Traffic stats of the connected clients, guarded by peerMutex.
+     */
+    std::vector<PeerStats> peers;
+    std::mutex peerMutex;
+
+    /**
+     * @brief Codec policy the listener is configured with.
+     */
+    std::atomic<int> codecPolicy;
+
+    /**
+     * @brief Codec the subsystem's codec policy settled on.
+     */
+    std::atomic<int> activeCodec;
+
+    /**
+     * @brief Target FPS of the backend guest, picked by the subsystem's rate controller.
+     */
+    std::atomic<uint32_t> targetFPS;
+
+    /**
+     * @brief Whether the VM has been told about targetFPS yet. Messages to the VM are dropped until it has sent us
+     * something, so the first rate is announced once it did.
      */
-    bool authenticating;
+    std::atomic<bool> fpsAnnounced;
 
     /**
-     * @brief Target FPS of the backend guest.
+     * @brief Sends a DISPLAY_UPDATE_COMPLETE message carrying the given frame rate to the VM.
      */
-    uint16_t targetFPS;
+    void sendFrameRate(uint32_t fps);
 
     /**
      * @brief Map holding set of authentication credentials
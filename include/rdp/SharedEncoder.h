@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_SHAREDENCODER_H
+#define RDPMUX_SHAREDENCODER_H
+
+#include <memory>
+#include <vector>
+#include <freerdp/server/shadow.h>
+#include <freerdp/codec/rfx.h>
+
+/**
+ * @brief Encodes a frame once and sends the result to several clients, instead of having every client's encoder go
+ * over the same pixels.
+ *
+ * The shadow server gives each client an encoder of its own, which is what we want for a single client but means CPU
+ * use grows with every observer of a shared session. Clients that negotiated RemoteFX surface bits at the size of the
+ * surface all end up with byte for byte the same PDUs though, save for the codec ID and frame ID, which are filled in
+ * per client when sending. Everything else, e.g. clients using the graphics pipeline, stays with the shadow server's
+ * own encoding.
+ *
+ * Frames are encoded and sent on the subsystem thread, under the surface lock that keeps the clients' own threads from
+ * sending frames of their own at the same time, see rdpmux_subsystem_sends_directly().
+ */
+class SharedEncoder
+{
+public:
+    /**
+     * @brief A frame encoded for several clients.
+     */
+    struct Frame
+    {
+        UINT32 width;
+        UINT32 height;
+        UINT32 frameId;
+        std::vector<std::vector<BYTE>> messages; ///< Serialized RemoteFX messages.
+    };
+
+    SharedEncoder();
+    ~SharedEncoder();
+
+    /**
+     * @brief Checks whether a client can be sent the shared encoding of a surface.
+     *
+     * @returns Whether the client is ready for frames and negotiated settings the shared encoding satisfies.
+     *
+     * @param client The client.
+     * @param surface The surface being encoded.
+     */
+    bool Compatible(rdpShadowClient *client, rdpShadowSurface *surface);
+
+    /**
+     * @brief Encodes part of a surface for the given clients. The caller must hold the surface lock.
+     *
+     * @returns The frame, or nullptr if it couldn't be encoded.
+     *
+     * @param surface The surface to encode.
+     * @param rects Rectangles to encode.
+     * @param numRects Number of rectangles.
+     * @param clients Clients the frame is going to be sent to, all of which passed Compatible().
+     */
+    std::shared_ptr<const Frame> Encode(rdpShadowSurface *surface, const RECTANGLE_16 *rects, UINT32 numRects,
+                                        const std::vector<rdpShadowClient *> &clients);
+
+    /**
+     * @brief Sends a frame to a client. The caller must hold the surface lock.
+     *
+     * @returns Whether the frame was sent. Clients that were resized since the frame was encoded aren't sent it.
+     *
+     * @param client The client, one of those the frame was encoded for.
+     * @param frame The frame.
+     */
+    static bool Send(rdpShadowClient *client, const Frame &frame);
+
+private:
+    /**
+     * @brief The RemoteFX encoder. Created on the first Encode().
+     */
+    RFX_CONTEXT *rfx;
+
+    /**
+     * @brief Size of the surface rfx was last reset for.
+     */
+    UINT32 width;
+    UINT32 height;
+
+    /**
+     * @brief Clients the last frame was encoded for, to notice new clients that need the codec headers.
+     */
+    std::vector<rdpShadowClient *> audience;
+
+    /**
+     * @brief Stream RemoteFX messages are serialized into.
+     */
+    wStream *stream;
+
+    /**
+     * @brief Frame ID of the last frame. The clients' own encoders keep theirs to themselves.
+     */
+    UINT32 frameId;
+};
+
+#endif //RDPMUX_SHAREDENCODER_H
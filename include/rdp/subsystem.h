@@ -6,6 +6,21 @@
 #define RDPMUX_SUBSYSTEM_CPP_H
 
 #include "RDPListener.h"
+#include "FrameRateController.h"
+#include "SharedEncoder.h"
+#include "CodecPolicy.h"
+#include "PixelConverter.h"
+#include "util/EventLoop.h"
+
+/**
+ * @brief Where a head was when the subsystem's monitors were last set up, to tell which heads a display switch changed.
+ */
+struct HeadLayout
+{
+    bool on;               ///< Whether the head was switched on.
+    RECTANGLE_16 rect;     ///< The head's place on the desktop.
+    uint32_t serial;       ///< Layout serial of the head's last display switch.
+};
 
 typedef struct rdpmux_shadow_subsystem {
     RDP_SHADOW_SUBSYSTEM_COMMON();
@@ -13,8 +28,42 @@ typedef struct rdpmux_shadow_subsystem {
     RDPListener *listener;
     size_t src_width;
     size_t src_height;
+    BOOL fullRefresh; // recopy the whole surface on the next frame
+    FrameRateController *rateController;
+    SharedEncoder *sharedEncoder;
+    CodecPolicy *codecPolicy;
+    UINT64 lastRateUpdate; // tick of the last rate update, to turn bytes sent into bandwidth
+    PixelConverter *converter;
+    BOOL passthrough; // the last frame was encoded straight from shm, so the surface's own buffer is stale
+    std::map<rdpShadowClient *, PeerStats> *peers; // running traffic totals per client
+    UINT64 nextFrame; // tick the next frame may be produced at
+    UINT64 nextRateUpdate; // tick the frame rate is recomputed at
+    BOOL pending; // the last frame was deferred and has to be redone
+    HANDLE subsystemThread; // thread producing frames, NULL while running on the listener's event loop
+    LoopTask *loopTask; // task producing frames on the listener's event loop, NULL while running on a thread
+    CursorState *cursor; // the VM's cursor as last handed to the clients
+    std::map<rdpShadowClient *, UINT32> *cursorPeers; // shape serial each client was last sent
+    std::atomic<rdpShadowClient *> *lastMouseClient; // client that moved the mouse last, never sent its own moves
+    uint32_t layoutSerial; // layout serial of the listener the monitors were last set up for
+    HeadLayout layout[MUX_MAX_HEADS]; // the heads as the monitors were last set up for, by index
+    UINT64 lastConnected; // tick a client was last seen connected at, to tell when to hibernate
+    BOOL hibernating; // the surface is shrunk and the framebuffers unmapped until the next client connects
+    DamageTrace *trace; // updates whose damage is in the invalid region, but wasn't sent yet
 } rdpmuxShadowSubsystem;
 
+/**
+ * @brief Checks whether the subsystem thread may send to a client itself, rather than leave it to the client's thread.
+ *
+ * The shadow server's client thread only sends frames while it holds the surface lock, which also covers the codec
+ * settings it reads for them. Whatever else it sends on its own, channel data and the like, doesn't share any state
+ * with updates, and it's only ever posted pointer updates by us. So anything the subsystem thread sends while holding
+ * the surface lock can neither get in between the fragments of a frame nor have its own split up. The exception are
+ * clients on the RDP security layer, which encrypts every PDU with one running key: those are left to their thread.
+ *
+ * @returns Whether the subsystem thread may send to the client while it holds the surface lock.
+ */
+BOOL rdpmux_subsystem_sends_directly(rdpShadowClient *client);
+
 FREERDP_API int RDPMux_ShadowSubsystemEntry(RDP_SHADOW_ENTRY_POINTS *pEntryPoints);
 
 #endif //RDPMUX_SUBSYSTEM_CPP_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_AFFINITY_H
+#define RDPMUX_AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * @brief A set of CPUs to run threads on. An empty set doesn't restrict anything, so a thread "pinned" to it keeps
+ * running wherever the scheduler likes.
+ */
+class CpuSet
+{
+public:
+    /**
+     * @brief Creates an empty set.
+     */
+    CpuSet();
+
+    /**
+     * @brief Parses a list of CPUs the way the kernel writes them, e.g. "0-3,8,10-11", as used on the command line.
+     *
+     * @returns Whether the list was valid. An empty list is, and gives an empty set.
+     *
+     * @param list The list.
+     * @param set Set to the CPUs in the list.
+     */
+    static bool Parse(const std::string &list, CpuSet &set);
+
+    /**
+     * @brief Gets the CPUs of a NUMA node, as listed in sysfs.
+     *
+     * @returns The CPUs, empty if the node doesn't exist.
+     *
+     * @param node The node.
+     */
+    static CpuSet NumaNode(int node);
+
+    bool Empty() const;
+    int Count() const;
+    bool Contains(int cpu) const;
+
+    /**
+     * @brief Gets the CPUs in both this set and another one.
+     */
+    CpuSet Intersect(const CpuSet &other) const;
+
+    /**
+     * @brief Writes the set the way Parse() takes it.
+     */
+    std::string ToString() const;
+
+    /**
+     * @brief Restricts a thread to the CPUs of the set. Threads it creates from then on inherit the restriction.
+     *
+     * @returns Whether the thread was pinned, or the set is empty.
+     *
+     * @param thread The thread.
+     */
+    bool Apply(pthread_t thread) const;
+
+private:
+    cpu_set_t cpus;
+};
+
+/**
+ * @brief Pins the calling thread to a set of CPUs for as long as it's in scope, and puts its previous affinity back
+ * once it goes out of scope. Threads created in the meantime stay pinned, which is how threads somebody else creates,
+ * e.g. those of the shadow server, are placed.
+ */
+class ScopedAffinity
+{
+public:
+    ScopedAffinity(const CpuSet &cpus);
+    ~ScopedAffinity();
+
+private:
+    cpu_set_t previous;
+    bool pinned;
+
+    ScopedAffinity(const ScopedAffinity &) = delete;
+    ScopedAffinity &operator=(const ScopedAffinity &) = delete;
+};
+
+/**
+ * @brief Works out which NUMA node a process lives on: the node its memory is bound to if it's bound to a single one,
+ * otherwise the node most of its threads last ran on.
+ *
+ * @returns The node, -1 if the process is gone or the machine has a single node anyway.
+ *
+ * @param pid PID of the process.
+ */
+int numa_node_of_process(pid_t pid);
+
+#endif //RDPMUX_AFFINITY_H
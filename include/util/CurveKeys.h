@@ -0,0 +1,58 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_CURVEKEYS_H
+#define RDPMUX_CURVEKEYS_H
+
+#include <set>
+#include <string>
+
+/**
+ * @brief CURVE keys a shard reachable from other hosts authenticates the VMs connecting to it with. Only hosts whose
+ * public key is listed get through the handshake, everybody else is refused before sending anything.
+ */
+struct CurveKeys
+{
+    /**
+     * @brief Secret key of the shard, Z85 encoded. Empty for a shard that doesn't authenticate.
+     */
+    std::string secret_key;
+
+    /**
+     * @brief Public keys of the hosts allowed to connect, as the binary 32 bytes ZAP hands them over in.
+     */
+    std::set<std::string> client_keys;
+
+    /**
+     * @brief Loads the keys from files holding them Z85 encoded, the way zmq_curve_keypair() writes them. The secret
+     * key file holds the key on its first line. The client key file holds a public key per line; empty lines and
+     * lines starting with # are skipped.
+     *
+     * @returns Whether both files could be read and held valid keys, at least one of them in the client key file.
+     *
+     * @param secret_file File holding the shard's secret key.
+     * @param clients_file File holding the public keys of the hosts allowed to connect.
+     * @param keys Set to the keys.
+     */
+    static bool Load(const std::string &secret_file, const std::string &clients_file, CurveKeys &keys);
+
+    /**
+     * @brief Whether the shard authenticates.
+     */
+    bool Enabled() const;
+};
+
+#endif //RDPMUX_CURVEKEYS_H
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_EVENTLOOP_H
+#define RDPMUX_EVENTLOOP_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <winpr/synch.h>
+#include "util/Affinity.h"
+
+/**
+ * @brief Something that runs on an EventLoop, waking up whenever one of its events is signalled or its timeout expires.
+ *
+ * This is the loop body of a thread that would otherwise sit in WaitForMultipleObjects(), split in two: Prepare() says
+ * what the thread would wait for, and Dispatch() is what it would do once it woke up.
+ */
+class LoopTask
+{
+public:
+    virtual ~LoopTask() {}
+
+    /**
+     * @brief Called before the loop waits for the task. Only ever called on the loop thread.
+     *
+     * @returns How long to wait at most in ms, INFINITE to only wake up for the events.
+     *
+     * @param events Set to the WinPR events to wait for. Any of them being signalled wakes the task up.
+     */
+    virtual DWORD Prepare(std::vector<HANDLE> &events) = 0;
+
+    /**
+     * @brief Called on the loop thread once one of the events was signalled or the timeout expired.
+     *
+     * @returns Whether the task should keep running. Once it returns false, it's never called again.
+     */
+    virtual bool Dispatch() = 0;
+};
+
+/**
+ * @brief A thread waiting for the events of any number of LoopTasks at once, and running them as they come up.
+ *
+ * The events are the file descriptors behind WinPR events, waited for all together with epoll, so an idle task costs
+ * nothing but its registration. Tasks are only ever run on the loop thread, one at a time, so a task that takes long
+ * delays the others on the same loop.
+ */
+class EventLoop
+{
+public:
+    /**
+     * @brief Sets up epoll and starts the loop thread.
+     *
+     * @param cpus CPUs the loop thread runs on, empty for any.
+     */
+    EventLoop(const CpuSet &cpus = CpuSet());
+
+    /**
+     * @brief Stops the loop thread and waits for it to finish. Functions and watches still pending are dropped without
+     * being run.
+     */
+    ~EventLoop();
+
+    /**
+     * @brief Runs a function on the loop thread. Safe to call from any thread.
+     *
+     * @param fn The function.
+     */
+    void Post(std::function<void()> fn);
+
+    /**
+     * @brief Runs a function on the loop thread once the given event is signalled. The function is run only once, and
+     * destroyed right after it ran. Safe to call from any thread.
+     *
+     * @param event The WinPR event to wait for.
+     * @param fn The function.
+     */
+    void OnSignal(HANDLE event, std::function<void()> fn);
+
+    /**
+     * @brief Starts running a task. Safe to call from any thread. The caller keeps ownership of the task, and has to
+     * Remove() it before destroying it.
+     *
+     * @param task The task.
+     */
+    void Add(LoopTask *task);
+
+    /**
+     * @brief Stops running a task, whether it's still running or already finished. Safe to call from any thread; once
+     * this returns, the task won't be called again. Must not be called from a thread the loop could be waiting for.
+     *
+     * @param task The task.
+     */
+    void Remove(LoopTask *task);
+
+    /**
+     * @brief Gets the number of tasks and watches currently registered, to spread new ones evenly over loops.
+     */
+    size_t Load() const;
+
+private:
+    /**
+     * @brief A task or watch registered with the loop.
+     */
+    struct Source
+    {
+        LoopTask *task;                 ///< The task, nullptr for watches.
+        std::function<void()> callback; ///< Function run once the event of a watch is signalled.
+        std::vector<int> fds;           ///< Descriptors registered with epoll for the source.
+        uint64_t deadline;              ///< Tick the source wants to be run at in any case, NO_DEADLINE for none.
+        bool ready;                     ///< Whether the source is already due to be run in this pass.
+        bool dead;                      ///< Whether the source is gone and only waiting to be freed.
+    };
+
+    /**
+     * @brief Runs the loop until stop is set.
+     */
+    void run();
+
+    /**
+     * @brief Registers a new source and makes it wait for the given events.
+     */
+    void addSource(LoopTask *task, std::function<void()> callback, const std::vector<HANDLE> &events);
+
+    /**
+     * @brief Asks a task what to wait for, and updates its registration with epoll to match.
+     */
+    void prepare(Source *source);
+
+    /**
+     * @brief Runs a source which woke up, and prepares it for the next wait.
+     */
+    void dispatch(Source *source);
+
+    /**
+     * @brief Drops the registration of a source. It's freed at the end of the current pass.
+     */
+    void unwatch(Source *source);
+
+    /**
+     * @brief Makes epoll wait for exactly the given descriptors on behalf of a source.
+     */
+    void watch(Source *source, std::vector<int> fds);
+
+    /**
+     * @brief Runs the functions posted since the last pass.
+     */
+    void runPosted();
+
+    /**
+     * @brief Whether this is being called on the loop thread, or the loop thread is gone.
+     */
+    bool ownsSources() const;
+
+    static const uint64_t NO_DEADLINE = UINT64_MAX;
+
+    int epoll_fd;
+
+    /**
+     * @brief eventfd for waking up the loop when a function was posted or it has to stop.
+     */
+    int wakeup_fd;
+
+    std::thread thread;
+    std::atomic<bool> stop;
+    std::atomic<bool> running;
+
+    /**
+     * @brief All registered sources. Only touched on the loop thread, or once it's gone.
+     */
+    std::vector<std::unique_ptr<Source>> sources;
+    std::atomic<size_t> load;
+
+    /**
+     * @brief Functions posted to the loop, guarded by posted_lock.
+     */
+    std::vector<std::function<void()>> posted;
+    std::mutex posted_lock;
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+};
+
+/**
+ * @brief A fixed number of EventLoops, usually one per core, for spreading tasks over.
+ */
+class EventLoopPool
+{
+public:
+    /**
+     * @brief Starts the loops.
+     *
+     * @param threads Number of loops.
+     * @param cpus CPUs the loop threads run on, empty for any.
+     */
+    EventLoopPool(unsigned int threads, const CpuSet &cpus = CpuSet());
+
+    /**
+     * @brief Picks the loop with the least tasks and watches registered.
+     */
+    EventLoop &Pick();
+
+private:
+    std::vector<std::unique_ptr<EventLoop>> loops;
+
+    /**
+     * @brief Loop the next Pick() starts looking at.
+     */
+    std::atomic<size_t> next;
+};
+
+#endif //RDPMUX_EVENTLOOP_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_INPUTQUEUE_H
+#define RDPMUX_INPUTQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A single keyboard or mouse event on its way to a VM.
+ *
+ * Plain old data, so it can be copied into a preallocated queue slot without touching the heap.
+ */
+struct InputRecord
+{
+    uint16_t type;          ///< MOUSE or KEYBOARD.
+    uint16_t code;          ///< Scancode of a keyboard event.
+    uint16_t x;             ///< X-coordinate of a mouse event.
+    uint16_t y;             ///< Y-coordinate of a mouse event.
+    uint16_t flags;         ///< RDP event flags.
+    uint32_t slot;          ///< Slot of the listener the event came from in its broker shard.
+    uint32_t generation;    ///< Generation of that slot, so events from a listener that's gone can be told apart.
+    uint64_t queued_us;     ///< When the event was queued, for measuring input latency. See metrics_now_us().
+};
+
+/**
+ * @brief A bounded, lock-free queue of InputRecords with many producers and a single consumer.
+ *
+ * This is a ring of cells, each with a sequence number telling producers and the consumer whose turn it is to touch
+ * it, as described by Dmitry Vyukov. Producers only contend on a single atomic position counter; the consumer doesn't
+ * contend at all.
+ */
+class InputQueue
+{
+public:
+    /**
+     * @brief Allocates the ring.
+     *
+     * @param capacity Number of records the queue holds. Rounded up to a power of two.
+     */
+    InputQueue(size_t capacity);
+    ~InputQueue();
+
+    /**
+     * @brief Queues a record. Safe to call from any thread.
+     *
+     * @returns Whether there was room for the record.
+     *
+     * @param record The record to queue.
+     * @param first Set to whether the queue was empty before, i.e. whether the consumer needs waking up.
+     */
+    bool push(const InputRecord &record, bool &first);
+
+    /**
+     * @brief Takes the oldest record off the queue. Must only be called from the consumer thread.
+     *
+     * @returns Whether there was a record to take.
+     *
+     * @param record Set to the record taken.
+     */
+    bool pop(InputRecord &record);
+
+    /**
+     * @brief Tells the queue the consumer is done with a batch of records, so the next push() wakes it again.
+     *
+     * @returns Whether records were queued in the meantime, in which case the consumer should go for another batch
+     * instead of sleeping.
+     *
+     * @param count Number of records taken with pop() since the last call.
+     */
+    bool release(size_t count);
+
+    /**
+     * @brief Gets the number of records waiting to be taken. Only an estimate while records are pushed or taken.
+     */
+    size_t size() const;
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        InputRecord record;
+    };
+
+    Cell *cells;
+    size_t mask;
+
+    // producers and the consumer each get their own cache line
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) size_t dequeue_pos;
+    alignas(64) std::atomic<size_t> pending;
+
+    InputQueue(const InputQueue &) = delete;
+    InputQueue &operator=(const InputQueue &) = delete;
+};
+
+#endif //RDPMUX_INPUTQUEUE_H
@@ -27,12 +27,15 @@ typedef std::tuple<std::vector<uint16_t>, std::string> QueueItem;
 
 /**
  * @brief A synchronized FIFO queue backed by an std::queue to hold msgpack::sbufs for processing.
+ *
+ * Besides blocking in dequeue(), a consumer can wait for items by polling EventFd(), which becomes readable whenever
+ * the queue goes from empty to non-empty, and then take everything queued up at once with dequeueAll().
  */
 class MessageQueue
 {
 public:
-    MessageQueue() {};
-    ~MessageQueue() {};
+    MessageQueue();
+    ~MessageQueue();
 
     /**
      * @brief Checks if the queue is empty.
@@ -40,9 +43,20 @@ public:
      * @returns Whether the queue is empty.
      */
     bool isEmpty() {
+        std::lock_guard<std::mutex> lock(mutex_);
         return queue_.empty();
     }
 
+    /**
+     * @brief Gets the number of items in the queue.
+     *
+     * @returns Number of items waiting to be dequeued.
+     */
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+
     /**
      * @brief Enqueues an item on the queue
      *
@@ -57,10 +71,32 @@ public:
      */
     const QueueItem dequeue();
 
+    /**
+     * @brief Takes every item currently in the queue, without blocking, and resets EventFd().
+     *
+     * @returns The dequeued items, in FIFO order. Empty if there were none.
+     */
+    std::queue<QueueItem> dequeueAll();
+
+    /**
+     * @brief Makes EventFd() readable without queueing anything, e.g. to have the consumer check for shutdown.
+     */
+    void wake();
+
+    /**
+     * @brief Gets the eventfd signalling that items are waiting.
+     *
+     * @returns The eventfd, or -1 if it couldn't be created.
+     */
+    int EventFd() const {
+        return event_fd_;
+    }
+
 private:
     std::mutex mutex_;
     std::condition_variable cond_push_;
     std::queue<QueueItem> queue_;
+    int event_fd_;
 };
 
 #endif //QEMU_RDP_MESSAGEQUEUE_H
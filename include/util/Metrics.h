@@ -0,0 +1,136 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_METRICS_H
+#define RDPMUX_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Gets the current time on the monotonic clock, in µs. What all timestamps fed into the metrics are taken with.
+ */
+uint64_t metrics_now_us();
+
+/**
+ * @brief Values of a Histogram at some point in time.
+ */
+struct HistogramSnapshot
+{
+    uint64_t count;                 ///< Number of values recorded.
+    uint64_t sum;                   ///< Sum of the values recorded.
+    std::vector<uint64_t> buckets;  ///< Number of values per bucket, not cumulative.
+
+    /**
+     * @brief Estimates a percentile from the buckets.
+     *
+     * @returns The upper bound of the bucket the percentile falls into, 0 if nothing was recorded.
+     *
+     * @param p The percentile, between 0 and 1.
+     */
+    uint64_t Percentile(double p) const;
+};
+
+/**
+ * @brief Lock-free histogram with power-of-two buckets, cheap enough to record into on every frame and input event.
+ *
+ * Bucket i counts the values up to 2^i, the last bucket everything larger than that.
+ */
+class Histogram
+{
+public:
+    /**
+     * @brief Number of buckets. Covers up to a little over 4 s for values in µs.
+     */
+    static const int BUCKETS = 24;
+
+    Histogram();
+
+    /**
+     * @brief Records a value. Safe to call from any thread.
+     */
+    void Record(uint64_t value);
+
+    /**
+     * @brief Gets the current values. Not atomic as a whole, so the count may be off by the values recorded meanwhile.
+     */
+    HistogramSnapshot Snapshot() const;
+
+    /**
+     * @brief Gets the upper bound of a bucket.
+     *
+     * @returns The largest value counted in the bucket, UINT64_MAX for the last one.
+     */
+    static uint64_t UpperBound(int bucket);
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+};
+
+/**
+ * @brief Writes metrics in the Prometheus text exposition format.
+ *
+ * Every metric family is started with Family(), followed by one sample per label set. Label values are escaped, names
+ * are expected to be valid already.
+ */
+class PrometheusWriter
+{
+public:
+    /**
+     * @param out Stream to write to. Its precision is raised so large counters are written in full.
+     */
+    explicit PrometheusWriter(std::ostream &out);
+
+    /**
+     * @brief Starts a metric family.
+     *
+     * @param name Name of the family, without the rdpmux_ prefix.
+     * @param type "counter", "gauge" or "histogram".
+     * @param help One line describing the family.
+     */
+    void Family(const std::string &name, const char *type, const char *help);
+
+    /**
+     * @brief Writes a counter or gauge sample of the current family.
+     *
+     * @param labels Labels of the sample, e.g. {"uuid", "..."}, as name, value pairs.
+     * @param value Value of the sample.
+     */
+    void Sample(const std::vector<std::string> &labels, double value);
+
+    /**
+     * @brief Writes the samples of a histogram of the current family.
+     *
+     * @param labels Labels of the histogram, as name, value pairs.
+     * @param histogram The histogram.
+     * @param scale Factor to convert the recorded values into the unit of the family, e.g. 1e-6 for µs to s.
+     */
+    void Sample(const std::vector<std::string> &labels, const HistogramSnapshot &histogram, double scale);
+
+private:
+    std::ostream &out;
+    std::string family;
+
+    void sample(const std::string &name, const std::vector<std::string> &labels, const char *extra_name,
+                const std::string &extra_value, double value);
+};
+
+#endif //RDPMUX_METRICS_H
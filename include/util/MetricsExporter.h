@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_METRICSEXPORTER_H
+#define RDPMUX_METRICSEXPORTER_H
+
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+
+/**
+ * @brief Minimal HTTP server answering every request with the current metrics, for Prometheus to scrape.
+ *
+ * Requests are served one at a time on a thread of its own. Scrapes come in every few seconds at most, so there's no
+ * point in anything fancier.
+ */
+class MetricsExporter
+{
+public:
+    /**
+     * @brief Function writing the metrics in the Prometheus text exposition format.
+     */
+    typedef std::function<void(std::ostream &)> Collector;
+
+    /**
+     * @param collect Called for every request to produce the response body.
+     */
+    explicit MetricsExporter(Collector collect);
+
+    /**
+     * @brief Stops serving and waits for the thread to finish.
+     */
+    ~MetricsExporter();
+
+    /**
+     * @brief Binds the listening socket and starts serving on a new thread.
+     *
+     * @returns Whether the socket could be bound.
+     *
+     * @param address IPv4 address to listen on.
+     * @param port TCP port to listen on.
+     */
+    bool Start(const std::string &address, uint16_t port);
+
+private:
+    Collector collect;
+
+    /**
+     * @brief Listening socket, -1 until Start().
+     */
+    int sock;
+
+    std::thread thread;
+    std::atomic<bool> stop;
+
+    /**
+     * @brief Reads a request from a client and sends the response.
+     */
+    void serve(int conn);
+
+    /**
+     * @brief Accept loop.
+     */
+    void run();
+};
+
+#endif //RDPMUX_METRICSEXPORTER_H
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_PORTALLOCATOR_H
+#define RDPMUX_PORTALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Hands out the ports listeners listen on.
+ *
+ * Ports in use are tracked in a bitmap covering every port, so reserving and releasing one is constant time. Free
+ * ports are handed out lowest first from a configurable range, so ports are re-used as much as possible, and a port
+ * that was just released is the next one handed out.
+ *
+ * Whether a port can actually be bound is checked without holding the allocator's lock, so concurrent registrations
+ * don't wait for each other's checks.
+ */
+class PortAllocator
+{
+public:
+    /**
+     * @brief Creates an allocator with every port free.
+     *
+     * @param first First port Acquire() hands out.
+     * @param last Last port Acquire() hands out.
+     */
+    PortAllocator(uint16_t first, uint16_t last);
+
+    /**
+     * @brief Picks the lowest free port in the range that nothing else on the host is bound to, and marks it in use.
+     *
+     * The socket the port was checked with is handed out still bound, so nothing on the host takes the port in
+     * between the check and the listener binding it. Whoever gets it closes it right before binding the port itself.
+     *
+     * @returns The port, 0 if there is none left.
+     *
+     * @param probe Set to the socket bound to the port, -1 if there is no port.
+     */
+    uint16_t Acquire(int &probe);
+
+    /**
+     * @brief Marks the given port in use, whether it's in the range or not.
+     *
+     * @returns Whether the port was free.
+     *
+     * @param port The port.
+     */
+    bool Reserve(uint16_t port);
+
+    /**
+     * @brief Marks a port free again.
+     *
+     * @param port The port, as returned by Acquire() or passed to Reserve().
+     */
+    void Release(uint16_t port);
+
+    /**
+     * @brief Gets the number of ports currently in use.
+     */
+    size_t InUse();
+
+    /**
+     * @brief Checks whether a port is in the range Acquire() hands ports out from.
+     */
+    bool InRange(uint16_t port) const;
+
+private:
+    /**
+     * @brief Binds a socket to the given port on all interfaces the way a listener would, without listening on it.
+     *
+     * @returns The socket, -1 if the port can't be bound.
+     */
+    static int bindProbe(uint16_t port);
+
+    /**
+     * @brief Finds the first free port in [from, to]. The caller must hold lock.
+     *
+     * @returns The port, -1 if all of them are in use.
+     */
+    int findFree(uint32_t from, uint32_t to);
+
+    /**
+     * @brief One bit per port, set while it's in use. Guarded by lock.
+     */
+    std::vector<uint64_t> used;
+
+    uint16_t first;
+    uint16_t last;
+
+    size_t in_use;
+    std::mutex lock;
+};
+
+#endif //RDPMUX_PORTALLOCATOR_H
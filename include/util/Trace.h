@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_TRACE_H
+#define RDPMUX_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Number of events every thread keeps. Older ones are overwritten.
+ */
+#define TRACE_RING_SIZE 4096
+
+/**
+ * @brief Stages a display update goes through on its way from the VM to the clients, in that order.
+ */
+enum trace_point : uint16_t
+{
+    TRACE_VM_REFRESH,       ///< The VM started looking for the damage of the update.
+    TRACE_VM_SENT,          ///< The VM put the update on the wire.
+    TRACE_RECEIVED,         ///< The listener got the update from the broker.
+    TRACE_FRAME_START,      ///< The subsystem took the damage of the update to build a frame with.
+    TRACE_FRAME_COPIED,     ///< The damage was read out of shared memory.
+    TRACE_FRAME_SENT,       ///< The frame holding the damage was handed to the clients.
+};
+
+/**
+ * @brief A recorded trace point.
+ */
+struct TraceEvent
+{
+    uint64_t time_us;   ///< When the point was reached, from metrics_now_us().
+    uint32_t vm;        ///< ID of the VM the update came from.
+    uint32_t seq;       ///< Number of the update, as counted by the VM.
+    uint16_t point;     ///< The trace_point reached.
+};
+
+/**
+ * @brief Whether trace points are recorded. Off unless a trace file was asked for, in which case every point costs a
+ * few stores into a ring of the calling thread, and never takes a lock.
+ */
+extern std::atomic<bool> trace_enabled;
+
+/**
+ * @brief Records a trace point into the calling thread's ring. Use trace() instead.
+ */
+void trace_record(trace_point point, uint32_t vm, uint32_t seq, uint64_t time_us);
+
+/**
+ * @brief Records a trace point if tracing is on, and costs a relaxed load otherwise.
+ *
+ * @param point The point reached.
+ * @param vm ID of the VM the update came from.
+ * @param seq Number of the update.
+ * @param time_us When the point was reached, from metrics_now_us().
+ */
+inline void trace(trace_point point, uint32_t vm, uint32_t seq, uint64_t time_us)
+{
+    if (trace_enabled.load(std::memory_order_relaxed))
+        trace_record(point, vm, seq, time_us);
+}
+
+/**
+ * @brief Turns a time stamp of the VM, the low 32 bits of the shared monotonic clock in µs, into a full one.
+ *
+ * @returns The time stamp on the scale of metrics_now_us(), assuming it's no more than about an hour before now_us.
+ *
+ * @param vm_us The VM's time stamp.
+ * @param now_us The current time, from metrics_now_us().
+ */
+inline uint64_t trace_vm_time(uint32_t vm_us, uint64_t now_us)
+{
+    return now_us - static_cast<uint32_t>(static_cast<uint32_t>(now_us) - vm_us);
+}
+
+/**
+ * @brief Writes the events of every thread's ring to a file, oldest first, one per line. Safe to call from any thread
+ * while tracing goes on; events overwritten while they are read are left out.
+ *
+ * @returns Whether the file could be written.
+ *
+ * @param path Path of the file. Replaced if it exists.
+ */
+bool trace_dump(const std::string &path);
+
+#endif //RDPMUX_TRACE_H
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RDPMUX_WIREFORMAT_H
+#define RDPMUX_WIREFORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <msgpack/sbuffer.hpp>
+#include "common.h"
+#include "util/InputQueue.h"
+
+/**
+ * @brief Largest binary message the server ever sends: a full INPUT_BATCH.
+ */
+#define WIRE_MAX_INPUT_BATCH 256
+
+/**
+ * @brief Size of a buffer large enough for any binary message the server sends.
+ */
+#define WIRE_MAX_SIZE (sizeof(MuxWireHeader) + WIRE_MAX_INPUT_BATCH * sizeof(MuxWireInput))
+
+/**
+ * @brief Checks whether a message received from a VM is a binary one rather than msgpack.
+ *
+ * msgpack arrays always start with a byte that has the high bit set, binary messages with the low byte of a message
+ * type, which never has.
+ *
+ * @returns Whether the message is binary.
+ *
+ * @param data The message.
+ * @param size Size of the message in bytes.
+ */
+bool wire_is_binary(const char *data, size_t size);
+
+/**
+ * @brief Gets the type of a binary message.
+ *
+ * @param data The message. Must have passed wire_is_binary().
+ */
+uint16_t wire_type(const char *data);
+
+/**
+ * @brief A tile of a DISPLAY_TILES message, as sent by the VM. Points into the message it was decoded from.
+ */
+struct WireTile
+{
+    uint32_t head;
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+    const char *data;   ///< The tile's LZ4 compressed pixels.
+    size_t size;        ///< Size of data in bytes.
+};
+
+/**
+ * @brief Decodes a binary DISPLAY_TILES message. Its pixels are left compressed, and never copied into a vector of
+ * uint32_ts like those of the other messages.
+ *
+ * tiles is cleared first and keeps its capacity.
+ *
+ * @returns Whether the message was well-formed. Coordinates aren't checked against any head yet.
+ *
+ * @param data The message. Must have passed wire_is_binary().
+ * @param size Size of the message in bytes.
+ * @param tiles Set to the tiles of the message.
+ */
+bool wire_decode_tiles(const char *data, size_t size, std::vector<WireTile> &tiles);
+
+/**
+ * @brief Decodes a binary message from a VM into the same vector of uint32_ts its msgpack twin deserializes to, so
+ * RDPListener::processIncomingMessage() doesn't need to care which one the VM speaks. A CURSOR_DEFINE message becomes
+ * [type, hot_x, hot_y, w, h] followed by one entry per pixel, a DISPLAY_COPY message [type, count] followed by
+ * src_x, src_y, dst_x, dst_y, w and h of every copy. A DISPLAY_UPDATE_RECTS message ending in a MuxWireTrace gets
+ * seq, refresh_us and sent_us appended after its rects, which are still counted by the count entry. A REMOTE_REGISTER
+ * message becomes [type, version, id, port, flags].
+ *
+ * vec is cleared first and keeps its capacity, so a vector reused across messages stops allocating once it has grown to
+ * fit the largest one.
+ *
+ * @returns Whether the message was well-formed.
+ *
+ * @param data The message. Must have passed wire_is_binary().
+ * @param size Size of the message in bytes.
+ * @param vec Set to the decoded message.
+ */
+bool wire_decode(const char *data, size_t size, std::vector<uint32_t> &vec);
+
+/**
+ * @brief Encodes a message queued through RDPListener::processOutgoingMessage() as a binary message. REMOTE_CREDIT and
+ * REMOTE_RESYNC are laid out as [type, credits].
+ *
+ * @returns Size of the message in bytes, 0 if the message type has no binary encoding or buf is too small.
+ *
+ * @param vec The message, laid out the way it would be msgpack'd.
+ * @param buf Buffer to write the message to.
+ * @param size Size of buf in bytes.
+ */
+size_t wire_encode(const std::vector<uint16_t> &vec, char *buf, size_t size);
+
+/**
+ * @brief Encodes the VM_HANDLE message telling a VM the handle to address its messages with.
+ *
+ * @returns Size of the message in bytes, 0 if buf is too small.
+ *
+ * @param handle The VM's handle.
+ * @param buf Buffer to write the message to.
+ * @param size Size of buf in bytes.
+ */
+size_t wire_encode_handle(uint32_t handle, char *buf, size_t size);
+
+/**
+ * @brief Encodes a batch of input events as a binary message. A single event becomes a MOUSE or KEYBOARD message, more
+ * than one an INPUT_BATCH.
+ *
+ * @returns Size of the message in bytes, 0 if buf is too small.
+ *
+ * @param records The events.
+ * @param count Number of events, at least 1.
+ * @param buf Buffer to write the message to.
+ * @param size Size of buf in bytes.
+ */
+size_t wire_encode_input(const InputRecord *records, size_t count, char *buf, size_t size);
+
+/**
+ * @brief Encodes a batch of input events as a msgpack message, for VMs that don't speak the binary messages. Laid out
+ * like wire_encode_input(): a single event as the msgpack'd std::vector<uint16_t> of a MOUSE or KEYBOARD message, more
+ * than one as [INPUT_BATCH, count, type, a, b, c, ...].
+ *
+ * @param records The events.
+ * @param count Number of events, at least 1.
+ * @param buf Buffer to write the message to. Cleared first, so its memory is reused across batches.
+ */
+void msgpack_encode_input(const InputRecord *records, size_t count, msgpack::sbuffer &buf);
+
+#endif //RDPMUX_WIREFORMAT_H
@@ -17,18 +17,29 @@ typedef struct InputEventCallbacks {
 } InputEventCallbacks;
 
 typedef struct mux_display MuxDisplay;
+typedef struct mux_head MuxHead;
 
 void mux_display_update(int x, int y, int w, int h);
+void mux_display_copy(int src_x, int src_y, int dst_x, int dst_y, int w, int h);
 void mux_display_switch(pixman_image_t *surface);
 uint32_t mux_display_refresh();
+MuxHead *mux_display_head(int index);
+bool mux_head_switch(MuxHead *head, pixman_image_t *surface, int x, int y);
+void mux_head_update(MuxHead *head, int x, int y, int w, int h);
+void mux_head_copy(MuxHead *head, int src_x, int src_y, int dst_x, int dst_y, int w, int h);
+bool mux_cursor_define(int hot_x, int hot_y, int w, int h, const uint32_t *pixels);
+bool mux_cursor_move(int x, int y, bool visible);
 
 void *mux_mainloop(void *arg);
 void mux_out_loop();
 void *mux_display_buffer_update_loop(void *arg);
 
 void mux_register_event_callbacks(InputEventCallbacks cb);
+void mux_set_shm_hugepages(bool enable);
 MuxDisplay *mux_init_display_struct(const char *uuid);
 bool mux_connect(const char *path);
+bool mux_connect_remote(const char *endpoint, int id, uint16_t port, const char *server_key, const char *public_key,
+                        const char *secret_key);
 bool mux_get_socket_path(const char *name, const char *obj, char **out_path, int id, uint16_t port, const char *auth);
 void mux_cleanup(MuxDisplay *display);
 
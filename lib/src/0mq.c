@@ -1,78 +1,114 @@
 /** @file */
+#include <endian.h>
 #include "0mq.h"
 #include "common.h"
+#include "fdpass.h"
 
 /**
- * @brief Receives data through the given 0mq socket and sticks it into buf.
+ * @brief Checks whether the address frame of an incoming message is our UUID, or the handle the server gave us.
+ */
+static bool mux_0mq_is_ours(zmq_msg_t *identity)
+{
+    if (zmq_msg_size(identity) == sizeof(uint32_t) && display->zmq.handle != 0) {
+        uint32_t handle;
+        memcpy(&handle, zmq_msg_data(identity), sizeof(handle));
+        return le32toh(handle) == display->zmq.handle;
+    }
+    return zmq_msg_size(identity) == MUX_UUID_LENGTH &&
+           !memcmp(zmq_msg_data(identity), display->uuid, MUX_UUID_LENGTH);
+}
+
+/**
+ * @brief Receives a message through the 0mq socket.
+ *
+ * The frames are received straight into the 0mq messages kept in the display struct, so nothing is allocated or copied
+ * on our side; buf points into the data frame.
  *
  * This function is blocking.
  *
- * @returns Number of bytes read.
+ * @returns Number of bytes read, -1 on error.
  *
- * @param buf Pointer to a void* buffer.
+ * @param buf Set to the received data. Valid until the next call.
  */
-int mux_0mq_recv_msg(void **buf)
+int mux_0mq_recv_msg(const void **buf)
 {
-    zmsg_t *msg = NULL;
-    zframe_t *identity = NULL;
-    zframe_t *data = NULL;
-    int len = -1;
+    void *socket = zsock_resolve(display->zmq.socket);
+    zmq_msg_t *identity = &display->zmq.in_uuid;
+    zmq_msg_t *data = &display->zmq.in_data;
 
     mux_printf("Now blocking on recv");
 
-    if ((msg = zmsg_recv(display->zmq.socket)) == NULL) {
+    if (zmq_msg_recv(identity, socket, 0) < 0) {
         mux_printf_error("Could not receive message from socket!");
         return -1;
     }
 
-    //zmsg_print(msg);
-    identity = zmsg_pop(msg);
-    //zframe_print(identity, "F: ");
+    if (!zmq_msg_more(identity)) {
+        mux_printf_error("Received message without data frame");
+        return -1;
+    }
 
-    if (!zframe_streq(identity, display->uuid)) {
-        char *wrong = zframe_strdup(identity);
-        mux_printf_error("Incorrect UUID: %s", wrong);
-        free(wrong);
-        zframe_destroy(&identity);
+    if (zmq_msg_recv(data, socket, 0) < 0) {
+        mux_printf_error("Could not receive message from socket!");
         return -1;
     }
 
-    data = zmsg_pop(msg);
-    //zframe_print(data, "F: ");
-    len = zframe_size(data);
-    *buf = calloc(1, zframe_size(data) + 1);
-    memcpy(*buf, zframe_data(data), zframe_size(data));
+    if (zmq_msg_more(data)) {
+        // drain the rest, so the next call starts at a message boundary again
+        while (zmq_msg_more(data) && zmq_msg_recv(data, socket, 0) >= 0);
+        mux_printf_error("Received message with too many frames");
+        return -1;
+    }
 
-    zframe_destroy(&identity);
-    zframe_destroy(&data);
+    if (!mux_0mq_is_ours(identity)) {
+        mux_printf_error("Message not addressed to us, %zu byte address frame", zmq_msg_size(identity));
+        return -1;
+    }
 
-    return len;
+    *buf = zmq_msg_data(data);
+    return zmq_msg_size(data);
 }
 
 /**
  * @brief Send a message through the 0mq socket.
  *
+ * Once the server told us our handle, the message is addressed with its four bytes instead of the UUID. Before that,
+ * the UUID frame is a copy of the one cached in the display struct, which only bumps a reference count. The data is
+ * copied by 0mq, which keeps it inline in the message for anything as small as a binary display update.
+ *
  * This function is blocking.
  *
- * @returns The number of bytes sent.
+ * @returns The number of bytes sent, -1 on error.
  *
  * @param buf The data to send.
  * @param len The length of buf.
  */
-int mux_0mq_send_msg(void *buf, size_t len)
+int mux_0mq_send_msg(const void *buf, size_t len)
 {
-    zmsg_t *msg = zmsg_new();
+    void *socket = zsock_resolve(display->zmq.socket);
+    zmq_msg_t uuid;
 
     mux_printf("Now attempting to send message!");
-    zmsg_addstr(msg, display->uuid);
-    zmsg_addmem(msg, buf, len);
 
-    if (zmsg_size(msg) != 2) {
-        mux_printf_error("Something went wrong building zmsg");
-        return -1;
+    if (display->zmq.handle != 0) {
+        uint32_t handle = htole32(display->zmq.handle);
+        if (zmq_send(socket, &handle, sizeof(handle), ZMQ_SNDMORE) < 0) {
+            mux_printf_error("Could not send handle frame: %s", zmq_strerror(errno));
+            return -1;
+        }
+    } else {
+        zmq_msg_init(&uuid);
+        if (zmq_msg_copy(&uuid, &display->zmq.uuid_frame) < 0 || zmq_msg_send(&uuid, socket, ZMQ_SNDMORE) < 0) {
+            mux_printf_error("Could not send UUID frame: %s", zmq_strerror(errno));
+            zmq_msg_close(&uuid);
+            return -1;
+        }
     }
 
-    zmsg_send(&msg, display->zmq.socket); // TODO: figure out how return code works for this
+    if (zmq_send(socket, buf, len, 0) < 0) {
+        mux_printf_error("Could not send data frame: %s", zmq_strerror(errno));
+        return -1;
+    }
 
     return len;
 }
@@ -90,16 +126,46 @@ static void mux_handler(int signal_value)
  * @brief Connects to the 0mq socket on path.
  *
  * Connects to the 0mq socket located on the file path passed in, then stores that socket in the global display struct
- * upon success.
+ * upon success. For ipc:// endpoints, the path of the server's descriptor passing socket is derived from it as well, so
+ * the shared memory region can be handed over as a memfd.
  *
  * @returns Whether the connection succeeded.
  *
  * @param path The path to the 0mq socket in the filesystem.
  */
 __PUBLIC bool mux_connect(const char *path)
+{
+    return mux_connect_curve(path, NULL, NULL, NULL);
+}
+
+/**
+ * @brief Connects to the 0mq socket on path like mux_connect(), authenticated with CURVE if a server key is given.
+ *
+ * @returns Whether the connection succeeded.
+ *
+ * @param path The endpoint.
+ * @param server_key The server's public key, Z85 encoded. NULL connects without CURVE.
+ * @param public_key Our public key, Z85 encoded. Ignored without server_key.
+ * @param secret_key Our secret key, Z85 encoded. Ignored without server_key.
+ */
+bool mux_connect_curve(const char *path, const char *server_key, const char *public_key, const char *secret_key)
 {
     display->zmq.path = path;
-    display->zmq.socket = zsock_new_dealer(display->zmq.path);
+    display->zmq.fd_path = mux_fd_socket_path(path);
+    if (display->zmq.fd_path != NULL && !mux_fd_probe(display->zmq.fd_path)) {
+        mux_printf("Server has no descriptor socket, falling back to named shared memory");
+        g_free(display->zmq.fd_path);
+        display->zmq.fd_path = NULL;
+    }
+    // the keys have to be set before connecting, which zsock_new_dealer() does right away
+    display->zmq.socket = zsock_new(ZMQ_DEALER);
+    if (display->zmq.socket != NULL && server_key != NULL) {
+        zsock_set_curve_serverkey(display->zmq.socket, server_key);
+        zsock_set_curve_publickey(display->zmq.socket, public_key);
+        zsock_set_curve_secretkey(display->zmq.socket, secret_key);
+    }
+    if (display->zmq.socket != NULL && zsock_attach(display->zmq.socket, display->zmq.path, false) != 0)
+        zsock_destroy(&display->zmq.socket);
     zsys_handler_set(mux_handler);
     if (display->zmq.socket == NULL) {
         mux_printf_error("0mq socket creation failed");
@@ -111,7 +177,27 @@ __PUBLIC bool mux_connect(const char *path)
         mux_printf_error("Could not initialize socket poller");
         return false;
     }
+
+    // the UUID outlives the socket, so the cached frame can point at it instead of owning a copy
+    zmq_msg_init_data(&display->zmq.uuid_frame, (void *) display->uuid, MUX_UUID_LENGTH, NULL, NULL);
+    zmq_msg_init(&display->zmq.in_uuid);
+    zmq_msg_init(&display->zmq.in_data);
+    display->zmq.handle = 0; // handles are only valid on the connection they were handed out on
     mux_printf("Bound to %s", path);
 
     return true;
 }
+
+#ifndef USE_REMOTE
+/**
+ * @brief Stands in for mux_connect_remote() in a library built without LZ4, which can't talk to remote servers.
+ *
+ * @returns false.
+ */
+__PUBLIC bool mux_connect_remote(const char *endpoint, int id, uint16_t port, const char *server_key,
+                                 const char *public_key, const char *secret_key)
+{
+    mux_printf_error("librdpmux was built without remote server support");
+    return false;
+}
+#endif
@@ -7,8 +7,9 @@
 
 #include "common.h"
 
-int mux_0mq_recv_msg(void **buf);
-int mux_0mq_send_msg(void *buf, size_t len);
+int mux_0mq_recv_msg(const void **buf);
+int mux_0mq_send_msg(const void *buf, size_t len);
 bool mux_connect(const char *path);
+bool mux_connect_curve(const char *path, const char *server_key, const char *public_key, const char *secret_key);
 
 #endif //SHIM_NANOMSG_H
@@ -26,7 +26,54 @@
 /**
  * @brief Protocol version.
  */
-#define RDPMUX_PROTOCOL_VERSION 5
+#define RDPMUX_PROTOCOL_VERSION 17
+
+/**
+ * @brief Last protocol version without REMOTE_REGISTER and DISPLAY_TILES. Never spoken to a remote server, which has
+ * to know them; still spoken on the same host if the server doesn't.
+ */
+#define RDPMUX_PROTOCOL_VERSION_TRACE 16
+
+/**
+ * @brief Last protocol version whose binary DISPLAY_UPDATE_RECTS messages don't end in a MuxWireTrace. Still spoken by
+ * the library if the server doesn't know the trailer yet.
+ */
+#define RDPMUX_PROTOCOL_VERSION_HEADS 15
+
+/**
+ * @brief Last protocol version without the HEAD_SWITCH message. Still spoken by the library if the server only knows a
+ * single display head, in which case only head 0 can be switched on, and only at the top left corner.
+ */
+#define RDPMUX_PROTOCOL_VERSION_COPY 14
+
+/**
+ * @brief Last protocol version without the DISPLAY_COPY message. Still spoken by the library if the server can't pass
+ * copies on to the RDP clients yet, in which case their destination is sent as damage.
+ */
+#define RDPMUX_PROTOCOL_VERSION_CURSOR 13
+
+/**
+ * @brief Last protocol version without the CURSOR_DEFINE and CURSOR_MOVE messages. Still spoken by the library if the
+ * server can't show the cursor as an RDP pointer yet, in which case the hypervisor has to draw it into the framebuffer.
+ */
+#define RDPMUX_PROTOCOL_VERSION_HANDLES 12
+
+/**
+ * @brief Last protocol version that addresses every message with the VM's UUID. Still spoken by the library if the
+ * server doesn't hand out VM handles yet.
+ */
+#define RDPMUX_PROTOCOL_VERSION_BINARY 11
+
+/**
+ * @brief Last protocol version that encodes every message with msgpack. Still spoken by the library if the server
+ * doesn't support the fixed-layout binary messages of RDPMUX_PROTOCOL_VERSION_BINARY.
+ */
+#define RDPMUX_PROTOCOL_VERSION_MSGPACK 10
+
+/**
+ * @brief Length of the VM's UUID in its canonical text form.
+ */
+#define MUX_UUID_LENGTH 36
 
 /**
  * @brief debug output macro
@@ -44,6 +91,295 @@
 #define mux_printf_error(x, ...) fprintf(stderr, "ERROR:   %s:%d: " x "\n", \
                             __func__, __LINE__, ##__VA_ARGS__);
 
+/**
+ * @brief Side length in px of the square tiles used for damage tracking.
+ */
+#define MUX_TILE_SIZE 64
+
+/**
+ * @brief Maximum number of rectangles carried by a single DISPLAY_UPDATE_RECTS message.
+ *
+ * If the damage collected during a refresh tick can't be described in this many rectangles, the library falls back to
+ * sending the bounding box of all damaged tiles instead.
+ */
+#define MUX_MAX_UPDATE_RECTS 64
+
+/**
+ * @brief Largest width and height of a cursor shape in px, the most an RDP alpha pointer can have.
+ */
+#define MUX_CURSOR_MAX_SIZE 96
+
+/**
+ * @brief Most copies the library holds on to in between two runs of the main loop, and sends in one DISPLAY_COPY
+ * message. Any more go out as damage instead.
+ */
+#define MUX_MAX_COPY_RECTS 16
+
+/**
+ * @brief Most display heads a VM can have.
+ */
+#define MUX_MAX_HEADS 8
+
+/**
+ * @brief Most tiles a single DISPLAY_TILES message carries. Tiles are the MUX_TILE_SIZE tiles of the damage map.
+ */
+#define MUX_REMOTE_MAX_TILES 1024
+
+/**
+ * @brief Flag of a REMOTE_REGISTER message asking the server for a REMOTE_RESYNC.
+ */
+#define MUX_REMOTE_REGISTER_RESYNC 1
+
+/**
+ * @brief Milliseconds in between two REMOTE_REGISTER messages asking a remote server for a REMOTE_RESYNC, while there
+ * is no answer.
+ */
+#define MUX_REMOTE_REGISTER_INTERVAL 500
+
+/**
+ * @brief Milliseconds a remote server may go without sending anything before the library asks whether it's still
+ * there.
+ */
+#define MUX_REMOTE_HEARTBEAT_INTERVAL 1000
+
+/**
+ * @brief Milliseconds a remote server may go without sending anything before the library takes it for gone, and
+ * registers from scratch.
+ */
+#define MUX_REMOTE_TIMEOUT 5000
+
+/**
+ * @brief Magic number at the start of the shared memory region, "RDMX" in little-endian byte order.
+ */
+#define MUX_SHM_MAGIC 0x584d4452
+
+/**
+ * @brief Size in bytes reserved for the MuxShmHeader at the start of the shared memory region.
+ *
+ * One full page, so the framebuffer that follows it stays page-aligned.
+ */
+#define MUX_SHM_HEADER_SIZE 4096
+
+/**
+ * @brief Size of a transparent hugepage. Shared memory regions are rounded up to this when hugepages are enabled.
+ */
+#define MUX_SHM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * @brief Header at the start of the shared memory region.
+ *
+ * The framebuffer follows the header at offset header_size. Access to it is synchronized with a seqlock: the library
+ * makes seq odd before it touches the framebuffer and even again when it is done, and the server retries its copy if
+ * seq was odd or changed while it was reading. That way the server never sees a half-written frame, and the library
+ * never has to wait for the server.
+ *
+ * The layout is shared with the RDPMux server and must be kept in sync with its copy.
+ */
+typedef struct mux_shm_header {
+    /**
+     * @brief Always MUX_SHM_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * @brief Protocol version the region was created with.
+     */
+    uint32_t version;
+    /**
+     * @brief Offset of the framebuffer from the start of the region, in bytes.
+     */
+    uint32_t header_size;
+    /**
+     * @brief Unused, keeps seq 8-byte aligned.
+     */
+    uint32_t reserved;
+    /**
+     * @brief Seqlock generation counter. Odd while the library is writing.
+     */
+    uint64_t seq;
+    /**
+     * @brief Width of the framebuffer in px.
+     */
+    uint32_t width;
+    /**
+     * @brief Height of the framebuffer in px.
+     */
+    uint32_t height;
+    /**
+     * @brief Scanline of the framebuffer in bytes.
+     */
+    uint32_t stride;
+    /**
+     * @brief pixman format code of the framebuffer.
+     */
+    uint32_t format;
+} MuxShmHeader;
+
+/**
+ * @brief Header of a binary message, spoken from RDPMUX_PROTOCOL_VERSION_BINARY on instead of msgpack.
+ *
+ * A binary message is this header followed by count records of the layout belonging to the message type: MuxWireRect
+ * for DISPLAY_UPDATE and DISPLAY_UPDATE_RECTS, MuxWireSwitch for DISPLAY_SWITCH, MuxWireInput for MOUSE, KEYBOARD and
+ * INPUT_BATCH, MuxWireAck for DISPLAY_UPDATE_COMPLETE, MuxWireHandle for VM_HANDLE, MuxWireCursor for CURSOR_DEFINE,
+ * MuxWireCursorPos for CURSOR_MOVE, MuxWireCopy for DISPLAY_COPY, MuxWireHeadSwitch for HEAD_SWITCH,
+ * MuxWireRemoteRegister for REMOTE_REGISTER, MuxWireTile for DISPLAY_TILES, MuxWireCredit for REMOTE_CREDIT and
+ * REMOTE_RESYNC, and nothing for SHUTDOWN. All fields are little-endian. Since message types are small, the first byte
+ * of a binary message can never be mistaken for the start of a msgpack array.
+ *
+ * The layouts are shared with the server and must be kept in sync with its copy.
+ */
+typedef struct __attribute__((packed)) MuxWireHeader {
+    uint16_t type;
+    uint16_t count;
+} MuxWireHeader;
+
+/**
+ * @brief A rectangle in a binary display update, as top left corner and size in px.
+ */
+typedef struct __attribute__((packed)) MuxWireRect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} MuxWireRect;
+
+/**
+ * @brief Trailer of a binary DISPLAY_UPDATE_RECTS message from RDPMUX_PROTOCOL_VERSION on: the number of the update,
+ * when the library started looking for its damage, and when it was sent. Times are the low 32 bits of
+ * CLOCK_MONOTONIC in µs, which the server shares.
+ */
+typedef struct __attribute__((packed)) MuxWireTrace {
+    uint32_t seq;
+    uint32_t refresh_us;
+    uint32_t sent_us;
+} MuxWireTrace;
+
+/**
+ * @brief Body of a binary display switch.
+ */
+typedef struct __attribute__((packed)) MuxWireSwitch {
+    uint32_t format;
+    uint32_t w;
+    uint32_t h;
+    uint32_t shm_size;
+} MuxWireSwitch;
+
+/**
+ * @brief Body of a binary HEAD_SWITCH message: a display switch of one head, which also places the head on the desktop.
+ */
+typedef struct __attribute__((packed)) MuxWireHeadSwitch {
+    uint32_t head;
+    uint32_t x;
+    uint32_t y;
+    uint32_t format;
+    uint32_t w;
+    uint32_t h;
+    uint32_t shm_size;
+} MuxWireHeadSwitch;
+
+/**
+ * @brief An input event in a binary MOUSE, KEYBOARD or INPUT_BATCH message. a, b and c are keycode, flags and 0 for
+ * keyboard events, and x, y and flags for mouse events.
+ */
+typedef struct __attribute__((packed)) MuxWireInput {
+    uint16_t type;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} MuxWireInput;
+
+/**
+ * @brief Body of a binary DISPLAY_UPDATE_COMPLETE message.
+ */
+typedef struct __attribute__((packed)) MuxWireAck {
+    uint32_t success;
+    uint32_t framerate;
+} MuxWireAck;
+
+/**
+ * @brief Body of a binary VM_HANDLE message: the handle the server knows the VM by, which replaces the UUID frame of
+ * every message from then on.
+ */
+typedef struct __attribute__((packed)) MuxWireHandle {
+    uint32_t handle;
+} MuxWireHandle;
+
+/**
+ * @brief Body of a binary CURSOR_DEFINE message. Followed by w * h pixels of the cursor shape, row by row, each an
+ * a8r8g8b8 uint32_t with straight alpha.
+ */
+typedef struct __attribute__((packed)) MuxWireCursor {
+    uint32_t hot_x;
+    uint32_t hot_y;
+    uint32_t w;
+    uint32_t h;
+} MuxWireCursor;
+
+/**
+ * @brief Body of a binary CURSOR_MOVE message: where the hotspot is on the framebuffer, and whether the cursor is
+ * shown at all.
+ */
+typedef struct __attribute__((packed)) MuxWireCursorPos {
+    uint32_t x;
+    uint32_t y;
+    uint32_t visible;
+} MuxWireCursorPos;
+
+/**
+ * @brief A copy in a binary DISPLAY_COPY message: a w x h block of the framebuffer moved from (src_x, src_y) to
+ * (dst_x, dst_y). The shared memory region already holds the result.
+ */
+typedef struct __attribute__((packed)) MuxWireCopy {
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t dst_x;
+    uint32_t dst_y;
+    uint32_t w;
+    uint32_t h;
+} MuxWireCopy;
+
+/**
+ * @brief Body of a binary REMOTE_REGISTER message: how a VM on another host registers with the server, and tells it
+ * it's still there while it has nothing else to send.
+ */
+typedef struct __attribute__((packed)) MuxWireRemoteRegister {
+    uint32_t version;
+    uint32_t id;
+    uint32_t port;
+    uint32_t flags;
+} MuxWireRemoteRegister;
+
+/**
+ * @brief A tile in a binary DISPLAY_TILES message, in coordinates local to its head. Followed by size bytes: the
+ * tile's w x h pixels, row by row without padding, compressed as a single LZ4 block.
+ */
+typedef struct __attribute__((packed)) MuxWireTile {
+    uint32_t head;
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+    uint32_t size;
+} MuxWireTile;
+
+/**
+ * @brief Body of a binary REMOTE_CREDIT message, the number of tiles the server applied, or of a REMOTE_RESYNC
+ * message, the number of tiles the library may have in flight from then on.
+ */
+typedef struct __attribute__((packed)) MuxWireCredit {
+    uint32_t credits;
+} MuxWireCredit;
+
+/**
+ * @brief Largest binary message the library ever sends, except for cursor shapes.
+ */
+#define MUX_WIRE_MAX_SIZE (sizeof(MuxWireHeader) + MUX_MAX_UPDATE_RECTS * sizeof(MuxWireRect) + sizeof(MuxWireTrace))
+
+/**
+ * @brief Largest CURSOR_DEFINE message the library ever sends.
+ */
+#define MUX_WIRE_CURSOR_MAX_SIZE (sizeof(MuxWireHeader) + sizeof(MuxWireCursor) + \
+                                  MUX_CURSOR_MAX_SIZE * MUX_CURSOR_MAX_SIZE * sizeof(uint32_t))
+
 /**
  * @brief This struct is populated by the code using the library to provide callbacks for mouse and keyboard events.
  *
@@ -65,7 +401,18 @@ typedef enum message_type {
     MOUSE,
     KEYBOARD,
     DISPLAY_UPDATE_COMPLETE,
-    SHUTDOWN
+    SHUTDOWN,
+    DISPLAY_UPDATE_RECTS,
+    INPUT_BATCH,
+    VM_HANDLE,
+    CURSOR_DEFINE,
+    CURSOR_MOVE,
+    DISPLAY_COPY,
+    HEAD_SWITCH,
+    REMOTE_REGISTER,
+    DISPLAY_TILES,
+    REMOTE_CREDIT,
+    REMOTE_RESYNC
 } MessageType;
 
 /**
@@ -94,11 +441,51 @@ typedef struct display_update {
 } display_update;
 
 /**
- * @brief Parameters for a display switch event.
+ * @brief Parameters for a multi-rectangle display update event.
+ *
+ * Carries every region of the framebuffer that was damaged since the last refresh tick, so that scattered small
+ * updates don't have to be merged into one large bounding box. Each rectangle uses the same layout as a
+ * display_update.
+ */
+typedef struct display_update_rects {
+    /**
+     * @brief Number of valid entries in rects.
+     */
+    uint32_t count;
+    /**
+     * @brief The damaged regions.
+     */
+    display_update rects[MUX_MAX_UPDATE_RECTS];
+    /**
+     * @brief Number of the update, counting up for every update of the display.
+     */
+    uint32_t seq;
+    /**
+     * @brief When the refresh that found the damage started, from mux_now_us().
+     */
+    uint32_t refresh_us;
+} display_update_rects;
+
+/**
+ * @brief Parameters for a display switch event. Goes out as a HEAD_SWITCH message if the server knows about heads, as
+ * a DISPLAY_SWITCH message of head 0 otherwise.
  */
 typedef struct display_switch {
     /**
-     * @brief file descriptor for the shared memory region.
+     * @brief index of the head switched.
+     */
+    int head;
+    /**
+     * @brief X-coordinate of the head's top left corner on the desktop, in px.
+     */
+    int x;
+    /**
+     * @brief Y-coordinate of the head's top left corner on the desktop, in px.
+     */
+    int y;
+    /**
+     * @brief file descriptor for the shared memory region, passed to the server alongside the message. -1 if the region
+     * is a named one the server opens by itself.
      */
     int shm_fd;
     /**
@@ -113,6 +500,10 @@ typedef struct display_switch {
      * @brief height of framebuffer in px.
      */
     int h;
+    /**
+     * @brief size of the shared memory region in bytes, header included.
+     */
+    uint32_t shm_size;
 } display_switch;
 
 /**
@@ -190,6 +581,7 @@ typedef struct MuxUpdate {
      */
     union {
         display_update disp_update;
+        display_update_rects disp_rects;
         display_switch disp_switch;
         kb_update kb;
         mouse_update mouse;
@@ -209,6 +601,168 @@ typedef struct MuxMsgQueue {
     SIMPLEQ_HEAD(, MuxUpdate) updates;
 } MuxMsgQueue;
 
+/**
+ * @brief Tile-granular damage map of the framebuffer.
+ *
+ * The framebuffer is divided into MUX_TILE_SIZE x MUX_TILE_SIZE tiles, and every tile touched by a display update is
+ * flagged in the bitmap. At refresh time the flagged tiles are turned back into a short list of rectangles, so the amount
+ * of data copied and re-encoded is proportional to what actually changed on screen.
+ */
+typedef struct mux_damage {
+    /**
+     * @brief The bitmap itself, one bit per tile, stored row by row.
+     */
+    uint64_t *bits;
+    /**
+     * @brief Number of uint64_t words holding one row of tiles.
+     */
+    int words_per_row;
+    /**
+     * @brief Number of tile columns.
+     */
+    int tiles_x;
+    /**
+     * @brief Number of tile rows.
+     */
+    int tiles_y;
+    /**
+     * @brief Width of the tracked surface in px.
+     */
+    int width;
+    /**
+     * @brief Height of the tracked surface in px.
+     */
+    int height;
+    /**
+     * @brief Whether any tile is currently flagged.
+     */
+    bool dirty;
+} MuxDamage;
+
+/**
+ * @brief Tiles of a head waiting for the main loop to compress and send them to a remote server. They're copied out of
+ * the framebuffer as they are, one after the other, each as the MuxWireTile record of a DISPLAY_TILES message with the
+ * size of its raw pixels, followed by those pixels with the rows packed.
+ */
+typedef struct mux_tile_buf {
+    /**
+     * @brief The tiles. Grows to fit and is kept around after that, like msgpack_buf.
+     */
+    uint8_t *data;
+    /**
+     * @brief Size of data in bytes.
+     */
+    size_t size;
+    /**
+     * @brief Bytes of data in use.
+     */
+    size_t len;
+    /**
+     * @brief Number of tiles in data.
+     */
+    uint32_t tiles;
+} MuxTileBuf;
+
+/**
+ * @brief Cursor updates waiting for the main loop to send them.
+ *
+ * Only the latest shape and the latest position are kept: a shape or position that's replaced before it went out
+ * would have been outdated by the time it arrived anyway.
+ */
+typedef struct mux_cursor {
+    /**
+     * @brief Lock guarding the rest of the struct.
+     */
+    pthread_mutex_t lock;
+    /**
+     * @brief The pending CURSOR_DEFINE message, ready to be sent.
+     */
+    uint8_t define_buf[MUX_WIRE_CURSOR_MAX_SIZE];
+    /**
+     * @brief Size of the pending CURSOR_DEFINE message in bytes, 0 if there is none.
+     */
+    size_t define_len;
+    /**
+     * @brief Buffer the main loop copies the pending CURSOR_DEFINE message to, so it can send it without holding
+     * the lock.
+     */
+    uint8_t send_buf[MUX_WIRE_CURSOR_MAX_SIZE];
+    /**
+     * @brief The pending position, in host byte order.
+     */
+    MuxWireCursorPos pos;
+    /**
+     * @brief Whether pos has to be sent.
+     */
+    bool move_pending;
+} MuxCursor;
+
+/**
+ * @brief A head of the VM's display, e.g. one of the monitors of a guest with several.
+ *
+ * Every head has a framebuffer of its own, synced to a shared memory region of its own and tracked for damage on its
+ * own, and sits somewhere on the desktop the server shows the clients. The coordinates of a head's damage are local to
+ * the head; they're moved to where the head is on the desktop when they're sent.
+ */
+typedef struct mux_head {
+    /**
+     * @brief Index of the head in the display struct.
+     */
+    int index;
+    /**
+     * @brief X-coordinate of the head's top left corner on the desktop, in px.
+     */
+    int x;
+    /**
+     * @brief Y-coordinate of the head's top left corner on the desktop, in px.
+     */
+    int y;
+    /**
+     * @brief pointer to the QEMU framebuffer surface of the head, NULL until the head was switched on.
+     */
+    pixman_image_t *surface;
+    /**
+     * @brief File descriptor of the shared memory region.
+     */
+    int shmem_fd;
+    /**
+     * @brief pointer to the header at the start of the shared memory region.
+     */
+    MuxShmHeader *shm_header;
+    /**
+     * @brief pointer to the framebuffer inside the shared memory region, right after the header.
+     */
+    void *shm_buffer;
+    /**
+     * @brief Size of the shared memory region in bytes, header included.
+     */
+    size_t shm_size;
+    /**
+     * @brief Whether the shared memory region is an anonymous memfd rather than a named POSIX shm object.
+     */
+    bool shm_memfd;
+    /**
+     * @brief Damage accumulated since the last refresh tick.
+     */
+    MuxDamage damage;
+    /**
+     * @brief Current outgoing update of the head. Guarded by the display's out_lock.
+     */
+    MuxUpdate out_update;
+    /**
+     * @brief Boolean representing ready state of out_update.
+     */
+    bool out_ready;
+    /**
+     * @brief Times in a row the head's display switch couldn't be handed over with its descriptor. Main loop only.
+     */
+    uint32_t switch_failures;
+    /**
+     * @brief Tiles not sent yet, if the server is a remote one. Guarded by the display's out_lock.
+     */
+    MuxTileBuf tiles;
+} MuxHead;
+
 /**
  * @brief Main struct
  *
@@ -217,35 +771,97 @@ typedef struct MuxMsgQueue {
  */
 struct mux_display {
     /**
-     * @brief pointer to the QEMU framebuffer surface.
+     * @brief The heads of the VM's display, by index.
      */
-    pixman_image_t *surface;
+    MuxHead heads[MUX_MAX_HEADS];
 
     /**
      * @brief Internal ID of the virtual machine
      */
     int vm_id;
     /**
-     * @brief File descriptor of the shared memory region.
+     * @brief Whether the shared memory regions should be backed by transparent hugepages.
      */
-    int shmem_fd;
+    bool shm_hugepages;
+
     /**
-     * @brief pointer to the shared memory region.
+     * @brief Whether the server was registered with RDPMUX_PROTOCOL_VERSION_BINARY or later and speaks binary
+     * messages, rather than msgpack.
      */
-    void *shm_buffer;
+    bool wire_binary;
     /**
-     * @brief Current dirty update
+     * @brief Whether the server was registered with a protocol newer than RDPMUX_PROTOCOL_VERSION_HANDLES and shows
+     * the cursor as an RDP pointer, rather than as part of the framebuffer.
      */
-    MuxUpdate dirty_update;
+    bool cursor_messages;
     /**
-     * @brief Current outgoing update
+     * @brief Cursor updates not sent yet.
      */
-    MuxUpdate out_update;
+    MuxCursor cursor;
+    /**
+     * @brief Whether the server was registered with a protocol newer than RDPMUX_PROTOCOL_VERSION_CURSOR and takes
+     * DISPLAY_COPY messages.
+     */
+    bool copy_messages;
+    /**
+     * @brief Whether the server was registered with a protocol newer than RDPMUX_PROTOCOL_VERSION_COPY and takes
+     * HEAD_SWITCH messages.
+     */
+    bool head_messages;
+    /**
+     * @brief Whether the server was registered with a protocol newer than RDPMUX_PROTOCOL_VERSION_HEADS and takes a
+     * MuxWireTrace at the end of binary DISPLAY_UPDATE_RECTS messages.
+     */
+    bool trace_messages;
+    /**
+     * @brief Number of the last display update, across all heads. Guarded by out_lock.
+     */
+    uint32_t update_seq;
+    /**
+     * @brief Copies not sent yet, in host byte order and desktop coordinates. Guarded by out_lock, like the heads'
+     * out_update.
+     */
+    MuxWireCopy copies[MUX_MAX_COPY_RECTS];
+    /**
+     * @brief Number of valid entries in copies.
+     */
+    int copy_count;
+    /**
+     * @brief Scratch buffer outgoing binary messages are built in.
+     */
+    uint8_t wire_buf[MUX_WIRE_MAX_SIZE];
+    /**
+     * @brief Scratch buffer outgoing msgpack messages are built in. Grows to fit the largest message and is kept
+     * around after that, so sending doesn't allocate.
+     */
+    void *msgpack_buf;
+    /**
+     * @brief Size of msgpack_buf in bytes.
+     */
+    size_t msgpack_size;
 
     struct {
         zsock_t *socket;
         zpoller_t *poller;
         const char *path;
+        /**
+         * @brief Path of the server's descriptor passing socket, NULL if the 0mq endpoint doesn't have one.
+         */
+        char *fd_path;
+        /**
+         * @brief UUID frame every outgoing message starts with. Copied for sending, which doesn't allocate.
+         */
+        zmq_msg_t uuid_frame;
+        /**
+         * @brief Handle the server told us in a VM_HANDLE message, 0 until then. Sent instead of the UUID frame once
+         * it's set.
+         */
+        uint32_t handle;
+        /**
+         * @brief Frames the last incoming message was received into, reused for the next one.
+         */
+        zmq_msg_t in_uuid;
+        zmq_msg_t in_data;
     } zmq;
 
     /**
@@ -257,16 +873,65 @@ struct mux_display {
      * @brief current framerate target of the VM guest. Comes from the server.
      */
     uint32_t framerate;
+    /**
+     * @brief Whether the pages of the heads' shared framebuffers were given back to the system since the framerate
+     * dropped to 0. Only touched by the display thread.
+     */
+    bool shm_released;
 
     /**
-     * @brief Lock guarding access to out_update.
+     * @brief State of the connection to a server on another host, which gets the framebuffers as compressed tiles
+     * instead of through shared memory.
      */
-    pthread_mutex_t out_lock;
+    struct {
+        /**
+         * @brief Whether the server is a remote one, connected to with mux_connect_remote().
+         */
+        bool enabled;
+        /**
+         * @brief Port the server should run the VM's listener on, 0 for any.
+         */
+        uint16_t port;
+        /**
+         * @brief Tiles the server lets us have in flight, 0 while it hasn't told us yet. Written by the main loop, read
+         * by the display thread.
+         */
+        uint32_t window;
+        /**
+         * @brief Tiles sent, or about to be, that the server didn't credit us for yet. Updated by both threads.
+         */
+        uint32_t in_flight;
+        /**
+         * @brief Whether the server asked for every head again, which the display thread does on its next refresh.
+         */
+        bool resync;
+        /**
+         * @brief When the last message of the server came in, from g_get_monotonic_time(). Main loop only.
+         */
+        gint64 last_heard;
+        /**
+         * @brief When we last registered or sent a heartbeat, from g_get_monotonic_time(). Main loop only.
+         */
+        gint64 last_register;
+        /**
+         * @brief Tiles taken out of the heads, being sent by the main loop. Main loop only.
+         */
+        MuxTileBuf send[MUX_MAX_HEADS];
+        /**
+         * @brief Scratch buffer the tiles taken out of the heads are compressed into, as DISPLAY_TILES messages. Main
+         * loop only.
+         */
+        uint8_t *scratch;
+        /**
+         * @brief Size of scratch in bytes.
+         */
+        size_t scratch_size;
+    } remote;
 
     /**
-     * @brief Boolean representing ready state of out_update.
+     * @brief Lock guarding access to the out_update of every head.
      */
-    bool out_ready;
+    pthread_mutex_t out_lock;
 };
 typedef struct mux_display MuxDisplay;
 
@@ -0,0 +1,86 @@
+/** @file */
+#include "copy.h"
+#include "damage.h"
+#include "diff.h"
+
+/**
+ * @func Copies a pixel region from one buffer to another. The two buffers are assumed to have the same subpixel
+ * layout and bpp. The function will transfer a given rectangle of certain dimension from the source buffer to
+ * a rectangle in the destination buffer with the same width and height, but not necessarily the same coordinates.
+ *
+ * @param dstData Pointer to the destination buffer. Assumed to be big enough to hold the data being copied into it.
+ * @param dstStep Scanline of dstData.
+ * @param xDst x-coordinate of the top-left corner of the destination rectangle.
+ * @param yDst y-coordinate of the top-left corner of the destination rectangle.
+ * @param width width of the rectangle in px.
+ * @param height height of the rectangle in px.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of the source buffer.
+ * @param xSrc x-coordinate of the top-left corner of the source rectangle.
+ * @param ySrc y-coordinate of the top-left corner of the source rectangle.
+ * @param bpp Bits per pixel of the two buffers.
+ */
+void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int yDst, int width, int height,
+                     unsigned char *srcData, int srcStep, int xSrc, int ySrc, int bpp)
+{
+    int lineSize;
+    int pixelSize;
+    unsigned char* pSrc;
+    unsigned char* pDst;
+    unsigned char* pEnd;
+
+    pixelSize = (bpp + 7) / 8;
+    lineSize = width * pixelSize;
+
+    pSrc = &srcData[(ySrc * srcStep) + (xSrc * pixelSize)];
+    pDst = &dstData[(yDst * dstStep) + (xDst * pixelSize)];
+
+
+    // when the source and destination rectangles are both strips
+    // of the framebuffer spanning the full width, it's much cheaper
+    // to do one memcpy rather than going line-by-line.
+    if ((srcStep == dstStep) && (lineSize == srcStep)) {
+        memcpy(pDst, pSrc, lineSize * height);
+    } else {
+        pEnd = pSrc + (srcStep * height);
+
+        while (pSrc < pEnd) {
+            memcpy(pDst, pSrc, lineSize);
+            pSrc += srcStep;
+            pDst += dstStep;
+        }
+    }
+}
+
+/**
+ * @func Syncs every damaged tile into the shared memory region, comparing it against the copy already there.
+ *
+ * Hypervisors report damage conservatively, so a lot of what is flagged is byte-identical to what the server already
+ * has. Tiles that turn out not to have changed are dropped from the damage map, which keeps them out of the update
+ * message and away from the encoder.
+ *
+ * @param damage The damage map to sync and prune.
+ * @param dstData Pointer to the shared memory framebuffer.
+ * @param dstStep Scanline of dstData.
+ * @param srcData Pointer to the hypervisor framebuffer.
+ * @param srcStep Scanline of srcData.
+ * @param bpp Bits per pixel of the two buffers.
+ */
+void mux_sync_damaged_tiles(MuxDamage *damage, unsigned char *dstData, int dstStep,
+                            unsigned char *srcData, int srcStep, int bpp)
+{
+    for (int ty = 0; ty < damage->tiles_y; ty++) {
+        for (int tx = 0; tx < damage->tiles_x; tx++) {
+            if (!mux_damage_test_tile(damage, tx, ty))
+                continue;
+
+            int x = tx * MUX_TILE_SIZE;
+            int y = ty * MUX_TILE_SIZE;
+            int w = MIN(MUX_TILE_SIZE, damage->width - x);
+            int h = MIN(MUX_TILE_SIZE, damage->height - y);
+
+            if (!mux_copy_pixels_diff(dstData, dstStep, x, y, w, h, srcData, srcStep, bpp))
+                mux_damage_clear_tile(damage, tx, ty);
+        }
+    }
+}
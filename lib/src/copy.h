@@ -0,0 +1,13 @@
+/** @file */
+
+#ifndef SHIM_COPY_H
+#define SHIM_COPY_H
+
+#include "common.h"
+
+void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int yDst, int width, int height,
+                     unsigned char *srcData, int srcStep, int xSrc, int ySrc, int bpp);
+void mux_sync_damaged_tiles(MuxDamage *damage, unsigned char *dstData, int dstStep,
+                            unsigned char *srcData, int srcStep, int bpp);
+
+#endif //SHIM_COPY_H
@@ -0,0 +1,287 @@
+/** @file */
+#include "damage.h"
+
+/**
+ * @brief Returns a pointer to the first bitmap word of a tile row.
+ */
+static inline uint64_t *mux_damage_row(MuxDamage *damage, int ty)
+{
+    return &damage->bits[ty * damage->words_per_row];
+}
+
+/**
+ * @brief Resizes the damage map to cover a surface of the given dimensions.
+ *
+ * Any damage recorded before the resize is discarded. The caller is expected to send a full frame to the server after
+ * a resize anyway, so there is nothing worth preserving.
+ *
+ * @returns Whether the tile bitmap could be allocated.
+ *
+ * @param damage The damage map to resize.
+ * @param width New surface width in px.
+ * @param height New surface height in px.
+ */
+bool mux_damage_resize(MuxDamage *damage, int width, int height)
+{
+    int tiles_x = (width + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE;
+    int tiles_y = (height + MUX_TILE_SIZE - 1) / MUX_TILE_SIZE;
+    int words_per_row = (tiles_x + 63) / 64;
+
+    if (damage->bits == NULL || tiles_x != damage->tiles_x || tiles_y != damage->tiles_y) {
+        g_free(damage->bits);
+        damage->bits = g_try_malloc0_n(MAX(words_per_row * tiles_y, 1), sizeof(uint64_t));
+        if (damage->bits == NULL) {
+            mux_printf_error("Could not allocate damage bitmap for %dx%d surface", width, height);
+            damage->tiles_x = damage->tiles_y = damage->words_per_row = 0;
+            damage->width = damage->height = 0;
+            damage->dirty = false;
+            return false;
+        }
+    } else {
+        memset(damage->bits, 0, words_per_row * tiles_y * sizeof(uint64_t));
+    }
+
+    damage->tiles_x = tiles_x;
+    damage->tiles_y = tiles_y;
+    damage->words_per_row = words_per_row;
+    damage->width = width;
+    damage->height = height;
+    damage->dirty = false;
+    return true;
+}
+
+/**
+ * @brief Releases the memory held by the damage map.
+ *
+ * @param damage The damage map to free.
+ */
+void mux_damage_free(MuxDamage *damage)
+{
+    g_free(damage->bits);
+    memset(damage, 0, sizeof(MuxDamage));
+}
+
+/**
+ * @brief Clips a rectangle to the surface and finds the range of tiles it covers.
+ *
+ * @returns Whether anything is left of the rectangle after clipping.
+ */
+static bool mux_damage_tile_range(MuxDamage *damage, int x, int y, int w, int h, int *tx1, int *ty1, int *tx2,
+                                  int *ty2)
+{
+    int x1 = MAX(x, 0);
+    int y1 = MAX(y, 0);
+    int x2 = MIN(x + w, damage->width);
+    int y2 = MIN(y + h, damage->height);
+
+    if (damage->bits == NULL || x2 <= x1 || y2 <= y1)
+        return false;
+
+    *tx1 = x1 / MUX_TILE_SIZE;
+    *tx2 = (x2 - 1) / MUX_TILE_SIZE;
+    *ty1 = y1 / MUX_TILE_SIZE;
+    *ty2 = (y2 - 1) / MUX_TILE_SIZE;
+    return true;
+}
+
+/**
+ * @brief Flags every tile intersecting the given rectangle as damaged.
+ *
+ * The rectangle is clipped to the surface, so callers can pass through whatever the hypervisor reports.
+ *
+ * @param damage The damage map.
+ * @param x X-coordinate of the top-left corner of the damaged region.
+ * @param y Y-coordinate of the top-left corner of the damaged region.
+ * @param w Width of the damaged region in px.
+ * @param h Height of the damaged region in px.
+ */
+void mux_damage_add(MuxDamage *damage, int x, int y, int w, int h)
+{
+    int tx1, ty1, tx2, ty2;
+    if (!mux_damage_tile_range(damage, x, y, w, h, &tx1, &ty1, &tx2, &ty2))
+        return;
+
+    for (int ty = ty1; ty <= ty2; ty++) {
+        uint64_t *row = mux_damage_row(damage, ty);
+        for (int tx = tx1; tx <= tx2; tx++) {
+            row[tx / 64] |= UINT64_C(1) << (tx % 64);
+        }
+    }
+
+    damage->dirty = true;
+}
+
+/**
+ * @brief Flags the whole surface as damaged.
+ *
+ * @param damage The damage map.
+ */
+void mux_damage_add_all(MuxDamage *damage)
+{
+    mux_damage_add(damage, 0, 0, damage->width, damage->height);
+}
+
+/**
+ * @brief Checks whether a single tile is flagged as damaged.
+ *
+ * @returns Whether the tile is damaged.
+ *
+ * @param damage The damage map.
+ * @param tx Column of the tile.
+ * @param ty Row of the tile.
+ */
+bool mux_damage_test_tile(MuxDamage *damage, int tx, int ty)
+{
+    return (mux_damage_row(damage, ty)[tx / 64] >> (tx % 64)) & 1;
+}
+
+/**
+ * @brief Checks whether any tile intersecting the given rectangle is flagged as damaged.
+ *
+ * @returns Whether part of the rectangle is damaged.
+ *
+ * @param damage The damage map.
+ * @param x X-coordinate of the top-left corner of the region.
+ * @param y Y-coordinate of the top-left corner of the region.
+ * @param w Width of the region in px.
+ * @param h Height of the region in px.
+ */
+bool mux_damage_test_rect(MuxDamage *damage, int x, int y, int w, int h)
+{
+    int tx1, ty1, tx2, ty2;
+    if (!mux_damage_tile_range(damage, x, y, w, h, &tx1, &ty1, &tx2, &ty2))
+        return false;
+
+    for (int ty = ty1; ty <= ty2; ty++) {
+        for (int tx = tx1; tx <= tx2; tx++) {
+            if (mux_damage_test_tile(damage, tx, ty))
+                return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Removes the damaged flag from a single tile, for instance because its contents turned out to be unchanged.
+ *
+ * @param damage The damage map.
+ * @param tx Column of the tile.
+ * @param ty Row of the tile.
+ */
+void mux_damage_clear_tile(MuxDamage *damage, int tx, int ty)
+{
+    mux_damage_row(damage, ty)[tx / 64] &= ~(UINT64_C(1) << (tx % 64));
+}
+
+/**
+ * @brief Counts the tiles flagged as damaged.
+ *
+ * @returns The number of damaged tiles.
+ *
+ * @param damage The damage map.
+ */
+uint32_t mux_damage_count(MuxDamage *damage)
+{
+    uint32_t count = 0;
+
+    if (!damage->dirty || damage->bits == NULL)
+        return 0;
+
+    // bits past the last tile column are never set, so whole words can be counted
+    for (int i = 0; i < damage->words_per_row * damage->tiles_y; i++)
+        count += __builtin_popcountll(damage->bits[i]);
+    return count;
+}
+
+/**
+ * @brief Converts the damaged tiles into a list of rectangles and resets the damage map.
+ *
+ * Horizontally adjacent damaged tiles are merged into runs, and runs spanning the same columns on consecutive tile rows
+ * are merged into a single rectangle. Rectangles are clipped to the surface. On a damage pattern that is too fragmented
+ * to fit into max_rects rectangles, a single rectangle covering the bounding box of all damaged tiles is returned
+ * instead.
+ *
+ * @returns The number of rectangles written to rects. Zero if nothing was damaged.
+ *
+ * @param damage The damage map.
+ * @param rects Output array of at least max_rects entries.
+ * @param max_rects Capacity of rects. Must be at least 1.
+ */
+int mux_damage_collect(MuxDamage *damage, display_update *rects, int max_rects)
+{
+    int count = 0;
+    bool overflow = false;
+    int min_tx = damage->tiles_x, min_ty = damage->tiles_y, max_tx = -1, max_ty = -1;
+
+    if (!damage->dirty || damage->bits == NULL)
+        return 0;
+
+    for (int ty = 0; ty < damage->tiles_y; ty++) {
+        uint64_t *row = mux_damage_row(damage, ty);
+        int tx = 0;
+
+        while (tx < damage->tiles_x) {
+            uint64_t word = row[tx / 64] >> (tx % 64);
+            if (word == 0) {
+                // skip the rest of this word in one go
+                tx = (tx / 64 + 1) * 64;
+                continue;
+            }
+            tx += __builtin_ctzll(word);
+            if (tx >= damage->tiles_x)
+                break;
+
+            int run_start = tx;
+            while (tx < damage->tiles_x && (row[tx / 64] & (UINT64_C(1) << (tx % 64))))
+                tx++;
+
+            min_tx = MIN(min_tx, run_start);
+            max_tx = MAX(max_tx, tx - 1);
+            min_ty = MIN(min_ty, ty);
+            max_ty = ty;
+
+            if (overflow)
+                continue;
+
+            int x1 = run_start * MUX_TILE_SIZE;
+            int x2 = MIN(tx * MUX_TILE_SIZE, damage->width);
+            int y1 = ty * MUX_TILE_SIZE;
+            int y2 = MIN((ty + 1) * MUX_TILE_SIZE, damage->height);
+
+            // extend a rectangle ending on the previous tile row if it spans exactly the same columns
+            bool merged = false;
+            for (int i = 0; i < count; i++) {
+                if (rects[i].y2 == y1 && rects[i].x1 == x1 && rects[i].x2 == x2) {
+                    rects[i].y2 = y2;
+                    merged = true;
+                    break;
+                }
+            }
+
+            if (!merged) {
+                if (count == max_rects) {
+                    overflow = true;
+                    continue;
+                }
+                rects[count].x1 = x1;
+                rects[count].y1 = y1;
+                rects[count].x2 = x2;
+                rects[count].y2 = y2;
+                count++;
+            }
+        }
+    }
+
+    if (overflow) {
+        rects[0].x1 = min_tx * MUX_TILE_SIZE;
+        rects[0].y1 = min_ty * MUX_TILE_SIZE;
+        rects[0].x2 = MIN((max_tx + 1) * MUX_TILE_SIZE, damage->width);
+        rects[0].y2 = MIN((max_ty + 1) * MUX_TILE_SIZE, damage->height);
+        count = 1;
+    }
+
+    memset(damage->bits, 0, damage->words_per_row * damage->tiles_y * sizeof(uint64_t));
+    damage->dirty = false;
+
+    return count;
+}
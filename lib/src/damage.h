@@ -0,0 +1,18 @@
+/** @file */
+
+#ifndef SHIM_DAMAGE_H
+#define SHIM_DAMAGE_H
+
+#include "common.h"
+
+bool mux_damage_resize(MuxDamage *damage, int width, int height);
+void mux_damage_free(MuxDamage *damage);
+void mux_damage_add(MuxDamage *damage, int x, int y, int w, int h);
+void mux_damage_add_all(MuxDamage *damage);
+bool mux_damage_test_tile(MuxDamage *damage, int tx, int ty);
+bool mux_damage_test_rect(MuxDamage *damage, int x, int y, int w, int h);
+void mux_damage_clear_tile(MuxDamage *damage, int tx, int ty);
+uint32_t mux_damage_count(MuxDamage *damage);
+int mux_damage_collect(MuxDamage *damage, display_update *rects, int max_rects);
+
+#endif //SHIM_DAMAGE_H
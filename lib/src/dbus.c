@@ -79,18 +79,24 @@ __PUBLIC bool mux_get_socket_path(const char *name, const char *obj, char **out_
                 return false;
             }
 
+            // prefer the newest protocol, fall back to older ones against servers that don't speak it yet
             GVariant *child;
             while ((child = g_variant_iter_next_value(iter))) {
-                if (g_variant_type_equal(child, G_VARIANT_TYPE_INT32)) {
-                    if (g_variant_get_int32(child) == RDPMUX_PROTOCOL_VERSION) {
-                        proto = g_variant_get_int32(child);
-                        goto proto_found;
+                if (g_variant_is_of_type(child, G_VARIANT_TYPE_INT32)) {
+                    int version = g_variant_get_int32(child);
+                    if (version >= RDPMUX_PROTOCOL_VERSION_MSGPACK && version <= RDPMUX_PROTOCOL_VERSION &&
+                        version > proto) {
+                        proto = version;
                     }
                 }
+                g_variant_unref(child);
             }
+            g_variant_iter_free(iter);
 
-            mux_printf_error("DBus protocol not found!\n");
-            return false;
+            if (proto < 0) {
+                mux_printf_error("DBus protocol not found!\n");
+                return false;
+            }
 
         } else {
             mux_printf_error("Don't know how to handle variant type %s, bailing", (char *) ele_type);
@@ -102,13 +108,12 @@ __PUBLIC bool mux_get_socket_path(const char *name, const char *obj, char **out_
         }
     }
 
-proto_found:
-    if (proto != RDPMUX_PROTOCOL_VERSION) {
+    if (proto < RDPMUX_PROTOCOL_VERSION_MSGPACK || proto > RDPMUX_PROTOCOL_VERSION) {
         mux_printf_error("Protocol mismatch with RDPMux server, %d vs %d", proto, RDPMUX_PROTOCOL_VERSION);
         return false;
     }
 
-    if (!mux_org_rdpmux_rdpmux_call_register_sync(proxy, id, RDPMUX_PROTOCOL_VERSION, display->uuid,
+    if (!mux_org_rdpmux_rdpmux_call_register_sync(proxy, id, proto, display->uuid,
                                                   port, auth, out_path, NULL, &error)) {
         mux_printf_error("could not retrieve socket path: %s", error->message);
         g_error_free(error);
@@ -116,6 +121,11 @@ proto_found:
     }
     assert(*out_path != NULL);
     display->vm_id = id;
+    display->wire_binary = proto >= RDPMUX_PROTOCOL_VERSION_BINARY;
+    display->cursor_messages = proto > RDPMUX_PROTOCOL_VERSION_HANDLES;
+    display->copy_messages = proto > RDPMUX_PROTOCOL_VERSION_CURSOR;
+    display->head_messages = proto > RDPMUX_PROTOCOL_VERSION_COPY;
+    display->trace_messages = proto > RDPMUX_PROTOCOL_VERSION_HEADS;
     return true;
 }
 
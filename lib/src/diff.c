@@ -0,0 +1,139 @@
+/** @file */
+#include "diff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MUX_DIFF_X86
+#endif
+
+/**
+ * @brief Signature of a row kernel. Copies len bytes from src to dst and reports whether any of them differed.
+ */
+typedef bool (*mux_diff_row_fn)(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * @brief Portable row kernel. memcmp() bails out at the first difference, so unchanged rows cost one read pass and
+ * changed rows are copied wholesale.
+ */
+static bool mux_diff_row_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    if (memcmp(dst, src, len) == 0)
+        return false;
+
+    memcpy(dst, src, len);
+    return true;
+}
+
+#ifdef MUX_DIFF_X86
+/**
+ * @brief SSE2 row kernel. Compares 16 bytes at a time and only writes back the chunks that actually changed, so
+ * unchanged parts of the shm region are never dirtied.
+ */
+__attribute__((target("sse2")))
+static bool mux_diff_row_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    bool changed = false;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, d)) != 0xFFFF) {
+            _mm_storeu_si128((__m128i *) (dst + i), s);
+            changed = true;
+        }
+    }
+
+    if (i < len)
+        changed |= mux_diff_row_scalar(dst + i, src + i, len - i);
+
+    return changed;
+}
+
+/**
+ * @brief AVX2 row kernel. Same as the SSE2 one, 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static bool mux_diff_row_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    bool changed = false;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(s, d)) != 0xFFFFFFFFu) {
+            _mm256_storeu_si256((__m256i *) (dst + i), s);
+            changed = true;
+        }
+    }
+
+    if (i < len)
+        changed |= mux_diff_row_sse2(dst + i, src + i, len - i);
+
+    return changed;
+}
+#endif
+
+/**
+ * @brief The row kernel selected by mux_diff_init().
+ */
+static mux_diff_row_fn mux_diff_row = mux_diff_row_scalar;
+
+/**
+ * @brief Selects the fastest compare-and-copy kernel the CPU supports.
+ *
+ * Safe to call more than once. Until it has been called, the scalar kernel is used.
+ */
+void mux_diff_init(void)
+{
+#ifdef MUX_DIFF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mux_printf("Using AVX2 content diff kernel");
+        mux_diff_row = mux_diff_row_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        mux_printf("Using SSE2 content diff kernel");
+        mux_diff_row = mux_diff_row_sse2;
+    } else {
+        mux_diff_row = mux_diff_row_scalar;
+    }
+#endif
+}
+
+/**
+ * @brief Copies a pixel region from one buffer to the same coordinates of another while comparing it against what the
+ * destination already holds.
+ *
+ * This is the diffing counterpart of mux_copy_pixels(). Both buffers are assumed to have the same subpixel layout and
+ * bpp. Bytes that are already identical in the destination are not rewritten.
+ *
+ * @returns Whether any pixel in the region differed between the two buffers.
+ *
+ * @param dstData Pointer to the destination buffer.
+ * @param dstStep Scanline of dstData.
+ * @param x x-coordinate of the top-left corner of the region.
+ * @param y y-coordinate of the top-left corner of the region.
+ * @param width width of the region in px.
+ * @param height height of the region in px.
+ * @param srcData Pointer to the source buffer.
+ * @param srcStep Scanline of srcData.
+ * @param bpp Bits per pixel of the two buffers.
+ */
+bool mux_copy_pixels_diff(unsigned char *dstData, int dstStep, int x, int y, int width, int height,
+                          const unsigned char *srcData, int srcStep, int bpp)
+{
+    int pixelSize = (bpp + 7) / 8;
+    size_t lineSize = (size_t) width * pixelSize;
+    const unsigned char *pSrc = &srcData[(y * srcStep) + (x * pixelSize)];
+    unsigned char *pDst = &dstData[(y * dstStep) + (x * pixelSize)];
+    bool changed = false;
+
+    for (int line = 0; line < height; line++) {
+        changed |= mux_diff_row(pDst, pSrc, lineSize);
+        pSrc += srcStep;
+        pDst += dstStep;
+    }
+
+    return changed;
+}
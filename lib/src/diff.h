@@ -0,0 +1,12 @@
+/** @file */
+
+#ifndef SHIM_DIFF_H
+#define SHIM_DIFF_H
+
+#include "common.h"
+
+void mux_diff_init(void);
+bool mux_copy_pixels_diff(unsigned char *dstData, int dstStep, int x, int y, int width, int height,
+                          const unsigned char *srcData, int srcStep, int bpp);
+
+#endif //SHIM_DIFF_H
@@ -0,0 +1,143 @@
+/** @file */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fdpass.h"
+
+/**
+ * @brief Derives the path of the server's descriptor passing socket from the path of its 0mq socket.
+ *
+ * Only ipc:// endpoints have one. The descriptor socket lives next to the 0mq one, with ".fd" appended, so
+ * "ipc://@/tmp/rdpmux" maps to "@/tmp/rdpmux.fd". A leading '@' denotes the abstract socket namespace, same as for 0mq.
+ *
+ * @returns Newly allocated path, to be freed with g_free(). NULL if the endpoint has no descriptor socket.
+ *
+ * @param zmq_path The 0mq endpoint the library connects to.
+ */
+char *mux_fd_socket_path(const char *zmq_path)
+{
+    const char *prefix = "ipc://";
+
+    if (zmq_path == NULL || strncmp(zmq_path, prefix, strlen(prefix)) != 0)
+        return NULL;
+
+    return g_strdup_printf("%s.fd", zmq_path + strlen(prefix));
+}
+
+/**
+ * @brief Opens a connection to the descriptor socket at path.
+ *
+ * @returns The connected socket, or -1 on failure.
+ *
+ * @param path Path of the descriptor socket, as returned by mux_fd_socket_path().
+ */
+static int mux_fd_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    size_t path_len = strlen(path);
+
+    if (path_len >= sizeof(addr.sun_path)) {
+        mux_printf_error("Descriptor socket path %s is too long", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, path_len);
+    addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0'; // abstract namespace, the name isn't NUL-terminated
+    else
+        addr_len++;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        mux_printf_error("Could not create descriptor socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *) &addr, addr_len) < 0) {
+        mux_printf("Could not connect to descriptor socket %s: %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Checks whether the server is listening on the descriptor socket at path.
+ *
+ * @returns Whether a connection could be established.
+ *
+ * @param path Path of the descriptor socket, as returned by mux_fd_socket_path().
+ */
+bool mux_fd_probe(const char *path)
+{
+    int sock = mux_fd_connect(path);
+    if (sock < 0)
+        return false;
+
+    close(sock); // the server ignores connections that don't carry a message
+    return true;
+}
+
+/**
+ * @brief Sends a message to the server together with a file descriptor.
+ *
+ * Opens a fresh connection to the descriptor socket at path and sends a single packet consisting of the UUID of the
+ * VM followed by the encoded message, with fd attached as SCM_RIGHTS ancillary data. The server ends up with its own
+ * reference to whatever fd refers to, so the caller is free to close it afterwards.
+ *
+ * @returns Whether the message was sent.
+ *
+ * @param path Path of the descriptor socket, as returned by mux_fd_socket_path().
+ * @param uuid UUID of the VM.
+ * @param buf The encoded message.
+ * @param len Length of buf.
+ * @param fd The file descriptor to pass along.
+ */
+bool mux_fd_send_msg(const char *path, const char *uuid, void *buf, size_t len, int fd)
+{
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov[2];
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    bool ret = false;
+
+    int sock = mux_fd_connect(path);
+    if (sock < 0)
+        return false;
+
+    iov[0].iov_base = (void *) uuid;
+    iov[0].iov_len = strlen(uuid);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = 2;
+    hdr.msg_control = cmsg_buf;
+    hdr.msg_controllen = sizeof(cmsg_buf);
+
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0) {
+        mux_printf_error("Could not send descriptor: %s", strerror(errno));
+    } else {
+        ret = true;
+    }
+
+    close(sock);
+    return ret;
+}
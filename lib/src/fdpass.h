@@ -0,0 +1,12 @@
+/** @file */
+
+#ifndef SHIM_FDPASS_H
+#define SHIM_FDPASS_H
+
+#include "common.h"
+
+char *mux_fd_socket_path(const char *zmq_path);
+bool mux_fd_probe(const char *path);
+bool mux_fd_send_msg(const char *path, const char *uuid, void *buf, size_t len, int fd);
+
+#endif //SHIM_FDPASS_H
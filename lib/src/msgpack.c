@@ -1,5 +1,6 @@
 /** @file */
 #include "msgpack.h"
+#include "wire.h"
 
 /**
  * @brief Initializes a new nnStr struct.
@@ -39,35 +40,19 @@ static size_t mux_msg_writer(cmp_ctx_t *ctx, const void *data, size_t count)
 {
     nnStr *msg = (nnStr *) ctx->buf;
 
-    if (msg->buf == NULL) {
-        // if buf needs to be newly allocated to hold our serialization
-        // This typically happens when we start creating our serialized data
-        // and this is the first invocation of mux_msg_writer.
-        mux_printf("Allocating new buffer");
-        void *new_buf = g_malloc0(count * sizeof(uint8_t));
+    if ((msg->pos + count) > msg->size) {
+        // we need to grow the buffer. It's kept for the next message, so this stops happening once it fits the largest
+        // one. g_realloc() handles the initial NULL buffer too.
+        size_t size = MAX(msg->size * 2, msg->pos + count);
+        void *new_buf = g_realloc(msg->buf, size);
         if (new_buf) {
             msg->buf = new_buf;
-            msg->size = malloc_usable_size(new_buf); // I have ruined portability forever.
+            msg->size = size;
         } else {
-            mux_printf_error("Cannot allocate buffer");
+            // error reallocing, return 0 without changing the original buffer
+            mux_printf_error("Error reallocing buffer, returning 0");
             return 0;
         }
-    } else {
-        if ((msg->pos + count) > msg->size) {
-            // we need to realloc the size of our string
-            // g_realloc() will abort on error, but this is still good practice
-            // in case the implementation changes or we change to a different
-            // realloc later on.
-            void *new_buf = g_realloc(msg->buf, msg->size * 2); // more efficient
-            if (new_buf) {
-                msg->buf = new_buf;
-                msg->size = msg->size * 2;
-            } else {
-                // error reallocing, return null without changing the original string
-                mux_printf_error("Error reallocing buffer, returning 0");
-                return 0;
-            }
-        }
     }
     uint8_t *serialized = (uint8_t *) msg->buf;
     uint8_t *begin = serialized + msg->pos;
@@ -165,6 +150,42 @@ static void mux_process_incoming_mouse_msg(cmp_ctx_t *cmp, nnStr *msg)
     callbacks.mux_receive_mouse(mouse_x, mouse_y, flags);
 }
 
+/**
+ * @brief Deserializes a batch of input events and fires the matching callback for each of them, in order.
+ *
+ * Batches are encoded as [count, type, a, b, c, type, a, b, c, ...] after the message type, with one
+ * (type, a, b, c) quadruple per event. For keyboard events a, b and c are keycode, flags and padding; for mouse events
+ * they are mouse_x, mouse_y and flags.
+ *
+ * @param cmp The cmp struct that holds the serialized msgpack buffer.
+ * @param msg Unused, here for consistency with the other message handlers.
+ */
+static void mux_process_incoming_batch_msg(cmp_ctx_t *cmp, nnStr *msg)
+{
+    uint32_t count, type, a, b, c;
+
+    if (!cmp_read_uint(cmp, &count)) {
+        mux_printf_error("batch count wasn't read properly");
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!cmp_read_uint(cmp, &type) || !cmp_read_uint(cmp, &a) || !cmp_read_uint(cmp, &b) ||
+            !cmp_read_uint(cmp, &c)) {
+            mux_printf_error("batched event %u wasn't read properly", i);
+            return;
+        }
+
+        if (type == KEYBOARD) {
+            callbacks.mux_receive_kb(a, b);
+        } else if (type == MOUSE) {
+            callbacks.mux_receive_mouse(a, b, c);
+        } else {
+            mux_printf_error("Invalid batched event type %u", type);
+        }
+    }
+}
+
 static void mux_process_incoming_complete_msg(cmp_ctx_t *cmp, nnStr *msg)
 {
     uint32_t new_framerate, success;
@@ -184,7 +205,8 @@ static void mux_process_incoming_complete_msg(cmp_ctx_t *cmp, nnStr *msg)
         return;
     }
 
-    display->framerate = new_framerate;
+    // read by the hypervisor's refresh tick, which runs on a different thread than us
+    __atomic_store_n(&display->framerate, new_framerate, __ATOMIC_RELAXED);
 }
 
 /**
@@ -194,14 +216,22 @@ static void mux_process_incoming_complete_msg(cmp_ctx_t *cmp, nnStr *msg)
  * @param buf The raw data to be wrapped in a cmp decoding struct.
  * @param nbytes The size of buf.
  */
-void mux_process_incoming_msg(void *buf, int nbytes)
+void mux_process_incoming_msg(const void *buf, int nbytes)
 {
     // deserialize msg into component parts
     cmp_ctx_t cmp;
     uint32_t msg_type, array_size;
 
     nnStr msg;
-    mux_nnstr_init(&msg, buf, nbytes);
+
+    // the server picks binary or msgpack depending on what we registered with, but telling them apart is cheap
+    if (mux_wire_is_binary(buf, nbytes)) {
+        mux_wire_process_msg(buf, nbytes);
+        return;
+    }
+
+    // only ever read from, the cast just lets the reader share nnStr with the writer
+    mux_nnstr_init(&msg, (void *) buf, nbytes);
     cmp_init(&cmp, &msg, mux_msg_reader, mux_msg_writer);
 
 //    mux_printf("Now deserializing msgpack array!");
@@ -226,14 +256,18 @@ void mux_process_incoming_msg(void *buf, int nbytes)
             mux_printf("Processing incoming kb msg");
             mux_process_incoming_kb_msg(&cmp, &msg);
             break;
+        case INPUT_BATCH:
+            mux_printf("Processing incoming input batch msg");
+            mux_process_incoming_batch_msg(&cmp, &msg);
+            break;
         case DISPLAY_UPDATE_COMPLETE:
+            mux_printf("Processing incoming update complete msg");
+            mux_process_incoming_complete_msg(&cmp, &msg);
             break;
         default:
             mux_printf_error("Invalid message type");
             break;
     }
-    // clean up msg
-    free(msg.buf);
     return;
 }
 
@@ -266,6 +300,39 @@ static void mux_write_outgoing_update_msg(cmp_ctx_t *cmp, MuxUpdate *update)
         mux_printf_error("Something went wrong writing h");
 }
 
+/**
+ * @brief Serializes a multi-rectangle display update event to a msgpack message.
+ *
+ * The message is laid out as [type, count, x, y, w, h, x, y, w, h, ...], with one (x, y, w, h) quadruple per damaged
+ * rectangle.
+ *
+ * @param cmp The cmp struct that holds the write buffer.
+ * @param update The update to serialize.
+ */
+static void mux_write_outgoing_rects_msg(cmp_ctx_t *cmp, MuxUpdate *update)
+{
+    display_update_rects *u = &update->disp_rects;
+
+    if (!cmp_write_array(cmp, 2 + 4 * u->count))
+        mux_printf_error("Something went wrong writing array specifier");
+
+    if (!cmp_write_uint(cmp, update->type))
+        mux_printf_error("Something went wrong writing update type");
+
+    if (!cmp_write_uint(cmp, u->count))
+        mux_printf_error("Something went wrong writing rect count");
+
+    for (uint32_t i = 0; i < u->count; i++) {
+        display_update *r = &u->rects[i];
+
+        if (!cmp_write_uint(cmp, r->x1) || !cmp_write_uint(cmp, r->y1) ||
+            !cmp_write_uint(cmp, r->x2 - r->x1) || !cmp_write_uint(cmp, r->y2 - r->y1)) {
+            mux_printf_error("Something went wrong writing rect %u", i);
+            return;
+        }
+    }
+}
+
 /**
  * @brief Serializes a display switch event to a msgpack message.
  *
@@ -276,7 +343,7 @@ static void mux_write_outgoing_switch_msg(cmp_ctx_t *cmp, MuxUpdate *update)
 {
     display_switch u = update->disp_switch;
 
-    if (!cmp_write_array(cmp, 4))
+    if (!cmp_write_array(cmp, 5))
         mux_printf_error("Something went wrong writing array specifier");
 
     if (!cmp_write_uint(cmp, update->type))
@@ -290,6 +357,9 @@ static void mux_write_outgoing_switch_msg(cmp_ctx_t *cmp, MuxUpdate *update)
 
     if (!cmp_write_uint(cmp, u.h))
         mux_printf_error("Something went wrong writing h");
+
+    if (!cmp_write_uint(cmp, u.shm_size))
+        mux_printf_error("Something went wrong writing shm size");
 }
 
 static void mux_write_outgoing_shutdown_msg(cmp_ctx_t *cmp)
@@ -314,24 +384,27 @@ size_t mux_write_outgoing_msg(MuxUpdate *update, nnStr *msg)
     // takes a struct and serializes it to a msgpack message.
     //printf("LIBSHIM: Writing a new message now!");
     cmp_ctx_t cmp;
-    //nnStr msg;
-    mux_nnstr_init(msg, msg->buf, 0);
+    // keep whatever buffer we got, only start writing over it from the top
+    mux_nnstr_init(msg, msg->buf, msg->size);
     cmp_init(&cmp, msg, mux_msg_reader, mux_msg_writer);
 
     if (update == NULL) {
         mux_write_outgoing_shutdown_msg(&cmp);
-        return msg->size;
+        return msg->pos;
     }
 
     if (update->type == DISPLAY_UPDATE) {
         mux_write_outgoing_update_msg(&cmp, update);
+    } else if (update->type == DISPLAY_UPDATE_RECTS) {
+        mux_write_outgoing_rects_msg(&cmp, update);
     } else if (update->type == DISPLAY_SWITCH) {
         mux_write_outgoing_switch_msg(&cmp, update);
     } else {
         mux_printf_error("Unknown message type queued for writing!");
     }
 
-    size_t len = msg->size;
+    // pos, not size: the buffer is usually larger than the message in it
+    size_t len = msg->pos;
     return len;
 }
 
@@ -5,8 +5,6 @@
 #ifndef SHIM_MSGPACK_H
 #define SHIM_MSGPACK_H
 
-#include <malloc.h>
-
 #include "common.h"
 #include "lib/c-msgpack.h"
 
@@ -17,6 +15,6 @@ typedef struct nn_str {
 } nnStr;
 
 size_t mux_write_outgoing_msg(MuxUpdate *update, nnStr *msg);
-void mux_process_incoming_msg(void *buf, int nbytes);
+void mux_process_incoming_msg(const void *buf, int nbytes);
 
 #endif //SHIM_MSGPACK_H
@@ -7,96 +7,55 @@
 #include "common.h"
 #include "msgpack.h"
 #include "0mq.h"
+#include "damage.h"
+#include "diff.h"
+#include "copy.h"
+#include "shm.h"
+#include "fdpass.h"
+#include "remote.h"
+#include "wire.h"
 
 InputEventCallbacks callbacks;
 MuxDisplay *display;
 
 /**
- * @func Checks whether the bounding box of the display update needs to be expanded, and does so if necessary.
+ * @func Public API function to get a head of the VM's display, to switch it on or report damage to it. Guests with a
+ * single monitor can stick to the mux_display_*() functions instead, which act on head 0.
  *
- * This function is called when more than one display update event is received per refresh tick. It computes the smallest
- * bounding box of the display buffer that contains all the updated screen regions received thus far, and updates the
- * display update with the new coordinates.
+ * @param index Index of the head, below MUX_MAX_HEADS (8).
  *
- * @param update The update object to update if necessary. Should be verified to be of type DISPLAY_UPDATE by caller.
- * @param x The X-coordinate of the top-left corner of the new region to be included in the update.
- * @param y The Y-coordinate of the top-left corner of the new region to be included in the update.
- * @param w The width of the new region to be included in the update.
- * @param h The height of the new region to be included in the update.
+ * @returns The head, NULL if there is no head of that index.
  */
-static void mux_expand_rect(MuxUpdate *update, int x, int y, int w, int h)
+__PUBLIC MuxHead *mux_display_head(int index)
 {
-    if (update->type != DISPLAY_UPDATE)
-        return;
-
-    display_update *u = &update->disp_update;
-
-    int new_x1 = x;
-    int new_y1 = y;
-    int new_x2 = x+w;
-    int new_y2 = y+h;
-
-    u->x1 = MIN(u->x1, new_x1);
-    u->y1 = MIN(u->y1, new_y1);
-    u->x2 = MAX(u->x2, new_x2);
-    u->y2 = MAX(u->y2, new_y2);
+    if (index < 0 || index >= MUX_MAX_HEADS)
+        return NULL;
+    return &display->heads[index];
 }
 
 /**
- * @func Copies a pixel region from one buffer to another. The two buffers are assumed to have the same subpixel
- * layout and bpp. The function will transfer a given rectangle of certain dimension from the source buffer to
- * a rectangle in the destination buffer with the same width and height, but not necessarily the same coordinates.
+ * @func Public API function designed to be called when a region of a head's framebuffer changes. For example, when a
+ * window moves or an animation updates on screen.
+ *
+ * The function accepts four parameters [(x, y) w x h] that together define the rectangular bounding box of the changed
+ * region in pixels, relative to the head's own framebuffer. The region is recorded at tile granularity (see
+ * MUX_TILE_SIZE) and synced on the next refresh.
  *
- * @param dstData Pointer to the destination buffer. Assumed to be big enough to hold the data being copied into it.
- * @param dstStep Scanline of dstData.
- * @param xDst x-coordinate of the top-left corner of the destination rectangle.
- * @param yDst y-coordinate of the top-left corner of the destination rectangle.
- * @param width width of the rectangle in px.
- * @param height height of the rectangle in px.
- * @param srcData Pointer to the source buffer.
- * @param srcStep Scanline of the source buffer.
- * @param xSrc x-coordinate of the top-left corner of the source rectangle.
- * @param ySrc y-coordinate of the top-left corner of the source rectangle.
- * @param bpp Bits per pixel of the two buffers.
+ * @param head The head.
+ * @param x X coordinate of the top-left corner of the changed region.
+ * @param y Y-coordinate of the top-left corner of the changed region.
+ * @param w Width of the changed region, in px.
+ * @param h Height of the changed region, in px.
  */
-static void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int yDst, int width, int height,
-                            unsigned char *srcData, int srcStep, int xSrc, int ySrc, int bpp)
+__PUBLIC void mux_head_update(MuxHead *head, int x, int y, int w, int h)
 {
-    int lineSize;
-    int pixelSize;
-    unsigned char* pSrc;
-    unsigned char* pDst;
-    unsigned char* pEnd;
-
-    pixelSize = (bpp + 7) / 8;
-    lineSize = width * pixelSize;
-
-    pSrc = &srcData[(ySrc * srcStep) + (xSrc * pixelSize)];
-    pDst = &dstData[(yDst * dstStep) + (xDst * pixelSize)];
-
-
-    // when the source and destination rectangles are both strips
-    // of the framebuffer spanning the full width, it's much cheaper
-    // to do one memcpy rather than going line-by-line.
-    if ((srcStep == dstStep) && (lineSize == srcStep)) {
-        memcpy(pDst, pSrc, lineSize * height);
-    } else {
-        pEnd = pSrc + (srcStep * height);
-
-        while (pSrc < pEnd) {
-            memcpy(pDst, pSrc, lineSize);
-            pSrc += srcStep;
-            pDst += dstStep;
-        }
-    }
+    mux_printf("DCL display update event triggered on head %d", head->index);
+    mux_damage_add(&head->damage, x, y, w, h);
 }
 
 /**
- * @func Public API function designed to be called when a region of the framebuffer changes. For example, when a window
- * moves or an animation updates on screen.
- *
- * The function accepts four parameters [(x, y) w x h] that together define the rectangular bounding box of the changed
- * region in pixels.
+ * @func Public API function designed to be called when a region of the framebuffer of head 0 changes. See
+ * mux_head_update().
  *
  * @param x X coordinate of the top-left corner of the changed region.
  * @param y Y-coordinate of the top-left corner of the changed region.
@@ -105,102 +64,190 @@ static void mux_copy_pixels(unsigned char *dstData, int dstStep, int xDst, int y
  */
 __PUBLIC void mux_display_update(int x, int y, int w, int h)
 {
-    mux_printf("DCL display update event triggered");
-    MuxUpdate *update = &(display->dirty_update);
-    if (update->type == MSGTYPE_INVALID) {
-        update->type = DISPLAY_UPDATE;
-        update->disp_update.x1 = x;
-        update->disp_update.y1 = y;
-        update->disp_update.x2 = x+w;
-        update->disp_update.y2 = y+h;
-    } else {
-        // update dirty bounding box
-        if (update->type != DISPLAY_UPDATE) {
-            return;
+    mux_head_update(&display->heads[0], x, y, w, h);
+}
+
+/**
+ * @func Public API function designed to be called when the hypervisor moved a block of a head's framebuffer, e.g.
+ * because the guest scrolled or dragged a window, after it did so. Both the block and where it was moved to are
+ * relative to the head's own framebuffer.
+ *
+ * Instead of the destination being synced and re-encoded like any other damage, the server is told about the copy, and
+ * passes it on to RDP clients that can do it themselves. That only works if the server already has what was copied,
+ * so the destination is recorded as damage after all while the source has damage of its own that wasn't synced yet,
+ * or if the server doesn't take copies.
+ *
+ * @param head The head.
+ * @param src_x X-coordinate of the top-left corner of the block before it was moved.
+ * @param src_y Y-coordinate of the top-left corner of the block before it was moved.
+ * @param dst_x X-coordinate of the top-left corner of the block after it was moved.
+ * @param dst_y Y-coordinate of the top-left corner of the block after it was moved.
+ * @param w Width of the block, in px.
+ * @param h Height of the block, in px.
+ */
+__PUBLIC void mux_head_copy(MuxHead *head, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+{
+    int width = head->damage.width;
+    int height = head->damage.height;
+    bool queued = false;
+
+    mux_printf("DCL display copy event triggered on head %d", head->index);
+
+    bool inside = w > 0 && h > 0 && src_x >= 0 && src_y >= 0 && dst_x >= 0 && dst_y >= 0 && src_x <= width - w &&
+                  dst_x <= width - w && src_y <= height - h && dst_y <= height - h;
+    if (inside && display->copy_messages && head->shm_header != NULL &&
+        __atomic_load_n(&display->framerate, __ATOMIC_RELAXED) > 0 &&
+        !mux_damage_test_rect(&head->damage, src_x, src_y, w, h)) {
+        int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(head->surface));
+        int dstStep = width * ((bpp + 7) / 8);
+
+        pthread_mutex_lock(&display->out_lock);
+        if (display->copy_count < MUX_MAX_COPY_RECTS) {
+            // the shared framebuffer still has the source as it was, the hypervisor's already has the result
+            mux_shm_write_begin(head->shm_header);
+            mux_copy_pixels(head->shm_buffer, dstStep, dst_x, dst_y, w, h,
+                            (unsigned char *) pixman_image_get_data(head->surface),
+                            pixman_image_get_stride(head->surface), dst_x, dst_y, bpp);
+            mux_shm_write_end(head->shm_header);
+
+            // the server applies copies to the whole desktop
+            MuxWireCopy *copy = &display->copies[display->copy_count++];
+            copy->src_x = head->x + src_x;
+            copy->src_y = head->y + src_y;
+            copy->dst_x = head->x + dst_x;
+            copy->dst_y = head->y + dst_y;
+            copy->w = w;
+            copy->h = h;
+            queued = true;
         }
-        mux_expand_rect(update, x, y, w, h);
+        pthread_mutex_unlock(&display->out_lock);
     }
 
-    mux_printf("Bounding box updated to [(%d, %d), (%d, %d)]", update->disp_update.x1, update->disp_update.x2,
-               update->disp_update.x2, update->disp_update.y2);
+    if (!queued)
+        mux_damage_add(&head->damage, dst_x, dst_y, w, h);
+}
+
+/**
+ * @func Public API function designed to be called when the hypervisor moved a block of the framebuffer of head 0. See
+ * mux_head_copy().
+ *
+ * @param src_x X-coordinate of the top-left corner of the block before it was moved.
+ * @param src_y Y-coordinate of the top-left corner of the block before it was moved.
+ * @param dst_x X-coordinate of the top-left corner of the block after it was moved.
+ * @param dst_y Y-coordinate of the top-left corner of the block after it was moved.
+ * @param w Width of the block, in px.
+ * @param h Height of the block, in px.
+ */
+__PUBLIC void mux_display_copy(int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+{
+    mux_head_copy(&display->heads[0], src_x, src_y, dst_x, dst_y, w, h);
 }
 
 /**
- * @func Public API function, to be called if the framebuffer surface changes in a user-facing way; for example, when the
- * display buffer resolution changes. In here, we create a new shared memory region for the framebuffer if necessary,
- * and do a straight memcpy of the new framebuffer data into the space. We then enqueue a display switch event that
- * contains the new shm region's information and the new dimensions of the display buffer. Finally, we notify the outside
- * about the new target framerate we'd like
+ * @func Public API function, to be called if the framebuffer surface of a head changes in a user-facing way; for
+ * example, when the display buffer resolution changes, or when the guest turns the head on. In here, we make sure the
+ * head's shared memory region is sized for the new framebuffer, replacing it if necessary, and do a straight copy of
+ * the new framebuffer data into the space. We then enqueue a display switch event that contains the new shm region's
+ * information, the new dimensions of the display buffer and where the head goes on the desktop.
  *
+ * Heads must not overlap on the desktop, or the server refuses the switch. A server that registered the VM with
+ * RDPMUX_PROTOCOL_VERSION_COPY or older only knows a single head: only head 0 can be switched on then, and it's always
+ * put at the top left corner.
+ *
+ * @param head The head.
  * @param surface The new framebuffer display surface.
+ * @param x X-coordinate of the head's top left corner on the desktop, in px.
+ * @param y Y-coordinate of the head's top left corner on the desktop, in px.
  *
- * @returns Target framerate for the VM guest.
+ * @returns Whether the switch is sent to the server.
  */
-__PUBLIC void mux_display_switch(pixman_image_t *surface)
+__PUBLIC bool mux_head_switch(MuxHead *head, pixman_image_t *surface, int x, int y)
 {
-    mux_printf("DCL display switch event triggered.");
-
-    // save the pointers in our display struct for further use.
-    display->surface = surface;
-    uint32_t *framebuf_data = pixman_image_get_data(display->surface);
-    int width = pixman_image_get_width(display->surface);
-    int height = pixman_image_get_height(display->surface);
-
-    // do all sorts of stuff to get the shmem region opened and ready
-    const char *socket_fmt = "/%d.rdpmux";
-    char socket_str[20] = ""; // 20 is a magic number carefully chosen
-                              // to be the length of INT_MAX plus the characters
-                              // in socket_fmt. If you change socket_fmt, make
-                              // sure to change this too.
-    int shm_size = 4096 * 2048 * sizeof(uint32_t); // rdp protocol has max framebuffer size 4096x2048
-    sprintf(socket_str, socket_fmt, display->vm_id);
-
-    // set up the shm region. This path only runs the first time a display switch event is received.
-    if (display->shmem_fd < 0) {
-        // this is the shm buffer being created! Hooray!
-        int shim_fd = shm_open(socket_str,
-                               O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IRGRP | S_IROTH);
-        if (shim_fd < 0) {
-            mux_printf_error("shm_open failed: %s", strerror(errno));
-            return;
-        }
+    mux_printf("DCL display switch event triggered on head %d.", head->index);
 
-        // resize the newly created shm region to the size of the framebuffer
-        if (ftruncate(shim_fd, shm_size)) {
-            mux_printf_error("ftruncate of new buffer failed: %s", strerror(errno));
-            return;
+    if (!display->head_messages) {
+        if (head->index > 0) {
+            mux_printf_error("The server doesn't support more than one display head");
+            return false;
         }
-        // save our new shm file descriptor for later use
-        display->shmem_fd = shim_fd;
-
-        // mmap the shm region into our process space
-        void *shm_buffer = mmap(NULL, shm_size, PROT_READ | PROT_WRITE,
-                                MAP_SHARED, display->shmem_fd, 0);
-        if (shm_buffer == MAP_FAILED) {
-            mux_printf_error("mmap failed: %s", strerror(errno));
-            return;
-        }
-
-        // save the pointer to the buffer for later use
-        display->shm_buffer = shm_buffer;
+        x = y = 0;
+    }
+    if (x < 0 || y < 0) {
+        mux_printf_error("Invalid position %d,%d for head %d", x, y, head->index);
+        return false;
     }
 
-    memcpy(display->shm_buffer, framebuf_data, width * height * sizeof(uint32_t));
+    // save the pointers in our head struct for further use.
+    head->surface = surface;
+    uint32_t *framebuf_data = pixman_image_get_data(head->surface);
+    int width = pixman_image_get_width(head->surface);
+    int height = pixman_image_get_height(head->surface);
+
+    pixman_format_code_t format = pixman_image_get_format(head->surface);
+    int bpp = PIXMAN_FORMAT_BPP(format);
+    int stride = width * ((bpp + 7) / 8);
+
+    // get a shmem region of the right size opened and ready
+    if (!mux_shm_resize(display, head, (size_t) stride * height))
+        return false;
+
+    // the geometry is updated inside the same write section as the pixels, so the server can tell from the header
+    // alone whether what it reads still matches the last display switch it processed.
+    mux_shm_write_begin(head->shm_header);
+    head->shm_header->width = width;
+    head->shm_header->height = height;
+    head->shm_header->stride = stride;
+    head->shm_header->format = format;
+    mux_copy_pixels(head->shm_buffer, stride, 0, 0, width, height, (unsigned char *) framebuf_data,
+                    pixman_image_get_stride(head->surface), 0, 0, bpp);
+    mux_shm_write_end(head->shm_header);
+
+    // the whole buffer was just synced, so start tracking damage for the new surface from scratch
+    mux_damage_resize(&head->damage, width, height);
     // create the event update
 
-    MuxUpdate *update = &display->out_update;
+    MuxUpdate *update = &head->out_update;
     pthread_mutex_lock(&display->out_lock);
     //////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////
     //                     CRITICAL SECTION                            //
     ////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////
-    update->type = DISPLAY_SWITCH;
-    update->disp_switch.shm_fd = display->shmem_fd;
+    if ((update->type == DISPLAY_SWITCH || update->type == HEAD_SWITCH) && update->disp_switch.shm_fd >= 0)
+        close(update->disp_switch.shm_fd); // superseded before the main loop got around to sending it
+    update->type = display->head_messages ? HEAD_SWITCH : DISPLAY_SWITCH;
+    // the main loop sends this, and we may have replaced the region again by then, so hand it its own reference. A
+    // remote server has no use for it.
+    update->disp_switch.shm_fd = head->shm_memfd && !display->remote.enabled ? dup(head->shmem_fd) : -1;
+    update->disp_switch.head = head->index;
+    update->disp_switch.x = x;
+    update->disp_switch.y = y;
     update->disp_switch.w = width;
     update->disp_switch.h = height;
-    update->disp_switch.format = pixman_image_get_format(display->surface);
-    display->out_ready = true;
+    update->disp_switch.format = format;
+    update->disp_switch.shm_size = head->shm_size;
+    head->out_ready = true;
+    head->x = x;
+    head->y = y;
+    // the switch brings the whole framebuffer along, so copies on the head are moot. Copies on other heads aren't.
+    int kept = 0;
+    for (int i = 0; i < display->copy_count; i++) {
+        MuxWireCopy *copy = &display->copies[i];
+        bool moot = (int) copy->dst_x >= x && (int) copy->dst_x < x + width && (int) copy->dst_y >= y &&
+                    (int) copy->dst_y < y + height;
+        if (!moot)
+            display->copies[kept++] = *copy;
+    }
+    display->copy_count = kept;
+    if (display->remote.enabled) {
+        // a remote server gets the whole framebuffer as tiles right after the switch, which supersede any older ones.
+        // Until it gave us a window it wouldn't take them, and asks for every head again once it does.
+        mux_remote_reset(display, &head->tiles);
+        if (__atomic_load_n(&display->remote.window, __ATOMIC_ACQUIRE) > 0) {
+            display_update all = {0, 0, width, height};
+            mux_remote_queue_rects(display, head, &all, 1);
+        }
+    }
     //////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////
     //                 END CRITICAL SECTION                            //
@@ -209,68 +256,120 @@ __PUBLIC void mux_display_switch(pixman_image_t *surface)
     pthread_mutex_unlock(&display->out_lock);
 
     mux_printf("DISPLAY: DCL display switch callback completed successfully.");
+    return true;
 }
 
 /**
- * @func Public API function, to be called when the framebuffer display refreshes.
+ * @func Public API function, to be called if the framebuffer surface of head 0 changes in a user-facing way. See
+ * mux_head_switch(). Head 0 stays wherever it was put last, the top left corner unless it was moved.
  *
- * This function attempts to lock the shared memory region, and if it succeeds, will sync the framebuffer
- * to the shared memory and copy the current dirty update for transmission.
+ * @param surface The new framebuffer display surface.
  */
-__PUBLIC uint32_t mux_display_refresh()
+__PUBLIC void mux_display_switch(pixman_image_t *surface)
 {
-    if (display->dirty_update.type == DISPLAY_UPDATE) {
-        int pixelSize;
-        size_t x = 0;
-        size_t y = 0;
-        size_t w = 0;
-        size_t h = 0;
-        display_update *u = &(display->dirty_update.disp_update);
-        size_t surfaceWidth = pixman_image_get_width(display->surface);
-        size_t surfaceHeight = pixman_image_get_height(display->surface);
-        int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(display->surface));
-        unsigned char *srcData = (unsigned char *) pixman_image_get_data(display->surface);
-        unsigned char *dstData = (unsigned char *) display->shm_buffer;
-
-        // align the bounding box to 16 for memory alignment purposes
-        if (u->x1 % 16) {
-            u->x1 -= (u->x1 % 16);
-        }
-
-        if (u->y1 % 16) {
-            u->y1 -= (u->y1 % 16);
-        }
-
-        if (u->x2 % 16) {
-            u->x2 += 16 - (u->x2 % 16);
-        }
+    MuxHead *head = &display->heads[0];
+    mux_head_switch(head, surface, head->x, head->y);
+}
 
-        if (u->y2 % 16) {
-            u->y2 += 16 - (u->y2 % 16);
-        }
+/**
+ * @brief Syncs every damaged tile of a head to its shared memory region and queues the list of damaged rectangles for
+ * transmission, unless the head's previous update hasn't been sent yet. The caller must hold out_lock.
+ *
+ * @param head The head.
+ */
+static void mux_head_refresh(MuxHead *head)
+{
+    // we don't have another event queued
+    if (!head->damage.dirty || head->shm_header == NULL || head->out_ready ||
+        head->out_update.type != MSGTYPE_INVALID) {
+        return;
+    }
+    // a remote server that can't keep up gets the damage in one go once it caught up, rather than piece by piece
+    if (display->remote.enabled && !mux_remote_may_send(display, mux_damage_count(&head->damage)))
+        return;
 
-        if (u->x2 > surfaceWidth) {
-            u->x2 = surfaceWidth;
-        }
+    size_t surfaceWidth = pixman_image_get_width(head->surface);
+    int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(head->surface));
+    unsigned char *srcData = (unsigned char *) pixman_image_get_data(head->surface);
+    unsigned char *dstData = (unsigned char *) head->shm_buffer;
+    int srcStep = pixman_image_get_stride(head->surface);
+    int pixelSize = (bpp + 7) / 8;
+
+    display_update_rects *u = &head->out_update.disp_rects;
+    u->refresh_us = mux_now_us();
+    mux_shm_write_begin(head->shm_header);
+#ifdef USE_CONTENT_DIFF
+    // copy while diffing, so only tiles that really changed make it into the rect list
+    mux_sync_damaged_tiles(&head->damage, dstData, surfaceWidth * pixelSize, srcData, srcStep, bpp);
+#endif
+    u->count = mux_damage_collect(&head->damage, u->rects, MUX_MAX_UPDATE_RECTS);
+
+#ifndef USE_CONTENT_DIFF
+    // tiles are already aligned to MUX_TILE_SIZE, and vertically stacked full-width tiles get merged
+    // into a single band, which mux_copy_pixels() moves with one memcpy.
+    for (uint32_t i = 0; i < u->count; i++) {
+        display_update *r = &u->rects[i];
+        mux_copy_pixels(dstData, surfaceWidth * pixelSize, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1,
+                        srcData, srcStep, r->x1, r->y1, bpp);
+    }
+#endif
+    mux_shm_write_end(head->shm_header);
 
-        if (u->y2 > surfaceHeight) {
-            u->y2 = surfaceHeight;
-        }
+    if (display->remote.enabled) {
+        // a remote server can't read the shared framebuffer, so it gets the damaged tiles themselves as the update
+        mux_remote_queue_rects(display, head, u->rects, u->count);
+        return;
+    }
 
-        y = u->y1;
-        h = u->y2 - u->y1;
+    // the server takes damage in desktop coordinates
+    for (uint32_t i = 0; i < u->count; i++) {
+        u->rects[i].x1 += head->x;
+        u->rects[i].x2 += head->x;
+        u->rects[i].y1 += head->y;
+        u->rects[i].y2 += head->y;
+    }
 
-        pixelSize = (bpp + 7) / 8;
+    if (u->count > 0) {
+        u->seq = ++display->update_seq;
+        head->out_update.type = DISPLAY_UPDATE_RECTS;
+        head->out_ready = true;
+    }
+}
 
-        // aligning the copy offsets does not yield a good performance gain,
-        // but copying contiguous memory blocks makes a huge difference.
-        // by forcing copying of full lines on buffers with the same step,
-        // we can use a single memcpy rather than one memcpy per line.
-        // this may over-copy a bit sometimes, but it's still way cheaper.
-        x = 0;
-        w = surfaceWidth;
+/**
+ * @func Public API function, to be called when the framebuffer display refreshes.
+ *
+ * This function attempts to lock the shared memory regions, and if it succeeds, will sync every damaged tile of every
+ * head's framebuffer to the head's shared memory and queue the list of damaged rectangles for transmission. If the
+ * lock can't be taken, or a head's previous update hasn't been sent yet, the damage is kept and synced on a later tick.
+ *
+ * @returns Target framerate for the VM guest, as last set by the server. 0 means nobody is connected; the hypervisor
+ * should fall back to a slow idle tick then, since the new rate is only picked up by calling this function.
+ */
+__PUBLIC uint32_t mux_display_refresh()
+{
+    uint32_t framerate = __atomic_load_n(&display->framerate, __ATOMIC_RELAXED);
+
+    // at 0 fps nobody is watching. The damage keeps piling up in the tile maps, and goes out in one go once somebody
+    // connects and the server raises the rate again. Nobody needs the shared framebuffers in the meantime either, so
+    // their pages are given back, and all of every head is synced again once somebody connects.
+    if (framerate > 0) {
+        if (display->shm_released) {
+            for (int i = 0; i < MUX_MAX_HEADS; i++) {
+                if (display->heads[i].surface != NULL)
+                    mux_damage_add_all(&display->heads[i].damage);
+            }
+            display->shm_released = false;
+        }
 
-        mux_expand_rect(&display->dirty_update, u->x1, u->y1, u->x2 - u->x1, u->y2 - u->y1);
+        // switching a head sends a remote server all of it, which is what it asks for when it lost track
+        if (display->remote.enabled && __atomic_exchange_n(&display->remote.resync, false, __ATOMIC_ACQ_REL)) {
+            for (int i = 0; i < MUX_MAX_HEADS; i++) {
+                MuxHead *head = &display->heads[i];
+                if (head->surface != NULL)
+                    mux_head_switch(head, head->surface, head->x, head->y);
+            }
+        }
 
         if (pthread_mutex_trylock(&display->out_lock) == 0) {
             //////////////////////////////////////////////////////////////////////
@@ -278,13 +377,9 @@ __PUBLIC uint32_t mux_display_refresh()
             //                     CRITICAL SECTION                            //
             ////////////////////////////////////////////////////////////////////
             ////////////////////////////////////////////////////////////////////
-            mux_copy_pixels(dstData, w * pixelSize, x, y, w, h, srcData, w * pixelSize, x, y, bpp);
-
-            if (display->out_ready == false &&
-                display->out_update.type == MSGTYPE_INVALID) { // we don't have another event queued
-                display->out_update = display->dirty_update;
-                display->out_ready = true;
-                display->dirty_update.type = MSGTYPE_INVALID;
+            for (int i = 0; i < MUX_MAX_HEADS; i++) {
+                if (display->heads[i].surface != NULL)
+                    mux_head_refresh(&display->heads[i]);
             }
             //////////////////////////////////////////////////////////////////////
             /////////////////////////////////////////////////////////////////////
@@ -294,10 +389,100 @@ __PUBLIC uint32_t mux_display_refresh()
             pthread_mutex_unlock(&display->out_lock);
         }
     } else {
+        if (!display->shm_released) {
+            for (int i = 0; i < MUX_MAX_HEADS; i++)
+                mux_shm_release(&display->heads[i]);
+            display->shm_released = true;
+        }
         mux_printf("Refresh deferred");
     }
 
-    return (uint32_t) 30;
+    return framerate;
+}
+
+/**
+ * @func Public API function to give the cursor a new shape, to be called whenever the guest changes it. The server
+ * shows the cursor to RDP clients as a pointer of their own, so the hypervisor must not draw it into the framebuffer
+ * as long as this succeeds: moving the cursor then costs a small message instead of damage around it on every move.
+ *
+ * The shape is sent by the main loop. A shape replaced before it went out is never sent.
+ *
+ * @param hot_x X-coordinate of the hotspot in the shape, in px.
+ * @param hot_y Y-coordinate of the hotspot in the shape, in px.
+ * @param w Width of the shape in px, MUX_CURSOR_MAX_SIZE (96) at most.
+ * @param h Height of the shape in px, MUX_CURSOR_MAX_SIZE (96) at most.
+ * @param pixels w * h a8r8g8b8 pixels of the shape with straight alpha, row by row.
+ *
+ * @returns Whether the shape will be shown. If not, because the server is too old or the shape too large, the
+ * hypervisor has to keep drawing the cursor into the framebuffer.
+ */
+__PUBLIC bool mux_cursor_define(int hot_x, int hot_y, int w, int h, const uint32_t *pixels)
+{
+    if (!display->cursor_messages)
+        return false;
+    if (w <= 0 || h <= 0 || w > MUX_CURSOR_MAX_SIZE || h > MUX_CURSOR_MAX_SIZE || pixels == NULL) {
+        mux_printf_error("Invalid cursor shape of %dx%d px", w, h);
+        return false;
+    }
+
+    pthread_mutex_lock(&display->cursor.lock);
+    display->cursor.define_len = mux_wire_write_cursor(display->cursor.define_buf, MAX(hot_x, 0), MAX(hot_y, 0), w,
+                                                       h, pixels);
+    pthread_mutex_unlock(&display->cursor.lock);
+    return true;
+}
+
+/**
+ * @func Public API function to move the cursor, or to hide or show it, to be called whenever the guest does.
+ *
+ * Moves are coalesced: if the main loop didn't get around to sending one before the next, only the latest is sent.
+ *
+ * @param x X-coordinate of the hotspot on the desktop, in px. Unless there are several heads, that's the framebuffer.
+ * @param y Y-coordinate of the hotspot on the desktop, in px.
+ * @param visible Whether the cursor is shown at all.
+ *
+ * @returns Whether the server is told about the move. See mux_cursor_define().
+ */
+__PUBLIC bool mux_cursor_move(int x, int y, bool visible)
+{
+    if (!display->cursor_messages)
+        return false;
+
+    pthread_mutex_lock(&display->cursor.lock);
+    display->cursor.pos.x = MAX(x, 0);
+    display->cursor.pos.y = MAX(y, 0);
+    display->cursor.pos.visible = visible ? 1 : 0;
+    display->cursor.move_pending = true;
+    pthread_mutex_unlock(&display->cursor.lock);
+    return true;
+}
+
+/**
+ * @brief Sends the pending cursor updates, the shape first so a move never arrives ahead of the shape it belongs to.
+ */
+static void mux_send_cursor()
+{
+    size_t define_len;
+    MuxWireCursorPos pos;
+    bool move;
+
+    pthread_mutex_lock(&display->cursor.lock);
+    define_len = display->cursor.define_len;
+    if (define_len > 0)
+        memcpy(display->cursor.send_buf, display->cursor.define_buf, define_len);
+    display->cursor.define_len = 0;
+    pos = display->cursor.pos;
+    move = display->cursor.move_pending;
+    display->cursor.move_pending = false;
+    pthread_mutex_unlock(&display->cursor.lock);
+
+    if (define_len > 0 && mux_0mq_send_msg(display->cursor.send_buf, define_len) < 0)
+        mux_printf_error("Failed to send cursor shape");
+    if (move) {
+        size_t len = mux_wire_write_cursor_pos(display->wire_buf, &pos);
+        if (mux_0mq_send_msg(display->wire_buf, len) < 0)
+            mux_printf_error("Failed to send cursor position");
+    }
 }
 
 /*
@@ -323,15 +508,98 @@ __PUBLIC void *mux_display_buffer_update_loop(void *arg)
 }
 
 
+/**
+ * @brief Serializes an outgoing update in whatever format was negotiated with the server.
+ *
+ * Either way the message is built in a scratch buffer of the display struct, which stays valid until the next call.
+ *
+ * @returns Size of the serialized message in bytes.
+ *
+ * @param update The update to serialize. NULL means a shutdown message.
+ * @param data Set to the serialized message.
+ */
+static size_t mux_serialize_update(MuxUpdate *update, void **data)
+{
+    size_t len;
+
+    if (display->wire_binary) {
+        len = mux_wire_write_msg(update, display->wire_buf, sizeof(display->wire_buf));
+        *data = display->wire_buf;
+    } else {
+        nnStr msg;
+        msg.buf = display->msgpack_buf;
+        msg.size = display->msgpack_size;
+        len = mux_write_outgoing_msg(update, &msg);
+        // the writer may have grown the buffer
+        display->msgpack_buf = msg.buf;
+        display->msgpack_size = msg.size;
+        *data = msg.buf;
+    }
+    return len;
+}
+
+/**
+ * @brief Puts a display switch whose descriptor couldn't be handed over back into its head, so the main loop tries
+ * again on its next pass. The server would go on showing the region the head had before otherwise.
+ *
+ * @param out The switch. Its descriptor is kept by the head, or closed if a newer switch took its place meanwhile.
+ */
+static void mux_requeue_switch(MuxUpdate *out)
+{
+    MuxHead *head = &display->heads[out->disp_switch.head];
+
+    pthread_mutex_lock(&display->out_lock);
+    if (head->out_ready && (head->out_update.type == DISPLAY_SWITCH || head->out_update.type == HEAD_SWITCH)) {
+        close(out->disp_switch.shm_fd);
+    } else {
+        // an update queued in the meantime is for the new region, which the server gets all of with the switch
+        head->out_update = *out;
+        head->out_ready = true;
+    }
+    pthread_mutex_unlock(&display->out_lock);
+}
+
+/**
+ * @brief Sends an update taken out of a head, passing the shared memory region along with display switches of memfd
+ * backed heads.
+ *
+ * @param out The update. Its descriptor, if it has one, is closed, or handed back to the head if it couldn't be sent.
+ */
+static void mux_send_update(MuxUpdate *out)
+{
+    void *data;
+    size_t len;
+
+    if ((out->type == DISPLAY_SWITCH || out->type == HEAD_SWITCH) && out->disp_switch.shm_fd >= 0) {
+        // the memfd has no name, so the switch has to travel along with the descriptor
+        MuxHead *head = &display->heads[out->disp_switch.head];
+        len = mux_serialize_update(out, &data);
+        if (!mux_fd_send_msg(display->zmq.fd_path, display->uuid, data, len, out->disp_switch.shm_fd)) {
+            // only the first failure is worth reporting, the main loop tries again every pass
+            if (head->switch_failures++ == 0)
+                mux_printf_error("Failed to send display switch, trying again");
+            mux_requeue_switch(out);
+            return;
+        }
+        if (head->switch_failures > 0)
+            mux_printf("Display switch sent after %u attempts", head->switch_failures + 1);
+        head->switch_failures = 0;
+
+        close(out->disp_switch.shm_fd);
+    } else if (out->type != MSGTYPE_INVALID) {
+        len = mux_serialize_update(out, &data);
+        while (mux_0mq_send_msg(data, len) < 0)
+            mux_printf_error("Failed to send message");
+    }
+}
+
 static void mux_send_shutdown_msg()
 {
-    nnStr msg;
-    msg.buf = NULL;
-    size_t len = mux_write_outgoing_msg(NULL, &msg); // NULL means shutdown!
-    while(mux_0mq_send_msg(msg.buf, len) < 0) {
+    void *data;
+    size_t len = mux_serialize_update(NULL, &data); // NULL means shutdown!
+    while(mux_0mq_send_msg(data, len) < 0) {
         mux_printf_error("Failed to send shutdown message!");
     }
-    g_free(msg.buf);
     mux_printf("Shutdown message sent!");
 }
 
@@ -345,7 +613,7 @@ static void mux_send_shutdown_msg()
 __PUBLIC void *mux_mainloop(void *arg)
 {
     mux_printf("Reached qemu shim in loop thread!");
-    void *buf = NULL;
+    const void *buf = NULL;
     size_t len;
     zpoller_t *poller = display->zmq.poller;
     bool stopping = false;
@@ -353,11 +621,11 @@ __PUBLIC void *mux_mainloop(void *arg)
     // main shim receive loop
     int nbytes;
     while(!stopping) {
-        nnStr msg;
-        msg.buf = NULL;
         buf = NULL;
-        MuxUpdate out;
-        bool ready = false;
+        MuxUpdate out[MUX_MAX_HEADS];
+        int out_count = 0;
+        MuxWireCopy copies[MUX_MAX_COPY_RECTS];
+        int copy_count;
 
         pthread_mutex_lock(&display->out_lock);
         //////////////////////////////////////////////////////////////////////
@@ -365,13 +633,25 @@ __PUBLIC void *mux_mainloop(void *arg)
         //                     CRITICAL SECTION                            //
         ////////////////////////////////////////////////////////////////////
         ////////////////////////////////////////////////////////////////////
-        ready = display->out_ready;
-        if (ready) {
-            mux_printf("Out update is ready, typed %d!", display->out_update.type);
-            out = display->out_update;
-            display->out_update.type = MSGTYPE_INVALID;
-            display->out_ready = false;
+        for (int i = 0; i < MUX_MAX_HEADS; i++) {
+            MuxHead *head = &display->heads[i];
+            if (head->out_ready) {
+                mux_printf("Out update of head %d is ready, typed %d!", i, head->out_update.type);
+                out[out_count++] = head->out_update;
+                head->out_update.type = MSGTYPE_INVALID;
+                head->out_ready = false;
+            }
+            if (head->tiles.len > 0) {
+                // swapped rather than copied, so both buffers are reused
+                MuxTileBuf tiles = display->remote.send[i];
+                display->remote.send[i] = head->tiles;
+                head->tiles = tiles;
+            }
         }
+        // sent after the update, so the server never takes damage that was synced before a copy for newer
+        copy_count = display->copy_count;
+        memcpy(copies, display->copies, copy_count * sizeof(MuxWireCopy));
+        display->copy_count = 0;
         //////////////////////////////////////////////////////////////////////
         /////////////////////////////////////////////////////////////////////
         //                 END CRITICAL SECTION                            //
@@ -379,17 +659,26 @@ __PUBLIC void *mux_mainloop(void *arg)
         ///////////////////////////////////////////////////////////////////
         pthread_mutex_unlock(&display->out_lock);
 
-        if (ready) {
-            if (out.type != MSGTYPE_INVALID) {
-                len = mux_write_outgoing_msg(&out, &msg);
-                while (mux_0mq_send_msg(msg.buf, len) < 0)
-                    mux_printf_error("Failed to send message");
+        // a head's tiles go after its switch, which sizes the server's copy of the framebuffer for them
+        for (int i = 0; i < out_count; i++)
+            mux_send_update(&out[i]);
+        for (int i = 0; i < MUX_MAX_HEADS; i++) {
+            if (display->remote.send[i].len > 0)
+                mux_remote_send(display, &display->remote.send[i]);
+        }
 
-                g_free(msg.buf);
-                memset(&out, 0, sizeof(MuxUpdate));
-            }
+        if (copy_count > 0) {
+            len = mux_wire_write_copies(display->wire_buf, copies, copy_count);
+            if (mux_0mq_send_msg(display->wire_buf, len) < 0)
+                mux_printf_error("Failed to send display copy");
         }
 
+        if (display->cursor_messages)
+            mux_send_cursor();
+
+        if (display->remote.enabled)
+            mux_remote_poll(display);
+
         // block on receiving messages
         zsock_t *which = (zsock_t *) zpoller_wait(poller, 5); // 5ms timeout
         if (which != display->zmq.socket)  {
@@ -401,6 +690,7 @@ __PUBLIC void *mux_mainloop(void *arg)
             nbytes = mux_0mq_recv_msg(&buf);
             if (nbytes > 0) {
                 // successful recv is successful
+                display->remote.last_heard = g_get_monotonic_time();
                 mux_process_incoming_msg(buf, nbytes);
             }
         }
@@ -413,6 +703,9 @@ __PUBLIC void *mux_mainloop(void *arg)
     mux_send_shutdown_msg();
 
     zsock_destroy(&display->zmq.socket);
+    zmq_msg_close(&display->zmq.in_uuid);
+    zmq_msg_close(&display->zmq.in_data);
+    zmq_msg_close(&display->zmq.uuid_frame);
     mux_printf("zsock_destroy has been called!");
 
     return NULL;
@@ -430,13 +723,16 @@ __PUBLIC void *mux_mainloop(void *arg)
 __PUBLIC MuxDisplay *mux_init_display_struct(const char *uuid)
 {
     display = g_malloc0(sizeof(MuxDisplay));
-    display->shmem_fd = -1;
+    for (int i = 0; i < MUX_MAX_HEADS; i++) {
+        display->heads[i].index = i;
+        display->heads[i].shmem_fd = -1;
+    }
     display->uuid = NULL;
     display->zmq.socket = NULL;
     display->framerate = 30;
 
     if (uuid != NULL) {
-        if (strlen(uuid) != 36) {
+        if (strlen(uuid) != MUX_UUID_LENGTH) {
             mux_printf_error("Invalid UUID");
             free(display);
             return NULL;
@@ -451,6 +747,8 @@ __PUBLIC MuxDisplay *mux_init_display_struct(const char *uuid)
     }
 
     pthread_mutex_init(&display->out_lock, NULL);
+    pthread_mutex_init(&display->cursor.lock, NULL);
+    mux_diff_init();
 
     return display;
 }
@@ -464,10 +762,35 @@ __PUBLIC void mux_register_event_callbacks(InputEventCallbacks cb)
     callbacks = cb;
 }
 
+/**
+ * @func Public API function to back the shared memory regions with transparent hugepages. Cuts down on TLB misses while
+ * copying large framebuffers, at the cost of rounding the region up to 2 MB. Takes effect on the next display switch,
+ * so this should be called before the first one.
+ *
+ * @param enable Whether to use hugepages.
+ */
+__PUBLIC void mux_set_shm_hugepages(bool enable)
+{
+    display->shm_hugepages = enable;
+}
+
 /**
  * @func Should be called to safely cleanup library state. Note that ZeroMQ threads may (will) hang around forever
  * unless they're cleaned up by this method.
  */
 __PUBLIC void mux_cleanup(MuxDisplay *d)
 {
+    for (int i = 0; i < MUX_MAX_HEADS; i++) {
+        mux_shm_free(d, &d->heads[i]);
+        mux_remote_free(&d->heads[i].tiles);
+        mux_remote_free(&d->remote.send[i]);
+    }
+    g_free(d->remote.scratch);
+    d->remote.scratch = NULL;
+    d->remote.scratch_size = 0;
+    g_free(d->zmq.fd_path);
+    d->zmq.fd_path = NULL;
+    g_free(d->msgpack_buf);
+    d->msgpack_buf = NULL;
+    d->msgpack_size = 0;
 }
@@ -0,0 +1,331 @@
+/** @file */
+#include <endian.h>
+#include <lz4.h>
+#include "remote.h"
+#include "0mq.h"
+#include "copy.h"
+#include "wire.h"
+
+/**
+ * @brief Grows a buffer to hold at least needed bytes, doubling it so appending stays cheap.
+ *
+ * @returns Whether the buffer is large enough.
+ */
+static bool mux_remote_grow(uint8_t **data, size_t *size, size_t needed)
+{
+    if (needed <= *size)
+        return true;
+
+    size_t grown_size = MAX(needed, *size * 2);
+    uint8_t *grown = g_try_realloc(*data, grown_size);
+    if (grown == NULL) {
+        mux_printf_error("Could not grow tile buffer to %zu bytes", grown_size);
+        return false;
+    }
+    *data = grown;
+    *size = grown_size;
+    return true;
+}
+
+/**
+ * @func Public API function to connect to an RDPMux server running on another host, instead of registering over DBus
+ * with mux_get_socket_path() and connecting with mux_connect(). The server must have been started with
+ * --remote-endpoint, and the display struct must have been initialized with a UUID.
+ *
+ * There is no shared memory across hosts, so the damaged tiles of the heads' framebuffers are compressed with LZ4 and
+ * sent over the connection by the main loop. The server tells the library how many tiles it may have in flight, and
+ * refreshes are held back while that many haven't been applied yet, so the damage piles up in the tile maps instead of
+ * in the network's buffers. The main loop registers the VM with the server, and does so again if the server goes
+ * silent for longer than MUX_REMOTE_TIMEOUT.
+ *
+ * Copies go out as damage, and updates aren't timed for the server's trace, since the two hosts' clocks can't be
+ * compared.
+ *
+ * @param endpoint The server's remote endpoint, e.g. tcp://rdpmux.example.com:7000. Must stay valid, like the path
+ * passed to mux_connect().
+ * @param id The ID of the VM.
+ * @param port The port the server should run the VM's listener on. Set this to 0 for auto port selection, anything
+ * else must lie in the server's listener port range.
+ * @param server_key The CURVE public key of the server's remote endpoint, Z85 encoded.
+ * @param public_key This host's CURVE public key, Z85 encoded. The server only lets in hosts whose key it was given.
+ * @param secret_key This host's CURVE secret key, Z85 encoded.
+ *
+ * @returns Whether the connection succeeded. The VM is registered once the main loop runs.
+ */
+__PUBLIC bool mux_connect_remote(const char *endpoint, int id, uint16_t port, const char *server_key,
+                                 const char *public_key, const char *secret_key)
+{
+    if (display->uuid == NULL) {
+        mux_printf_error("A remote server can only tell VMs apart by their UUID");
+        return false;
+    }
+    if (server_key == NULL || public_key == NULL || secret_key == NULL) {
+        mux_printf_error("A remote server only lets in hosts authenticated with CURVE");
+        return false;
+    }
+
+    display->vm_id = id;
+    display->remote.enabled = true;
+    display->remote.port = port;
+    display->wire_binary = true;
+    display->cursor_messages = true;
+    display->head_messages = true;
+    // copies need the server to have the source already, which it only has once the tiles got there
+    display->copy_messages = false;
+    display->trace_messages = false;
+
+    if (!mux_connect_curve(endpoint, server_key, public_key, secret_key))
+        return false;
+
+    display->remote.last_heard = g_get_monotonic_time();
+    display->remote.last_register = 0; // the main loop registers right away
+    return true;
+}
+
+/**
+ * @brief Checks whether a refresh sending a number of tiles fits into the window the server gave us. Damage that is
+ * larger than the whole window goes out anyway once nothing is in flight, or it would never go out at all.
+ *
+ * @returns Whether the tiles may be queued.
+ *
+ * @param d The display struct.
+ * @param tiles Number of tiles the refresh sends at most.
+ */
+bool mux_remote_may_send(MuxDisplay *d, uint32_t tiles)
+{
+    uint32_t window = __atomic_load_n(&d->remote.window, __ATOMIC_ACQUIRE);
+    uint32_t in_flight = __atomic_load_n(&d->remote.in_flight, __ATOMIC_RELAXED);
+    return window > 0 && (in_flight == 0 || in_flight + tiles <= window);
+}
+
+/**
+ * @brief Copies a tile of a head's shared framebuffer into the head's tile buffer, for the main loop to compress. The
+ * caller must hold out_lock.
+ *
+ * @returns Whether the tile was queued.
+ */
+static bool mux_remote_queue_tile(MuxDisplay *d, MuxHead *head, int x, int y, int w, int h)
+{
+    int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(head->surface));
+    int pixel_size = (bpp + 7) / 8;
+    int row = w * pixel_size;
+    int raw = row * h;
+    MuxTileBuf *buf = &head->tiles;
+
+    if (!mux_remote_grow(&buf->data, &buf->size, buf->len + sizeof(MuxWireTile) + raw))
+        return false;
+
+    // LZ4 takes a contiguous block, and the tile's rows are spread over the framebuffer
+    buf->len += mux_wire_write_tile(buf->data + buf->len, head->index, x, y, w, h, raw);
+    mux_copy_pixels(buf->data + buf->len, row, 0, 0, w, h, (unsigned char *) head->shm_buffer,
+                    head->damage.width * pixel_size, x, y, bpp);
+    buf->len += raw;
+    buf->tiles++;
+
+    __atomic_add_fetch(&d->remote.in_flight, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * @brief Queues every tile of a list of rectangles of a head for the main loop to compress and send, copied out of the
+ * head's shared framebuffer. The rectangles are in coordinates local to the head, and aligned to MUX_TILE_SIZE except
+ * at the framebuffer's right and bottom edges, as mux_damage_collect() returns them. The caller must hold out_lock.
+ *
+ * If a tile can't be queued, the server is sent every head again on the next refresh, since it would be missing the
+ * tile otherwise.
+ *
+ * @param d The display struct.
+ * @param head The head.
+ * @param rects The rectangles.
+ * @param count Number of rectangles.
+ */
+void mux_remote_queue_rects(MuxDisplay *d, MuxHead *head, const display_update *rects, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        const display_update *r = &rects[i];
+        for (int y = r->y1; y < r->y2; y += MUX_TILE_SIZE) {
+            for (int x = r->x1; x < r->x2; x += MUX_TILE_SIZE) {
+                if (!mux_remote_queue_tile(d, head, x, y, MIN(MUX_TILE_SIZE, r->x2 - x),
+                                           MIN(MUX_TILE_SIZE, r->y2 - y))) {
+                    __atomic_store_n(&d->remote.resync, true, __ATOMIC_RELEASE);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Drops the tiles of a tile buffer, e.g. because they're superseded by a display switch, and returns their
+ * credits.
+ *
+ * @param d The display struct.
+ * @param buf The tile buffer.
+ */
+void mux_remote_reset(MuxDisplay *d, MuxTileBuf *buf)
+{
+    mux_remote_credit(d, buf->tiles);
+    buf->len = 0;
+    buf->tiles = 0;
+}
+
+/**
+ * @brief Sends the DISPLAY_TILES message built in the scratch buffer. A message that couldn't be sent leaves the server
+ * without its tiles, so it's sent every head again on the next refresh.
+ *
+ * @param d The display struct.
+ * @param len Size of the message in bytes.
+ * @param count Number of tiles in the message.
+ */
+static void mux_remote_flush(MuxDisplay *d, size_t len, uint16_t count)
+{
+    mux_wire_write_tiles_header(d->remote.scratch, count);
+    if (mux_0mq_send_msg(d->remote.scratch, len) < 0) {
+        mux_printf_error("Failed to send tiles");
+        mux_remote_credit(d, count);
+        __atomic_store_n(&d->remote.resync, true, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Compresses the tiles of a tile buffer taken out of a head with LZ4, sends them as DISPLAY_TILES messages of
+ * up to MUX_REMOTE_MAX_TILES tiles each, and empties the buffer. Runs on the main loop, so the display thread only
+ * ever copies tiles, which in QEMU it does with the big lock held.
+ *
+ * A tile that couldn't be compressed or sent leaves the server without it, so it's sent every head again on the next
+ * refresh.
+ *
+ * @param d The display struct.
+ * @param buf The tile buffer.
+ */
+void mux_remote_send(MuxDisplay *d, MuxTileBuf *buf)
+{
+    size_t pos = 0;
+    size_t len = sizeof(MuxWireHeader);
+    uint16_t count = 0;
+
+    while (pos < buf->len) {
+        MuxWireTile tile;
+        memcpy(&tile, buf->data + pos, sizeof(tile));
+        pos += sizeof(tile);
+        int raw = (int) le32toh(tile.size);
+        const char *pixels = (const char *) buf->data + pos;
+        pos += raw;
+
+        int bound = LZ4_compressBound(raw);
+        int size = 0;
+        if (mux_remote_grow(&d->remote.scratch, &d->remote.scratch_size, len + sizeof(MuxWireTile) + bound)) {
+            size = LZ4_compress_default(pixels, (char *) d->remote.scratch + len + sizeof(MuxWireTile), raw, bound);
+            if (size <= 0)
+                mux_printf_error("Could not compress tile at %u,%u of head %u", le32toh(tile.x), le32toh(tile.y),
+                                 le32toh(tile.head));
+        }
+
+        if (size > 0) {
+            tile.size = htole32(size);
+            memcpy(d->remote.scratch + len, &tile, sizeof(tile));
+            len += sizeof(tile) + size;
+            count++;
+        } else {
+            mux_remote_credit(d, 1);
+            __atomic_store_n(&d->remote.resync, true, __ATOMIC_RELEASE);
+        }
+
+        if (count > 0 && (count == MUX_REMOTE_MAX_TILES || pos >= buf->len)) {
+            mux_remote_flush(d, len, count);
+            len = sizeof(MuxWireHeader);
+            count = 0;
+        }
+    }
+
+    buf->len = 0;
+    buf->tiles = 0;
+}
+
+/**
+ * @brief Registers the VM with the remote server until it answers, and makes sure it's still there afterwards. Runs on
+ * every pass of the main loop.
+ *
+ * Until the server sent a REMOTE_RESYNC, the VM registers every MUX_REMOTE_REGISTER_INTERVAL. After that, it sends a
+ * heartbeat whenever the server was quiet for MUX_REMOTE_HEARTBEAT_INTERVAL, which the server answers. A server that
+ * stays quiet for MUX_REMOTE_TIMEOUT restarted or can't be reached anymore, and the VM registers from scratch.
+ *
+ * @param d The display struct.
+ */
+void mux_remote_poll(MuxDisplay *d)
+{
+    gint64 now = g_get_monotonic_time();
+    uint32_t window = __atomic_load_n(&d->remote.window, __ATOMIC_RELAXED);
+    uint32_t flags;
+
+    if (window > 0 && now - d->remote.last_heard > MUX_REMOTE_TIMEOUT * G_GINT64_CONSTANT(1000)) {
+        // a restarted server doesn't know our handle, and wants every head again
+        mux_printf_error("Remote server went silent, registering again");
+        __atomic_store_n(&d->remote.window, 0, __ATOMIC_RELAXED);
+        d->zmq.handle = 0;
+        d->remote.last_register = 0;
+        window = 0;
+    }
+
+    if (window == 0) {
+        if (now - d->remote.last_register < MUX_REMOTE_REGISTER_INTERVAL * G_GINT64_CONSTANT(1000))
+            return;
+        flags = MUX_REMOTE_REGISTER_RESYNC;
+    } else {
+        if (now - d->remote.last_heard < MUX_REMOTE_HEARTBEAT_INTERVAL * G_GINT64_CONSTANT(1000) ||
+            now - d->remote.last_register < MUX_REMOTE_HEARTBEAT_INTERVAL * G_GINT64_CONSTANT(1000))
+            return;
+        flags = 0;
+    }
+
+    d->remote.last_register = now;
+    size_t len = mux_wire_write_register(d->wire_buf, flags);
+    if (mux_0mq_send_msg(d->wire_buf, len) < 0)
+        mux_printf_error("Failed to register with remote server");
+}
+
+/**
+ * @brief Takes tiles the server applied out of the ones in flight.
+ *
+ * The count never drops below 0: tiles sent before the last REMOTE_RESYNC are credited although they don't count
+ * anymore.
+ *
+ * @param d The display struct.
+ * @param credits Number of tiles applied.
+ */
+void mux_remote_credit(MuxDisplay *d, uint32_t credits)
+{
+    uint32_t in_flight = __atomic_load_n(&d->remote.in_flight, __ATOMIC_RELAXED);
+    uint32_t next;
+
+    do {
+        next = in_flight > credits ? in_flight - credits : 0;
+    } while (!__atomic_compare_exchange_n(&d->remote.in_flight, &in_flight, next, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Starts over with a window the server gave us, because it lost track of the VM's heads or never had them:
+ * nothing is in flight anymore, and every head is sent again on the next refresh.
+ *
+ * @param d The display struct.
+ * @param window Number of tiles the VM may have in flight.
+ */
+void mux_remote_resync(MuxDisplay *d, uint32_t window)
+{
+    __atomic_store_n(&d->remote.in_flight, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->remote.window, MAX(window, 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&d->remote.resync, true, __ATOMIC_RELEASE);
+    mux_printf("Remote server granted a window of %u tiles", window);
+}
+
+/**
+ * @brief Releases the memory held by a tile buffer.
+ *
+ * @param buf The tile buffer.
+ */
+void mux_remote_free(MuxTileBuf *buf)
+{
+    g_free(buf->data);
+    memset(buf, 0, sizeof(MuxTileBuf));
+}
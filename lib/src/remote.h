@@ -0,0 +1,32 @@
+/** @file */
+
+#ifndef SHIM_REMOTE_H
+#define SHIM_REMOTE_H
+
+#include "common.h"
+
+bool mux_connect_remote(const char *endpoint, int id, uint16_t port, const char *server_key, const char *public_key,
+                        const char *secret_key);
+
+#ifdef USE_REMOTE
+bool mux_remote_may_send(MuxDisplay *d, uint32_t tiles);
+void mux_remote_queue_rects(MuxDisplay *d, MuxHead *head, const display_update *rects, uint32_t count);
+void mux_remote_reset(MuxDisplay *d, MuxTileBuf *buf);
+void mux_remote_send(MuxDisplay *d, MuxTileBuf *buf);
+void mux_remote_poll(MuxDisplay *d);
+void mux_remote_credit(MuxDisplay *d, uint32_t credits);
+void mux_remote_resync(MuxDisplay *d, uint32_t window);
+void mux_remote_free(MuxTileBuf *buf);
+#else
+// without LZ4 there are no remote servers, so display->remote.enabled is never set and none of these get any work
+static inline bool mux_remote_may_send(MuxDisplay *d, uint32_t tiles) { return true; }
+static inline void mux_remote_queue_rects(MuxDisplay *d, MuxHead *head, const display_update *rects, uint32_t count) {}
+static inline void mux_remote_reset(MuxDisplay *d, MuxTileBuf *buf) {}
+static inline void mux_remote_send(MuxDisplay *d, MuxTileBuf *buf) {}
+static inline void mux_remote_poll(MuxDisplay *d) {}
+static inline void mux_remote_credit(MuxDisplay *d, uint32_t credits) {}
+static inline void mux_remote_resync(MuxDisplay *d, uint32_t window) {}
+static inline void mux_remote_free(MuxTileBuf *buf) {}
+#endif
+
+#endif //SHIM_REMOTE_H
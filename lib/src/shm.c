@@ -0,0 +1,280 @@
+/** @file */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm.h"
+
+/**
+ * @brief Longest name of a shared memory region, NUL included.
+ */
+#define MUX_SHM_NAME_SIZE 32
+
+/**
+ * @brief Writes the name of a head's shared memory region into buf. Head 0 keeps the name the region had before there
+ * were heads.
+ *
+ * @param d The display struct.
+ * @param head The head.
+ * @param buf Output buffer.
+ * @param len Size of buf.
+ */
+static void mux_shm_name(MuxDisplay *d, MuxHead *head, char *buf, size_t len)
+{
+    if (head->index == 0)
+        snprintf(buf, len, "/%d.rdpmux", d->vm_id);
+    else
+        snprintf(buf, len, "/%d.%d.rdpmux", d->vm_id, head->index);
+}
+
+/**
+ * @brief Fills in a freshly mapped shared memory header.
+ *
+ * @param header The header at the start of the shared memory region.
+ */
+void mux_shm_init_header(MuxShmHeader *header)
+{
+    memset(header, 0, MUX_SHM_HEADER_SIZE);
+    header->version = RDPMUX_PROTOCOL_VERSION;
+    header->header_size = MUX_SHM_HEADER_SIZE;
+
+    // publish the magic number last, so the server can't mistake a half-initialized header for a valid one
+    __atomic_store_n(&header->magic, MUX_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Opens a write section on the shared framebuffer.
+ *
+ * Makes the seqlock counter odd, which tells the server that whatever it reads from now on may be torn. Must be
+ * followed by mux_shm_write_end(). Only one thread may write at a time; in practice that is the hypervisor's display
+ * thread.
+ *
+ * @param header The header at the start of the shared memory region.
+ */
+void mux_shm_write_begin(MuxShmHeader *header)
+{
+    uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    // keep the framebuffer writes that follow from becoming visible before the counter is odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Closes a write section opened by mux_shm_write_begin().
+ *
+ * Makes the seqlock counter even again, publishing everything written to the framebuffer in the meantime.
+ *
+ * @param header The header at the start of the shared memory region.
+ */
+void mux_shm_write_end(MuxShmHeader *header)
+{
+    uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates a sealed memfd to back the shared memory region.
+ *
+ * The memfd has no name, so nothing is left behind if the hypervisor crashes, and it is sealed against shrinking and
+ * growing, so the server can map it without having to worry about the file being truncated under its feet.
+ *
+ * @returns The new file descriptor, or -1 if memfds aren't available.
+ *
+ * @param d The display struct.
+ * @param shm_size Size of the region in bytes.
+ */
+static int mux_shm_create_memfd(MuxDisplay *d, size_t shm_size)
+{
+#ifdef MFD_ALLOW_SEALING
+    unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    int fd = -1;
+
+#ifdef MFD_HUGETLB
+    // real hugetlb pages if the host has a pool set up, transparent hugepages through madvise() otherwise
+    if (d->shm_hugepages)
+        fd = memfd_create("rdpmux", flags | MFD_HUGETLB);
+#endif
+    if (fd < 0)
+        fd = memfd_create("rdpmux", flags);
+    if (fd < 0) {
+        mux_printf_error("memfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, shm_size)) {
+        mux_printf_error("ftruncate of new memfd failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+        mux_printf_error("Sealing memfd failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief Creates a named POSIX shm object to back the shared memory region. The server opens it by name.
+ *
+ * @returns The new file descriptor, or -1 on failure.
+ *
+ * @param d The display struct.
+ * @param head The head the region is for.
+ * @param shm_size Size of the region in bytes.
+ */
+static int mux_shm_create_named(MuxDisplay *d, MuxHead *head, size_t shm_size)
+{
+    char name[MUX_SHM_NAME_SIZE];
+    mux_shm_name(d, head, name, sizeof(name));
+
+    int shim_fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IRGRP | S_IROTH);
+    if (shim_fd < 0) {
+        mux_printf_error("shm_open failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // resize the newly created shm region to the size of the framebuffer
+    if (ftruncate(shim_fd, shm_size)) {
+        mux_printf_error("ftruncate of new buffer failed: %s", strerror(errno));
+        close(shim_fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    return shim_fd;
+}
+
+/**
+ * @brief Makes sure the shared memory region of a head is sized for a framebuffer of fb_size bytes.
+ *
+ * The region is the header plus the framebuffer, rounded up to a whole page, or to a whole hugepage if hugepages are
+ * enabled. If a region of the right size already exists it is kept. Otherwise the old region is retired and a new one
+ * is created, as a memfd if the server has a descriptor socket or is a remote one, and under the same name as before
+ * if not. The old
+ * region's seqlock counter is left odd, so the server stops copying from its old mapping
+ * until it has processed the display switch announcing the new size, and its pages are freed as soon as the server
+ * unmaps it. Resizing in place isn't an option, as shrinking the file would turn the server's mapping into a SIGBUS
+ * trap.
+ *
+ * @returns Whether a region of the right size is mapped.
+ *
+ * @param d The display struct.
+ * @param head The head.
+ * @param fb_size Size of the framebuffer in bytes.
+ */
+bool mux_shm_resize(MuxDisplay *d, MuxHead *head, size_t fb_size)
+{
+    size_t align = d->shm_hugepages ? MUX_SHM_HUGEPAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+    size_t shm_size = (MUX_SHM_HEADER_SIZE + fb_size + align - 1) / align * align;
+    char name[MUX_SHM_NAME_SIZE];
+
+    if (head->shm_header != NULL && head->shm_size == shm_size)
+        return true;
+
+    if (head->shm_header != NULL) {
+        // never closed, so the server won't trust anything it reads from this region again
+        mux_shm_write_begin(head->shm_header);
+    }
+    mux_shm_free(d, head);
+
+    // memfds can only be handed to the server over its descriptor socket. A remote server never maps the region, so
+    // it doesn't need a name then either.
+    bool memfd = false;
+    int shim_fd = -1;
+    if (d->zmq.fd_path != NULL || d->remote.enabled) {
+        shim_fd = mux_shm_create_memfd(d, shm_size);
+        memfd = shim_fd >= 0;
+    }
+    if (shim_fd < 0)
+        shim_fd = mux_shm_create_named(d, head, shm_size);
+    if (shim_fd < 0)
+        return false;
+
+    void *shm_region = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shim_fd, 0);
+    if (shm_region == MAP_FAILED) {
+        mux_printf_error("mmap failed: %s", strerror(errno));
+        close(shim_fd);
+        if (!memfd) {
+            mux_shm_name(d, head, name, sizeof(name));
+            shm_unlink(name);
+        }
+        return false;
+    }
+
+#ifdef MADV_HUGEPAGE
+    // only takes effect if the host allows hugepages on shmem (shmem_enabled set to advise or within_size)
+    if (d->shm_hugepages && madvise(shm_region, shm_size, MADV_HUGEPAGE))
+        mux_printf("madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+#endif
+
+    head->shmem_fd = shim_fd;
+    head->shm_memfd = memfd;
+    head->shm_size = shm_size;
+    head->shm_header = (MuxShmHeader *) shm_region;
+    head->shm_buffer = (unsigned char *) shm_region + MUX_SHM_HEADER_SIZE;
+    mux_shm_init_header(head->shm_header);
+
+    mux_printf("Mapped %zu byte %s shm region for head %d", shm_size, memfd ? "memfd" : "named", head->index);
+    return true;
+}
+
+/**
+ * @brief Unmaps and removes the shared memory region of a head, if there is one.
+ *
+ * The server's mapping stays valid until it unmaps it, at which point the memory is returned to the system.
+ *
+ * @param d The display struct.
+ * @param head The head.
+ */
+void mux_shm_free(MuxDisplay *d, MuxHead *head)
+{
+    char name[MUX_SHM_NAME_SIZE];
+
+    if (head->shm_header == NULL)
+        return;
+
+    munmap(head->shm_header, head->shm_size);
+    close(head->shmem_fd);
+    if (!head->shm_memfd) {
+        mux_shm_name(d, head, name, sizeof(name));
+        shm_unlink(name);
+    }
+
+    head->shm_header = NULL;
+    head->shm_buffer = NULL;
+    head->shm_size = 0;
+    head->shm_memfd = false;
+    head->shmem_fd = -1;
+}
+
+/**
+ * @brief Gives the pages of a head's framebuffer back to the system, keeping the region and its header. The
+ * framebuffer reads as black until it's written to again.
+ *
+ * Only worth it while nobody is connected: the server doesn't read from the region then, and the whole framebuffer has
+ * to be synced again before anybody sees it.
+ *
+ * @param head The head.
+ */
+void mux_shm_release(MuxHead *head)
+{
+    if (head->shm_header == NULL)
+        return;
+
+#ifdef MADV_REMOVE
+    // punches a hole into the memfd or shm object, unlike MADV_DONTNEED, which would only drop our page tables
+    mux_shm_write_begin(head->shm_header);
+    if (madvise(head->shm_buffer, head->shm_size - MUX_SHM_HEADER_SIZE, MADV_REMOVE))
+        mux_printf("madvise(MADV_REMOVE) failed: %s", strerror(errno));
+    mux_shm_write_end(head->shm_header);
+#endif
+}
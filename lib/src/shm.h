@@ -0,0 +1,15 @@
+/** @file */
+
+#ifndef SHIM_SHM_H
+#define SHIM_SHM_H
+
+#include "common.h"
+
+void mux_shm_init_header(MuxShmHeader *header);
+void mux_shm_write_begin(MuxShmHeader *header);
+void mux_shm_write_end(MuxShmHeader *header);
+bool mux_shm_resize(MuxDisplay *d, MuxHead *head, size_t fb_size);
+void mux_shm_free(MuxDisplay *d, MuxHead *head);
+void mux_shm_release(MuxHead *head);
+
+#endif //SHIM_SHM_H
@@ -0,0 +1,371 @@
+/** @file */
+#include <endian.h>
+#include "wire.h"
+#include "remote.h"
+
+/**
+ * @brief Checks whether a received message is a binary message rather than a msgpack one.
+ *
+ * msgpack messages always start with an array header, whose first byte has the high bit set. The first byte of a
+ * binary message is the low byte of its type, which never does.
+ *
+ * @returns Whether buf holds a binary message.
+ *
+ * @param buf The received message.
+ * @param nbytes Size of buf in bytes.
+ */
+bool mux_wire_is_binary(const void *buf, size_t nbytes)
+{
+    return nbytes >= sizeof(MuxWireHeader) && (((const uint8_t *) buf)[0] & 0x80) == 0;
+}
+
+/**
+ * @brief Gets the time stamps of a MuxWireTrace are taken from: the low 32 bits of CLOCK_MONOTONIC in µs, which is
+ * what g_get_monotonic_time() reads on Linux.
+ */
+uint32_t mux_now_us(void)
+{
+    return (uint32_t) g_get_monotonic_time();
+}
+
+/**
+ * @brief Writes the header of a binary message.
+ *
+ * @returns Pointer to the first byte after the header.
+ */
+static uint8_t *mux_wire_write_header(uint8_t *buf, uint16_t type, uint16_t count)
+{
+    MuxWireHeader header;
+    header.type = htole16(type);
+    header.count = htole16(count);
+    memcpy(buf, &header, sizeof(header));
+    return buf + sizeof(header);
+}
+
+/**
+ * @brief Writes a rectangle of a binary display update.
+ *
+ * @returns Pointer to the first byte after the rectangle.
+ */
+static uint8_t *mux_wire_write_rect(uint8_t *buf, display_update *u)
+{
+    MuxWireRect rect;
+    rect.x = htole32(u->x1);
+    rect.y = htole32(u->y1);
+    rect.w = htole32(u->x2 - u->x1);
+    rect.h = htole32(u->y2 - u->y1);
+    memcpy(buf, &rect, sizeof(rect));
+    return buf + sizeof(rect);
+}
+
+/**
+ * @brief Serializes an outgoing update to a binary message.
+ *
+ * Unlike mux_write_outgoing_msg(), this doesn't allocate anything: the message is built in the buffer passed in, for
+ * which MUX_WIRE_MAX_SIZE bytes are always enough.
+ *
+ * @returns Size of the message in bytes, 0 if it couldn't be serialized.
+ *
+ * @param update The update to serialize. NULL means a shutdown message.
+ * @param buf Buffer to write the message to.
+ * @param size Size of buf in bytes.
+ */
+size_t mux_wire_write_msg(MuxUpdate *update, uint8_t *buf, size_t size)
+{
+    uint8_t *pos = buf;
+
+    if (size < MUX_WIRE_MAX_SIZE) {
+        mux_printf_error("Buffer too small for binary message");
+        return 0;
+    }
+
+    if (update == NULL) {
+        pos = mux_wire_write_header(pos, SHUTDOWN, 0);
+    } else if (update->type == DISPLAY_UPDATE) {
+        pos = mux_wire_write_header(pos, DISPLAY_UPDATE, 1);
+        pos = mux_wire_write_rect(pos, &update->disp_update);
+    } else if (update->type == DISPLAY_UPDATE_RECTS) {
+        display_update_rects *u = &update->disp_rects;
+        uint32_t count = MIN(u->count, MUX_MAX_UPDATE_RECTS);
+
+        pos = mux_wire_write_header(pos, DISPLAY_UPDATE_RECTS, count);
+        for (uint32_t i = 0; i < count; i++)
+            pos = mux_wire_write_rect(pos, &u->rects[i]);
+
+        if (display->trace_messages) {
+            // stamped here rather than when the message is queued, so time spent waiting for the main loop counts
+            MuxWireTrace trace;
+            trace.seq = htole32(u->seq);
+            trace.refresh_us = htole32(u->refresh_us);
+            trace.sent_us = htole32(mux_now_us());
+            memcpy(pos, &trace, sizeof(trace));
+            pos += sizeof(trace);
+        }
+    } else if (update->type == DISPLAY_SWITCH) {
+        MuxWireSwitch sw;
+        sw.format = htole32(update->disp_switch.format);
+        sw.w = htole32(update->disp_switch.w);
+        sw.h = htole32(update->disp_switch.h);
+        sw.shm_size = htole32(update->disp_switch.shm_size);
+
+        pos = mux_wire_write_header(pos, DISPLAY_SWITCH, 1);
+        memcpy(pos, &sw, sizeof(sw));
+        pos += sizeof(sw);
+    } else if (update->type == HEAD_SWITCH) {
+        MuxWireHeadSwitch sw;
+        sw.head = htole32(update->disp_switch.head);
+        sw.x = htole32(update->disp_switch.x);
+        sw.y = htole32(update->disp_switch.y);
+        sw.format = htole32(update->disp_switch.format);
+        sw.w = htole32(update->disp_switch.w);
+        sw.h = htole32(update->disp_switch.h);
+        sw.shm_size = htole32(update->disp_switch.shm_size);
+
+        pos = mux_wire_write_header(pos, HEAD_SWITCH, 1);
+        memcpy(pos, &sw, sizeof(sw));
+        pos += sizeof(sw);
+    } else {
+        mux_printf_error("Unknown message type queued for writing!");
+        return 0;
+    }
+
+    return pos - buf;
+}
+
+/**
+ * @brief Serializes a cursor shape to a binary CURSOR_DEFINE message.
+ *
+ * @returns Size of the message in bytes.
+ *
+ * @param buf Buffer to write the message to, MUX_WIRE_CURSOR_MAX_SIZE bytes are always enough.
+ * @param hot_x X-coordinate of the hotspot in the shape, in px.
+ * @param hot_y Y-coordinate of the hotspot in the shape, in px.
+ * @param w Width of the shape in px, MUX_CURSOR_MAX_SIZE at most.
+ * @param h Height of the shape in px, MUX_CURSOR_MAX_SIZE at most.
+ * @param pixels w * h a8r8g8b8 pixels of the shape with straight alpha, row by row.
+ */
+size_t mux_wire_write_cursor(uint8_t *buf, int hot_x, int hot_y, int w, int h, const uint32_t *pixels)
+{
+    uint8_t *pos = mux_wire_write_header(buf, CURSOR_DEFINE, 1);
+    MuxWireCursor cursor;
+    cursor.hot_x = htole32(hot_x);
+    cursor.hot_y = htole32(hot_y);
+    cursor.w = htole32(w);
+    cursor.h = htole32(h);
+    memcpy(pos, &cursor, sizeof(cursor));
+    pos += sizeof(cursor);
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    memcpy(pos, pixels, (size_t) w * h * sizeof(uint32_t));
+    pos += (size_t) w * h * sizeof(uint32_t);
+#else
+    for (int i = 0; i < w * h; i++) {
+        uint32_t pixel = htole32(pixels[i]);
+        memcpy(pos, &pixel, sizeof(pixel));
+        pos += sizeof(pixel);
+    }
+#endif
+
+    return pos - buf;
+}
+
+/**
+ * @brief Serializes a cursor position to a binary CURSOR_MOVE message.
+ *
+ * @returns Size of the message in bytes.
+ *
+ * @param buf Buffer to write the message to, MUX_WIRE_MAX_SIZE bytes are always enough.
+ * @param pos The position, in host byte order.
+ */
+size_t mux_wire_write_cursor_pos(uint8_t *buf, const MuxWireCursorPos *pos)
+{
+    uint8_t *p = mux_wire_write_header(buf, CURSOR_MOVE, 1);
+    MuxWireCursorPos wire;
+    wire.x = htole32(pos->x);
+    wire.y = htole32(pos->y);
+    wire.visible = htole32(pos->visible);
+    memcpy(p, &wire, sizeof(wire));
+    return p + sizeof(wire) - buf;
+}
+
+/**
+ * @brief Serializes copies within the framebuffer to a binary DISPLAY_COPY message.
+ *
+ * @returns Size of the message in bytes.
+ *
+ * @param buf Buffer to write the message to, MUX_WIRE_MAX_SIZE bytes are always enough.
+ * @param copies The copies, in host byte order.
+ * @param count Number of copies, MUX_MAX_COPY_RECTS at most.
+ */
+size_t mux_wire_write_copies(uint8_t *buf, const MuxWireCopy *copies, int count)
+{
+    uint8_t *pos = mux_wire_write_header(buf, DISPLAY_COPY, count);
+    for (int i = 0; i < count; i++) {
+        MuxWireCopy copy;
+        copy.src_x = htole32(copies[i].src_x);
+        copy.src_y = htole32(copies[i].src_y);
+        copy.dst_x = htole32(copies[i].dst_x);
+        copy.dst_y = htole32(copies[i].dst_y);
+        copy.w = htole32(copies[i].w);
+        copy.h = htole32(copies[i].h);
+        memcpy(pos, &copy, sizeof(copy));
+        pos += sizeof(copy);
+    }
+    return pos - buf;
+}
+
+/**
+ * @brief Serializes a REMOTE_REGISTER message, which registers the VM with a remote server or tells it we're still
+ * there.
+ *
+ * @returns Size of the message in bytes.
+ *
+ * @param buf Buffer to write the message to, MUX_WIRE_MAX_SIZE bytes are always enough.
+ * @param flags MUX_REMOTE_REGISTER_RESYNC to ask the server for a REMOTE_RESYNC, 0 for a heartbeat.
+ */
+size_t mux_wire_write_register(uint8_t *buf, uint32_t flags)
+{
+    uint8_t *pos = mux_wire_write_header(buf, REMOTE_REGISTER, 1);
+    MuxWireRemoteRegister reg;
+    reg.version = htole32(RDPMUX_PROTOCOL_VERSION);
+    reg.id = htole32(display->vm_id);
+    reg.port = htole32(display->remote.port);
+    reg.flags = htole32(flags);
+    memcpy(pos, &reg, sizeof(reg));
+    return pos + sizeof(reg) - buf;
+}
+
+/**
+ * @brief Writes the header of a DISPLAY_TILES message, which may be rewritten as tiles are added to the message.
+ *
+ * @param buf Buffer to write the header to.
+ * @param count Number of tiles in the message, MUX_REMOTE_MAX_TILES at most.
+ */
+void mux_wire_write_tiles_header(uint8_t *buf, uint16_t count)
+{
+    mux_wire_write_header(buf, DISPLAY_TILES, count);
+}
+
+/**
+ * @brief Writes the record of a tile of a DISPLAY_TILES message. Its compressed pixels go right after it.
+ *
+ * @returns Size of the record in bytes.
+ *
+ * @param buf Buffer to write the record to.
+ * @param head Index of the head the tile is of.
+ * @param x X-coordinate of the tile's top left corner on the head, in px.
+ * @param y Y-coordinate of the tile's top left corner on the head, in px.
+ * @param w Width of the tile in px.
+ * @param h Height of the tile in px.
+ * @param size Size of the compressed pixels in bytes.
+ */
+size_t mux_wire_write_tile(uint8_t *buf, int head, int x, int y, int w, int h, uint32_t size)
+{
+    MuxWireTile tile;
+    tile.head = htole32(head);
+    tile.x = htole32(x);
+    tile.y = htole32(y);
+    tile.w = htole32(w);
+    tile.h = htole32(h);
+    tile.size = htole32(size);
+    memcpy(buf, &tile, sizeof(tile));
+    return sizeof(tile);
+}
+
+/**
+ * @brief Fires the callback matching a single input event of a binary message.
+ */
+static void mux_wire_dispatch_input(const MuxWireInput *input)
+{
+    uint16_t type = le16toh(input->type);
+
+    if (type == KEYBOARD) {
+        callbacks.mux_receive_kb(le16toh(input->a), le16toh(input->b));
+    } else if (type == MOUSE) {
+        callbacks.mux_receive_mouse(le16toh(input->a), le16toh(input->b), le16toh(input->c));
+    } else {
+        mux_printf_error("Invalid input event type %u", type);
+    }
+}
+
+/**
+ * @brief Deserializes an incoming binary message and invokes the right callbacks for it.
+ *
+ * Nothing is allocated or copied beyond single records; records are read straight out of buf.
+ *
+ * @param buf The received message. Must have passed mux_wire_is_binary().
+ * @param nbytes Size of buf in bytes.
+ */
+void mux_wire_process_msg(const void *buf, size_t nbytes)
+{
+    const uint8_t *pos = (const uint8_t *) buf;
+    MuxWireHeader header;
+    uint16_t type, count;
+
+    memcpy(&header, pos, sizeof(header));
+    pos += sizeof(header);
+    nbytes -= sizeof(header);
+    type = le16toh(header.type);
+    count = le16toh(header.count);
+
+    switch (type) {
+        case MOUSE:
+        case KEYBOARD:
+        case INPUT_BATCH:
+            mux_printf("Processing incoming binary input msg");
+            if (nbytes < (size_t) count * sizeof(MuxWireInput)) {
+                mux_printf_error("Truncated input message");
+                return;
+            }
+            for (uint16_t i = 0; i < count; i++) {
+                MuxWireInput input;
+                memcpy(&input, pos + i * sizeof(input), sizeof(input));
+                mux_wire_dispatch_input(&input);
+            }
+            break;
+        case DISPLAY_UPDATE_COMPLETE: {
+            MuxWireAck ack;
+            if (count < 1 || nbytes < sizeof(ack)) {
+                mux_printf_error("Truncated update complete message");
+                return;
+            }
+            memcpy(&ack, pos, sizeof(ack));
+            if (le32toh(ack.success) != 1) {
+                mux_printf_error("Unsuccessful update_complete");
+                return;
+            }
+            // read by the hypervisor's refresh tick, which runs on a different thread than us
+            __atomic_store_n(&display->framerate, le32toh(ack.framerate), __ATOMIC_RELAXED);
+            break;
+        }
+        case VM_HANDLE: {
+            MuxWireHandle handle;
+            if (count < 1 || nbytes < sizeof(handle)) {
+                mux_printf_error("Truncated VM handle message");
+                return;
+            }
+            memcpy(&handle, pos, sizeof(handle));
+            // sent and received on this thread only, so the next message already goes out with the handle
+            display->zmq.handle = le32toh(handle.handle);
+            mux_printf("Server assigned VM handle %u", display->zmq.handle);
+            break;
+        }
+        case REMOTE_CREDIT:
+        case REMOTE_RESYNC: {
+            MuxWireCredit credit;
+            if (!display->remote.enabled || count < 1 || nbytes < sizeof(credit)) {
+                mux_printf_error("Unexpected or truncated credit message");
+                return;
+            }
+            memcpy(&credit, pos, sizeof(credit));
+            if (type == REMOTE_CREDIT)
+                mux_remote_credit(display, le32toh(credit.credits));
+            else
+                mux_remote_resync(display, le32toh(credit.credits));
+            break;
+        }
+        default:
+            mux_printf_error("Invalid message type");
+            break;
+    }
+}
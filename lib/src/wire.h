@@ -0,0 +1,19 @@
+/** @file */
+
+#ifndef SHIM_WIRE_H
+#define SHIM_WIRE_H
+
+#include "common.h"
+
+uint32_t mux_now_us(void);
+bool mux_wire_is_binary(const void *buf, size_t nbytes);
+size_t mux_wire_write_msg(MuxUpdate *update, uint8_t *buf, size_t size);
+size_t mux_wire_write_cursor(uint8_t *buf, int hot_x, int hot_y, int w, int h, const uint32_t *pixels);
+size_t mux_wire_write_cursor_pos(uint8_t *buf, const MuxWireCursorPos *pos);
+size_t mux_wire_write_copies(uint8_t *buf, const MuxWireCopy *copies, int count);
+size_t mux_wire_write_register(uint8_t *buf, uint32_t flags);
+void mux_wire_write_tiles_header(uint8_t *buf, uint16_t count);
+size_t mux_wire_write_tile(uint8_t *buf, int head, int x, int y, int w, int h, uint32_t size);
+void mux_wire_process_msg(const void *buf, size_t nbytes);
+
+#endif //SHIM_WIRE_H
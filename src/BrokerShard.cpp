@@ -0,0 +1,692 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <msgpack/object.hpp>
+#include <msgpack/unpack.hpp>
+#include "BrokerShard.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <endian.h>
+#include <msgpack/pack.hpp>
+
+/**
+ * @brief Length of the UUID the VM prefixes its messages on the descriptor socket with.
+ */
+#define UUID_LENGTH 36
+
+/**
+ * @brief Length of the handle a VM addresses its messages with once it knows it, little-endian.
+ */
+#define HANDLE_LENGTH 4
+
+/**
+ * @brief Number of input events a shard can hold before they're sent. Way more than anybody can type or move the mouse
+ * in the time it takes the shard to wake up.
+ */
+#define INPUT_QUEUE_SIZE 4096
+
+/**
+ * @brief Most input events sent to a VM in a single INPUT_BATCH message. Bounded by what fits in wire_buf.
+ */
+#define MAX_INPUT_BATCH WIRE_MAX_INPUT_BATCH
+
+/**
+ * @brief Milliseconds a VM has to send its message after connecting to the descriptor socket. librdpmux sends it right
+ * after connecting, and tries again with a fresh connection if it can't, so connections still quiet by then are closed.
+ */
+#define FD_CONNECTION_TIMEOUT 1000
+
+/**
+ * @brief Most connections to the descriptor socket waiting for their message at once.
+ */
+#define MAX_FD_CONNECTIONS 64
+
+/**
+ * @brief Creates the listening Unix socket VMs pass their shared memory descriptors through.
+ *
+ * A leading '@' in path denotes the abstract socket namespace, same as for ZeroMQ ipc:// endpoints.
+ *
+ * @returns The listening socket, or -1 if it couldn't be set up.
+ *
+ * @param path Where to bind the socket.
+ */
+static int bind_fd_socket(const std::string &path)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG(WARNING) << "Descriptor socket path " << path << " is too long";
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    addr_len = offsetof(struct sockaddr_un, sun_path) + path.size();
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0'; // abstract namespace, the name isn't NUL-terminated
+    else
+        addr_len++;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOG(WARNING) << "Could not create descriptor socket: " << strerror(errno);
+        return -1;
+    }
+
+    if (bind(sock, (struct sockaddr *) &addr, addr_len) < 0 || listen(sock, 16) < 0) {
+        LOG(WARNING) << "Could not bind descriptor socket " << path << ": " << strerror(errno);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Endpoint ZeroMQ sends the ZAP requests of a context to.
+ */
+#define ZAP_ENDPOINT "inproc://zeromq.zap.01"
+
+BrokerShard::BrokerShard(zmq::context_t &context, std::string endpoint, const CurveKeys &keys)
+        : endpoint(endpoint),
+          zsocket(context, ZMQ_ROUTER),
+          stop(false),
+          input_queue(INPUT_QUEUE_SIZE),
+          received(0),
+          sent(0),
+          dropped(0)
+{
+    zsocket.setsockopt(ZMQ_ROUTER_MANDATORY, 1);
+    if (keys.Enabled()) {
+        // handshakes wait for the ZAP handler, which has to be there before anybody can connect
+        zap_socket.reset(new zmq::socket_t(context, ZMQ_REP));
+        zap_socket->bind(ZAP_ENDPOINT);
+        client_keys = keys.client_keys;
+
+        int server = 1;
+        zsocket.setsockopt(ZMQ_CURVE_SERVER, &server, sizeof(server));
+        zsocket.setsockopt(ZMQ_CURVE_SECRETKEY, keys.secret_key.c_str(), keys.secret_key.size());
+        zsocket.setsockopt(ZMQ_ZAP_DOMAIN, "rdpmux", strlen("rdpmux"));
+    }
+    zsocket.bind(endpoint);
+
+    // librdpmux derives the descriptor socket path from the ZeroMQ one by appending ".fd". Descriptors can't be passed
+    // to other hosts, so remote endpoints go without.
+    fd_socket = -1;
+    if (endpoint.compare(0, strlen("ipc://"), "ipc://") == 0)
+        fd_socket = bind_fd_socket(endpoint.substr(strlen("ipc://")) + ".fd");
+}
+
+BrokerShard::~BrokerShard()
+{
+    stop = true;
+    out_queue.wake(); // get the loop out of poll()
+    if (thread.joinable())
+        thread.join();
+    for (auto &pending : fd_conns)
+        close(pending.conn);
+    if (fd_socket >= 0)
+        close(fd_socket);
+}
+
+void BrokerShard::Start(const CpuSet &cpus)
+{
+    thread = std::thread(&BrokerShard::run, this);
+    cpus.Apply(thread.native_handle());
+}
+
+void BrokerShard::SetRegisterHandler(RegisterHandler handler)
+{
+    register_handler = handler;
+}
+
+const std::string &BrokerShard::Endpoint() const
+{
+    return endpoint;
+}
+
+void BrokerShard::AddListener(std::string uuid, std::shared_ptr<RDPListener> listener)
+{
+    {
+        std::lock_guard<std::mutex> lock(listener_lock);
+        listener_map[uuid] = listener;
+    }
+
+    // the handle's slot is reused once the VM is gone, its generation keeps events still queued for it from going to
+    // the next owner
+    uint32_t handle = index.Insert(uuid, listener.get());
+    if (handle == 0) {
+        LOG(WARNING) << "Broker shard " << endpoint << " is full, VM " << uuid << " won't get any messages";
+        return;
+    }
+    listener->setInputRoute(this, vm_handle_slot(handle), vm_handle_generation(handle));
+}
+
+void BrokerShard::RemoveListener(std::string uuid)
+{
+    // out of the index first, the message loop may still be using the listener until Remove() returns
+    index.Remove(uuid);
+
+    std::lock_guard<std::mutex> lock(listener_lock);
+    listener_map.erase(uuid);
+}
+
+BrokerShardStats BrokerShard::Stats()
+{
+    BrokerShardStats stats;
+    stats.endpoint = endpoint;
+    stats.vms = static_cast<uint32_t>(index.Size());
+    stats.received = received;
+    stats.sent = sent;
+    stats.dropped = dropped;
+    stats.queued = out_queue.size();
+    stats.input_queued = input_queue.size();
+    return stats;
+}
+
+void BrokerShard::queueOutgoingMessage(QueueItem item)
+{
+    out_queue.enqueue(std::move(item));
+}
+
+bool BrokerShard::queueInput(const InputRecord &record)
+{
+    bool first;
+
+    if (!input_queue.push(record, first))
+        return false;
+
+    // shares the eventfd of out_queue, so the loop only has one thing to poll for outgoing messages
+    if (first)
+        out_queue.wake();
+    return true;
+}
+
+bool BrokerShard::decodeMessage(const char *data, size_t size)
+{
+    if (wire_is_binary(data, size))
+        return wire_decode(data, size, incoming);
+
+    try {
+        msgpack::unpacked unpacked;
+        msgpack::unpack(&unpacked, data, size);
+        unpacked.get().convert(&incoming);
+    } catch (std::exception &e) {
+        LOG(ERROR) << "Msgpack conversion failed: " << e.what();
+        return false;
+    }
+    return !incoming.empty();
+}
+
+void BrokerShard::sendMessage(const std::vector<uint16_t> &vec, const std::string &uuid)
+{
+    const VmEntry *vm = index.Find(uuid);
+    if (!vm) {
+        LOG(ERROR) << "Listener with UUID " << uuid << " does not exist in map!";
+        dropped++;
+        return;
+    }
+
+    // input that found the input queue full holds back the events after it until now. They go through sendInput() on
+    // a later pass, so after this one whatever happens to it below.
+    if (!vec.empty() && (vec[0] == MOUSE || vec[0] == KEYBOARD))
+        vm->listener->InputFallbackSent();
+
+    if (vm->binary) {
+        size_t size = wire_encode(vec, wire_buf, sizeof(wire_buf));
+        if (size > 0) {
+            sendPacked(vm, wire_buf, size);
+            return;
+        }
+        // no binary layout for this one, msgpack is still understood
+    }
+
+    msgpack::sbuffer sbuf;
+    msgpack::pack(&sbuf, vec);
+
+    sendPacked(vm, sbuf.data(), sbuf.size());
+}
+
+bool BrokerShard::sendPacked(const VmEntry *vm, const char *data, size_t size)
+{
+    zmq::multipart_t msg;
+    uint32_t slot = vm_handle_slot(vm->handle);
+
+    if (slot >= connections.size() || connections[slot].handle != vm->handle) {
+        LOG(ERROR) << "Could not find connection id for UUID " << vm->uuid;
+        dropped++;
+        return false;
+    }
+
+    const Connection &connection = connections[slot];
+    msg.addstr(connection.id);
+    if (connection.announced) {
+        uint32_t handle = htole32(vm->handle);
+        msg.addmem(&handle, sizeof(handle));
+    } else {
+        msg.addstr(vm->uuid);
+    }
+    msg.addmem(data, size);
+
+    if (!msg.send(zsocket) || !msg.empty()) {
+        LOG(ERROR) << "Unable to send message to " << vm->uuid;
+        dropped++;
+        return false;
+    }
+    sent++;
+    return true;
+}
+
+void BrokerShard::updateConnection(const VmEntry *vm, const std::string &id, bool by_uuid)
+{
+    uint32_t slot = vm_handle_slot(vm->handle);
+    if (slot >= connections.size())
+        connections.resize(slot + 1, {0, std::string(), false});
+
+    Connection &connection = connections[slot];
+    if (connection.handle != vm->handle || connection.id != id) {
+        connection.handle = vm->handle;
+        connection.id = id;
+        connection.announced = false;
+    }
+
+    // a VM that already addresses us by handle got it on an earlier connection
+    if (!by_uuid)
+        connection.announced = true;
+    if (connection.announced || !vm->handles)
+        return;
+
+    size_t size = wire_encode_handle(vm->handle, wire_buf, sizeof(wire_buf));
+    if (sendPacked(vm, wire_buf, size))
+        connection.announced = true;
+}
+
+/**
+ * @brief Checks whether an input record is a plain mouse move, i.e. one with no button transition that could be
+ * merged into the next move without anything getting lost.
+ */
+static bool is_pure_motion(const InputRecord &record)
+{
+    return record.type == MOUSE && record.flags == PTR_FLAGS_MOVE;
+}
+
+void BrokerShard::sendInput()
+{
+    InputRecord record;
+
+    do {
+        size_t count = 0;
+        while (input_queue.pop(record)) {
+            count++;
+
+            const VmEntry *vm = index.Find(record.generation << VM_HANDLE_SLOT_BITS | record.slot);
+            if (!vm) {
+                dropped++; // the listener went away after queueing this
+                continue;
+            }
+
+            if (input_batches.size() <= record.slot)
+                input_batches.resize(record.slot + 1);
+            std::vector<InputRecord> &batch = input_batches[record.slot];
+            if (batch.empty()) {
+                input_vms.push_back(vm);
+            } else if (is_pure_motion(record) && is_pure_motion(batch.back())) {
+                // only the latest position of a drag matters. Anything with a button or key in it stays put, so
+                // clicks are never reordered or lost. The latency is still counted from the move that was replaced.
+                uint64_t queued_us = batch.back().queued_us;
+                batch.back() = record;
+                batch.back().queued_us = queued_us;
+                continue;
+            }
+
+            batch.push_back(record);
+            if (batch.size() == MAX_INPUT_BATCH)
+                flushInput(vm);
+        }
+
+        // go around again if a producer slipped an event in after we ran dry, it won't wake us for it
+        if (!input_queue.release(count))
+            break;
+    } while (true);
+
+    for (auto vm : input_vms)
+        flushInput(vm);
+    input_vms.clear();
+}
+
+/**
+ * @brief Records the latency of a batch of input events that was just sent.
+ */
+static void record_input_latency(ListenerMetrics *metrics, const std::vector<InputRecord> &batch)
+{
+    uint64_t now = metrics_now_us();
+    for (auto &record : batch)
+        metrics->input_latency.Record(now > record.queued_us ? now - record.queued_us : 0);
+}
+
+void BrokerShard::flushInput(const VmEntry *vm)
+{
+    std::vector<InputRecord> &batch = input_batches[vm_handle_slot(vm->handle)];
+    if (batch.empty())
+        return;
+
+    if (vm->binary) {
+        size_t size = wire_encode_input(batch.data(), batch.size(), wire_buf, sizeof(wire_buf));
+
+        try {
+            if (sendPacked(vm, wire_buf, size))
+                record_input_latency(vm->metrics, batch);
+        } catch (zmq::error_t &ex) {
+            LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+            dropped++;
+        }
+        batch.clear();
+        return;
+    }
+
+    msgpack_encode_input(batch.data(), batch.size(), input_buf);
+
+    try {
+        if (sendPacked(vm, input_buf.data(), input_buf.size()))
+            record_input_latency(vm->metrics, batch);
+    } catch (zmq::error_t &ex) {
+        LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+        dropped++;
+    }
+    batch.clear();
+}
+
+void BrokerShard::acceptDescriptors()
+{
+    while (true) {
+        int conn = accept4(fd_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG(WARNING) << "Could not accept descriptor connection: " << strerror(errno);
+            return;
+        }
+        if (fd_conns.size() >= MAX_FD_CONNECTIONS) {
+            // the VM finds its connection closed, and tries again
+            LOG(WARNING) << "Too many descriptor connections waiting for their message, closing one";
+            close(conn);
+            continue;
+        }
+        fd_conns.push_back({conn, metrics_now_us()});
+    }
+}
+
+bool BrokerShard::receiveDescriptor(int conn)
+{
+    char buf[512];
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cmsg_buf;
+    hdr.msg_controllen = sizeof(cmsg_buf);
+
+    ssize_t len = recvmsg(conn, &hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return false;
+
+    int shm_fd = -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); len >= 0 && cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (len == 0)
+        return true; // librdpmux checking whether we're listening
+
+    if (len <= UUID_LENGTH || shm_fd < 0 || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        LOG(WARNING) << "Invalid message received on descriptor socket";
+        if (shm_fd >= 0)
+            close(shm_fd);
+        return true;
+    }
+
+    received++;
+
+    std::string uuid(buf, UUID_LENGTH);
+    const VmEntry *vm = index.Find(uuid);
+
+    if (!vm)
+        LOG(WARNING) << "Listener with UUID " << uuid << " does not exist in map!";
+
+    if (!vm || !decodeMessage(buf + UUID_LENGTH, len - UUID_LENGTH) ||
+        (incoming[0] != DISPLAY_SWITCH && incoming[0] != HEAD_SWITCH)) {
+        dropped++;
+        close(shm_fd);
+        return true;
+    }
+
+    vm->listener->processDisplaySwitch(incoming, shm_fd);
+    return true;
+}
+
+void BrokerShard::authenticate()
+{
+    zmq::multipart_t request(*zap_socket);
+
+    // version, request ID, domain, address, routing ID, mechanism, and for CURVE the client's public key
+    std::string version = request.popstr();
+    std::string request_id = request.popstr();
+    request.popstr();
+    std::string address = request.popstr();
+    request.popstr();
+    std::string mechanism = request.popstr();
+    std::string key = request.popstr();
+
+    bool allowed = version == "1.0" && mechanism == "CURVE" && client_keys.count(key) > 0;
+    if (!allowed)
+        LOG(WARNING) << "Refused connection from " << address << " to " << endpoint << ", its key isn't allowed";
+
+    zmq::multipart_t reply;
+    reply.addstr("1.0");
+    reply.addstr(request_id);
+    reply.addstr(allowed ? "200" : "400");
+    reply.addstr(allowed ? "OK" : "Key not allowed");
+    reply.addstr(""); // user ID
+    reply.addstr(""); // metadata
+    reply.send(*zap_socket);
+}
+
+void BrokerShard::run()
+{
+    int ret = -1;
+    std::vector<zmq::pollitem_t> items;
+    int fd_item = -1, queue_item = -1, zap_item = -1;
+
+    items.push_back({(void *) zsocket, 0, ZMQ_POLLIN, 0});
+    if (fd_socket >= 0) {
+        fd_item = items.size();
+        items.push_back({nullptr, fd_socket, ZMQ_POLLIN, 0});
+    }
+    if (out_queue.EventFd() >= 0) {
+        queue_item = items.size();
+        items.push_back({nullptr, out_queue.EventFd(), ZMQ_POLLIN, 0});
+    }
+    if (zap_socket) {
+        zap_item = items.size();
+        items.push_back({(void *) *zap_socket, 0, ZMQ_POLLIN, 0});
+    }
+
+    // without the queue's eventfd there is nothing to wake us up for outgoing messages, so fall back to checking on
+    // the queue every few ms
+    long timeout = queue_item >= 0 ? -1 : 5;
+    // the descriptor connections waiting for their message go after everything else, and change from pass to pass
+    size_t fixed_items = items.size();
+
+    while (true) {
+        // nothing looked up in the index during the last pass is used past this point, so writers don't have to wait
+        // for us while we sleep, or once we're gone
+        index.Offline();
+
+        // check if we are terminating
+        if (stop) {
+            LOG(INFO) << "Broker shard " << endpoint << " terminating on stop";
+            return;
+        }
+
+        items.resize(fixed_items);
+        for (auto &pending : fd_conns)
+            items.push_back({nullptr, pending.conn, ZMQ_POLLIN, 0});
+
+        bool polled = true;
+        try {
+            // waiting connections are closed once they time out, so don't sleep through that
+            ret = zmq::poll(items, fd_conns.empty() || (timeout >= 0 && timeout < FD_CONNECTION_TIMEOUT) ?
+                                   timeout : FD_CONNECTION_TIMEOUT);
+        } catch (zmq::error_t &ex) {
+            LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+            polled = false;
+        }
+
+        index.Online();
+        if (!polled)
+            continue;
+
+        if (ret == -1) {
+            LOG(WARNING) << "Error polling socket: " << ret;
+            continue;
+        }
+
+        // send outgoing messages first, they're mostly input events and those are what users notice lag on
+        if (queue_item < 0 || (items[queue_item].revents & ZMQ_POLLIN)) {
+            auto batch = out_queue.dequeueAll();
+            sendInput();
+            while (!batch.empty()) {
+                QueueItem &msg = batch.front();
+                try {
+                    sendMessage(std::get<0>(msg), std::get<1>(msg));
+                } catch (zmq::error_t &ex) {
+                    LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+                    dropped++;
+                }
+                batch.pop();
+            }
+        }
+
+        // before accepting new connections, which have no poll results yet
+        uint64_t now = metrics_now_us();
+        size_t kept = 0;
+        for (size_t i = 0; i < fd_conns.size(); i++) {
+            DescriptorConnection &pending = fd_conns[i];
+            bool done;
+            if (items[fixed_items + i].revents & (ZMQ_POLLIN | ZMQ_POLLERR)) {
+                done = receiveDescriptor(pending.conn);
+            } else {
+                done = now > pending.accepted + FD_CONNECTION_TIMEOUT * 1000ull;
+                if (done)
+                    LOG(WARNING) << "Descriptor connection timed out before its message arrived";
+            }
+            if (done)
+                close(pending.conn);
+            else
+                fd_conns[kept++] = pending;
+        }
+        fd_conns.resize(kept);
+
+        if (fd_item >= 0 && (items[fd_item].revents & ZMQ_POLLIN))
+            acceptDescriptors();
+
+        if (zap_item >= 0 && (items[zap_item].revents & ZMQ_POLLIN)) {
+            try {
+                authenticate();
+            } catch (zmq::error_t &ex) {
+                LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
+            }
+        }
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            zmq::multipart_t multi(zsocket);
+
+            received++;
+
+            if (multi.size() != 3) {
+                LOG(WARNING) << "Possibly invalid message received! Message is: " << multi.str();
+                dropped++;
+                continue;
+            }
+
+            //VLOG(3) << multi.str();
+
+            std::string id = multi.popstr();
+            std::string address = multi.popstr();
+            std::string data = multi.popstr();
+
+            // deserialize message and pass to correct server
+            const VmEntry *vm = nullptr;
+            if (address.size() == HANDLE_LENGTH) {
+                uint32_t handle;
+                memcpy(&handle, address.data(), sizeof(handle));
+                vm = index.Find(le32toh(handle));
+                if (!vm)
+                    LOG(WARNING) << "Listener with handle " << le32toh(handle) << " does not exist in map!";
+            } else {
+                vm = index.Find(address);
+                if (!vm && register_handler && address.size() == UUID_LENGTH &&
+                    wire_is_binary(data.data(), data.size()) && wire_type(data.data()) == REMOTE_REGISTER) {
+                    // a remote VM introducing itself. It keeps asking until its listener is up, so nothing needs to be
+                    // remembered about the connection here.
+                    if (wire_decode(data.data(), data.size(), incoming))
+                        register_handler(address, incoming);
+                    else
+                        dropped++;
+                    continue;
+                }
+                if (!vm)
+                    LOG(WARNING) << "Listener with UUID " << address << " does not exist in map!";
+            }
+            if (!vm) {
+                dropped++;
+                continue;
+            }
+            updateConnection(vm, id, address.size() == UUID_LENGTH);
+
+            if (wire_is_binary(data.data(), data.size()) && wire_type(data.data()) == DISPLAY_TILES) {
+                // the bulk of what a remote VM sends, applied straight from the message instead of decoded first
+                try {
+                    vm->listener->processTiles(data.data(), data.size());
+                } catch (std::exception &e) {
+                    LOG(ERROR) << "Malformed tiles from " << vm->uuid << ": " << e.what();
+                    dropped++;
+                    vm->metrics->dropped++;
+                }
+                continue;
+            }
+
+            if (!decodeMessage(data.data(), data.size())) {
+                LOG(ERROR) << "Could not decode message from " << vm->uuid;
+                dropped++;
+                vm->metrics->dropped++;
+                continue;
+            }
+
+            try {
+                vm->listener->processIncomingMessage(incoming);
+            } catch (std::exception &e) {
+                LOG(ERROR) << "Malformed message from " << vm->uuid << ": " << e.what();
+                dropped++;
+                vm->metrics->dropped++;
+            }
+        }
+    }
+}
@@ -14,26 +14,101 @@
  * limitations under the License.
  */
 
-#include <msgpack/object.hpp>
-#include <msgpack/unpack.hpp>
+#include <algorithm>
+#include <unistd.h>
 #include "RDPServerWorker.h"
+#include "util/Metrics.h"
 
-RDPServerWorker::RDPServerWorker(uint16_t port, bool auth)
-        : starting_port(3901),
+/**
+ * @brief Endpoint of the first broker shard. Further shards append their index to it.
+ */
+#define BROKER_ENDPOINT "ipc://@/tmp/rdpmux"
+
+/**
+ * @brief Seconds a remote VM may go without sending anything before its listener is stopped. The VM sends a heartbeat
+ * every second while it's idle.
+ */
+#define REMOTE_SILENCE_TIMEOUT 30
+
+/**
+ * @brief Seconds in between two checks for remote VMs that went silent.
+ */
+#define REMOTE_CHECK_INTERVAL 5
+
+namespace {
+    /**
+     * @brief A REMOTE_REGISTER message on its way from the remote shard to the main loop.
+     */
+    struct RemoteRegistration
+    {
+        RDPServerWorker *worker;
+        std::string uuid;
+        int vm_id;
+        uint16_t port;
+        int protocol;
+    };
+
+    gboolean register_remote(gpointer data)
+    {
+        std::unique_ptr<RemoteRegistration> reg(static_cast<RemoteRegistration *>(data));
+        reg->worker->RegisterRemoteVM(reg->uuid, reg->vm_id, reg->port, reg->protocol);
+        return G_SOURCE_REMOVE;
+    }
+} // anonymous namespace
+
+RDPServerWorker::RDPServerWorker(uint16_t port, bool auth, unsigned int num_shards, unsigned int listener_threads,
+                                 uint16_t last_port, const CpuSet &broker_cpus, const CpuSet &listener_cpus,
+                                 const std::string &remote_endpoint, const CurveKeys &remote_keys,
+                                 const std::string &remote_auth)
+        : port_allocator(port, last_port),
+          stop(false),
           initialized(false),
-          context(1), // todo: explore the possibility of needing more than one thread
-          zsocket(context, ZMQ_ROUTER),
-          authenticating(auth)
+          broker_cpus(broker_cpus),
+          // one I/O thread per shard should be plenty to keep up with them
+          context(std::max(num_shards, 1u) + (remote_endpoint.empty() ? 0 : 1)),
+          remote_timeout_id(0),
+          authenticating(auth),
+          remote_auth(remote_auth)
 {
-    std::string path = "ipc://@/tmp/rdpmux";
-    zsocket.setsockopt(ZMQ_ROUTER_MANDATORY, 1);
-    zsocket.bind(path);
+    for (unsigned int i = 0; i < std::max(num_shards, 1u); i++) {
+        // the first shard keeps the endpoint there used to be only one of
+        std::string path = BROKER_ENDPOINT;
+        if (i > 0)
+            path += "-" + std::to_string(i);
+        shards.emplace_back(new BrokerShard(context, path));
+    }
+
+#ifdef USE_REMOTE
+    if (!remote_endpoint.empty()) {
+        remote_shard.reset(new BrokerShard(context, remote_endpoint, remote_keys));
+        // registering takes the shard's index lock, which the shard's own loop must never wait for
+        remote_shard->SetRegisterHandler([this](const std::string &uuid, const std::vector<uint32_t> &msg) {
+            if (msg.size() < 5 || msg[3] > UINT16_MAX) {
+                LOG(WARNING) << "Invalid registration of remote VM " << uuid;
+                return;
+            }
+            g_idle_add(register_remote, new RemoteRegistration{this, uuid, static_cast<int>(msg[2]),
+                                                               static_cast<uint16_t>(msg[3]),
+                                                               static_cast<int>(msg[1])});
+        });
+    }
+#else
+    if (!remote_endpoint.empty())
+        LOG(ERROR) << "Built without LZ4, not accepting remote VMs on " << remote_endpoint;
+#endif
+
+    if (listener_threads > 0)
+        listener_pool.reset(new EventLoopPool(listener_threads, listener_cpus));
 }
 
 RDPServerWorker::~RDPServerWorker()
 {
     std::lock_guard<std::mutex> lock(stop_mutex);
     stop = true;
+    if (remote_timeout_id)
+        g_source_remove(remote_timeout_id);
+    remote_shard.reset();
+    shards.clear(); // waits for the message loops to finish
 }
 
 void RDPServerWorker::setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn)
@@ -47,68 +122,104 @@ void RDPServerWorker::setDBusConnection(Glib::RefPtr<Gio::DBus::Connection> conn
 
 bool RDPServerWorker::Initialize()
 {
-    std::thread loop(&RDPServerWorker::run, this);
-    loop.detach();
+    for (auto &shard : shards)
+        shard->Start(broker_cpus);
+    if (remote_shard) {
+        remote_shard->Start(broker_cpus);
+        remote_timeout_id = g_timeout_add_seconds(REMOTE_CHECK_INTERVAL, &RDPServerWorker::checkRemoteVMs, this);
+        LOG(INFO) << "Accepting remote VMs on " << remote_shard->Endpoint();
+    }
     initialized = true;
     return initialized;
 }
 
-bool RDPServerWorker::RegisterNewVM(std::string uuid, int id, std::string auth, uint16_t port = 0)
+bool RDPServerWorker::RegisterNewVM(std::string uuid, int id, std::string auth, uint16_t port, int protocol, pid_t pid)
 {
-    std::lock_guard<std::mutex> lock(container_lock); // take lock on both ports and listener_map
-    uint16_t used_port = 0;
-    std::shared_ptr<RDPListener> l;
+    return registerVM(uuid, id, auth, port, protocol, pid, shardFor(uuid), false);
+}
 
-    if (port == 0) {
-        // find the next available port
-        // if this gets slow for you, consider not running as many VMs on the same computer
-        for (uint16_t i = starting_port; i < 65535; i++) {
-            if (ports.count(i) == 0) {
-                // check if port is available to be bound
-                struct addrinfo hints, *res;
-                int sockfd;
-
-                memset(&hints, 0, sizeof(hints));
-                hints.ai_family = AF_INET; // IPv4
-                hints.ai_socktype = SOCK_STREAM; // TCP stream socket
-                getaddrinfo("0.0.0.0", std::to_string(i).c_str(), &hints,
-                            &res); // check for usage across all interfaces
-
-                sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-                // try binding
-                int ret = bind(sockfd, res->ai_addr, res->ai_addrlen);
-                free(res); // free the linked list of results no matter what
-                if (ret < 0) { // failed, continue the loop
-                    continue;
-                }
-                // cleanup and setting the port if we suceeded
-                close(sockfd);
-                used_port = i;
-                break;
-            }
+bool RDPServerWorker::RegisterRemoteVM(std::string uuid, int id, uint16_t port, int protocol)
+{
+    // a remote VM can't fall back to anything older, it needs the tiles
+    if (protocol <= RDPMUX_PROTOCOL_VERSION_TRACE || protocol > RDPMUX_PROTOCOL_VERSION) {
+        LOG(WARNING) << "Remote VM " << uuid << " speaks unsupported protocol version " << protocol;
+        return false;
+    }
+
+    {
+        // the VM keeps asking until its listener answers, which takes a couple of messages
+        std::lock_guard<std::mutex> lock(container_lock);
+        auto it = listener_map.find(uuid);
+        if (it != listener_map.end() && !it->second->Remote()) {
+            LOG(WARNING) << "Remote VM " << uuid << " refused, a local VM is registered under that UUID";
+            return false;
         }
-    } else {
-        used_port = port;
+        if (it != listener_map.end())
+            return true;
     }
 
-    if (used_port == 0 || used_port > 65535) {
-        LOG(WARNING) << "Invalid server port number: " << used_port;
+    // the port is whatever the other host asked for, which mustn't be one the range keeps clear of
+    if (port != 0 && !port_allocator.InRange(port)) {
+        LOG(WARNING) << "Remote VM " << uuid << " refused, port " << port << " is outside of the listener port range";
         return false;
     }
 
-    ports.insert(used_port);
+    LOG(INFO) << "Registering remote VM " << uuid;
+    return registerVM(uuid, id, authenticating ? remote_auth : std::string(), port, protocol, 0, *remote_shard, true);
+}
+
+bool RDPServerWorker::registerVM(std::string uuid, int id, std::string auth, uint16_t port, int protocol, pid_t pid,
+                                 BrokerShard &shard, bool remote)
+{
+    uint16_t used_port = port;
+    int port_probe = -1;
+    std::shared_ptr<RDPListener> l;
+
+    if (port == 0) {
+        used_port = port_allocator.Acquire(port_probe);
+        if (used_port == 0) {
+            LOG(WARNING) << "No free port left for VM " << uuid;
+            return false;
+        }
+    } else if (!port_allocator.Reserve(port)) {
+        LOG(WARNING) << "Port " << port << " requested by VM " << uuid << " is already in use by another listener";
+        return false;
+    }
 
     try {
-        l = std::make_shared<RDPListener>(uuid, id, used_port, this, auth, dbus_conn);
+        l = std::make_shared<RDPListener>(uuid, id, used_port, this, auth, dbus_conn, protocol, pid, remote,
+                                          port_probe);
     } catch (std::exception &e) {
+        if (port_probe >= 0)
+            close(port_probe);
+        port_allocator.Release(used_port);
         return false;
     }
 
-    std::thread l_thread([l]() {l->RunServer();}); // i think this properly increments and decrements...?
-    l_thread.detach();
+    // before the listener starts, so its input events have somewhere to go from the first one on
+    {
+        std::lock_guard<std::mutex> lock(container_lock);
+        listener_map.insert(std::make_pair(uuid, l));
+        shard.AddListener(uuid, l);
+    }
 
-    listener_map.insert(std::make_pair(uuid, l));
+    if (!listener_pool) {
+        std::thread l_thread([l]() {l->RunServer();}); // i think this properly increments and decrements...?
+        l_thread.detach();
+        return true;
+    }
+
+    // the loop holds on to the listener until it's told to stop, then unregisters it and lets it go, which tears it
+    // down on the loop
+    EventLoop &loop = listener_pool->Pick();
+    l->SetEventLoop(&loop);
+    loop.Post([l, &loop]() {
+        if (!l->Start()) {
+            l->shutdown();
+            return;
+        }
+        loop.OnSignal(l->StopEvent(), [l]() { l->shutdown(); });
+    });
 
     return true;
 }
@@ -116,115 +227,141 @@ bool RDPServerWorker::RegisterNewVM(std::string uuid, int id, std::string auth,
 void RDPServerWorker::UnregisterVM(std::string uuid, uint16_t port)
 {
     std::lock_guard<std::mutex> lock(container_lock);
-    ports.erase(port);
+    port_allocator.Release(port);
+    auto it = listener_map.find(uuid);
+    if (it != listener_map.end() && it->second->Remote())
+        remote_shard->RemoveListener(uuid);
+    else
+        shardFor(uuid).RemoveListener(uuid);
     listener_map.erase(uuid); // rip server
 }
 
-void RDPServerWorker::sendMessage(std::vector<uint16_t> vec, std::string uuid)
+gboolean RDPServerWorker::checkRemoteVMs(gpointer data)
 {
-    zmq::multipart_t msg;
-
-    try {
-        msg.addstr(connection_map.at(uuid));
-    } catch (std::out_of_range &e) {
-        LOG(ERROR) << "Could not find connection id for UUID " << uuid;
-        return;
+    auto worker = static_cast<RDPServerWorker *>(data);
+    uint64_t now = metrics_now_us();
+
+    // nobody tells us if the VM's host or the network went down, so a VM that went quiet is taken for gone
+    std::lock_guard<std::mutex> lock(worker->container_lock);
+    for (auto &entry : worker->listener_map) {
+        RDPListener &listener = *entry.second;
+        if (listener.Remote() && now > listener.LastHeard() + REMOTE_SILENCE_TIMEOUT * 1000000ull) {
+            LOG(WARNING) << "Remote VM " << entry.first << " went silent, stopping its listener";
+            listener.requestStop();
+        }
     }
+    return G_SOURCE_CONTINUE;
+}
 
-    msg.addstr(uuid);
-
-    msgpack::sbuffer sbuf;
-    msgpack::pack(&sbuf, vec);
-
-    msg.addmem(sbuf.data(), sbuf.size());
+BrokerShard &RDPServerWorker::shardFor(const std::string &uuid)
+{
+    return *shards[std::hash<std::string>()(uuid) % shards.size()];
+}
 
-    if (!msg.send(zsocket) || !msg.empty()) {
-        LOG(ERROR) << "Unable to send message " << vec;
-    }
+std::string RDPServerWorker::ShardEndpoint(const std::string &uuid)
+{
+    return shardFor(uuid).Endpoint();
 }
 
-void RDPServerWorker::queueOutgoingMessage(QueueItem item)
+std::vector<BrokerShardStats> RDPServerWorker::ShardStats()
 {
-    out_queue.enqueue(std::move(item));
+    std::vector<BrokerShardStats> stats;
+    for (auto &shard : shards)
+        stats.push_back(shard->Stats());
+    if (remote_shard)
+        stats.push_back(remote_shard->Stats());
+    return stats;
 }
 
-void RDPServerWorker::run()
+void RDPServerWorker::ExportMetrics(std::ostream &out)
 {
-    int ret = -1;
-    zmq::pollitem_t item = {
-            (void *) zsocket,
-            0,
-            ZMQ_POLLIN,
-            0
+    PrometheusWriter writer(out);
+    std::vector<BrokerShardStats> shard_stats = ShardStats();
+    std::vector<std::shared_ptr<RDPListener>> listeners;
+    {
+        std::lock_guard<std::mutex> lock(container_lock);
+        for (auto &entry : listener_map)
+            listeners.push_back(entry.second);
+    }
+
+    const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        uint64_t BrokerShardStats::*value;
+    } shard_families[] = {
+            {"broker_vms", "gauge", "VMs assigned to the broker shard.", nullptr},
+            {"broker_messages_received_total", "counter", "Messages received from VMs.", &BrokerShardStats::received},
+            {"broker_messages_sent_total", "counter", "Messages sent to VMs.", &BrokerShardStats::sent},
+            {"broker_messages_dropped_total", "counter", "Messages that could not be delivered.",
+                    &BrokerShardStats::dropped},
+            {"broker_queue_depth", "gauge", "Messages waiting to be sent to VMs.", &BrokerShardStats::queued},
+            {"broker_input_queue_depth", "gauge", "Input events waiting to be sent to VMs.",
+                    &BrokerShardStats::input_queued},
     };
+    for (auto &family : shard_families) {
+        writer.Family(family.name, family.type, family.help);
+        for (auto &stats : shard_stats)
+            writer.Sample({"shard", stats.endpoint}, family.value ? stats.*family.value : stats.vms);
+    }
 
-    while (true) {
-        // check if we are terminating
-        std::lock_guard<std::mutex> lock(stop_mutex);
-        if (stop) {
-            LOG(INFO) << "ServerWorker loop terminating on stop";
-            initialized = false;
-            return;
-        }
+    const struct {
+        const char *name;
+        const char *help;
+        std::atomic<uint64_t> ListenerMetrics::*value;
+    } listener_families[] = {
+            {"display_updates_total", "Display update messages received from the VM.",
+                    &ListenerMetrics::display_updates},
+            {"dirty_rects_total", "Damaged rects received from the VM.", &ListenerMetrics::dirty_rects},
+            {"dirty_pixels_total", "Pixels copied out of the VM's framebuffer.", &ListenerMetrics::dirty_pixels},
+            {"frames_total", "Frames handed to the clients.", &ListenerMetrics::frames},
+            {"frames_deferred_total", "Frames put off because the VM drew while they were read.",
+                    &ListenerMetrics::frames_deferred},
+            {"copies_total", "Copies within the framebuffer sent to the clients as blits.", &ListenerMetrics::copies},
+            {"copies_damaged_total", "Copies that had to be sent as damage instead.", &ListenerMetrics::copies_damaged},
+            {"bytes_sent_total", "Bytes sent to the clients.", &ListenerMetrics::bytes_sent},
+            {"input_events_total", "Input events received from the clients.", &ListenerMetrics::input_events},
+            {"input_slow_path_total", "Input events that bypassed the input queue.", &ListenerMetrics::input_slow},
+            {"dropped_messages_total", "Messages from the VM that could not be processed.", &ListenerMetrics::dropped},
+            {"remote_tiles_total", "Tiles a remote VM sent of its framebuffer.", &ListenerMetrics::remote_tiles},
+            {"remote_bytes_total", "Compressed bytes of the tiles a remote VM sent.", &ListenerMetrics::remote_bytes},
+    };
+    for (auto &family : listener_families) {
+        writer.Family(family.name, "counter", family.help);
+        for (auto &listener : listeners)
+            writer.Sample({"uuid", listener->UUID()}, listener->Metrics().*family.value);
+    }
 
-        // send outgoing messages first
-        while (!out_queue.isEmpty()) {
-            QueueItem msg = out_queue.dequeue();
-            auto vec = std::get<0>(msg);
-            try {
-                sendMessage(vec, std::get<1>(msg));
-            } catch (zmq::error_t &ex) {
-                LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
-                break;
-            }
-        }
+    writer.Family("peers", "gauge", "Clients connected to the listener.");
+    for (auto &listener : listeners)
+        writer.Sample({"uuid", listener->UUID()}, ArrayList_Count(listener->server->clients));
 
-        try {
-            ret = zmq::poll(&item, 1, 5); // todo : determine reasonable poll interval
-        } catch (zmq::error_t &ex) {
-            LOG(WARNING) << "ZMQ EXCEPTION: " << ex.what();
-            continue;
-        }
+    writer.Family("frame_rate", "gauge", "Frame rate the listener runs at.");
+    for (auto &listener : listeners)
+        writer.Sample({"uuid", listener->UUID()}, listener->FrameRate());
 
-        if (ret > 0) {
-
-            if (item.revents & ZMQ_POLLIN) {
-                zmq::multipart_t multi(zsocket);
-
-                if (multi.size() != 3) {
-                    LOG(WARNING) << "Possibly invalid message received! Message is: " << multi.str();
-                    continue;
-                }
-
-                //VLOG(3) << multi.str();
-
-                std::string id = multi.popstr();
-                std::string uuid = multi.popstr();
-                std::string data = multi.popstr();
-
-                msgpack::unpacked unpacked;
-                msgpack::unpack(&unpacked, data.data(), data.size());
-
-                // deserialize msgpack message and pass to correct server
-                try {
-                    // so these two lines have to be in this order. if listener_map.at() fails, it'll skip the
-                    // connection_map line, which will silently create and/or update if nothing exists.
-                    auto server = listener_map.at(uuid);
-                    connection_map[uuid] = id;
-
-                    msgpack::object obj = unpacked.get();
-                    std::vector<uint32_t> vec;
-                    obj.convert(&vec);
-                    server->processIncomingMessage(vec);
-                } catch (std::out_of_range &e) {
-                    LOG(WARNING) << "Listener with UUID " << uuid << " does not exist in map!";
-                } catch (std::exception &e) {
-                    LOG(ERROR) << "Msgpack conversion failed: " << e.what();
-                    LOG(ERROR) << "Offending buffer is " << unpacked.get();
-                }
-            }
-        } else if (ret == -1) {
-            LOG(WARNING) << "Error polling socket: " << ret;
-        }
+    writer.Family("peer_bytes_sent_total", "counter", "Bytes sent to a client since it connected.");
+    for (auto &listener : listeners) {
+        for (auto &peer : listener->PeerStatsSnapshot())
+            writer.Sample({"uuid", listener->UUID(), "address", peer.address}, peer.bytes_sent);
     }
+
+    writer.Family("encode_seconds", "histogram", "Time it took the clients to encode a frame.");
+    for (auto &listener : listeners)
+        writer.Sample({"uuid", listener->UUID()}, listener->Metrics().encode_time.Snapshot(), 1e-6);
+
+    writer.Family("input_latency_seconds", "histogram",
+                  "Time from an input event arriving to it being sent to the VM.");
+    for (auto &listener : listeners)
+        writer.Sample({"uuid", listener->UUID()}, listener->Metrics().input_latency.Snapshot(), 1e-6);
+
+    writer.Family("frame_latency_seconds", "histogram",
+                  "Time from the VM looking for damage to the frame holding it being sent to the clients.");
+    for (auto &listener : listeners)
+        writer.Sample({"uuid", listener->UUID()}, listener->Metrics().frame_latency.Snapshot(), 1e-6);
+}
+
+void RDPServerWorker::queueOutgoingMessage(QueueItem item)
+{
+    shardFor(std::get<1>(item)).queueOutgoingMessage(std::move(item));
 }
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+#include "VmIndex.h"
+#include "rdp/RDPListener.h"
+
+VmIndex::VmIndex() : table(new Table()), reader_epoch(1), size(0)
+{
+    // the reader starts out offline, so writers don't wait for a loop that hasn't been started yet
+}
+
+VmIndex::~VmIndex()
+{
+    const Table *current = table.load();
+    for (const VmEntry *entry : current->slots)
+        delete entry;
+    delete current;
+}
+
+uint32_t VmIndex::Insert(const std::string &uuid, RDPListener *listener)
+{
+    std::lock_guard<std::mutex> lock(writer_lock);
+    const Table *current = table.load();
+
+    // reuse the first free slot, bumping its generation so anything still referring to its previous owner is dropped
+    uint32_t slot = 0;
+    while (slot < current->slots.size() && current->slots[slot])
+        slot++;
+    if (slot == VM_INDEX_MAX_SLOTS)
+        return 0;
+    if (slot == generations.size())
+        generations.push_back(0);
+
+    // generation 0 is skipped on wrap-around, which keeps 0 free to mean "no handle"
+    if (++generations[slot] == 0)
+        generations[slot] = 1;
+
+    VmEntry *entry = new VmEntry();
+    entry->handle = (uint32_t) generations[slot] << VM_HANDLE_SLOT_BITS | slot;
+    entry->uuid = uuid;
+    entry->listener = listener;
+    entry->metrics = &listener->Metrics();
+    entry->binary = listener->BinaryWire();
+    entry->handles = listener->VmHandles();
+
+    Table *next = new Table(*current);
+    const VmEntry *replaced = nullptr;
+    auto it = next->by_uuid.find(uuid);
+    if (it != next->by_uuid.end()) {
+        // registering a VM again replaces it, same as overwriting a map entry would
+        replaced = next->slots[it->second];
+        next->slots[it->second] = nullptr;
+        size--;
+    }
+    if (slot == next->slots.size())
+        next->slots.push_back(nullptr);
+    next->slots[slot] = entry;
+    next->by_uuid[uuid] = slot;
+    size++;
+
+    publish(next);
+    delete replaced;
+    return entry->handle;
+}
+
+bool VmIndex::Remove(const std::string &uuid)
+{
+    std::lock_guard<std::mutex> lock(writer_lock);
+    const Table *current = table.load();
+
+    auto it = current->by_uuid.find(uuid);
+    if (it == current->by_uuid.end())
+        return false;
+
+    Table *next = new Table(*current);
+    const VmEntry *removed = next->slots[it->second];
+    next->slots[it->second] = nullptr;
+    next->by_uuid.erase(uuid);
+    while (!next->slots.empty() && !next->slots.back())
+        next->slots.pop_back();
+    size--;
+
+    // publish() only returns once the reader is done with the old table, so it's done with the entry as well
+    publish(next);
+    delete removed;
+    return true;
+}
+
+size_t VmIndex::Size() const
+{
+    return size;
+}
+
+const VmEntry *VmIndex::Find(uint32_t handle) const
+{
+    const Table *current = table.load();
+    uint32_t slot = vm_handle_slot(handle);
+    if (slot >= current->slots.size())
+        return nullptr;
+
+    const VmEntry *entry = current->slots[slot];
+    if (!entry || entry->handle != handle)
+        return nullptr;
+    return entry;
+}
+
+const VmEntry *VmIndex::Find(const std::string &uuid) const
+{
+    const Table *current = table.load();
+    auto it = current->by_uuid.find(uuid);
+    if (it == current->by_uuid.end())
+        return nullptr;
+    return current->slots[it->second];
+}
+
+void VmIndex::Offline()
+{
+    // the reader is the only one bumping the epoch, so checking and bumping it doesn't need to be atomic
+    if (!(reader_epoch & 1))
+        reader_epoch++;
+}
+
+void VmIndex::Online()
+{
+    if (reader_epoch & 1)
+        reader_epoch++;
+}
+
+void VmIndex::publish(Table *next)
+{
+    const Table *old = table.exchange(next);
+    synchronize();
+    delete old;
+}
+
+void VmIndex::synchronize()
+{
+    // sequentially consistent with the exchange in publish(): if the reader wasn't offline by now, it may have loaded
+    // the old table, and is done with it once it went offline or back online
+    uint64_t epoch = reader_epoch;
+    if (epoch & 1)
+        return;
+    while (reader_epoch == epoch)
+        std::this_thread::yield();
+}
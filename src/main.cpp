@@ -17,6 +17,9 @@
 #include "common.h"
 #include <boost/program_options.hpp>
 #include "RDPServerWorker.h"
+#include "util/MetricsExporter.h"
+#include "util/Trace.h"
+#include <glib-unix.h>
 
 namespace po = boost::program_options;
 po::variables_map vm;
@@ -24,6 +27,7 @@ po::variables_map vm;
 INITIALIZE_EASYLOGGINGPP
 
 std::unique_ptr<RDPServerWorker> broker;
+std::unique_ptr<MetricsExporter> exporter;
 
 namespace {
     static Glib::RefPtr<Gio::DBus::NodeInfo> introspection_data;
@@ -40,6 +44,13 @@ namespace {
             "      <arg type='s' name='socket_path' direction='out'/>"
             "    </method>"
             "    <property type='ai' name='SupportedProtocolVersions' access='read' />"
+            "    <property type='as' name='BrokerEndpoints' access='read' />"
+            "    <property type='au' name='BrokerVMs' access='read' />"
+            "    <property type='at' name='BrokerMessagesReceived' access='read' />"
+            "    <property type='at' name='BrokerMessagesSent' access='read' />"
+            "    <property type='at' name='BrokerMessagesDropped' access='read' />"
+            "    <property type='at' name='BrokerQueueDepth' access='read' />"
+            "    <property type='at' name='BrokerInputQueueDepth' access='read' />"
             "  </interface>"
             "</node>";
     guint registered_id = 0;
@@ -51,6 +62,7 @@ void handle_SIGINT(int sig)
 {
     // clean up RDPServerWorker instance, this will trigger cleanup of all listeners
     LOG(INFO) << "SIGINT received, cleaning up";
+    exporter.reset(); // collects from the broker, so it has to go first
     if (broker)
         broker.reset();
 
@@ -59,10 +71,45 @@ void handle_SIGINT(int sig)
     raise(sig);
 }
 
+/**
+ * @brief Writes the trace rings to the trace file. Runs on the glib main loop rather than in signal context, so it's
+ * free to take locks and allocate.
+ */
+static gboolean handle_SIGUSR2(gpointer)
+{
+    auto path = vm["trace-file"].as<std::string>();
+    if (trace_dump(path))
+        LOG(INFO) << "Trace written to " << path;
+    else
+        LOG(WARNING) << "Could not write trace to " << path;
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Asks the bus for the PID of the process a message came from.
+ *
+ * @returns The PID, 0 if the bus couldn't tell.
+ */
+static pid_t sender_pid(const Glib::RefPtr<Gio::DBus::Connection> &conn, const Glib::ustring &sender)
+{
+    try {
+        auto reply = conn->call_sync("/org/freedesktop/DBus", "org.freedesktop.DBus", "GetConnectionUnixProcessID",
+                                     Glib::VariantContainerBase::create_tuple(
+                                             Glib::Variant<Glib::ustring>::create(sender)),
+                                     "org.freedesktop.DBus");
+        Glib::Variant<guint32> pid_variant;
+        reply.get_child(pid_variant, 0);
+        return (pid_t) pid_variant.get();
+    } catch (const Glib::Error &ex) {
+        LOG(WARNING) << "Could not look up the PID of " << sender << ": " << ex.what();
+        return 0;
+    }
+}
+
 // handles all method call invocations. Basically if you have more than one
 // you need to use a giant if/else if tree to handle them. Ugly.
 static void on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& conn,
-        const Glib::ustring&, // sender
+        const Glib::ustring& sender,
         const Glib::ustring&, // object_path
         const Glib::ustring&, // interface_name
         const Glib::ustring& method_name,
@@ -87,7 +134,9 @@ static void on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& conn,
         uint16_t port = port_variant.get();
         std::string auth = auth_variant.get();
 
-        if (ver != RDPMUX_PROTOCOL_VERSION) {
+        // older librdpmux builds lack some of the messages or only speak msgpack, newer ones switch to them if we
+        // accept their version
+        if (ver < RDPMUX_PROTOCOL_VERSION_MSGPACK || ver > RDPMUX_PROTOCOL_VERSION) {
             invocation->return_value(
                     Glib::VariantContainerBase::create_tuple(
                             Glib::Variant<Glib::ustring>::create("")
@@ -97,7 +146,10 @@ static void on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& conn,
             return;
         }
 
-        if (!broker->RegisterNewVM(uuid, vm_id, auth, port)) {
+        // only needed to place the listener next to the VM, so don't bother the bus otherwise
+        pid_t pid = vm["numa-affinity"].as<bool>() ? sender_pid(conn, sender) : 0;
+
+        if (!broker->RegisterNewVM(uuid, vm_id, auth, port, ver, pid)) {
             LOG(WARNING) << "VM Registration failed!";
             invocation->return_value(
                     Glib::VariantContainerBase::create_tuple(
@@ -107,7 +159,8 @@ static void on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& conn,
             return;
         }
 
-        Glib::ustring g_res = "ipc://@/tmp/rdpmux";
+        // every shard has its own endpoint, so send the VM to the one it was assigned to
+        Glib::ustring g_res = broker->ShardEndpoint(uuid);
         const auto response_variant = Glib::Variant<Glib::ustring>::create(g_res);
         Glib::VariantContainerBase response = Glib::VariantContainerBase::create_tuple(response_variant);
 
@@ -124,11 +177,49 @@ static void on_property_call(Glib::VariantBase& property,
         const Glib::ustring& property_name)
 {
     if (property_name == "SupportedProtocolVersions") {
-        // pretty inextensible way to do this, but since we have no other versions, it'll suffice for now.
+        // newest first, so a library that supports several picks the newest wire format
         auto versions = std::vector<int>();
         versions.push_back(RDPMUX_PROTOCOL_VERSION);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_TRACE);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_HEADS);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_COPY);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_CURSOR);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_HANDLES);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_BINARY);
+        versions.push_back(RDPMUX_PROTOCOL_VERSION_MSGPACK);
         auto ver_var = Glib::Variant<std::vector<int>>::create(versions);
         property = ver_var;
+    } else if (property_name.compare(0, 6, "Broker") == 0) {
+        // per-shard counters, one entry per shard in the same order as BrokerEndpoints
+        std::vector<Glib::ustring> endpoints;
+        std::vector<guint32> vms;
+        std::vector<guint64> received, sent, dropped, queued, input_queued;
+
+        for (auto &stats : broker->ShardStats()) {
+            endpoints.push_back(stats.endpoint);
+            vms.push_back(stats.vms);
+            received.push_back(stats.received);
+            sent.push_back(stats.sent);
+            dropped.push_back(stats.dropped);
+            queued.push_back(stats.queued);
+            input_queued.push_back(stats.input_queued);
+        }
+
+        if (property_name == "BrokerEndpoints") {
+            property = Glib::Variant<std::vector<Glib::ustring>>::create(endpoints);
+        } else if (property_name == "BrokerVMs") {
+            property = Glib::Variant<std::vector<guint32>>::create(vms);
+        } else if (property_name == "BrokerMessagesReceived") {
+            property = Glib::Variant<std::vector<guint64>>::create(received);
+        } else if (property_name == "BrokerMessagesSent") {
+            property = Glib::Variant<std::vector<guint64>>::create(sent);
+        } else if (property_name == "BrokerMessagesDropped") {
+            property = Glib::Variant<std::vector<guint64>>::create(dropped);
+        } else if (property_name == "BrokerQueueDepth") {
+            property = Glib::Variant<std::vector<guint64>>::create(queued);
+        } else if (property_name == "BrokerInputQueueDepth") {
+            property = Glib::Variant<std::vector<guint64>>::create(input_queued);
+        }
     }
 }
 
@@ -187,6 +278,103 @@ void process_options(const int argc, const char *argv[])
                         po::value<uint16_t>()->default_value(3901),
                         "Port to begin spawning listeners on."
                 )
+                (
+                        "last-port",
+                        po::value<uint16_t>()->default_value(65534),
+                        "Last port to spawn listeners on."
+                )
+                (
+                        "broker-threads,b",
+                        po::value<unsigned int>()->default_value(1),
+                        "Number of threads exchanging messages with VMs. VMs are spread evenly over them."
+                )
+                (
+                        "listener-threads",
+                        po::value<unsigned int>()->default_value(0),
+                        "Number of threads running the listeners and producing their frames. 0 gives every listener "
+                        "threads of its own."
+                )
+                (
+                        "broker-cpus",
+                        po::value<std::string>()->default_value(""),
+                        "CPUs to run the broker threads on, e.g. 0-3,8. Empty for any."
+                )
+                (
+                        "rdp-cpus",
+                        po::value<std::string>()->default_value(""),
+                        "CPUs to run the listeners, their encoders and frame production on, e.g. 0-3,8. Empty for any."
+                )
+                (
+                        "numa-affinity",
+                        po::bool_switch()->default_value(false),
+                        "Run every listener on the CPUs of the NUMA node its VM lives on"
+                )
+                (
+                        "codec-policy",
+                        po::value<std::string>()->default_value("auto"),
+                        "Codec for listeners: auto (picked from the workload), planar, remotefx or h264."
+                )
+                (
+                        "no-shared-encoding",
+                        po::bool_switch()->default_value(false),
+                        "Encode every frame separately for each client, even if several of them could share an encoding"
+                )
+                (
+                        "shm-passthrough",
+                        po::bool_switch()->default_value(false),
+                        "Encode 32-bit framebuffers straight from shared memory instead of copying them first. "
+                        "Clients may briefly see a torn frame if the VM draws while it's encoded"
+                )
+                (
+                        "idle-timeout",
+                        po::value<unsigned int>()->default_value(0),
+                        "Seconds without clients after which a listener gives back the memory its VM's display takes. "
+                        "0 keeps it forever."
+                )
+                (
+                        "trace-file",
+                        po::value<std::string>()->default_value(""),
+                        "Record when display updates pass each stage on their way to the clients, and write the "
+                        "latest of them to this file on SIGUSR2. Empty disables tracing."
+                )
+                (
+                        "remote-endpoint",
+                        po::value<std::string>()->default_value(""),
+                        "Endpoint to accept VMs of other hosts on, e.g. tcp://0.0.0.0:7000. Empty for none. Needs "
+                        "--remote-key-file and --remote-clients-file."
+                )
+                (
+                        "remote-key-file",
+                        po::value<std::string>()->default_value(""),
+                        "File holding the Z85 encoded CURVE secret key of the remote endpoint."
+                )
+                (
+                        "remote-clients-file",
+                        po::value<std::string>()->default_value(""),
+                        "File holding the Z85 encoded CURVE public keys of the hosts allowed to connect to the remote "
+                        "endpoint, one per line."
+                )
+                (
+                        "remote-auth-file",
+                        po::value<std::string>()->default_value(""),
+                        "Auth file the listeners of remote VMs authenticate clients with. Needed with "
+                        "--remote-endpoint unless --no-auth is given."
+                )
+                (
+                        "remote-window",
+                        po::value<unsigned int>()->default_value(1024),
+                        "Tiles a remote VM may have in flight before it waits for the listener to catch up."
+                )
+                (
+                        "metrics-port",
+                        po::value<uint16_t>()->default_value(0),
+                        "Port to serve Prometheus metrics over HTTP on. 0 disables the exporter."
+                )
+                (
+                        "metrics-address",
+                        po::value<std::string>()->default_value("127.0.0.1"),
+                        "Address to serve Prometheus metrics on."
+                )
                 (
                         "no-auth,n",
                         po::bool_switch()->default_value(false),
@@ -228,6 +416,11 @@ int main(int argc, const char* argv[])
 
     std::signal(SIGINT, handle_SIGINT);
 
+    if (!vm["trace-file"].as<std::string>().empty()) {
+        trace_enabled = true;
+        g_unix_signal_add(SIGUSR2, handle_SIGUSR2, nullptr);
+    }
+
     try {
         introspection_data = Gio::DBus::NodeInfo::create_for_xml(introspection_xml);
     } catch (const Glib::Error &ex) {
@@ -236,15 +429,70 @@ int main(int argc, const char* argv[])
     }
 
     auto port = vm["port"].as<uint16_t>();
+    auto last_port = vm["last-port"].as<uint16_t>();
     bool auth = !vm["no-auth"].as<bool>(); // take the opposite of no-auth to determine whether to auth connections
+    auto broker_threads = vm["broker-threads"].as<unsigned int>();
+    auto listener_threads = vm["listener-threads"].as<unsigned int>();
+
+    if (broker_threads < 1) {
+        LOG(FATAL) << "Need at least one broker thread";
+        return 1;
+    }
+
+    CpuSet broker_cpus, rdp_cpus;
+    if (!CpuSet::Parse(vm["broker-cpus"].as<std::string>(), broker_cpus)) {
+        LOG(FATAL) << "Invalid broker CPU list " << vm["broker-cpus"].as<std::string>();
+        return 1;
+    }
+    if (!CpuSet::Parse(vm["rdp-cpus"].as<std::string>(), rdp_cpus)) {
+        LOG(FATAL) << "Invalid RDP CPU list " << vm["rdp-cpus"].as<std::string>();
+        return 1;
+    }
+
+    auto remote_window = vm["remote-window"].as<unsigned int>();
+    if (remote_window < 1 || remote_window > UINT16_MAX) {
+        LOG(FATAL) << "Remote window must be between 1 and " << UINT16_MAX << " tiles";
+        return 1;
+    }
+
+    auto remote_endpoint = vm["remote-endpoint"].as<std::string>();
+    auto remote_auth = vm["remote-auth-file"].as<std::string>();
+    CurveKeys remote_keys;
+    if (!remote_endpoint.empty()) {
+#ifndef USE_REMOTE
+        LOG(FATAL) << "rdpmux was built without LZ4, and can't take remote VMs";
+        return 1;
+#endif
+        if (!CurveKeys::Load(vm["remote-key-file"].as<std::string>(), vm["remote-clients-file"].as<std::string>(),
+                             remote_keys)) {
+            LOG(FATAL) << "Remote VMs need a valid --remote-key-file and --remote-clients-file";
+            return 1;
+        }
+        if (auth && remote_auth.empty()) {
+            LOG(FATAL) << "Remote VMs need a --remote-auth-file to authenticate their clients with, or --no-auth";
+            return 1;
+        }
+    }
+
+    codec_choice codec_policy;
+    if (!CodecPolicy::Parse(vm["codec-policy"].as<std::string>(), codec_policy)) {
+        LOG(FATAL) << "Invalid codec policy " << vm["codec-policy"].as<std::string>();
+        return 1;
+    }
 
     // final check to make sure starting port is within bounds
     if (port > 0 && port < 65535) {
         if (port < 1024) {
             LOG(WARNING) << "Port number is low (below 1024), may conflict with other system services!";
         }
+        if (last_port < port) {
+            LOG(FATAL) << "Last port " << last_port << " is below the starting port " << port;
+            return 1;
+        }
         try {
-            broker = make_unique<RDPServerWorker>(port, auth); // create broker
+            // create broker
+            broker = make_unique<RDPServerWorker>(port, auth, broker_threads, listener_threads, last_port, broker_cpus,
+                                                  rdp_cpus, remote_endpoint, remote_keys, remote_auth);
         } catch (std::exception &e) {
             LOG(FATAL) << "Error initializing socket: " << e.what();
             return 1;
@@ -259,6 +507,15 @@ int main(int argc, const char* argv[])
         return 1;
     }
 
+    auto metrics_port = vm["metrics-port"].as<uint16_t>();
+    if (metrics_port > 0) {
+        exporter = make_unique<MetricsExporter>([](std::ostream &out) { broker->ExportMetrics(out); });
+        if (!exporter->Start(vm["metrics-address"].as<std::string>(), metrics_port)) {
+            LOG(FATAL) << "Could not start metrics exporter, exiting";
+            return 1;
+        }
+    }
+
     // take the well-known name on the specified bus.
     const auto id = Gio::DBus::own_name(Gio::DBus::BUS_TYPE_SYSTEM,
             "org.RDPMux.RDPMux",
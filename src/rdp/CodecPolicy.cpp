@@ -0,0 +1,217 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <winpr/sysinfo.h>
+#include "rdp/CodecPolicy.h"
+
+/**
+ * @brief Share of the screen changing per frame above which the content is treated as video.
+ */
+#define VIDEO_CHANGED 0.25
+
+/**
+ * @brief Frame rate the content has to keep up to be treated as video.
+ */
+#define VIDEO_FPS 15
+
+/**
+ * @brief Share of the screen changing per frame below which the content is treated as mostly static, e.g. text.
+ */
+#define STATIC_CHANGED 0.02
+
+/**
+ * @brief Bytes per second to a single client above which the bandwidth savings of H.264 are worth it regardless.
+ */
+#define HIGH_BANDWIDTH (4 * 1024 * 1024)
+
+/**
+ * @brief Share of the frame interval encoding may take up before the policy falls back to a cheaper codec.
+ */
+#define ENCODE_BUDGET 0.8
+
+/**
+ * @brief How long H.264 isn't picked after encoding it took longer than the budget, in ms.
+ */
+#define H264_HOLD_DOWN (30 * 1000)
+
+/**
+ * @brief Number of updates in a row a codec has to be the best pick before the listener switches to it.
+ */
+#define SWITCH_AFTER 4
+
+/**
+ * @brief Weight of a new sample in the moving averages.
+ */
+#define SAMPLE_WEIGHT 0.125
+
+CodecPolicy::CodecPolicy() : current(CODEC_REMOTEFX),
+                             candidate(CODEC_REMOTEFX),
+                             streak(0),
+                             changed(0),
+                             frame_time(0),
+                             h264_held_until(0)
+{
+}
+
+bool CodecPolicy::Parse(const std::string &name, codec_choice &policy)
+{
+    if (name == "auto")
+        policy = CODEC_AUTO;
+    else if (name == "planar")
+        policy = CODEC_PLANAR;
+    else if (name == "remotefx")
+        policy = CODEC_REMOTEFX;
+    else if (name == "h264")
+        policy = CODEC_H264;
+    else
+        return false;
+    return true;
+}
+
+const char *CodecPolicy::Name(codec_choice policy)
+{
+    switch (policy) {
+        case CODEC_PLANAR:
+            return "planar";
+        case CODEC_REMOTEFX:
+            return "remotefx";
+        case CODEC_H264:
+            return "h264";
+        default:
+            return "auto";
+    }
+}
+
+void CodecPolicy::FrameProduced(double changed, uint64_t frame_ms)
+{
+    this->changed += SAMPLE_WEIGHT * (changed - this->changed);
+    if (frame_time == 0)
+        frame_time = frame_ms;
+    else
+        frame_time += SAMPLE_WEIGHT * (frame_ms - frame_time);
+}
+
+codec_choice CodecPolicy::pick(uint32_t fps, uint64_t bandwidth)
+{
+    codec_choice best;
+
+    if ((changed >= VIDEO_CHANGED && fps >= VIDEO_FPS) || bandwidth > HIGH_BANDWIDTH)
+        best = CODEC_H264;
+    else if (changed <= STATIC_CHANGED)
+        best = CODEC_PLANAR;
+    else
+        best = CODEC_REMOTEFX;
+
+    // H.264 is encoded in software and the most expensive of the lot. If we can't keep up with it, RemoteFX at least
+    // holds the frame rate. Its frame times are only known while it's in use, so it stays off for a while after.
+    UINT64 now = GetTickCount64();
+    if (current == CODEC_H264 && fps > 0 && frame_time * fps > 1000 * ENCODE_BUDGET)
+        h264_held_until = now + H264_HOLD_DOWN;
+    if (best == CODEC_H264 && now < h264_held_until)
+        best = CODEC_REMOTEFX;
+
+    return best;
+}
+
+codec_choice CodecPolicy::Update(codec_choice policy, uint32_t fps, uint64_t bandwidth)
+{
+    if (policy != CODEC_AUTO) {
+        current = policy;
+        candidate = policy;
+        streak = 0;
+        return policy;
+    }
+
+    codec_choice best = pick(fps, bandwidth);
+    if (best == current) {
+        streak = 0;
+    } else if (best == candidate) {
+        if (++streak >= SWITCH_AFTER) {
+            current = best;
+            streak = 0;
+        }
+    } else {
+        candidate = best;
+        streak = 1;
+    }
+
+    return Codec();
+}
+
+codec_choice CodecPolicy::Codec() const
+{
+    return static_cast<codec_choice>(current.load());
+}
+
+void CodecPolicy::Apply(wArrayList *clients, rdpShadowSurface *surface)
+{
+    codec_choice codec = Codec();
+    std::map<rdpShadowClient *, ClientCodecs> seen;
+
+    ArrayList_Lock(clients);
+    EnterCriticalSection(&(surface->lock));
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (!client || !client->activated)
+            continue;
+
+        ClientCodecs caps = {false, false, FALSE, FALSE, FALSE, FALSE, FALSE, CODEC_AUTO};
+        auto it = this->clients.find(client);
+        if (it != this->clients.end())
+            caps = it->second;
+
+        // clients that are on the codec already only need another go once their GFX caps come in
+        if (caps.applied != codec || (!caps.gfxSaved && client->areGfxCapsReady))
+            switchClient(caps, client, codec);
+        seen[client] = caps;
+    }
+    LeaveCriticalSection(&(surface->lock));
+    ArrayList_Unlock(clients);
+
+    // forget about clients that went away, their pointers may be reused by new ones
+    this->clients.swap(seen);
+}
+
+void CodecPolicy::switchClient(ClientCodecs &caps, rdpShadowClient *client, codec_choice codec)
+{
+    rdpSettings *settings = client->context.settings;
+
+    // remember what the client negotiated before we change anything, that's all we'll ever switch it between
+    if (!caps.saved) {
+        caps.saved = true;
+        caps.remoteFx = settings->RemoteFxCodec;
+        caps.nsCodec = settings->NSCodec;
+    }
+    if (!caps.gfxSaved && client->areGfxCapsReady) {
+        caps.gfxSaved = true;
+        caps.gfxH264 = settings->GfxH264;
+        caps.gfxAVC444 = settings->GfxAVC444;
+        caps.gfxAVC444v2 = settings->GfxAVC444v2;
+    }
+    caps.applied = codec;
+
+    bool h264 = codec == CODEC_H264 && caps.gfxSaved && (caps.gfxH264 || caps.gfxAVC444 || caps.gfxAVC444v2);
+    if (caps.gfxSaved) {
+        settings->GfxH264 = h264 ? caps.gfxH264 : FALSE;
+        settings->GfxAVC444 = h264 ? caps.gfxAVC444 : FALSE;
+        settings->GfxAVC444v2 = h264 ? caps.gfxAVC444v2 : FALSE;
+    }
+
+    // no H.264 on this client means RemoteFX, or whatever the client has instead
+    settings->RemoteFxCodec = codec == CODEC_PLANAR ? FALSE : caps.remoteFx;
+    settings->NSCodec = codec == CODEC_PLANAR ? FALSE : caps.nsCodec;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "rdp/FrameRateController.h"
+
+/**
+ * @brief Lowest rate the controller picks while somebody is connected, so the display never freezes entirely.
+ */
+#define MIN_FPS 1
+
+/**
+ * @brief How much the rate grows per update while the clients keep up.
+ */
+#define FPS_STEP 2
+
+/**
+ * @brief Share of the frame interval that producing a frame may take up. The rest is headroom for the copy out of shm
+ * and for jitter.
+ */
+#define FRAME_BUDGET 0.8
+
+/**
+ * @brief Weight of a new sample in the frame time average.
+ */
+#define FRAME_TIME_WEIGHT 0.125
+
+FrameRateController::FrameRateController(uint32_t max_fps) : max_fps(std::max<uint32_t>(max_fps, MIN_FPS)),
+                                                             rate(0),
+                                                             frame_time(0)
+{
+}
+
+void FrameRateController::FrameProduced(uint64_t frame_ms)
+{
+    if (frame_time == 0)
+        frame_time = frame_ms;
+    else
+        frame_time += FRAME_TIME_WEIGHT * (frame_ms - frame_time);
+}
+
+uint32_t FrameRateController::Update(size_t peers, uint32_t inflight, uint32_t client_fps)
+{
+    uint32_t current = rate.load(std::memory_order_relaxed);
+
+    if (peers == 0) {
+        // forget what we learned about the old clients, whoever connects next gets a fresh start
+        frame_time = 0;
+        rate.store(0, std::memory_order_relaxed);
+        return 0;
+    }
+
+    uint32_t ceiling = max_fps;
+    if (client_fps > 0)
+        ceiling = std::min(ceiling, client_fps);
+    if (frame_time > 0)
+        ceiling = std::min(ceiling, static_cast<uint32_t>(1000 * FRAME_BUDGET / frame_time));
+    ceiling = std::max<uint32_t>(ceiling, MIN_FPS);
+
+    if (current == 0) {
+        // first client: start out at full speed and let the feedback below bring us down if that's too much
+        current = ceiling;
+    } else if (inflight > std::max<uint32_t>(2, current / 4)) {
+        // more than a quarter second worth of frames unacknowledged, the client or its link can't keep up
+        current = current / 2;
+    } else {
+        current += FPS_STEP;
+    }
+
+    current = std::min(std::max<uint32_t>(current, MIN_FPS), ceiling);
+    rate.store(current, std::memory_order_relaxed);
+    return current;
+}
+
+uint32_t FrameRateController::Rate() const
+{
+    return rate.load(std::memory_order_relaxed);
+}
+
+void FrameRateController::SetMaxRate(uint32_t max_fps)
+{
+    this->max_fps = std::max<uint32_t>(max_fps, MIN_FPS);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <freerdp/codec/color.h>
+#include "rdp/PixelConverter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Converts a row of 24 bpp pixels with the shuffle derived from freerdp_image_copy().
+ */
+static void convert_row24(uint8_t *dst, const uint8_t *src, size_t width, const int8_t *shuffle, const uint8_t *fill)
+{
+    for (size_t i = 0; i < width; i++, src += 3, dst += 4) {
+        for (int j = 0; j < 4; j++)
+            dst[j] = shuffle[j] < 0 ? fill[j] : src[shuffle[j]];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * @brief Same as convert_row24(), 4 pixels per pshufb.
+ */
+__attribute__((target("ssse3")))
+static void convert_row24_ssse3(uint8_t *dst, const uint8_t *src, size_t width, const int8_t *shuffle,
+                               const uint8_t *fill)
+{
+    alignas(16) int8_t mask_bytes[16];
+    alignas(16) uint8_t fill_bytes[16];
+    for (int p = 0; p < 4; p++) {
+        for (int j = 0; j < 4; j++) {
+            mask_bytes[p * 4 + j] = shuffle[j] < 0 ? (int8_t) 0x80 : (int8_t) (p * 3 + shuffle[j]);
+            fill_bytes[p * 4 + j] = shuffle[j] < 0 ? fill[j] : 0;
+        }
+    }
+    const __m128i mask = _mm_load_si128((const __m128i *) mask_bytes);
+    const __m128i constant = _mm_load_si128((const __m128i *) fill_bytes);
+
+    // pshufb zeroes the bytes with the top bit set in the mask, which is where the constants are ORed in. Every load
+    // reads 16 bytes for the 12 we use, so stop early enough not to read past the end of the row
+    size_t i = 0;
+    for (; i + 6 <= width; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *) (src + i * 3));
+        pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, mask), constant);
+        _mm_storeu_si128((__m128i *) (dst + i * 4), pixels);
+    }
+    convert_row24(dst + i * 4, src + i * 3, width - i, shuffle, fill);
+}
+#endif
+
+/**
+ * @brief Converts a row of 16 bpp pixels through the lookup table.
+ */
+static void convert_row16(uint8_t *dst, const uint8_t *src, size_t width, const uint32_t *lut)
+{
+    for (size_t i = 0; i < width; i++) {
+        uint16_t pixel;
+        memcpy(&pixel, src + i * 2, sizeof(pixel));
+        memcpy(dst + i * 4, &lut[pixel], sizeof(uint32_t));
+    }
+}
+
+PixelConverter::PixelConverter() : src_format(0), dst_format(0), ready(false), src_bpp(0), shuffle{0, 0, 0, 0},
+                                   fill{0, 0, 0, 0}, ssse3(false)
+{
+#ifdef HAVE_X86_SIMD
+    ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+bool PixelConverter::Prepare(uint32_t src_format, uint32_t dst_format)
+{
+    if (src_bpp != 0 && src_format == this->src_format && dst_format == this->dst_format)
+        return ready;
+
+    this->src_format = src_format;
+    this->dst_format = dst_format;
+    src_bpp = GetBytesPerPixel(src_format);
+    lut.clear();
+    ready = false;
+
+    if (GetBitsPerPixel(dst_format) != 32 || src_format == dst_format)
+        return false; // nothing to convert, freerdp_image_copy() copies those line by line already
+
+    if (GetBitsPerPixel(src_format) == 24)
+        ready = prepare24();
+    else if (GetBitsPerPixel(src_format) == 16)
+        ready = prepare16();
+
+    return ready;
+}
+
+bool PixelConverter::prepare24()
+{
+    // two probes with nothing in common, so a source byte can't be mistaken for a constant or the other way round
+    const BYTE probes[2][3] = {{0x10, 0x20, 0x30}, {0x40, 0x80, 0xC0}};
+
+    for (int p = 0; p < 2; p++) {
+        BYTE out[4];
+        if (!freerdp_image_copy(out, dst_format, 4, 0, 0, 1, 1, probes[p], src_format, 3, 0, 0, NULL,
+                                FREERDP_FLIP_NONE)) {
+            return false;
+        }
+
+        for (int j = 0; j < 4; j++) {
+            int8_t index = -2;
+            for (int i = 0; i < 3; i++) {
+                if (out[j] == probes[p][i])
+                    index = i;
+            }
+            if (index == -2)
+                index = -1; // not from the source, so it had better be the same constant for both probes
+
+            // anything that isn't a plain byte shuffle stays with freerdp_image_copy()
+            if (p > 0 && (shuffle[j] != index || (index < 0 && fill[j] != out[j])))
+                return false;
+            shuffle[j] = index;
+            fill[j] = index < 0 ? out[j] : 0;
+        }
+    }
+    return true;
+}
+
+bool PixelConverter::prepare16()
+{
+    std::vector<uint16_t> pixels(65536);
+    for (size_t i = 0; i < pixels.size(); i++)
+        pixels[i] = (uint16_t) i;
+
+    // convert every pixel there is as one 256x256 image, which gives us a table indexed by the source pixel
+    lut.resize(65536);
+    if (!freerdp_image_copy((BYTE *) lut.data(), dst_format, 256 * 4, 0, 0, 256, 256, (const BYTE *) pixels.data(),
+                            src_format, 256 * 2, 0, 0, NULL, FREERDP_FLIP_NONE)) {
+        lut.clear();
+        return false;
+    }
+    return true;
+}
+
+void PixelConverter::Convert(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t x,
+                             size_t y, size_t width, size_t height)
+{
+    for (size_t row = y; row < y + height; row++) {
+        uint8_t *d = dst + row * dst_stride + x * 4;
+        const uint8_t *s = src + row * src_stride + x * src_bpp;
+
+        if (src_bpp == 2) {
+            convert_row16(d, s, width, lut.data());
+            continue;
+        }
+#ifdef HAVE_X86_SIMD
+        if (ssse3) {
+            convert_row24_ssse3(d, s, width, shuffle, fill);
+            continue;
+        }
+#endif
+        convert_row24(d, s, width, shuffle, fill);
+    }
+}
@@ -16,12 +16,28 @@
 
 #include "rdp/RDPListener.h"
 #include "RDPServerWorker.h"
+#include <algorithm>
 #include <fcntl.h>
+#ifdef USE_REMOTE
+#include <lz4.h>
+#endif
 #include <msgpack/object.hpp>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "rdp/subsystem.h"
+#include "util/Trace.h"
 #include <boost/program_options.hpp>
 
+/**
+ * @brief Number of dirty rects the listener holds on to before collapsing them into their bounding box.
+ */
+#define MAX_DIRTY_RECTS 256
+
+/**
+ * @brief Highest frame rate the Configure DBus method lets a listener run at.
+ */
+#define CONFIG_MAX_FRAME_RATE 120
+
 thread_local RDPListener *rdp_listener_object = NULL;
 extern boost::program_options::variables_map vm;
 
@@ -34,33 +50,115 @@ Glib::ustring RDPListener::introspection_xml =
         "    <method name='SetAuthentication'>"
         "      <arg type='b' name='auth' direction='in' />"
         "    </method>"
+        "    <method name='SetSharedEncoding'>"
+        "      <arg type='b' name='shared' direction='in' />"
+        "    </method>"
+        "    <method name='SetCodecPolicy'>"
+        "      <arg type='s' name='policy' direction='in' />"
+        "    </method>"
+        "    <method name='Configure'>"
+        "      <arg type='a{sv}' name='settings' direction='in' />"
+        "    </method>"
+        "    <method name='GetStats'>"
+        "      <arg type='a{st}' name='stats' direction='out' />"
+        "      <arg type='as' name='peerAddresses' direction='out' />"
+        "      <arg type='at' name='peerBytesSent' direction='out' />"
+        "    </method>"
         "    <method name='Shutdown'></method>"
         "    <property type='i' name='Port' access='read' />"
         "    <property type='i' name='NumConnectedPeers' access='read'/>"
         "    <property type='b' name='RequiresAuthentication' access='read'/>"
+        "    <property type='u' name='FrameRate' access='read'/>"
+        "    <property type='b' name='SharedEncoding' access='read'/>"
+        "    <property type='s' name='CodecPolicy' access='read'/>"
+        "    <property type='s' name='Codec' access='read'/>"
         "  </interface>"
         "</node>";
 
 RDPListener::RDPListener(std::string uuid, int vm_id, uint16_t port, RDPServerWorker *parent, std::string auth,
-                         Glib::RefPtr<Gio::DBus::Connection> conn) : shm_buffer(nullptr),
+                         Glib::RefPtr<Gio::DBus::Connection> conn, int protocol, pid_t pid, bool remote,
+                         int port_probe) : heads(),
                                                                      dbus_conn(conn),
                                                                      parent(parent),
+                                                                     input_shard(nullptr),
+                                                                     input_slot(0),
+                                                                     input_generation(0),
+                                                                     input_fallback(0),
                                                                      port(port),
+                                                                     port_probe(port_probe),
                                                                      uuid(uuid),
                                                                      samfile(),
                                                                      vm_id(vm_id),
+                                                                     protocol_version(protocol),
+                                                                     cursor(),
+                                                                     loop(nullptr),
+                                                                     remote(remote),
+                                                                     remoteWindow(0),
+                                                                     lastHeard(0),
+                                                                     width(0),
+                                                                     height(0),
+                                                                     layoutSerial(0),
                                                                      listener_running(false),
-                                                                     targetFPS(30),
+                                                                     sharedEncoding(true),
+                                                                     shmPassthrough(false),
+                                                                     idleTimeout(0),
+                                                                     codecPolicy(CODEC_AUTO),
+                                                                     activeCodec(CODEC_REMOTEFX),
+                                                                     targetFPS(0),
+                                                                     fpsAnnounced(false),
+                                                                     configPending(false),
                                                                      credential_path()
 {
     WTSRegisterWtsApiFunctionTable(FreeRDP_InitWtsApi());
 
+    for (auto &head : heads)
+        head.shm_fd = -1;
+
+    updateEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    cursorEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!updateEvent || !cursorEvent || !stopEvent) {
+        LOG(FATAL) << "LISTENER " << this << ": Could not create events, exiting.";
+    }
+
     shadow_subsystem_set_entry(RDPMux_ShadowSubsystemEntry);
     server = shadow_server_new();
 
     if (!auth.empty())
         samfile = auth;
     this->Authenticating(!auth.empty());
+    this->SharedEncoding(!vm["no-shared-encoding"].as<bool>());
+    shmPassthrough = vm["shm-passthrough"].as<bool>();
+    idleTimeout = vm["idle-timeout"].as<unsigned int>();
+    remoteWindow = vm["remote-window"].as<unsigned int>();
+    if (remote)
+        lastHeard = metrics_now_us();
+
+    // checked on startup already, anything invalid leaves the threads wherever the scheduler puts them
+    CpuSet::Parse(vm["rdp-cpus"].as<std::string>(), affinity);
+    if (vm["numa-affinity"].as<bool>() && pid > 0) {
+        // the encoders read the framebuffer a lot more often than anything else, so keep them next to its pages
+        int node = numa_node_of_process(pid);
+        CpuSet local = CpuSet::NumaNode(node);
+        if (!affinity.Empty())
+            local = local.Intersect(affinity);
+        if (!local.Empty())
+            affinity = local;
+        VLOG(1) << "LISTENER " << this << ": VM " << pid << " is on NUMA node " << node << ", running on CPUs "
+                << (affinity.Empty() ? "any" : affinity.ToString());
+    }
+
+    codec_choice policy;
+    if (CodecPolicy::Parse(vm["codec-policy"].as<std::string>(), policy))
+        this->CodecPolicySetting(policy); // checked on startup already, anything invalid stays at auto
+
+    config.authenticating = authenticating;
+    config.credential_file = samfile;
+    config.shared_encoding = sharedEncoding;
+    config.codec_policy = CodecPolicySetting();
+    config.max_frame_rate = 0;
+    config.shm_passthrough = shmPassthrough;
+    config.idle_timeout = idleTimeout;
 
     if (!server) {
         LOG(FATAL) << "LISTENER " << this << ": Shadow server didn't alloc properly, exiting.";
@@ -73,21 +171,47 @@ RDPListener::~RDPListener()
         std::lock_guard<std::mutex> lock(listenerStopMutex);
         if (listener_running) {
             listener_running = false;
-            usleep(200000);
+            SetEvent(stopEvent);
+            SetEvent(updateEvent);
         }
     }
+    // stops the subsystem too, and waits for it to finish with the frame it's on
     shadow_server_uninit(server);
     shadow_server_free(server);
+    for (char *path : retiredSamFiles)
+        free(path);
+    CloseHandle(updateEvent);
+    CloseHandle(cursorEvent);
+    CloseHandle(stopEvent);
+    for (auto &head : heads) {
+        head.shm_mapping.reset();
+        if (head.local_header)
+            munmap(head.local_header, head.shm_size);
+        if (head.shm_fd >= 0)
+            close(head.shm_fd);
+    }
     dbus_conn->unregister_object(registered_id);
     WSACleanup();
 }
 
 void RDPListener::RunServer()
 {
-    int status = 0;
-    DWORD exitCode = 0;
+    if (Start()) {
+        // the shadow server thread only ever exits when it's stopped, but we'd rather not hang around if it crashed
+        HANDLE events[] = {stopEvent, this->server->thread};
+        WaitForMultipleObjects(2, events, FALSE, INFINITE);
+        VLOG(1) << "LISTENER " << this << ": Stop requested, shutting down";
+    }
+    shutdown(); // this will trigger destruction of the RDPListener object.
+}
+
+bool RDPListener::Start()
+{
     rdp_listener_object = this; // store a reference to the object in thread-local storage for the shadow server
 
+    // whatever the shadow server starts from here on inherits the affinity, even after this thread got its own back
+    ScopedAffinity pinned(affinity);
+
     std::string config_path = vm["config-path"].as<std::string>();
     this->server->ConfigPath = _strdup(config_path.c_str());
 
@@ -104,106 +228,490 @@ void RDPListener::RunServer()
 
     if (shadow_server_init(this->server) < 0) {
         VLOG(1) << "COULD NOT INIT SHADOW SERVER!!!!!";
-        goto cleanup;
+        return false;
     }
 
     try {
         introspection_data = Gio::DBus::NodeInfo::create_for_xml(introspection_xml);
     } catch (const Glib::Error &ex) {
         LOG(WARNING) << "LISTENER " << this << ": Unable to create introspection data.";
-        goto cleanup;
+        return false;
     }
 
     try {
         registered_id = dbus_conn->register_object(dbus_name, introspection_data->lookup_interface(), vtable);
     } catch (Gio::Error &e) {
         LOG(WARNING) << "LISTENER " << this << ": Could not take listener name on bus. Is there a duplicate registered?";
-        goto cleanup;
+        return false;
     }
 
     this->server->port = this->port;
 
-    // Shadow server run loop
-    if (shadow_server_start(this->server) < 0) {
-        VLOG(1) << "COULD NOT START SHADOW SERVER!!!!!";
-        goto cleanup;
-    }
-
+    // before the subsystem starts checking it, and so a stop requested from here on isn't lost
     {
         std::lock_guard<std::mutex> lock(listenerStopMutex);
         listener_running = true;
     }
 
-    while (true) {
-        WaitForSingleObject(this->server->thread, 150);
-        {
-            std::lock_guard<std::mutex> lock(listenerStopMutex);
-            if (!listener_running) {
-                break;
-            }
-        }
+    // there's no handing a bound socket to the shadow server, so the port is only free for the moment it takes to bind
+    // it again
+    closePortProbe();
+    if (shadow_server_start(this->server) < 0) {
+        VLOG(1) << "COULD NOT START SHADOW SERVER!!!!!";
+        return false;
     }
 
-    VLOG(1) << "LISTENER " << this << ": Main loop exited, exit code " << status;
-cleanup:
-    shutdown(); // this will trigger destruction of the RDPListener object.
+    return true;
+}
+
+HANDLE RDPListener::StopEvent()
+{
+    return stopEvent;
+}
+
+void RDPListener::SetEventLoop(EventLoop *loop)
+{
+    this->loop = loop;
+}
+
+EventLoop *RDPListener::Loop()
+{
+    return loop;
 }
 
 void RDPListener::shutdown()
 {
+    closePortProbe(); // before the port is handed out again
     parent->UnregisterVM(this->uuid, this->port);
 }
 
+void RDPListener::closePortProbe()
+{
+    if (port_probe >= 0) {
+        close(port_probe);
+        port_probe = -1;
+    }
+}
+
 
 void RDPListener::processOutgoingMessage(std::vector<uint16_t> vec)
 {
     QueueItem item = std::make_tuple(vec, this->uuid);
+    // remote VMs aren't in the shard their UUID hashes to, the shard they're in is where input goes too
+    if (input_shard) {
+        input_shard->queueOutgoingMessage(item);
+        return;
+    }
     parent->queueOutgoingMessage(item);
 }
 
-void RDPListener::processIncomingMessage(std::vector<uint32_t> rvec)
+void RDPListener::processInputEvent(uint16_t type, uint16_t code, uint16_t x, uint16_t y, uint16_t flags)
 {
+    metrics.input_events++;
+
+    // the input queue is drained ahead of the outgoing one, so it has to wait until the events in there are out
+    if (input_shard && input_fallback.load(std::memory_order_acquire) == 0) {
+        InputRecord record;
+        record.type = type;
+        record.code = code;
+        record.x = x;
+        record.y = y;
+        record.flags = flags;
+        record.slot = input_slot;
+        record.generation = input_generation;
+        record.queued_us = metrics_now_us();
+        if (input_shard->queueInput(record))
+            return;
+        VLOG(2) << "LISTENER " << this << ": Input queue full, taking the slow path";
+    }
+    metrics.input_slow++;
+    input_fallback.fetch_add(1, std::memory_order_acq_rel);
+
+    std::vector<uint16_t> vec;
+    vec.push_back(type);
+    if (type == KEYBOARD) {
+        vec.push_back(code);
+    } else {
+        vec.push_back(x);
+        vec.push_back(y);
+    }
+    vec.push_back(flags);
+    processOutgoingMessage(vec);
+}
+
+void RDPListener::InputFallbackSent()
+{
+    // a listener registered under the UUID of an earlier one may get to see that one's last events, but never owes any
+    uint32_t pending = input_fallback.load(std::memory_order_relaxed);
+    while (pending > 0 && !input_fallback.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel))
+        ;
+}
+
+void RDPListener::setInputRoute(BrokerShard *shard, uint32_t slot, uint32_t generation)
+{
+    input_shard = shard;
+    input_slot = slot;
+    input_generation = generation;
+}
+
+void RDPListener::processIncomingMessage(const std::vector<uint32_t> &rvec)
+{
+    if (remote)
+        lastHeard = metrics_now_us();
+
+    // the VM is reachable from now on, so let it know what rate we settled on while it wasn't
+    if (!fpsAnnounced.exchange(true)) {
+        sendFrameRate(targetFPS);
+    }
+
     // we filter by what type of message it is
-    if (rvec[0] == DISPLAY_UPDATE) {
+    if (rvec[0] == DISPLAY_UPDATE || rvec[0] == DISPLAY_UPDATE_RECTS) {
         processDisplayUpdate(rvec);
-    } else if (rvec[0] == DISPLAY_SWITCH) {
+    } else if (rvec[0] == DISPLAY_SWITCH || rvec[0] == HEAD_SWITCH) {
         VLOG(2) << "LISTENER " << this << ": processing display switch event now";
         processDisplaySwitch(rvec);
+    } else if (rvec[0] == DISPLAY_COPY) {
+        processDisplayCopy(rvec);
+    } else if (rvec[0] == CURSOR_DEFINE) {
+        processCursorDefine(rvec);
+    } else if (rvec[0] == CURSOR_MOVE) {
+        processCursorMove(rvec);
+    } else if (rvec[0] == REMOTE_REGISTER && remote) {
+        // a remote VM asking for its credits again, or checking whether we're still there
+        if (rvec.size() >= 5 && (rvec[4] & MUX_REMOTE_REGISTER_RESYNC)) {
+            sendResync();
+        } else {
+            std::vector<uint16_t> vec;
+            vec.push_back(REMOTE_CREDIT);
+            vec.push_back(0);
+            processOutgoingMessage(vec);
+        }
     } else if (rvec[0] == SHUTDOWN) {
         VLOG(2) << "LISTENER " << this << ": Shutdown event received!";
-        {
-            std::lock_guard<std::mutex> lock(listenerStopMutex);
-            listener_running = false;
-        }
+        requestStop();
     } else {
         // what the hell have you sent me
         LOG(WARNING) << "Invalid message type sent.";
     }
 }
 
-std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> RDPListener::GetDirtyRegion()
+bool RDPListener::Remote() const
+{
+    return remote;
+}
+
+uint64_t RDPListener::LastHeard() const
+{
+    return lastHeard;
+}
+
+bool RDPListener::BinaryWire() const
+{
+    return protocol_version >= RDPMUX_PROTOCOL_VERSION_BINARY;
+}
+
+bool RDPListener::VmHandles() const
+{
+    return protocol_version >= RDPMUX_PROTOCOL_VERSION_HANDLES;
+}
+
+void RDPListener::requestStop()
+{
+    std::lock_guard<std::mutex> lock(listenerStopMutex);
+    listener_running = false;
+    SetEvent(stopEvent);
+    SetEvent(updateEvent);
+}
+
+std::vector<RECTANGLE_16> RDPListener::TakeDirtyRegion(std::vector<ScreenCopy> &pending, DamageTrace &trace)
 {
+    std::vector<RECTANGLE_16> rects;
     std::lock_guard<std::mutex> lock(dimMutex);
-    return std::make_tuple(x, y, w, h);
+    rects.swap(dirty_rects);
+    pending.clear();
+    pending.swap(copies);
+    trace = dirty_trace;
+    dirty_trace = DamageTrace();
+    // reset under the lock, so damage added right after this can't have its wakeup swallowed
+    ResetEvent(updateEvent);
+    return rects;
 }
 
-void RDPListener::processDisplayUpdate(std::vector<uint32_t> msg)
+HANDLE RDPListener::UpdateEvent()
+{
+    return updateEvent;
+}
+
+void RDPListener::TakeCursor(CursorState &out)
+{
+    std::lock_guard<std::mutex> lock(cursorMutex);
+    if (out.shape_serial != cursor.shape_serial)
+        out = cursor;
+    out.x = cursor.x;
+    out.y = cursor.y;
+    out.visible = cursor.visible;
+    ResetEvent(cursorEvent);
+}
+
+HANDLE RDPListener::CursorEvent()
+{
+    return cursorEvent;
+}
+
+void RDPListener::SetFrameRate(uint32_t fps)
+{
+    if (targetFPS.exchange(fps) != fps && fpsAnnounced) {
+        VLOG(2) << "LISTENER " << this << ": Target frame rate is now " << fps;
+        sendFrameRate(fps);
+    }
+}
+
+uint32_t RDPListener::FrameRate()
+{
+    return targetFPS;
+}
+
+void RDPListener::sendFrameRate(uint32_t fps)
+{
+    std::vector<uint16_t> vec;
+    vec.push_back(DISPLAY_UPDATE_COMPLETE);
+    vec.push_back(1); // success
+    vec.push_back(static_cast<uint16_t>(std::min<uint32_t>(fps, UINT16_MAX)));
+    processOutgoingMessage(vec);
+}
+
+/**
+ * @brief Builds a RECTANGLE_16 out of an (x, y, w, h) quadruple, clamping it to the coordinate range RDP can express.
+ */
+static RECTANGLE_16 make_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    RECTANGLE_16 rect;
+    rect.left = static_cast<UINT16>(std::min<uint32_t>(x, UINT16_MAX));
+    rect.top = static_cast<UINT16>(std::min<uint32_t>(y, UINT16_MAX));
+    rect.right = static_cast<UINT16>(std::min<uint64_t>(static_cast<uint64_t>(x) + w, UINT16_MAX));
+    rect.bottom = static_cast<UINT16>(std::min<uint64_t>(static_cast<uint64_t>(y) + h, UINT16_MAX));
+    return rect;
+}
+
+void RDPListener::processDisplayUpdate(const std::vector<uint32_t> &msg)
 {
     // note that under current calling conditions, this will run in the mainloop of the RDPServerWorker.
+    std::vector<RECTANGLE_16> rects;
+    DamageTrace update_trace;
 
     VLOG(3) << "LISTENER " << this << ": Now processing display update message";
+
+    if (msg.at(0) == DISPLAY_UPDATE) {
+        rects.push_back(make_rect(msg.at(1), msg.at(2), msg.at(3), msg.at(4)));
+    } else {
+        uint32_t count = msg.at(1);
+        if (msg.size() < 2 + 4 * static_cast<size_t>(count)) {
+            LOG(WARNING) << "LISTENER " << this << ": Truncated display update with " << count << " rects received";
+            return;
+        }
+        rects.reserve(count);
+        for (size_t i = 2; i < 2 + 4 * static_cast<size_t>(count); i += 4) {
+            rects.push_back(make_rect(msg[i], msg[i + 1], msg[i + 2], msg[i + 3]));
+        }
+
+        // seq, refresh_us and sent_us follow the rects if the VM timed the update
+        size_t end = 2 + 4 * static_cast<size_t>(count);
+        if (msg.size() >= end + 3) {
+            uint64_t now = metrics_now_us();
+            update_trace.valid = true;
+            update_trace.seq = msg[end];
+            update_trace.refresh_us = trace_vm_time(msg[end + 1], now);
+            trace(TRACE_VM_REFRESH, vm_id, update_trace.seq, update_trace.refresh_us);
+            trace(TRACE_VM_SENT, vm_id, update_trace.seq, trace_vm_time(msg[end + 2], now));
+            trace(TRACE_RECEIVED, vm_id, update_trace.seq, now);
+        }
+    }
+
+    metrics.display_updates++;
+    metrics.dirty_rects += rects.size();
+    addDamage(rects, update_trace);
+}
+
+void RDPListener::addDamage(std::vector<RECTANGLE_16> &rects, const DamageTrace &trace)
+{
     {
         std::lock_guard<std::mutex> lock(dimMutex);
-        x = msg.at(1);
-        y = msg.at(2);
-        w = msg.at(3);
-        h = msg.at(4);
+        if (dirty_rects.empty()) {
+            dirty_rects.swap(rects);
+        } else {
+            dirty_rects.insert(dirty_rects.end(), rects.begin(), rects.end());
+        }
+        dirty_trace.Merge(trace);
+
+        // the subsystem is rate limited, so updates can pile up in between two frames. Past a certain point the
+        // bounding box is cheaper to handle than the individual rects.
+        if (dirty_rects.size() > MAX_DIRTY_RECTS) {
+            RECTANGLE_16 bounds = dirty_rects[0];
+            for (auto &r : dirty_rects) {
+                bounds.left = std::min(bounds.left, r.left);
+                bounds.top = std::min(bounds.top, r.top);
+                bounds.right = std::max(bounds.right, r.right);
+                bounds.bottom = std::max(bounds.bottom, r.bottom);
+            }
+            dirty_rects.assign(1, bounds);
+        }
+
+        SetEvent(updateEvent);
     }
 }
 
-std::tuple<int, int, int> RDPListener::GetRDPFormat()
+static bool rects_intersect(const RECTANGLE_16 &a, const RECTANGLE_16 &b)
+{
+    return a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+}
+
+void RDPListener::processTiles(const char *data, size_t size)
+{
+    if (!remote) {
+        LOG(WARNING) << "LISTENER " << this << ": Tiles received from a VM that shares its framebuffer";
+        return;
+    }
+    lastHeard = metrics_now_us();
+
+    bool valid = wire_decode_tiles(data, size, incomingTiles);
+    std::vector<RECTANGLE_16> rects;
+    MuxShmHeader *writing = nullptr;
+    uint32_t applied = 0;
+
+    // only this thread ever moves or replaces the heads, so they can be read without holding the lock
+    for (size_t i = 0; valid && i < incomingTiles.size(); i++) {
+        const WireTile &tile = incomingTiles[i];
+        DisplayHead *head = tile.head < MUX_MAX_HEADS ? &heads[tile.head] : nullptr;
+        size_t bpp = head ? (PIXMAN_FORMAT_BPP(head->format) + 7) / 8 : 0;
+        if (!head || !head->local_header || bpp == 0 || tile.w == 0 || tile.h == 0 ||
+            tile.w > MUX_REMOTE_TILE_SIZE || tile.h > MUX_REMOTE_TILE_SIZE ||
+            (uint64_t) tile.x + tile.w > head->width || (uint64_t) tile.y + tile.h > head->height) {
+            valid = false;
+            break;
+        }
+
+        int raw = static_cast<int>(tile.w * tile.h * bpp);
+        if (tileScratch.size() < (size_t) raw)
+            tileScratch.resize(raw);
+#ifdef USE_REMOTE
+        if (LZ4_decompress_safe(tile.data, tileScratch.data(), static_cast<int>(tile.size), raw) != raw) {
+            valid = false;
+            break;
+        }
+#else
+        // built without LZ4, there are no remote VMs to get here
+        valid = false;
+        break;
+#endif
+
+        // one write section for every run of tiles of the same head, so the subsystem retries its copy at most once
+        if (head->local_header != writing) {
+            if (writing)
+                shm_write_end(writing);
+            writing = head->local_header;
+            shm_write_begin(writing);
+        }
+        size_t stride = (size_t) head->width * bpp;
+        uint8_t *dst = (uint8_t *) writing + MUX_SHM_HEADER_SIZE + tile.y * stride + tile.x * bpp;
+        for (uint32_t row = 0; row < tile.h; row++)
+            memcpy(dst + row * stride, tileScratch.data() + row * tile.w * bpp, tile.w * bpp);
+
+        rects.push_back(make_rect(head->x + tile.x, head->y + tile.y, tile.w, tile.h));
+        metrics.remote_bytes += tile.size;
+        applied++;
+    }
+    if (writing)
+        shm_write_end(writing);
+
+    metrics.remote_tiles += applied;
+    if (!rects.empty()) {
+        // remote VMs don't send the damage separately, their tiles are it
+        metrics.display_updates++;
+        metrics.dirty_rects += rects.size();
+        addDamage(rects, DamageTrace());
+    }
+
+    if (!valid) {
+        LOG(WARNING) << "LISTENER " << this << ": Invalid tiles received, asking the VM for every head again";
+        metrics.dropped++;
+        sendResync();
+        return;
+    }
+
+    std::vector<uint16_t> vec;
+    vec.push_back(REMOTE_CREDIT);
+    vec.push_back(static_cast<uint16_t>(applied));
+    processOutgoingMessage(vec);
+}
+
+void RDPListener::sendResync()
+{
+    std::vector<uint16_t> vec;
+    vec.push_back(REMOTE_RESYNC);
+    vec.push_back(static_cast<uint16_t>(std::min<uint32_t>(remoteWindow, UINT16_MAX)));
+    processOutgoingMessage(vec);
+}
+
+void RDPListener::processDisplayCopy(const std::vector<uint32_t> &msg)
+{
+    uint32_t count = msg.at(1);
+    if (msg.size() < 2 + 6 * static_cast<size_t>(count)) {
+        LOG(WARNING) << "LISTENER " << this << ": Truncated display copy with " << count << " copies received";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(dimMutex);
+    for (size_t i = 2; i < 2 + 6 * static_cast<size_t>(count); i += 6) {
+        ScreenCopy copy;
+        copy.src = make_rect(msg[i], msg[i + 1], msg[i + 4], msg[i + 5]);
+        copy.dst_x = static_cast<UINT16>(std::min<uint32_t>(msg[i + 2], UINT16_MAX));
+        copy.dst_y = static_cast<UINT16>(std::min<uint32_t>(msg[i + 3], UINT16_MAX));
+
+        // every copy queued so far goes first, so only damage still pending can spoil the source. Damage coming in
+        // later is applied after the copy, and doesn't matter.
+        bool stale = std::any_of(dirty_rects.begin(), dirty_rects.end(), [&copy](const RECTANGLE_16 &r) {
+            return rects_intersect(r, copy.src);
+        });
+        if (stale || copies.size() >= MAX_DIRTY_RECTS) {
+            dirty_rects.push_back(make_rect(msg[i + 2], msg[i + 3], msg[i + 4], msg[i + 5]));
+            metrics.copies_damaged++;
+        } else {
+            copies.push_back(copy);
+        }
+    }
+    SetEvent(updateEvent);
+}
+
+void RDPListener::processCursorDefine(const std::vector<uint32_t> &msg)
+{
+    uint32_t w = msg.at(3), h = msg.at(4);
+    if (w > MUX_CURSOR_MAX_SIZE || h > MUX_CURSOR_MAX_SIZE || msg.size() < 5 + static_cast<size_t>(w) * h) {
+        LOG(WARNING) << "LISTENER " << this << ": Invalid " << w << "x" << h << " cursor shape received";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(cursorMutex);
+    cursor.shape_serial = std::max<uint32_t>(cursor.shape_serial + 1, 1); // 0 means no shape, even on wrap-around
+    cursor.hot_x = std::min(msg[1], w > 0 ? w - 1 : 0);
+    cursor.hot_y = std::min(msg[2], h > 0 ? h - 1 : 0);
+    cursor.width = w;
+    cursor.height = h;
+    cursor.pixels.assign(msg.begin() + 5, msg.begin() + 5 + w * h);
+    SetEvent(cursorEvent);
+}
+
+void RDPListener::processCursorMove(const std::vector<uint32_t> &msg)
+{
+    std::lock_guard<std::mutex> lock(cursorMutex);
+    cursor.x = std::min<uint32_t>(msg.at(1), UINT16_MAX);
+    cursor.y = std::min<uint32_t>(msg.at(2), UINT16_MAX);
+    cursor.visible = msg.at(3) != 0;
+    SetEvent(cursorEvent);
+}
+
+std::tuple<int, int, int> RDPListener::GetRDPFormat(pixman_format_code_t format)
 {
-    switch (this->format)
+    switch (format)
     {
         case PIXMAN_r8g8b8a8:
         case PIXMAN_r8g8b8x8:
@@ -224,43 +732,305 @@ std::tuple<int, int, int> RDPListener::GetRDPFormat()
     }
 }
 
-void RDPListener::processDisplaySwitch(std::vector<uint32_t> msg)
+bool RDPListener::mapSharedMemory(int shim_fd, size_t expected_size, DisplayHead &head, MuxShmHeader *local)
+{
+    VLOG(3) << "LISTENER " << this << ": shim_fd is " << shim_fd;
+
+    // the VM may have replaced a named region again since it sent the message, so trust the region over the message
+    struct stat st;
+    if (fstat(shim_fd, &st) < 0 || (size_t) st.st_size < MUX_SHM_HEADER_SIZE) {
+        LOG(WARNING) << "LISTENER " << this << ": shmem region is missing or truncated";
+        close(shim_fd);
+        return false;
+    }
+    size_t region_size = (size_t) st.st_size;
+    if (region_size != expected_size) {
+        VLOG(2) << "LISTENER " << this << ": shmem region is " << region_size << " bytes, expected " << expected_size;
+    }
+
+#ifdef F_GET_SEALS
+    // an unsealed memfd could be truncated by the VM while we read from it, and take the whole server down with SIGBUS
+    int seals = fcntl(shim_fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) == 0) {
+        LOG(WARNING) << "LISTENER " << this << ": memfd passed by the VM isn't sealed against shrinking";
+        close(shim_fd);
+        return false;
+    }
+#endif
+
+    const MuxShmHeader *header = mapRegion(shim_fd, region_size);
+    if (!header) {
+        close(shim_fd);
+        return false;
+    }
+
+    {
+        // the descriptor stays open so the region can be mapped again after the listener hibernated
+        // a frame still being encoded from the old mapping holds on to it until it's done
+        std::shared_ptr<const ShmMapping> mapping = std::make_shared<ShmMapping>(header, region_size);
+        std::lock_guard<std::mutex> lock(shmMutex);
+        if (head.local_header)
+            munmap(head.local_header, head.shm_size);
+        if (head.shm_fd >= 0)
+            close(head.shm_fd);
+        head.shm_mapping.swap(mapping);
+        head.shm_header = header;
+        head.local_header = local;
+        head.shm_buffer = (uint8_t *) header + header->header_size;
+        head.shm_size = region_size;
+        head.shm_fd = shim_fd;
+    }
+
+    VLOG(2) << "LISTENER " << this << ": mmap() completed successfully! Yayyyyyy";
+    return true;
+}
+
+bool RDPListener::createLocalRegion(size_t size, DisplayHead &head)
+{
+#ifdef MFD_ALLOW_SEALING
+    int fd = memfd_create("rdpmux-remote", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    int fd = -1;
+    errno = ENOSYS;
+#endif
+    if (fd < 0) {
+        LOG(WARNING) << "LISTENER " << this << ": Could not create framebuffer for remote VM: " << strerror(errno);
+        return false;
+    }
+
+    // sealed like the memfds VMs pass, so it's mapped by the same rules
+    if (ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        LOG(WARNING) << "LISTENER " << this << ": Could not size framebuffer for remote VM: " << strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        LOG(WARNING) << "mmap() failed: " << strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    auto header = (MuxShmHeader *) region;
+    header->version = RDPMUX_PROTOCOL_VERSION;
+    header->header_size = MUX_SHM_HEADER_SIZE;
+    // the magic is what mapRegion() checks first, so it goes in last
+    __atomic_store_n(&header->magic, MUX_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    if (!mapSharedMemory(fd, size, head, header)) {
+        munmap(region, size);
+        return false;
+    }
+    return true;
+}
+
+ShmMapping::~ShmMapping()
+{
+    munmap((void *) header, size);
+}
+
+const MuxShmHeader *RDPListener::mapRegion(int shm_fd, size_t size)
+{
+    void *shm_region = mmap(NULL, size, PROT_READ, MAP_SHARED, shm_fd, 0);
+    if (shm_region == MAP_FAILED) {
+        LOG(WARNING) << "mmap() failed: " << strerror(errno);
+        return nullptr;
+    }
+
+    // the region layout hasn't changed since the last msgpack-only version, only the messages have
+    auto header = (const MuxShmHeader *) shm_region;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != MUX_SHM_MAGIC ||
+        header->version < RDPMUX_PROTOCOL_VERSION_MSGPACK || header->version > RDPMUX_PROTOCOL_VERSION ||
+        header->header_size != MUX_SHM_HEADER_SIZE) {
+        LOG(WARNING) << "LISTENER " << this << ": shmem region has an unknown header, refusing to use it";
+        munmap(shm_region, size);
+        return nullptr;
+    }
+
+#ifdef MADV_HUGEPAGE
+    // lets the kernel map the region with huge PMDs if the VM got it backed by hugepages
+    madvise(shm_region, size, MADV_HUGEPAGE);
+#endif
+
+    return header;
+}
+
+void RDPListener::ReleaseSharedMemory()
+{
+    std::lock_guard<std::mutex> lock(shmMutex);
+    for (auto &head : heads) {
+        if (!head.shm_header)
+            continue;
+        head.shm_mapping.reset();
+        head.shm_header = nullptr;
+        head.shm_buffer = nullptr;
+
+        // the framebuffer of a remote VM only lives in the listener's own region, so give back its pages there
+        if (head.local_header) {
+            madvise((uint8_t *) head.local_header + MUX_SHM_HEADER_SIZE, head.shm_size - MUX_SHM_HEADER_SIZE,
+                    MADV_REMOVE);
+        }
+    }
+    VLOG(2) << "LISTENER " << this << ": Unmapped the framebuffers of every head";
+}
+
+void RDPListener::RestoreSharedMemory()
+{
+    std::lock_guard<std::mutex> lock(shmMutex);
+    for (auto &head : heads) {
+        if (head.shm_header || head.shm_fd < 0)
+            continue;
+
+        // a named region may have been truncated by the VM in the meantime, which mapping it would only find out
+        // with SIGBUS
+        struct stat st;
+        if (fstat(head.shm_fd, &st) < 0 || (size_t) st.st_size < head.shm_size) {
+            LOG(WARNING) << "LISTENER " << this << ": shmem region shrank while the listener hibernated";
+            continue;
+        }
+        const MuxShmHeader *header = mapRegion(head.shm_fd, head.shm_size);
+        if (!header)
+            continue;
+        head.shm_mapping = std::make_shared<ShmMapping>(header, head.shm_size);
+        head.shm_header = header;
+        head.shm_buffer = (uint8_t *) header + header->header_size;
+    }
+    VLOG(2) << "LISTENER " << this << ": Mapped the framebuffers of every head again";
+
+    // whatever a remote VM sent us before is gone
+    if (remote)
+        sendResync();
+}
+
+unsigned int RDPListener::IdleTimeout()
+{
+    return idleTimeout;
+}
+
+int RDPListener::VmId() const
+{
+    return vm_id;
+}
+
+void RDPListener::processDisplaySwitch(const std::vector<uint32_t> &msg, int shm_fd)
 {
     // note that under current calling conditions, this will run in the thread of the RDPServerWorker associated with
     // the VM.
     VLOG(2) << "LISTENER " << this << ": Now processing display switch event";
+    if (msg.size() < (msg.at(0) == HEAD_SWITCH ? 8u : 5u)) {
+        LOG(WARNING) << "LISTENER " << this << ": Display switch message is too short";
+        if (shm_fd >= 0)
+            close(shm_fd);
+        return;
+    }
     uint32_t displayWidth = msg.at(2);
     uint32_t displayHeight = msg.at(3);
     pixman_format_code_t displayFormat = (pixman_format_code_t) msg.at(1);
-    int shim_fd;
-    size_t shm_size = 4096 * 2048 * sizeof(uint32_t);
+    size_t displayShmSize = msg.at(4);
+    uint32_t index = msg.at(0) == HEAD_SWITCH ? msg.at(5) : 0;
+    uint32_t headX = msg.at(0) == HEAD_SWITCH ? msg.at(6) : 0;
+    uint32_t headY = msg.at(0) == HEAD_SWITCH ? msg.at(7) : 0;
+
+    // the desktop has to fit into the coordinates RDP can express, and heads drawing over each other would make the
+    // damage of one overwrite the other
+    RECTANGLE_16 headRect = make_rect(headX, headY, displayWidth, displayHeight);
+    bool valid = index < MUX_MAX_HEADS && (uint64_t) headX + displayWidth <= UINT16_MAX &&
+                 (uint64_t) headY + displayHeight <= UINT16_MAX;
+    for (uint32_t i = 0; valid && i < MUX_MAX_HEADS; i++) {
+        // only this thread ever moves or replaces the heads, so where they are can be read without holding the lock
+        const DisplayHead &other = heads[i];
+        if (i != index && other.shm_fd >= 0 &&
+            rects_intersect(headRect, make_rect(other.x, other.y, other.width, other.height))) {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        LOG(WARNING) << "LISTENER " << this << ": Refusing head " << index << " at " << headX << "," << headY
+                     << ", it's out of range or overlaps another head";
+        if (shm_fd >= 0)
+            close(shm_fd);
+        return;
+    }
+    DisplayHead &head = heads[index];
+    size_t displaySize = (size_t) displayWidth * displayHeight * ((PIXMAN_FORMAT_BPP(displayFormat) + 7) / 8);
 
     // TODO: clear all queues if necessary
 
-    // map in new shmem region if it's the first time
-    if (!shm_buffer) {
+    if (shm_fd >= 0) {
+        // every descriptor we get is a brand new region, so always remap
+        if (!mapSharedMemory(shm_fd, displayShmSize, head))
+            return;
+    } else if (remote) {
+        // nothing of a remote VM's is shared with us, so the region is ours, and sized by us
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t regionSize = (MUX_SHM_HEADER_SIZE + displaySize + page - 1) / page * page;
+        if (head.shm_fd < 0 || regionSize != head.shm_size) {
+            if (!createLocalRegion(regionSize, head))
+                return;
+        }
+    } else if (head.shm_fd < 0 || displayShmSize != head.shm_size) {
+        // map in the named shmem region if it's the first time, or if the VM replaced it with one of a different size
         std::stringstream ss;
-        ss << "/" << vm_id << ".rdpmux";
-
-        VLOG(2) << "LISTENER " << this << ": Creating new shmem buffer from path " << ss.str();
-        shim_fd = shm_open(ss.str().data(), O_RDONLY, S_IRUSR | S_IRGRP | S_IROTH);
-        VLOG(3) << "LISTENER " << this << ": shim_fd is " << shim_fd;
+        if (index == 0)
+            ss << "/" << vm_id << ".rdpmux";
+        else
+            ss << "/" << vm_id << "." << index << ".rdpmux";
 
-        void *shm_buffer = mmap(NULL, shm_size, PROT_READ, MAP_SHARED, shim_fd, 0);
-        if (shm_buffer == MAP_FAILED) {
-            LOG(WARNING) << "mmap() failed: " << strerror(errno);
+        VLOG(2) << "LISTENER " << this << ": Mapping shmem buffer from path " << ss.str();
+        int shim_fd = shm_open(ss.str().data(), O_RDONLY, S_IRUSR | S_IRGRP | S_IROTH);
+        if (shim_fd < 0) {
+            LOG(WARNING) << "shm_open() failed: " << strerror(errno);
+            return;
+        }
+        if (!mapSharedMemory(shim_fd, displayShmSize, head)) {
             // todo: send this information to the backend service so it can trigger a retry
             return;
         }
-        VLOG(2) << "LISTENER " << this << ": mmap() completed successfully! Yayyyyyy";
-        this->shm_buffer = shm_buffer;
     }
 
-    this->width = displayWidth;
-    this->height = displayHeight;
-    this->format = displayFormat;
+    // the subsystem copies straight out of the mapping, so never accept a geometry it doesn't fit
+    if (MUX_SHM_HEADER_SIZE + displaySize > head.shm_size) {
+        LOG(WARNING) << "LISTENER " << this << ": " << displayWidth << "x" << displayHeight
+                     << " framebuffer doesn't fit into the " << head.shm_size << " byte shmem region";
+        return;
+    }
+
+    // for a remote VM, we're the ones writing the region, header and all. Its tiles follow the switch.
+    if (head.local_header) {
+        shm_write_begin(head.local_header);
+        head.local_header->width = displayWidth;
+        head.local_header->height = displayHeight;
+        head.local_header->stride = displayWidth * ((PIXMAN_FORMAT_BPP(displayFormat) + 7) / 8);
+        head.local_header->format = displayFormat;
+        shm_write_end(head.local_header);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shmMutex);
+        head.x = headX;
+        head.y = headY;
+        head.width = displayWidth;
+        head.height = displayHeight;
+        head.format = displayFormat;
+
+        // the desktop starts at the top left corner, wherever the heads are
+        size_t desktopWidth = 0, desktopHeight = 0;
+        for (auto &h : heads) {
+            if (h.shm_fd >= 0) {
+                desktopWidth = std::max<size_t>(desktopWidth, h.x + h.width);
+                desktopHeight = std::max<size_t>(desktopHeight, h.y + h.height);
+            }
+        }
+        this->width = desktopWidth;
+        this->height = desktopHeight;
+        head.switch_serial = ++layoutSerial;
+    }
+
+    // wake up the subsystem so it picks up the new geometry without waiting for the next damage
+    SetEvent(updateEvent);
 
-    VLOG(2) << "LISTENER " << this << ": Display switch processed successfully!";
+    VLOG(2) << "LISTENER " << this << ": Display switch of head " << index << " processed successfully!";
 }
 
 size_t RDPListener::Width()
@@ -273,6 +1043,11 @@ size_t RDPListener::Height()
     return this->height;
 }
 
+uint32_t RDPListener::LayoutSerial()
+{
+    return layoutSerial;
+}
+
 std::string RDPListener::CredentialPath()
 {
     return credential_path;
@@ -285,18 +1060,239 @@ bool RDPListener::Authenticating()
 
 void RDPListener::Authenticating(bool auth)
 {
+    rdpSettings *settings = this->server->settings;
+
+    // the shadow server's listener thread copies these for every client it accepts, without a lock we could take. So
+    // the new protocols are enabled before the old ones are disabled, which leaves a client accepted in between with
+    // either of them, but never with none, or with NLA and no SAM file. It takes clients accepted after this returns
+    // to be sure of the new setting.
     this->authenticating = auth;
     if (auth) {
-        this->server->settings->NlaSecurity = TRUE;
-        this->server->settings->TlsSecurity = FALSE;
-        this->server->settings->RdpSecurity = FALSE;
-        if (!this->server->settings->NtlmSamFile)
-            this->server->settings->NtlmSamFile = _strdup(this->samfile.c_str());
+        if (!settings->NtlmSamFile)
+            settings->NtlmSamFile = _strdup(this->samfile.c_str());
+        std::atomic_thread_fence(std::memory_order_release);
+        settings->NlaSecurity = TRUE;
+        std::atomic_thread_fence(std::memory_order_release);
+        settings->TlsSecurity = FALSE;
+        settings->RdpSecurity = FALSE;
     } else {
-        this->server->settings->NlaSecurity = FALSE;
-        this->server->settings->TlsSecurity = TRUE;
-        this->server->settings->RdpSecurity = TRUE;
+        settings->TlsSecurity = TRUE;
+        settings->RdpSecurity = TRUE;
+        std::atomic_thread_fence(std::memory_order_release);
+        settings->NlaSecurity = FALSE;
+    }
+}
+
+bool RDPListener::SharedEncoding()
+{
+    return sharedEncoding;
+}
+
+void RDPListener::SharedEncoding(bool shared)
+{
+    this->sharedEncoding = shared;
+}
+
+/**
+ * @brief Gets the value of a setting passed to Configure, checking it has the type the setting takes.
+ *
+ * @returns Whether the value has the right type.
+ */
+template <typename T>
+static bool config_value(const Glib::ustring &name, const Glib::VariantBase &value, T &out, Glib::ustring &error)
+{
+    Glib::VariantType type = Glib::Variant<T>::variant_type();
+    if (!value.is_of_type(type)) {
+        error = name + Glib::ustring(" must be of type ") + Glib::ustring(type.get_string()) + Glib::ustring(", not ") +
+                Glib::ustring(value.get_type_string());
+        return false;
     }
+    out = Glib::VariantBase::cast_dynamic<Glib::Variant<T>>(value).get();
+    return true;
+}
+
+bool RDPListener::Configure(const std::map<Glib::ustring, Glib::VariantBase> &settings, Glib::ustring &error)
+{
+    std::lock_guard<std::mutex> lock(configMutex);
+    ListenerConfig next = configPending ? staged : config;
+
+    // everything is checked before anything is staged, so a call either changes all of its settings or none
+    for (auto &setting : settings) {
+        const Glib::ustring &name = setting.first;
+        const Glib::VariantBase &value = setting.second;
+        Glib::ustring text;
+
+        if (name == "authentication") {
+            if (!config_value(name, value, next.authenticating, error))
+                return false;
+        } else if (name == "credential-file") {
+            if (!config_value(name, value, text, error))
+                return false;
+            next.credential_file = text;
+        } else if (name == "shared-encoding") {
+            if (!config_value(name, value, next.shared_encoding, error))
+                return false;
+        } else if (name == "codec-policy") {
+            if (!config_value(name, value, text, error))
+                return false;
+            if (!CodecPolicy::Parse(text, next.codec_policy)) {
+                error = "codec-policy must be one of auto, planar, remotefx or h264";
+                return false;
+            }
+        } else if (name == "max-frame-rate") {
+            if (!config_value(name, value, next.max_frame_rate, error))
+                return false;
+            if (next.max_frame_rate > CONFIG_MAX_FRAME_RATE) {
+                error = "max-frame-rate must be at most " + std::to_string(CONFIG_MAX_FRAME_RATE);
+                return false;
+            }
+        } else if (name == "shm-passthrough") {
+            if (!config_value(name, value, next.shm_passthrough, error))
+                return false;
+        } else if (name == "idle-timeout") {
+            if (!config_value(name, value, next.idle_timeout, error))
+                return false;
+        } else {
+            error = "Unknown setting " + name;
+            return false;
+        }
+    }
+
+    if (next.authenticating && next.credential_file.empty()) {
+        error = "authentication needs a credential-file";
+        return false;
+    }
+
+    staged = next;
+    configPending = true;
+
+    // under the lock the subsystem resets the event with, so it can't miss the wakeup after it took the damage
+    std::lock_guard<std::mutex> dimLock(dimMutex);
+    SetEvent(updateEvent);
+    return true;
+}
+
+bool RDPListener::ApplyConfig(ListenerConfig &applied)
+{
+    if (!configPending)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(configMutex);
+        config = staged;
+        configPending = false;
+        applied = config;
+    }
+
+    if (applied.credential_file != samfile) {
+        samfile = applied.credential_file;
+        credential_path = samfile;
+        // the shadow server thread reads the settings for every client it accepts, without a lock we could take, so the
+        // old path is replaced by the new one in one go and kept around until that thread is gone
+        char *retired = this->server->settings->NtlmSamFile;
+        this->server->settings->NtlmSamFile = applied.authenticating ? _strdup(samfile.c_str()) : NULL;
+        if (retired)
+            retiredSamFiles.push_back(retired);
+    }
+    this->Authenticating(applied.authenticating);
+    this->SharedEncoding(applied.shared_encoding);
+    this->CodecPolicySetting(applied.codec_policy);
+    shmPassthrough = applied.shm_passthrough;
+    idleTimeout = applied.idle_timeout;
+
+    VLOG(1) << "LISTENER " << this << ": New settings applied";
+    return true;
+}
+
+ListenerMetrics &RDPListener::Metrics()
+{
+    return metrics;
+}
+
+void RDPListener::SetPeerStats(std::vector<PeerStats> peers)
+{
+    std::lock_guard<std::mutex> lock(peerMutex);
+    this->peers.swap(peers);
+}
+
+std::vector<PeerStats> RDPListener::PeerStatsSnapshot()
+{
+    std::lock_guard<std::mutex> lock(peerMutex);
+    return peers;
+}
+
+std::vector<std::pair<std::string, uint64_t>> RDPListener::Stats()
+{
+    std::vector<std::pair<std::string, uint64_t>> stats;
+    size_t pending;
+    {
+        std::lock_guard<std::mutex> lock(dimMutex);
+        pending = dirty_rects.size();
+    }
+
+    stats.emplace_back("display_updates", metrics.display_updates);
+    stats.emplace_back("dirty_rects", metrics.dirty_rects);
+    stats.emplace_back("dirty_rects_pending", pending);
+    stats.emplace_back("dirty_pixels", metrics.dirty_pixels);
+    stats.emplace_back("frames", metrics.frames);
+    stats.emplace_back("frames_deferred", metrics.frames_deferred);
+    stats.emplace_back("copies", metrics.copies);
+    stats.emplace_back("copies_damaged", metrics.copies_damaged);
+    stats.emplace_back("bytes_sent", metrics.bytes_sent);
+    stats.emplace_back("input_events", metrics.input_events);
+    stats.emplace_back("input_slow_path", metrics.input_slow);
+    stats.emplace_back("dropped_messages", metrics.dropped);
+    stats.emplace_back("remote_tiles", metrics.remote_tiles);
+    stats.emplace_back("remote_bytes", metrics.remote_bytes);
+    stats.emplace_back("peers", ArrayList_Count(this->server->clients));
+    stats.emplace_back("frame_rate", targetFPS);
+
+    // histograms are summed up as count, sum and a couple of percentiles, the full buckets are in the Prometheus export
+    const std::pair<const char *, const Histogram *> histograms[] = {
+            {"encode_time_us", &metrics.encode_time},
+            {"input_latency_us", &metrics.input_latency},
+            {"frame_latency_us", &metrics.frame_latency}
+    };
+    for (auto &histogram : histograms) {
+        HistogramSnapshot snapshot = histogram.second->Snapshot();
+        std::string name = histogram.first;
+        stats.emplace_back(name + "_count", snapshot.count);
+        stats.emplace_back(name + "_sum", snapshot.sum);
+        stats.emplace_back(name + "_p50", snapshot.Percentile(0.5));
+        stats.emplace_back(name + "_p99", snapshot.Percentile(0.99));
+    }
+
+    return stats;
+}
+
+const std::string &RDPListener::UUID() const
+{
+    return uuid;
+}
+
+bool RDPListener::ShmPassthrough()
+{
+    return shmPassthrough;
+}
+
+codec_choice RDPListener::CodecPolicySetting()
+{
+    return static_cast<codec_choice>(codecPolicy.load());
+}
+
+void RDPListener::CodecPolicySetting(codec_choice policy)
+{
+    this->codecPolicy = policy;
+}
+
+void RDPListener::SetCodec(codec_choice codec)
+{
+    if (activeCodec.exchange(codec) != codec)
+        VLOG(2) << "LISTENER " << this << ": Now encoding with " << CodecPolicy::Name(codec);
+}
+
+codec_choice RDPListener::Codec()
+{
+    return static_cast<codec_choice>(activeCodec.load());
 }
 
 void RDPListener::on_method_call(const Glib::RefPtr<Gio::DBus::Connection> &, /* connection */
@@ -307,24 +1303,57 @@ void RDPListener::on_method_call(const Glib::RefPtr<Gio::DBus::Connection> &, /*
                                  const Glib::VariantContainerBase &parameters,
                                  const Glib::RefPtr<Gio::DBus::MethodInvocation> &invocation)
 {
-    if (method_name == "SetCredentialFile") {
+    // the setters are shorthands for Configure with a single setting, and take effect the same way
+    auto configure = [this, &invocation](const std::map<Glib::ustring, Glib::VariantBase> &settings) {
+        Glib::ustring message;
+        if (!this->Configure(settings, message)) {
+            Gio::DBus::Error error(Gio::DBus::Error::INVALID_ARGS, message);
+            invocation->return_error(error);
+            return;
+        }
+        invocation->return_value(Glib::VariantContainerBase());
+    };
+
+    if (method_name == "Configure") {
+        Glib::Variant<std::map<Glib::ustring, Glib::VariantBase>> settings_variant;
+        parameters.get_child(settings_variant, 0);
+        configure(settings_variant.get());
+    } else if (method_name == "SetCredentialFile") {
         Glib::Variant<std::string> cred_variant;
         parameters.get_child(cred_variant, 0);
-
-        credential_path = cred_variant.get();
-
-        invocation->return_value(Glib::VariantContainerBase());
+        configure({{"credential-file", Glib::Variant<Glib::ustring>::create(cred_variant.get())}});
     } else if (method_name == "SetAuthentication") {
         Glib::Variant<bool> auth_variant;
         parameters.get_child(auth_variant, 0);
-        this->Authenticating(auth_variant.get());
-        invocation->return_value(Glib::VariantContainerBase());
+        configure({{"authentication", auth_variant}});
+    } else if (method_name == "SetSharedEncoding") {
+        Glib::Variant<bool> shared_variant;
+        parameters.get_child(shared_variant, 0);
+        configure({{"shared-encoding", shared_variant}});
+    } else if (method_name == "SetCodecPolicy") {
+        Glib::Variant<std::string> policy_variant;
+        parameters.get_child(policy_variant, 0);
+        configure({{"codec-policy", Glib::Variant<Glib::ustring>::create(policy_variant.get())}});
+    } else if (method_name == "GetStats") {
+        std::map<Glib::ustring, guint64> stats;
+        for (auto &stat : Stats())
+            stats[stat.first] = stat.second;
+
+        std::vector<Glib::ustring> addresses;
+        std::vector<guint64> bytes_sent;
+        for (auto &peer : PeerStatsSnapshot()) {
+            addresses.push_back(peer.address);
+            bytes_sent.push_back(peer.bytes_sent);
+        }
+
+        std::vector<Glib::VariantBase> response;
+        response.push_back(Glib::Variant<std::map<Glib::ustring, guint64>>::create(stats));
+        response.push_back(Glib::Variant<std::vector<Glib::ustring>>::create(addresses));
+        response.push_back(Glib::Variant<std::vector<guint64>>::create(bytes_sent));
+        invocation->return_value(Glib::VariantContainerBase::create_tuple(response));
     } else if (method_name == "Shutdown") {
         LOG(INFO) << "LISTENER " << this << ": Manually shutting down listener!";
-        {
-            std::lock_guard<std::mutex> lock(listenerStopMutex);
-            listener_running = false;
-        }
+        requestStop();
         invocation->return_value(Glib::VariantContainerBase());
     } else {
         Gio::DBus::Error error(Gio::DBus::Error::UNKNOWN_METHOD,
@@ -346,6 +1375,14 @@ void RDPListener::on_property_call(Glib::VariantBase &property,
         property = Glib::Variant<uint32_t>::create(ArrayList_Count(this->server->clients));
     } else if (property_name == "RequiresAuthentication") {
         property = Glib::Variant<bool>::create(authenticating);
+    } else if (property_name == "FrameRate") {
+        property = Glib::Variant<uint32_t>::create(targetFPS);
+    } else if (property_name == "SharedEncoding") {
+        property = Glib::Variant<bool>::create(sharedEncoding);
+    } else if (property_name == "CodecPolicy") {
+        property = Glib::Variant<Glib::ustring>::create(CodecPolicy::Name(CodecPolicySetting()));
+    } else if (property_name == "Codec") {
+        property = Glib::Variant<Glib::ustring>::create(CodecPolicy::Name(Codec()));
     }
 }
 
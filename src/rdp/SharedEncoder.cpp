@@ -0,0 +1,177 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <freerdp/log.h>
+#include "rdp/SharedEncoder.h"
+#include "rdp/subsystem.h"
+
+#define TAG SERVER_TAG("rdpmux.encoder")
+
+/**
+ * @brief Initial size of the stream RemoteFX messages are serialized into. Grows as needed.
+ */
+#define STREAM_SIZE (1024 * 1024)
+
+SharedEncoder::SharedEncoder() : rfx(nullptr), width(0), height(0), stream(nullptr), frameId(0)
+{
+}
+
+SharedEncoder::~SharedEncoder()
+{
+    if (rfx)
+        rfx_context_free(rfx);
+    if (stream)
+        Stream_Free(stream, TRUE);
+}
+
+bool SharedEncoder::Compatible(rdpShadowClient *client, rdpShadowSurface *surface)
+{
+    rdpSettings *settings = client->context.settings;
+
+    if (!client->activated || client->suppressOutput || client->inLobby || !client->mayView || client->resizeRequested)
+        return false;
+
+    // graphics pipeline clients may switch over to it at any point, leave those to their own encoder
+    if (!settings->RemoteFxCodec || settings->SupportGraphicsPipeline || settings->ColorDepth != 32)
+        return false;
+    if (!rdpmux_subsystem_sends_directly(client))
+        return false;
+
+    return settings->DesktopWidth == (UINT32) surface->width && settings->DesktopHeight == (UINT32) surface->height;
+}
+
+std::shared_ptr<const SharedEncoder::Frame> SharedEncoder::Encode(rdpShadowSurface *surface, const RECTANGLE_16 *rects,
+                                                                   UINT32 numRects,
+                                                                   const std::vector<rdpShadowClient *> &clients)
+{
+    UINT32 maxDataSize = 0;
+    int numMessages = 0;
+    std::vector<RFX_RECT> rfxRects;
+
+    if (!rfx) {
+        if (!(rfx = rfx_context_new(TRUE)) || !(stream = Stream_New(NULL, STREAM_SIZE))) {
+            WLog_ERR(TAG, "Could not create shared RemoteFX encoder");
+            return nullptr;
+        }
+        rfx->mode = clients.front()->server->rfxMode;
+        rfx_context_set_pixel_format(rfx, PIXEL_FORMAT_BGRX32);
+    }
+
+    // the codec headers only go out with the first message after a reset, and a client that missed them can't decode
+    // anything. Resetting whenever somebody new joins makes sure everybody has seen them.
+    bool newcomer = std::any_of(clients.begin(), clients.end(), [this](rdpShadowClient *client) {
+        return std::find(audience.begin(), audience.end(), client) == audience.end();
+    });
+    if (newcomer || width != (UINT32) surface->width || height != (UINT32) surface->height) {
+        width = surface->width;
+        height = surface->height;
+        rfx_context_reset(rfx, width, height);
+    }
+    audience = clients;
+
+    // every message has to fit in the smallest fragment any of the clients accepts
+    for (auto client : clients) {
+        UINT32 size = client->context.settings->MultifragMaxRequestSize;
+        if (maxDataSize == 0 || size < maxDataSize)
+            maxDataSize = size;
+    }
+
+    for (UINT32 i = 0; i < numRects; i++) {
+        RFX_RECT rect;
+        rect.x = rects[i].left;
+        rect.y = rects[i].top;
+        rect.width = rects[i].right - rects[i].left;
+        rect.height = rects[i].bottom - rects[i].top;
+        rfxRects.push_back(rect);
+    }
+
+    RFX_MESSAGE *rfxMessages = rfx_encode_messages(rfx, rfxRects.data(), rfxRects.size(), surface->data,
+                                                   surface->width, surface->height, surface->scanline, &numMessages,
+                                                   (int) maxDataSize);
+    if (!rfxMessages) {
+        WLog_ERR(TAG, "Shared RemoteFX encoding failed");
+        audience.clear(); // whatever state the encoder is in now, start over with headers next time
+        return nullptr;
+    }
+
+    auto frame = std::make_shared<Frame>();
+    frame->width = width;
+    frame->height = height;
+    frame->messages.resize(numMessages);
+
+    bool ok = true;
+    for (int i = 0; i < numMessages; i++) {
+        Stream_SetPosition(stream, 0);
+        if (ok && rfx_write_message(rfx, stream, &rfxMessages[i])) {
+            frame->messages[i].assign(Stream_Buffer(stream), Stream_Buffer(stream) + Stream_GetPosition(stream));
+        } else if (ok) {
+            WLog_ERR(TAG, "Could not serialize shared RemoteFX message");
+            audience.clear();
+            ok = false;
+        }
+        rfx_message_free(rfx, &rfxMessages[i]);
+    }
+    free(rfxMessages);
+
+    if (!ok)
+        return nullptr;
+
+    // zero is never handed out, it's what a frame acknowledgement carries when it doesn't acknowledge anything
+    if (++frameId == 0)
+        frameId = 1;
+    frame->frameId = frameId;
+    return frame;
+}
+
+bool SharedEncoder::Send(rdpShadowClient *client, const Frame &frame)
+{
+    rdpSettings *settings = client->context.settings;
+    rdpUpdate *update = client->context.update;
+    SURFACE_BITS_COMMAND cmd = { 0 };
+    BOOL ret = TRUE;
+    size_t count = frame.messages.size();
+
+    // a resize may be underway on the client's thread, the next frame is encoded for the new size
+    if (!client->activated || settings->DesktopWidth != frame.width || settings->DesktopHeight != frame.height)
+        return false;
+
+    cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+    cmd.destLeft = 0;
+    cmd.destTop = 0;
+    cmd.destRight = frame.width;
+    cmd.destBottom = frame.height;
+    cmd.bmp.bpp = 32;
+    cmd.bmp.flags = 0;
+    cmd.bmp.codecID = settings->RemoteFxCodecId; // the only thing in the PDU that differs between clients
+    cmd.bmp.width = frame.width;
+    cmd.bmp.height = frame.height;
+    cmd.skipCompression = TRUE;
+
+    for (size_t i = 0; i < count && ret; i++) {
+        cmd.bmp.bitmapDataLength = frame.messages[i].size();
+        cmd.bmp.bitmapData = (BYTE *) frame.messages[i].data();
+
+        if (settings->SurfaceFrameMarkerEnabled)
+            IFCALLRET(update->SurfaceFrameBits, ret, update->context, &cmd, i == 0, i + 1 == count, frame.frameId);
+        else
+            IFCALLRET(update->SurfaceBits, ret, update->context, &cmd);
+    }
+
+    if (!ret)
+        WLog_WARN(TAG, "Could not send shared frame to client %p", (void *) client);
+    return ret == TRUE;
+}
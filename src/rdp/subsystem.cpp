@@ -2,11 +2,37 @@
 // Created by sramanujam on 5/23/17.
 //
 
+#include <sys/mman.h>
+#include <unistd.h>
 #include <winpr/sysinfo.h>
+#include <algorithm>
+#include <iterator>
+#include <thread>
 #include "rdp/subsystem.h"
+#include "util/Trace.h"
 
 #define TAG SERVER_TAG("rdpmux.subsystem")
 
+/**
+ * @brief Raster operation of a plain copy, SRCCOPY.
+ */
+#define ROP_SRCCOPY 0xCC
+
+/**
+ * @brief How many times a frame copy is retried when the VM writes to the framebuffer while it is being read.
+ */
+#define SHM_READ_ATTEMPTS 4
+
+/**
+ * @brief Highest frame rate a listener runs at.
+ */
+#define MAX_FRAME_RATE 30
+
+/**
+ * @brief How often the frame rate is recomputed while somebody is connected, in ms.
+ */
+#define RATE_UPDATE_INTERVAL 250
+
 extern thread_local RDPListener *rdp_listener_object;
 
 void rdpmux_synchronize_event(rdpmuxShadowSubsystem *system, rdpShadowClient *client, UINT32 flags)
@@ -29,29 +55,202 @@ void rdpmux_extended_mouse_event(rdpmuxShadowSubsystem *subsystem,
 void rdpmux_keyboard_event(rdpmuxShadowSubsystem *system,
                                            rdpShadowClient *client, UINT16 flags, UINT16 code)
 {
-    std::vector<uint16_t> vec;
-    vec.push_back(KEYBOARD);
-    vec.push_back(code);
-    vec.push_back(flags);
-    system->listener->processOutgoingMessage(vec);
+    system->listener->processInputEvent(KEYBOARD, code, 0, 0, flags);
 }
 
 void rdpmux_mouse_event(rdpmuxShadowSubsystem *system,
                                         rdpShadowClient *client, UINT16 flags, UINT16 x, UINT16 y)
 {
-    std::vector<uint16_t> vec;
-    vec.push_back(MOUSE);
-    vec.push_back(x);
-    vec.push_back(y);
-    vec.push_back(flags);
-    system->listener->processOutgoingMessage(vec);
+    *system->lastMouseClient = client;
+    system->listener->processInputEvent(MOUSE, 0, x, y, flags);
+}
+
+/**
+ * @brief Frees a pointer message once the last client it was posted to is done with it.
+ */
+static void rdpmux_pointer_message_free(UINT32 id, SHADOW_MSG_OUT *msg)
+{
+    if (id == SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE_ID) {
+        free(((SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *) msg)->xorMaskData);
+        free(((SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *) msg)->andMaskData);
+    }
+    free(msg);
+}
+
+/**
+ * @brief Converts the cursor shape into a pointer message. A hidden cursor goes out as a transparent one.
+ */
+static BOOL rdpmux_pointer_shape(const CursorState *cursor, SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *msg)
+{
+    UINT32 transparent = 0;
+    BOOL shown = cursor->visible && cursor->width > 0 && cursor->height > 0;
+    msg->xHot = shown ? cursor->hot_x : 0;
+    msg->yHot = shown ? cursor->hot_y : 0;
+    msg->width = shown ? cursor->width : 1;
+    msg->height = shown ? cursor->height : 1;
+    BYTE *pixels = (BYTE *) (shown ? cursor->pixels.data() : &transparent);
+
+    // a8r8g8b8 in host byte order is BGRA in memory, which is what the conversion takes
+    return shadow_subsystem_pointer_convert_alpha_pointer_data(pixels, FALSE, msg->width, msg->height, msg) >= 0;
+}
+
+/**
+ * @brief Posts the cursor shape to a client's thread as an alpha pointer.
+ */
+static BOOL rdpmux_subsystem_post_pointer_shape(rdpShadowClient *client, const CursorState *cursor)
+{
+    auto msg = (SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE *) calloc(1, sizeof(SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE));
+    if (!msg)
+        return FALSE;
+
+    if (!rdpmux_pointer_shape(cursor, msg)) {
+        free(msg);
+        return FALSE;
+    }
+    msg->common.Free = rdpmux_pointer_message_free;
+    return shadow_client_post_msg(client, NULL, SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE_ID, (SHADOW_MSG_OUT *) msg, NULL);
+}
+
+/**
+ * @brief Posts the cursor position to a client's thread.
+ */
+static BOOL rdpmux_subsystem_post_pointer_position(rdpShadowClient *client, const CursorState *cursor)
+{
+    auto msg = (SHADOW_MSG_OUT_POINTER_POSITION_UPDATE *) calloc(1, sizeof(SHADOW_MSG_OUT_POINTER_POSITION_UPDATE));
+    if (!msg)
+        return FALSE;
+
+    msg->xPos = cursor->x;
+    msg->yPos = cursor->y;
+    msg->common.Free = rdpmux_pointer_message_free;
+    return shadow_client_post_msg(client, NULL, SHADOW_MSG_OUT_POINTER_POSITION_UPDATE_ID, (SHADOW_MSG_OUT *) msg,
+                                  NULL);
+}
+
+/**
+ * @brief Sends the cursor shape to a client as an alpha pointer, the way its own thread sends a posted one. The caller
+ * must hold the surface lock, see rdpmux_subsystem_sends_directly().
+ */
+static BOOL rdpmux_subsystem_send_pointer_shape(rdpShadowClient *client, const CursorState *cursor)
+{
+    rdpUpdate *update = client->context.update;
+    SHADOW_MSG_OUT_POINTER_ALPHA_UPDATE msg = { 0 };
+    POINTER_NEW_UPDATE pointerNew = { 0 };
+    POINTER_CACHED_UPDATE pointerCached = { 0 };
+    BOOL ret = FALSE;
+
+    if (!rdpmux_pointer_shape(cursor, &msg))
+        return FALSE;
+
+    POINTER_COLOR_UPDATE *pointerColor = &(pointerNew.colorPtrAttr);
+    pointerNew.xorBpp = 24;
+    pointerColor->cacheIndex = 0;
+    pointerColor->xPos = msg.xHot;
+    pointerColor->yPos = msg.yHot;
+    pointerColor->width = msg.width;
+    pointerColor->height = msg.height;
+    pointerColor->lengthAndMask = msg.lengthAndMask;
+    pointerColor->lengthXorMask = msg.lengthXorMask;
+    pointerColor->xorMaskData = msg.xorMaskData;
+    pointerColor->andMaskData = msg.andMaskData;
+    pointerCached.cacheIndex = pointerColor->cacheIndex;
+
+    IFCALLRET(update->pointer->PointerNew, ret, update->context, &pointerNew);
+    if (ret)
+        IFCALLRET(update->pointer->PointerCached, ret, update->context, &pointerCached);
+
+    free(msg.xorMaskData);
+    free(msg.andMaskData);
+    return ret;
+}
+
+/**
+ * @brief Sends the cursor position to a client. The caller must hold the surface lock, see
+ * rdpmux_subsystem_sends_directly().
+ */
+static BOOL rdpmux_subsystem_send_pointer_position(rdpShadowClient *client, const CursorState *cursor)
+{
+    rdpUpdate *update = client->context.update;
+    POINTER_POSITION_UPDATE position = { 0 };
+    BOOL ret = FALSE;
+
+    position.xPos = cursor->x;
+    position.yPos = cursor->y;
+    IFCALLRET(update->pointer->PointerPosition, ret, update->context, &position);
+    return ret;
+}
+
+BOOL rdpmux_subsystem_sends_directly(rdpShadowClient *client)
+{
+    return !client->context.settings->UseRdpSecurityLayer;
+}
+
+/**
+ * @brief Hands the VM's cursor to the clients as an RDP pointer, so moving it costs a pointer update instead of
+ * re-encoding the part of the framebuffer it was drawn into.
+ *
+ * Clients that don't have the current shape yet, because it changed or because they only just connected, get it along
+ * with the position. Everybody else only gets the position, except for the client that moved the mouse last: its own
+ * pointer is already where the VM's cursor follows it to, and sending the position back would only make it jitter.
+ *
+ * Pointer updates are sent from here, under the surface lock, to every client that allows it, so they never get in
+ * between the fragments of a frame sent from here as well. Only clients on the RDP security layer are posted theirs.
+ */
+static void rdpmux_subsystem_update_cursor(rdpmuxShadowSubsystem *system)
+{
+    CursorState *cursor = system->cursor;
+    UINT32 x = cursor->x, y = cursor->y;
+    bool visible = cursor->visible;
+
+    system->listener->TakeCursor(*cursor);
+    if (cursor->shape_serial == 0)
+        return; // the VM draws its cursor into the framebuffer
+
+    bool moved = cursor->x != x || cursor->y != y;
+    bool shown = cursor->visible != visible;
+    rdpShadowClient *mover = *system->lastMouseClient;
+    wArrayList *clients = system->server->clients;
+    rdpShadowSurface *surface = system->server->surface;
+    std::map<rdpShadowClient *, UINT32> seen;
+
+    ArrayList_Lock(clients);
+    EnterCriticalSection(&(surface->lock));
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (!client || !client->activated)
+            continue; // pointer updates are dropped until the client is activated, try again once it is
+
+        bool direct = rdpmux_subsystem_sends_directly(client);
+        auto sendShape = direct ? rdpmux_subsystem_send_pointer_shape : rdpmux_subsystem_post_pointer_shape;
+        auto sendPosition = direct ? rdpmux_subsystem_send_pointer_position : rdpmux_subsystem_post_pointer_position;
+
+        auto it = system->cursorPeers->find(client);
+        bool current = it != system->cursorPeers->end() && it->second == cursor->shape_serial;
+        if (!current || shown) {
+            if (!sendShape(client, cursor))
+                continue;
+            sendPosition(client, cursor);
+        } else if (moved && client != mover) {
+            sendPosition(client, cursor);
+        }
+        seen[client] = cursor->shape_serial;
+    }
+    LeaveCriticalSection(&(surface->lock));
+    ArrayList_Unlock(clients);
+
+    // clients that went away drop out of the map, so a new one reusing their pointer gets the shape
+    system->cursorPeers->swap(seen);
 }
 
 int rdpmux_subsystem_process_message(rdpmuxShadowSubsystem *system, wMessage *message)
 {
     switch(message->id) {
 	case SHADOW_MSG_IN_REFRESH_REQUEST_ID:
-	    shadow_subsystem_frame_update((rdpShadowSubsystem *) system);
+	    // picked up by the next frame, which recopies the whole surface. Clients ask for one once they're activated,
+	    // which is also when they can take the cursor.
+	    system->fullRefresh = TRUE;
+	    rdpmux_subsystem_update_cursor(system);
 	    break;
 	default:
         WLog_WARN(TAG, "Unprocessed message: %u", message->id);
@@ -65,70 +264,570 @@ int rdpmux_subsystem_process_message(rdpmuxShadowSubsystem *system, wMessage *me
     return 1;
 }
 
-void rdpmux_subsystem_update_frame(rdpmuxShadowSubsystem *system)
+/**
+ * @brief Encodes the invalid region once for all clients that can share an encoding, and sends it to them.
+ *
+ * Clients that can't share get the invalid region added to their own, so the shadow server's per-client encoding
+ * still picks it up for them once the surface's invalid region has been cleared. Nothing is shared unless at least two
+ * clients can share, since a single client gains nothing from it.
+ *
+ * @returns Whether the frame still needs to go through the shadow server's own encoding.
+ */
+static BOOL rdpmux_subsystem_share_frame(rdpmuxShadowSubsystem *system)
 {
-    rdpShadowServer *server = system->server;
-    rdpShadowSurface *surface = server->surface;
-    RECTANGLE_16 invalidRect, surfaceRect;
-    const RECTANGLE_16 *extents = NULL;
+    rdpShadowSurface *surface = system->server->surface;
+    wArrayList *clients = system->server->clients;
+    std::vector<rdpShadowClient *> shared;
+    std::vector<rdpShadowClient *> fallback;
+    const RECTANGLE_16 *rects;
+    UINT32 numRects = 0;
+
+    if (!system->listener->SharedEncoding())
+        return TRUE;
+
+    // held until the frame is sent, so none of the clients goes away under us
+    ArrayList_Lock(clients);
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (!client)
+            continue;
+        if (system->sharedEncoder->Compatible(client, surface))
+            shared.push_back(client);
+        else
+            fallback.push_back(client);
+    }
+
+    if (shared.size() < 2) {
+        ArrayList_Unlock(clients);
+        return TRUE;
+    }
+
+    EnterCriticalSection(&(surface->lock));
+    rects = region16_rects(&(surface->invalidRegion), &numRects);
+    auto frame = system->sharedEncoder->Encode(surface, rects, numRects, shared);
+    BOOL encoded = frame != nullptr;
+    if (encoded) {
+        for (auto client : fallback) {
+            EnterCriticalSection(&(client->lock));
+            for (UINT32 i = 0; i < numRects; i++)
+                region16_union_rect(&(client->invalidRegion), &(client->invalidRegion), &rects[i]);
+            LeaveCriticalSection(&(client->lock));
+        }
+        region16_clear(&(surface->invalidRegion));
+
+        // before the frame update, so it also goes out ahead of whatever the clients' threads send for the frame
+        for (auto client : shared)
+            SharedEncoder::Send(client, *frame);
+    }
+    LeaveCriticalSection(&(surface->lock));
+    ArrayList_Unlock(clients);
+
+    return !encoded || !fallback.empty();
+}
+
+/**
+ * @brief Hands the frame in the surface's invalid region to the clients, and records how long that took.
+ *
+ * @param changedArea Number of pixels in the invalid region.
+ */
+static void rdpmux_subsystem_publish_frame(rdpmuxShadowSubsystem *system, UINT64 changedArea)
+{
+    rdpShadowSurface *surface = system->server->surface;
+
+    ListenerMetrics &metrics = system->listener->Metrics();
+
+    // this returns once every client has encoded the frame or timed out doing so, which makes it a decent measure
+    // of how much work a frame is
+    uint64_t frameStart = metrics_now_us();
+    if (rdpmux_subsystem_share_frame(system))
+        shadow_subsystem_frame_update((rdpShadowSubsystem *) system);
+    uint64_t frameTime = metrics_now_us() - frameStart;
+    system->rateController->FrameProduced(frameTime / 1000);
+    system->codecPolicy->FrameProduced((double) changedArea / ((UINT64) surface->width * surface->height),
+                                       frameTime / 1000);
+
+    metrics.frames++;
+    metrics.dirty_pixels += changedArea;
+    metrics.encode_time.Record(frameTime);
+
+    DamageTrace *pending = system->trace;
+    if (pending->valid) {
+        uint64_t now = frameStart + frameTime;
+        trace(TRACE_FRAME_SENT, system->listener->VmId(), pending->seq, now);
+        metrics.frame_latency.Record(now - std::min(pending->refresh_us, now));
+        *pending = DamageTrace();
+    }
+}
+
+/**
+ * @brief Publishes the frame with the surface pointing straight at the VM's framebuffer, instead of copying the
+ * invalid region into the surface first. The head is the caller's copy, whose reference keeps the mapping in place
+ * until the clients are done encoding, even if the listener switches displays meanwhile.
+ *
+ * The surface gets its own buffer back before this returns, so the shadow server never gets to resize or free the
+ * mapping. The seqlock is checked once the clients are done; if the VM drew in the meantime, the frame they got may be
+ * torn, so the invalid region is put back for the next frame to fix it up.
+ *
+ * @returns FALSE if the frame has to be redone, TRUE otherwise.
+ */
+static BOOL rdpmux_subsystem_passthrough_frame(rdpmuxShadowSubsystem *system, const DisplayHead &head,
+                                               UINT64 changedArea)
+{
+    rdpShadowSurface *surface = system->server->surface;
+    const MuxShmHeader *header = head.shm_header;
+    REGION16 frameRegion;
+    uint64_t seq = 1;
+
+    for (int attempt = 0; attempt < SHM_READ_ATTEMPTS && (seq & 1); attempt++) {
+        seq = shm_read_begin(header);
+        if (seq & 1)
+            std::this_thread::yield();
+    }
+    if (seq & 1)
+        return FALSE; // the VM is busy drawing, try again with the next frame
+
+    if (header->width != head.width || header->height != head.height || header->stride != surface->scanline)
+        return TRUE; // a display switch is on its way, wait for it
+
+    region16_init(&frameRegion);
+    EnterCriticalSection(&(surface->lock));
+    region16_copy(&frameRegion, &(surface->invalidRegion));
+    BYTE *data = surface->data;
+    surface->data = (BYTE *) head.shm_buffer; // only ever read by the encoders
+    LeaveCriticalSection(&(surface->lock));
+
+    rdpmux_subsystem_publish_frame(system, changedArea);
+
+    EnterCriticalSection(&(surface->lock));
+    surface->data = data;
+    BOOL consistent = shm_read_valid(header, seq);
+    if (consistent) {
+        region16_clear(&(surface->invalidRegion));
+    } else {
+        WLog_DBG(TAG, "Framebuffer changed while encoding, redoing frame");
+        system->listener->Metrics().frames_deferred++;
+        region16_union(&(surface->invalidRegion), &(surface->invalidRegion), &frameRegion);
+    }
+    LeaveCriticalSection(&(surface->lock));
+    region16_uninit(&frameRegion);
+
+    return consistent;
+}
+
+/**
+ * @brief Moves a block of the surface the way the VM moved it in its framebuffer. The caller must hold the surface
+ * lock, and make sure both source and destination are inside the surface.
+ */
+static void rdpmux_surface_copy(rdpShadowSurface *surface, const ScreenCopy &copy)
+{
+    size_t width = (size_t) (copy.src.right - copy.src.left) * 4;
+    int height = copy.src.bottom - copy.src.top;
+    const BYTE *src = surface->data + (size_t) copy.src.top * surface->scanline + copy.src.left * 4;
+    BYTE *dst = surface->data + (size_t) copy.dst_y * surface->scanline + copy.dst_x * 4;
+
+    // rows are copied in the direction that never overwrites a source row before it was read
+    if (copy.dst_y > copy.src.top) {
+        for (int row = height - 1; row >= 0; row--)
+            memmove(dst + (size_t) row * surface->scanline, src + (size_t) row * surface->scanline, width);
+    } else {
+        for (int row = 0; row < height; row++)
+            memmove(dst + (size_t) row * surface->scanline, src + (size_t) row * surface->scanline, width);
+    }
+}
+
+/**
+ * @brief Gets the rectangle a copy lands on.
+ */
+static RECTANGLE_16 rdpmux_copy_destination(const ScreenCopy &copy)
+{
+    RECTANGLE_16 dst;
+    dst.left = copy.dst_x;
+    dst.top = copy.dst_y;
+    dst.right = (UINT16) std::min<UINT32>(copy.dst_x + (copy.src.right - copy.src.left), UINT16_MAX);
+    dst.bottom = (UINT16) std::min<UINT32>(copy.dst_y + (copy.src.bottom - copy.src.top), UINT16_MAX);
+    return dst;
+}
+
+/**
+ * @brief Checks whether a client can be sent copies of a surface as screen-to-screen blits.
+ */
+static BOOL rdpmux_subsystem_can_blit(rdpShadowClient *client, rdpShadowSurface *surface)
+{
+    rdpSettings *settings = client->context.settings;
+
+    // the graphics pipeline has no place for drawing orders, and its codecs keep state a blit would get out of sync
+    return !settings->SupportGraphicsPipeline && settings->OrderSupport[NEG_SCRBLT_INDEX] &&
+           rdpmux_subsystem_sends_directly(client) && settings->DesktopWidth == (UINT32) surface->width &&
+           settings->DesktopHeight == (UINT32) surface->height;
+}
+
+/**
+ * @brief Sends copies to a client as screen-to-screen blits. The caller must hold the surface lock, see
+ * rdpmux_subsystem_sends_directly().
+ *
+ * Copies whose source the client doesn't show yet, because it still has to be sent its own share of an earlier frame,
+ * are added to the surface's invalid region at their destination instead, for the frame to send.
+ */
+static void rdpmux_client_blit(rdpShadowClient *client, const std::vector<ScreenCopy> &copies,
+                               rdpShadowSurface *surface, ListenerMetrics &metrics)
+{
+    rdpUpdate *update = client->context.update;
+    BOOL painting = FALSE;
+    REGION16 damaged; // destinations of the copies not blitted so far, which later copies can't take from either
+
+    region16_init(&damaged);
+    for (auto &copy : copies) {
+        EnterCriticalSection(&(client->lock));
+        BOOL ret = !region16_intersects_rect(&(client->invalidRegion), &copy.src) &&
+                   !region16_intersects_rect(&damaged, &copy.src);
+        LeaveCriticalSection(&(client->lock));
+
+        if (ret && !painting) {
+            IFCALLRET(update->BeginPaint, ret, update->context);
+            painting = ret;
+        }
+        if (ret) {
+            SCRBLT_ORDER order = { 0 };
+            order.nLeftRect = copy.dst_x;
+            order.nTopRect = copy.dst_y;
+            order.nWidth = copy.src.right - copy.src.left;
+            order.nHeight = copy.src.bottom - copy.src.top;
+            order.bRop = ROP_SRCCOPY;
+            order.nXSrc = copy.src.left;
+            order.nYSrc = copy.src.top;
+            IFCALLRET(update->primary->ScrBlt, ret, update->context, &order);
+        }
+
+        if (!ret) {
+            RECTANGLE_16 dst = rdpmux_copy_destination(copy);
+            region16_union_rect(&damaged, &damaged, &dst);
+            region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &dst);
+            metrics.copies_damaged++;
+        }
+    }
 
-    if (ArrayList_Count(server->clients) < 1)
+    if (painting)
+        IFCALL(update->EndPaint, update->context);
+    region16_uninit(&damaged);
+}
+
+/**
+ * @brief Applies the copies the VM made in its framebuffer to the surface, and to what the clients show by sending
+ * them blits, so scrolling and moving windows don't have to be re-encoded.
+ *
+ * A copy can only be blitted if every client can take blits, and the surface holds what the VM copied at the source.
+ * Other copies are sent as damage at their destination instead, to everybody, the way they would have been without
+ * copies. The same goes for copies some client doesn't show the source of yet. The blits go out ahead of the frame
+ * they are part of, so nothing the VM drew over a copy's destination since can be overwritten by them.
+ */
+static void rdpmux_subsystem_apply_copies(rdpmuxShadowSubsystem *system, const std::vector<ScreenCopy> &copies)
+{
+    rdpShadowSurface *surface = system->server->surface;
+    wArrayList *clients = system->server->clients;
+    ListenerMetrics &metrics = system->listener->Metrics();
+    std::vector<rdpShadowClient *> viewers;
+    std::vector<ScreenCopy> blits;
+
+    if (copies.empty())
+        return;
+    if (system->fullRefresh) {
+        metrics.copies_damaged += copies.size(); // everything is resent anyway
         return;
+    }
+
+    // same order as rdpmux_subsystem_share_frame(), clients first
+    ArrayList_Lock(clients);
+    int count = ArrayList_Count(clients);
+    for (int i = 0; i < count; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+
+        // whoever isn't shown anything right now is sent the whole surface once that changes
+        if (!client || !client->activated || client->suppressOutput || client->inLobby || !client->mayView)
+            continue;
+        viewers.push_back(client);
+    }
+
+    EnterCriticalSection(&(surface->lock));
+    BOOL blittable = !viewers.empty();
+    for (auto client : viewers) {
+        if (!rdpmux_subsystem_can_blit(client, surface))
+            blittable = FALSE;
+    }
+
+    for (auto &copy : copies) {
+        UINT32 width = copy.src.right - copy.src.left;
+        UINT32 height = copy.src.bottom - copy.src.top;
+        RECTANGLE_16 dst = rdpmux_copy_destination(copy);
+
+        BOOL inside = width > 0 && height > 0 && copy.src.right <= surface->width &&
+                      copy.src.bottom <= surface->height && copy.dst_x + width <= (UINT32) surface->width &&
+                      copy.dst_y + height <= (UINT32) surface->height;
+        BOOL blitted = inside && blittable && !region16_intersects_rect(&(surface->invalidRegion), &copy.src);
+
+        if (inside)
+            rdpmux_surface_copy(surface, copy);
+        if (blitted) {
+            blits.push_back(copy);
+            metrics.copies++;
+        } else {
+            region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &dst);
+            metrics.copies_damaged++;
+        }
+    }
+
+    if (!blits.empty()) {
+        for (auto client : viewers)
+            rdpmux_client_blit(client, blits, surface, metrics);
+    }
+    LeaveCriticalSection(&(surface->lock));
+    ArrayList_Unlock(clients);
+}
 
-    auto formats = system->listener->GetRDPFormat();
+/**
+ * @brief Copies the part of the invalid region that lies on a head out of the head's framebuffer into the surface, as
+ * a seqlock read: the rects are copied, then the VM is checked not to have written to the framebuffer in the meantime.
+ * The VM never waits for us, so if it keeps redrawing we eventually give up. The caller must hold the surface's lock
+ * and a copy of the head, which keeps its mapping in place.
+ *
+ * @returns FALSE if the head doesn't match its framebuffer or the surface, which means a display switch is on its way,
+ * or if copying failed. TRUE otherwise.
+ *
+ * @param consistent Set to whether the copy is consistent.
+ */
+static BOOL rdpmux_subsystem_copy_head(rdpmuxShadowSubsystem *system, const DisplayHead &head,
+                                       const RECTANGLE_16 *rects, UINT32 numRects, BOOL *consistent)
+{
+    rdpShadowSurface *surface = system->server->surface;
+    const MuxShmHeader *header = head.shm_header;
+    auto formats = RDPListener::GetRDPFormat(head.format);
     auto source_format = std::get<0>(formats);
     auto dest_format = std::get<1>(formats);
     auto source_bpp = std::get<2>(formats);
+    size_t source_stride = (size_t) head.width * source_bpp;
 
-    if (source_format < 0 || dest_format < 0 || source_bpp < 0)
-        return; // invalid buffer type, don't make the copy
+    *consistent = FALSE;
+    if (head.x + head.width > (UINT32) surface->width || head.y + head.height > (UINT32) surface->height)
+        return FALSE;
 
-    auto dims = system->listener->GetDirtyRegion();
-    auto x = static_cast<UINT16>(std::get<0>(dims));
-    auto y = static_cast<UINT16>(std::get<1>(dims));
-    auto w = static_cast<UINT16>(std::get<2>(dims));
-    auto h = static_cast<UINT16>(std::get<3>(dims));
+    RECTANGLE_16 headRect;
+    headRect.left = (UINT16) head.x;
+    headRect.top = (UINT16) head.y;
+    headRect.right = (UINT16) (head.x + head.width);
+    headRect.bottom = (UINT16) (head.y + head.height);
 
-    invalidRect.left = x;
-    invalidRect.top = y;
-    invalidRect.right = x+w;
-    invalidRect.bottom = y+h;
+    // the converter is a lot faster than freerdp_image_copy() for the formats it handles. It takes the same
+    // coordinates in both framebuffers, so it's handed the surface starting at the head's corner.
+    bool convert = system->converter->Prepare(source_format, dest_format);
+    BYTE *headData = surface->data + (size_t) head.y * surface->scanline + (size_t) head.x * 4;
+
+    for (int attempt = 0; attempt < SHM_READ_ATTEMPTS; attempt++) {
+        uint64_t seq = shm_read_begin(header);
+        if (seq & 1) {
+            std::this_thread::yield();
+            continue;
+        }
 
-    WLog_DBG(TAG, "invalidRect: %d x %d (%d x %d)", x, y, w, h);
+        // the header is updated together with the pixels, so a mismatch means a display switch is on its way
+        if (header->width != head.width || header->height != head.height || header->stride != source_stride)
+            return FALSE;
+
+        for (UINT32 i = 0; i < numRects; i++) {
+            RECTANGLE_16 part;
+            if (!rectangles_intersection(&rects[i], &headRect, &part))
+                continue;
+
+            auto left = part.left - head.x;
+            auto top = part.top - head.y;
+            auto width = part.right - part.left;
+            auto height = part.bottom - part.top;
+
+            if (convert) {
+                system->converter->Convert(headData, surface->scanline, (const uint8_t *) head.shm_buffer,
+                                           source_stride, left, top, width, height);
+                continue;
+            }
+
+            if (!freerdp_image_copy(surface->data,              /* destination surface */
+                                    dest_format,                /* destination surface pixel format */
+                                    surface->scanline,          /* destination surface scanline */
+                                    part.left,                  /* x coordinate of top left corner of region to copy */
+                                    part.top,                   /* y coordinate of top left corner of region to copy */
+                                    width,                      /* width of region to copy */
+                                    height,                     /* height of region to copy */
+                                    (BYTE *) head.shm_buffer,   /* source surface to copy data from */
+                                    source_format,              /* source surface pixel format */
+                                    source_stride,              /* scanline of source surface */
+                                    left,                       /* x coord of top left corner of dirty part of source buffer */
+                                    top,                        /* y coord of top left corner of dirty part of source buffer */
+                                    NULL,                       /* GDI palette to use */
+                                    FREERDP_FLIP_NONE           /* transformations to apply */
+            )) {
+                return FALSE;
+            }
+        }
+
+        if (shm_read_valid(header, seq)) {
+            *consistent = TRUE;
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Applies the subsystem's share of new listener settings: the frame rate cap, and whatever only takes effect
+ * with a rate update, which is brought forward to right away.
+ */
+static void rdpmux_subsystem_apply_config(rdpmuxShadowSubsystem *system, const ListenerConfig &config)
+{
+    system->rateController->SetMaxRate(config.max_frame_rate > 0 ? config.max_frame_rate : MAX_FRAME_RATE);
+    system->nextRateUpdate = GetTickCount64();
+}
+
+BOOL rdpmux_subsystem_update_frame(rdpmuxShadowSubsystem *system)
+{
+    rdpShadowServer *server = system->server;
+    rdpShadowSurface *surface = server->surface;
+    RECTANGLE_16 surfaceRect;
+    const RECTANGLE_16 *rects = NULL;
+    UINT32 numRects = 0;
+    BOOL copied = TRUE;
+    BOOL consistent = TRUE;
+
+    // always take the damage, even if we end up not using it, so it doesn't pile up in the listener
+    std::vector<ScreenCopy> copies;
+    DamageTrace taken;
+    auto dirty = system->listener->TakeDirtyRegion(copies, taken);
+    system->trace->Merge(taken);
+
+    // in between two frames is where new settings go in, so no frame ever sees half of them
+    ListenerConfig config;
+    if (system->listener->ApplyConfig(config))
+        rdpmux_subsystem_apply_config(system, config);
+
+    // before the damage, which may already be newer than what was copied. The copies only touch the surface, so this
+    // doesn't hold up display switches on the shm mappings while the blits go out.
+    rdpmux_subsystem_apply_copies(system, copies);
+
+    // a copy of the heads holds on to their mappings, which the listener replaces when the VM switches displays. It
+    // doesn't have to wait for us to do so.
+    DisplayHead heads[MUX_MAX_HEADS];
+    {
+        std::lock_guard<std::mutex> shmLock(system->listener->shmMutex);
+        std::copy(std::begin(system->listener->heads), std::end(system->listener->heads), heads);
+    }
+    const DisplayHead *primary = NULL;
+    int numHeads = 0;
+    BOOL valid = TRUE;
+    for (int i = 0; i < MUX_MAX_HEADS; i++) {
+        if (!heads[i].shm_header)
+            continue;
+        auto formats = RDPListener::GetRDPFormat(heads[i].format);
+        if (std::get<0>(formats) < 0 || std::get<1>(formats) < 0 || std::get<2>(formats) < 0)
+            valid = FALSE;
+        if (!primary)
+            primary = &heads[i];
+        numHeads++;
+    }
+
+    if (ArrayList_Count(server->clients) < 1 || numHeads == 0 || !valid) {
+        // nobody to copy for, or nothing valid to copy from. Whatever we skip now is stale by the time we can copy
+        // again, so start over with the whole surface then.
+        system->fullRefresh = TRUE;
+        *system->trace = DamageTrace();
+        return TRUE;
+    }
+
+    // when the VM's framebuffer looks exactly like the surface, the clients can just as well encode from it directly.
+    // That takes a single head covering all of the surface.
+    auto formats = RDPListener::GetRDPFormat(primary->format);
+    BOOL passthrough = system->listener->ShmPassthrough() && numHeads == 1 && primary->x == 0 && primary->y == 0 &&
+                       std::get<0>(formats) == std::get<1>(formats) &&
+                       primary->shm_header->stride == surface->scanline &&
+                       primary->shm_header->width == (UINT32) surface->width &&
+                       primary->shm_header->height == (UINT32) surface->height;
+    if (system->passthrough && !passthrough)
+        system->fullRefresh = TRUE; // nothing was copied into the surface while we passed the framebuffer through
+    system->passthrough = passthrough;
+
+    if (dirty.empty() && !system->fullRefresh && region16_is_empty(&(surface->invalidRegion)))
+        return TRUE;
 
     surfaceRect.top = 0;
     surfaceRect.left = 0;
     surfaceRect.right = (UINT16) surface->width;
     surfaceRect.bottom = (UINT16) surface->height;
 
-    region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &invalidRect);
+    EnterCriticalSection(&(surface->lock));
+
+    if (system->fullRefresh) {
+        region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &surfaceRect);
+        system->fullRefresh = FALSE;
+    }
+
+    // feed every damaged rect into the invalid region separately, so that scattered updates stay scattered instead
+    // of being merged into one bounding box.
+    for (auto &invalidRect : dirty) {
+        WLog_DBG(TAG, "invalidRect: (%u, %u) -> (%u, %u)", invalidRect.left, invalidRect.top, invalidRect.right,
+                 invalidRect.bottom);
+        region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &invalidRect);
+    }
     region16_intersect_rect(&(surface->invalidRegion), &(surface->invalidRegion), &surfaceRect);
 
-    if (!region16_is_empty(&(surface->invalidRegion))) {
-        extents = region16_extents(&(surface->invalidRegion));
-
-        auto left = extents->left;
-        auto top = extents->top;
-        auto width = extents->right - extents->left;
-        auto height = extents->bottom - extents->top;
-
-        if (!freerdp_image_copy(surface->data,                             /* destination surface */
-                                dest_format,                               /* destination surface pixel format */
-                                surface->scanline,                         /* destination surface scanline */
-                                left,                                      /* x coordinate of top left corner of region to copy */
-                                top,                                       /* y coordinate of top left corner of region to copy */
-                                width,                                     /* width of region to copy */
-                                height,                                    /* height of region to copy */
-                                (BYTE *) system->listener->shm_buffer,     /* source surface to copy data from */
-                                source_format,                             /* source surface pixel format */
-                                system->src_width * source_bpp,            /* scanline of source surface */
-                                left,                                      /* x coord of top left corner of dirty part of source buffer */
-                                top,                                       /* y coord of top left corner of dirty part of source buffer */
-                                NULL,                                      /* GDI palette to use */
-                                FREERDP_FLIP_NONE                          /* transformations to apply */
-        )) return;
-        shadow_subsystem_frame_update((rdpShadowSubsystem *) system);
+    if (region16_is_empty(&(surface->invalidRegion))) {
+        LeaveCriticalSection(&(surface->lock));
+        *system->trace = DamageTrace(); // all of it was off the surface
+        return TRUE;
+    }
+
+    int vmId = system->listener->VmId();
+    if (system->trace->valid)
+        trace(TRACE_FRAME_START, vmId, system->trace->seq, metrics_now_us());
+
+    rects = region16_rects(&(surface->invalidRegion), &numRects);
+
+    // how much of the screen changes per frame is what tells video apart from text for the codec policy
+    UINT64 changedArea = 0;
+    for (UINT32 i = 0; i < numRects; i++)
+        changedArea += (UINT64) (rects[i].right - rects[i].left) * (rects[i].bottom - rects[i].top);
+
+    if (passthrough) {
+        LeaveCriticalSection(&(surface->lock));
+        return rdpmux_subsystem_passthrough_frame(system, *primary, changedArea);
+    }
+
+    // every head is a seqlock of its own, and the frame is only good if all of them were read consistently. Parts of
+    // the desktop no head covers stay blank.
+    for (int i = 0; i < MUX_MAX_HEADS && copied && consistent; i++) {
+        if (heads[i].shm_header)
+            copied = rdpmux_subsystem_copy_head(system, heads[i], rects, numRects, &consistent);
+    }
+
+    LeaveCriticalSection(&(surface->lock));
+
+    if (!copied)
+        return TRUE; // not going to get any better by retrying, wait for new damage
+
+    if (!consistent) {
+        // the invalid region is left as it is, so the retry copies all of it again
+        WLog_DBG(TAG, "Framebuffer changed while copying, deferring frame");
+        system->listener->Metrics().frames_deferred++;
+        return FALSE;
     }
+
+    if (system->trace->valid)
+        trace(TRACE_FRAME_COPIED, vmId, system->trace->seq, metrics_now_us());
+    rdpmux_subsystem_publish_frame(system, changedArea);
+
+    // every client has picked up the invalid region by now, so start the next frame from a clean slate. Otherwise
+    // the region keeps growing and every frame re-encodes everything that was ever damaged.
+    EnterCriticalSection(&(surface->lock));
+    region16_clear(&(surface->invalidRegion));
+    LeaveCriticalSection(&(surface->lock));
+
+    return TRUE;
 }
 
 int rdpmux_subsystem_enum_monitors(MONITOR_DEF *monitors, int maxMonitors)
@@ -136,29 +835,87 @@ int rdpmux_subsystem_enum_monitors(MONITOR_DEF *monitors, int maxMonitors)
     int numMonitors = 1;
     MONITOR_DEF *monitor = &monitors[0];
 
-    /* default to largest size allowed */
+    // the VM's desktop as the listener knows it so far, the heads are added once the listener calls us up
+    RDPListener *listener = rdp_listener_object;
     monitor->left = 0;
     monitor->top = 0;
-    monitor->right = 4096;
-    monitor->bottom = 2048;
+    monitor->right = listener ? listener->Width() : 0;
+    monitor->bottom = listener ? listener->Height() : 0;
     monitor->flags = 1;
 
     return numMonitors;
 }
 
+/**
+ * @brief Describes the VM's desktop and its heads in the subsystem's monitors.
+ *
+ * The shadow server only ever shares the selected monitor, which is the first one, so that one spans the whole
+ * desktop. The heads follow it, one monitor each, in the order of their index.
+ */
+static void rdpmux_subsystem_update_monitors(rdpmuxShadowSubsystem *system)
+{
+    MONITOR_DEF *desktop = &(system->monitors[0]);
+    desktop->left = 0;
+    desktop->top = 0;
+    desktop->right = system->listener->Width();
+    desktop->bottom = system->listener->Height();
+    desktop->flags = 1;
+
+    int numMonitors = 1;
+    std::lock_guard<std::mutex> lock(system->listener->shmMutex);
+    for (int i = 0; i < MUX_MAX_HEADS; i++) {
+        const DisplayHead &head = system->listener->heads[i];
+        HeadLayout &layout = system->layout[i];
+        layout.on = head.shm_fd >= 0;
+        layout.rect.left = (UINT16) head.x;
+        layout.rect.top = (UINT16) head.y;
+        layout.rect.right = (UINT16) (head.x + head.width);
+        layout.rect.bottom = (UINT16) (head.y + head.height);
+        layout.serial = head.switch_serial;
+
+        if (head.shm_fd < 0 || numMonitors >= (int) (sizeof(system->monitors) / sizeof(system->monitors[0])))
+            continue;
+        MONITOR_DEF *monitor = &(system->monitors[numMonitors++]);
+        monitor->left = head.x;
+        monitor->top = head.y;
+        monitor->right = head.x + head.width;
+        monitor->bottom = head.y + head.height;
+        monitor->flags = 0;
+    }
+    system->numMonitors = numMonitors;
+}
+
+/**
+ * @brief Blanks a rectangle of the surface. The caller must hold the surface lock.
+ */
+static void rdpmux_surface_clear(rdpShadowSurface *surface, const RECTANGLE_16 &rect)
+{
+    UINT32 right = std::min<UINT32>(rect.right, surface->width);
+    UINT32 bottom = std::min<UINT32>(rect.bottom, surface->height);
+    if (rect.left >= right || rect.top >= bottom)
+        return;
+
+    for (UINT32 row = rect.top; row < bottom; row++)
+        memset(surface->data + (size_t) row * surface->scanline + (size_t) rect.left * 4, 0,
+               (size_t) (right - rect.left) * 4);
+}
+
 BOOL rdpmux_subsystem_check_resize(rdpmuxShadowSubsystem *system)
 {
+    uint32_t serial = system->listener->LayoutSerial();
+    if (serial == system->layoutSerial)
+        return FALSE;
+    system->layoutSerial = serial;
+
+    HeadLayout previous[MUX_MAX_HEADS];
+    std::copy(std::begin(system->layout), std::end(system->layout), previous);
+    rdpmux_subsystem_update_monitors(system);
+    rdpShadowSurface *surface = system->server->surface;
+
     if (system->src_width != system->listener->Width() || system->src_height != system->listener->Height()) {
         /* screen size changed */
-        MONITOR_DEF *monitor = &(system->monitors[0]);
         MONITOR_DEF *virtualScreen = &(system->virtualScreen);
 
-        /* update monitor definition */
-        monitor->left = 0;
-        monitor->left = 0;
-        monitor->bottom = system->listener->Height();
-        monitor->right = system->listener->Width();
-
         /* resize */
         shadow_screen_resize(system->server->screen);
         system->src_height = system->listener->Height();
@@ -170,14 +927,41 @@ BOOL rdpmux_subsystem_check_resize(rdpmuxShadowSubsystem *system)
         virtualScreen->bottom = system->src_height;
         virtualScreen->right = system->src_width;
         virtualScreen->flags = 1;
+
+        // the surface was reallocated for the new size, so none of what it held is where it was anymore
+        EnterCriticalSection(&(surface->lock));
+        memset(surface->data, 0, (size_t) surface->scanline * surface->height);
+        LeaveCriticalSection(&(surface->lock));
+        system->fullRefresh = TRUE;
         return TRUE;
     }
-    return FALSE;
+
+    // a display switch brings the head's whole framebuffer along, so it's copied again wherever it is now. No head
+    // ever draws to the gaps in between heads, so whatever it left behind where it used to be is cleared, and sent as
+    // the blank it is now, unless another head was switched there.
+    EnterCriticalSection(&(surface->lock));
+    for (int i = 0; i < MUX_MAX_HEADS; i++) {
+        const HeadLayout &was = previous[i];
+        const HeadLayout &now = system->layout[i];
+        if (was.serial == now.serial)
+            continue;
+
+        if (was.on) {
+            rdpmux_surface_clear(surface, was.rect);
+            region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &was.rect);
+        }
+        if (now.on)
+            region16_union_rect(&(surface->invalidRegion), &(surface->invalidRegion), &now.rect);
+    }
+    LeaveCriticalSection(&(surface->lock));
+    return TRUE;
 }
 
 int rdpmux_subsystem_init(rdpmuxShadowSubsystem *system)
 {
-    system->numMonitors = rdpmux_subsystem_enum_monitors(system->monitors, 1);
+    // the heads the listener already knows about, the first check for a display switch then only picks up later ones
+    system->layoutSerial = system->listener->LayoutSerial();
+    rdpmux_subsystem_update_monitors(system);
     MONITOR_DEF *virtualScreen = &(system->virtualScreen);
 
     virtualScreen->left = 0;
@@ -188,12 +972,18 @@ int rdpmux_subsystem_init(rdpmuxShadowSubsystem *system)
 
     system->src_height = system->listener->Height();
     system->src_width = system->listener->Width();
+    system->lastConnected = GetTickCount64();
 
     return 1;
 }
 
 int rdpmux_subsystem_uninit(rdpmuxShadowSubsystem *system)
 {
+    if (system->loopTask) {
+        system->listener->Loop()->Remove(system->loopTask);
+        delete system->loopTask;
+        system->loopTask = NULL;
+    }
     return 1;
 }
 
@@ -210,72 +1000,334 @@ rdpmuxShadowSubsystem *rdpmux_subsystem_new()
     system->MouseEvent = (pfnShadowMouseEvent) rdpmux_mouse_event;
 
     system->listener = rdp_listener_object;
+    system->rateController = new FrameRateController(MAX_FRAME_RATE);
+    system->sharedEncoder = new SharedEncoder();
+    system->codecPolicy = new CodecPolicy();
+    system->converter = new PixelConverter();
+    system->peers = new std::map<rdpShadowClient *, PeerStats>();
+    system->cursor = new CursorState();
+    system->cursorPeers = new std::map<rdpShadowClient *, UINT32>();
+    system->lastMouseClient = new std::atomic<rdpShadowClient *>(nullptr);
+    system->trace = new DamageTrace();
 
     return system;
 }
 
 void rdpmux_subsystem_free(rdpmuxShadowSubsystem *system)
 {
+    if (!system)
+        return;
+
+    delete system->rateController;
+    delete system->sharedEncoder;
+    delete system->codecPolicy;
+    delete system->converter;
+    delete system->peers;
+    delete system->cursor;
+    delete system->cursorPeers;
+    delete system->lastMouseClient;
+    delete system->trace;
     free(system);
 }
 
-void *rdpmux_subsystem_thread(rdpmuxShadowSubsystem *system)
+/**
+ * @brief Feeds the current state of the connected clients into the rate controller, and applies the rate it picks both
+ * to our own frame pacing and to the VM's refresh timer. The codec policy is re-evaluated along with it.
+ */
+static void rdpmux_subsystem_update_rate(rdpmuxShadowSubsystem *system)
 {
-    DWORD nCount = 0;
-    DWORD status;
-    HANDLE events[32];
-    HANDLE stopEvent = system->server->StopEvent;
-    wMessagePipe *msgPipe = system->MsgPipe;
-    wMessage message;
-    DWORD interval;
-    UINT64 frametime;
+    wArrayList *clients = system->server->clients;
+    UINT32 inflight = 0;
+    UINT32 clientFps = 0;
+    UINT64 sent = 0;
+    UINT64 totalSent = 0;
+    UINT64 now = GetTickCount64();
+    std::map<rdpShadowClient *, PeerStats> seen;
 
-    events[nCount++] = stopEvent;
-    events[nCount++] = MessageQueue_Event(msgPipe->In);
+    ArrayList_Lock(clients);
+    int peers = ArrayList_Count(clients);
+    for (int i = 0; i < peers; i++) {
+        rdpShadowClient *client = (rdpShadowClient *) ArrayList_GetItem(clients, i);
+        if (!client || !client->encoder)
+            continue;
 
-    system->captureFrameRate = 30;
-    interval = (DWORD) (1000 / system->captureFrameRate);
-    frametime = GetTickCount64() + interval;
+        // the encoder tracks frame acknowledgements, and lowers its preferred rate when they come back late
+        inflight = std::max(inflight, shadow_encoder_inflight_frames(client->encoder));
+        UINT32 fps = shadow_encoder_preferred_fps(client->encoder);
+        if (fps > 0 && (clientFps == 0 || fps < clientFps))
+            clientFps = fps;
 
-    while(true) {
+        // the transport's counter is reset on every update, so keep a running total for the stats per client
+        UINT64 clientSent = freerdp_get_transport_sent(&(client->context), TRUE);
+        sent = std::max(sent, clientSent);
+        totalSent += clientSent;
 
-        if (!system->listener->listenerRunning()) {
-            break;
-        }
+        PeerStats peer = {std::string(), 0};
+        auto it = system->peers->find(client);
+        if (it != system->peers->end())
+            peer = it->second;
+        else if (client->context.peer && client->context.peer->hostname)
+            peer.address = client->context.peer->hostname;
+        peer.bytes_sent += clientSent;
+        seen[client] = peer;
+    }
+    ArrayList_Unlock(clients);
 
-        status = WaitForMultipleObjects(nCount, events, FALSE, 5);
+    // forget about clients that went away, their pointers may be reused by new ones
+    system->peers->swap(seen);
+    std::vector<PeerStats> peerStats;
+    for (auto &peer : *system->peers)
+        peerStats.push_back(peer.second);
+    system->listener->SetPeerStats(std::move(peerStats));
+    system->listener->Metrics().bytes_sent += totalSent;
 
-        if (WaitForSingleObject(stopEvent, 0) == WAIT_OBJECT_0) {
-            break;
-        }
+    UINT32 rate = system->rateController->Update((size_t) peers, inflight, clientFps);
+    system->captureFrameRate = std::max<UINT32>(rate, 1);
+    system->listener->SetFrameRate(rate);
+
+    UINT64 elapsed = std::max<UINT64>(now - system->lastRateUpdate, 1);
+    system->lastRateUpdate = now;
+    codec_choice codec = system->codecPolicy->Update(system->listener->CodecPolicySetting(), rate,
+                                                     sent * 1000 / elapsed);
+    system->codecPolicy->Apply(clients, system->server->surface);
+    system->listener->SetCodec(codec);
+}
+
+/**
+ * @brief Checks whether the subsystem has a frame to produce.
+ *
+ * New damage or a display switch always counts. A deferred frame or a pending full refresh only count while somebody is
+ * connected; the full refresh is kept around for whoever connects next, and the client's refresh request wakes us up.
+ */
+static BOOL rdpmux_subsystem_frame_due(rdpmuxShadowSubsystem *system, BOOL pending)
+{
+    if (WaitForSingleObject(system->listener->UpdateEvent(), 0) == WAIT_OBJECT_0)
+        return TRUE;
+
+    return (pending || system->fullRefresh) && ArrayList_Count(system->server->clients) > 0;
+}
+
+/**
+ * @brief Gives the pages of a surface's pixels back to the system. The buffer stays where it is, at the same size, and
+ * reads as black until it's drawn to again.
+ */
+static void rdpmux_surface_release(rdpShadowSurface *surface)
+{
+    if (!surface || !surface->data)
+        return;
+
+    // only whole pages can be given back, the partial ones at either end may be shared with other allocations
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t) surface->data + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) surface->data + (size_t) surface->scanline * surface->height) & ~(page - 1);
+
+    EnterCriticalSection(&(surface->lock));
+    if (end > begin)
+        madvise((void *) begin, end - begin, MADV_DONTNEED);
+    LeaveCriticalSection(&(surface->lock));
+}
+
+/**
+ * @brief Gives back the memory that only matters while somebody is connected. The VM stopped refreshing as soon as the
+ * last client went away; this also gives back the pages of the surface and the lobby, drops the shared encoder's
+ * buffers and unmaps the VM's framebuffers.
+ *
+ * The desktop keeps its size, so a client connecting to a hibernating listener negotiates the size it ends up with
+ * and never needs to be resized.
+ */
+static void rdpmux_subsystem_hibernate(rdpmuxShadowSubsystem *system)
+{
+    rdpmux_surface_release(system->server->surface);
+    rdpmux_surface_release(system->server->lobby);
+
+    delete system->sharedEncoder;
+    system->sharedEncoder = new SharedEncoder();
+    system->listener->ReleaseSharedMemory();
+
+    system->hibernating = TRUE;
+    system->fullRefresh = TRUE;
+    WLog_DBG(TAG, "No clients for %u s, hibernating", system->listener->IdleTimeout());
+}
+
+/**
+ * @brief Undoes rdpmux_subsystem_hibernate() for a client that just connected. The next frame copies all of the surface
+ * again.
+ */
+static void rdpmux_subsystem_wake(rdpmuxShadowSubsystem *system)
+{
+    system->listener->RestoreSharedMemory();
+    system->hibernating = FALSE;
+    system->fullRefresh = TRUE;
+    WLog_DBG(TAG, "Client connected, waking up");
+}
+
+/**
+ * @brief Works out what the subsystem waits for before producing its next frame.
+ *
+ * @returns How long to wait at most in ms, INFINITE if only an event can bring the next frame.
+ *
+ * @param events Set to the events to wait for, 4 at most.
+ * @param nCount Set to the number of events.
+ */
+static DWORD rdpmux_subsystem_prepare(rdpmuxShadowSubsystem *system, HANDLE *events, DWORD *nCount)
+{
+    *nCount = 0;
+    events[(*nCount)++] = system->server->StopEvent;
+    events[(*nCount)++] = MessageQueue_Event(system->MsgPipe->In);
+    events[(*nCount)++] = system->listener->CursorEvent();
+
+    // frames are produced only when there's something to show. While there isn't, we sleep until damage arrives.
+    // Once there is, we don't wake up for more damage before the next frame is due, and just let it accumulate.
+    DWORD timeout = INFINITE;
+    UINT64 now = GetTickCount64();
+    if (rdpmux_subsystem_frame_due(system, system->pending))
+        timeout = now < system->nextFrame ? (DWORD) (system->nextFrame - now) : 0;
+    else
+        events[(*nCount)++] = system->listener->UpdateEvent();
+
+    // while anybody is connected, keep checking on them even if the screen is idle: that's how we notice they
+    // went away. Once the rate has dropped to 0, the next client announces itself with a refresh request.
+    if (ArrayList_Count(system->server->clients) > 0 || system->rateController->Rate() > 0) {
+        DWORD untilRateUpdate = now < system->nextRateUpdate ? (DWORD) (system->nextRateUpdate - now) : 0;
+        timeout = std::min(timeout, untilRateUpdate);
+    }
+
+    // while nobody is, wake up once it's time to hibernate
+    UINT64 idleTimeout = (UINT64) system->listener->IdleTimeout() * 1000;
+    if (idleTimeout > 0 && !system->hibernating && ArrayList_Count(system->server->clients) < 1) {
+        UINT64 deadline = system->lastConnected + idleTimeout;
+        timeout = (DWORD) std::min<UINT64>(timeout, now < deadline ? deadline - now : 0);
+    }
+
+    return timeout;
+}
 
-        if (WaitForSingleObject(MessageQueue_Event(msgPipe->In), 0) == WAIT_OBJECT_0) {
-            if (MessageQueue_Peek(msgPipe->In, &message, TRUE)) {
-                if (message.id == WMQ_QUIT) {
-                    break;
-                }
-                rdpmux_subsystem_process_message(system, &message);
+/**
+ * @brief Does whatever woke the subsystem up: handles client messages, updates the frame rate and produces a frame if
+ * one is due.
+ *
+ * @returns FALSE once the subsystem has to stop.
+ */
+static BOOL rdpmux_subsystem_dispatch(rdpmuxShadowSubsystem *system)
+{
+    wMessagePipe *msgPipe = system->MsgPipe;
+    wMessage message;
+
+    if (!system->listener->listenerRunning()) {
+        return FALSE;
+    }
+
+    if (WaitForSingleObject(system->server->StopEvent, 0) == WAIT_OBJECT_0) {
+        return FALSE;
+    }
+
+    if (WaitForSingleObject(MessageQueue_Event(msgPipe->In), 0) == WAIT_OBJECT_0) {
+        if (MessageQueue_Peek(msgPipe->In, &message, TRUE)) {
+            if (message.id == WMQ_QUIT) {
+                return FALSE;
             }
+            rdpmux_subsystem_process_message(system, &message);
         }
+    }
 
-        if (status == WAIT_TIMEOUT || GetTickCount64() > frametime) {
+    // the cursor goes out right away, it has nothing to do with frames or their rate
+    if (WaitForSingleObject(system->listener->CursorEvent(), 0) == WAIT_OBJECT_0)
+        rdpmux_subsystem_update_cursor(system);
+
+    // a client coming or going changes the rate right away, everything else waits for the next interval
+    BOOL connected = ArrayList_Count(system->server->clients) > 0;
+    BOOL running = system->rateController->Rate() > 0;
+    if (connected != running || (connected && GetTickCount64() >= system->nextRateUpdate)) {
+        rdpmux_subsystem_update_rate(system);
+        system->nextRateUpdate = GetTickCount64() + RATE_UPDATE_INTERVAL;
+    }
+
+    // the first client to connect wakes us up with its refresh request, in time for the frame it asks for
+    UINT64 idleTimeout = (UINT64) system->listener->IdleTimeout() * 1000;
+    if (connected) {
+        system->lastConnected = GetTickCount64();
+        if (system->hibernating)
+            rdpmux_subsystem_wake(system);
+    } else if (idleTimeout > 0 && !system->hibernating && GetTickCount64() - system->lastConnected >= idleTimeout) {
+        rdpmux_subsystem_hibernate(system);
+    }
+
+    if (GetTickCount64() >= system->nextFrame && rdpmux_subsystem_frame_due(system, system->pending)) {
+        // display switches keep coming in while we hibernate, they're picked up once we wake up
+        if (!system->hibernating)
             rdpmux_subsystem_check_resize(system);
-            rdpmux_subsystem_update_frame(system);
-            interval = 1000 / system->captureFrameRate;
-            frametime += interval;
-        }
+        system->pending = !rdpmux_subsystem_update_frame(system);
+        system->nextFrame = GetTickCount64() + 1000 / system->captureFrameRate;
     }
 
+    return TRUE;
+}
+
+void *rdpmux_subsystem_thread(rdpmuxShadowSubsystem *system)
+{
+    HANDLE events[4];
+    DWORD nCount;
+
+    do {
+        DWORD timeout = rdpmux_subsystem_prepare(system, events, &nCount);
+        WaitForMultipleObjects(nCount, events, FALSE, timeout);
+    } while (rdpmux_subsystem_dispatch(system));
+
     return NULL;
 }
 
+/**
+ * @brief Produces the frames of a subsystem on the listener's event loop, instead of on a thread of its own.
+ */
+class SubsystemLoopTask : public LoopTask
+{
+public:
+    SubsystemLoopTask(rdpmuxShadowSubsystem *system) : system(system)
+    {
+    }
+
+    DWORD Prepare(std::vector<HANDLE> &events) override
+    {
+        HANDLE handles[4];
+        DWORD nCount;
+        DWORD timeout = rdpmux_subsystem_prepare(system, handles, &nCount);
+        events.assign(handles, handles + nCount);
+        return timeout;
+    }
+
+    bool Dispatch() override
+    {
+        return rdpmux_subsystem_dispatch(system);
+    }
+
+private:
+    rdpmuxShadowSubsystem *system;
+};
 
 int rdpmux_subsystem_start(rdpmuxShadowSubsystem *system)
 {
     if (!system)
         return -1;
 
-    if (!CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) rdpmux_subsystem_thread, (void *) system, 0, NULL))
+    system->captureFrameRate = MAX_FRAME_RATE;
+    system->nextFrame = GetTickCount64();
+    system->nextRateUpdate = system->nextFrame;
+    system->lastRateUpdate = system->nextFrame;
+    system->pending = FALSE;
+
+    // nobody is connected yet, tell the VM it can stop refreshing until somebody does
+    rdpmux_subsystem_update_rate(system);
+
+    EventLoop *loop = system->listener->Loop();
+    if (loop) {
+        system->loopTask = new SubsystemLoopTask(system);
+        loop->Add(system->loopTask);
+        return 1;
+    }
+
+    system->subsystemThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) rdpmux_subsystem_thread, (void *) system,
+                                           0, NULL);
+    if (!system->subsystemThread)
         return -1;
 
     return 1;
@@ -283,6 +1335,13 @@ int rdpmux_subsystem_start(rdpmuxShadowSubsystem *system)
 
 int rdpmux_subsystem_stop(rdpmuxShadowSubsystem *system)
 {
+    // the server's stop event is set by now, which is what makes the thread exit. A task on the event loop is only
+    // removed on uninit: we're called from the server thread here, which the loop may be waiting for.
+    if (system->subsystemThread) {
+        WaitForSingleObject(system->subsystemThread, INFINITE);
+        CloseHandle(system->subsystemThread);
+        system->subsystemThread = NULL;
+    }
     return 1;
 }
 
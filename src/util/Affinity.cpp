@@ -0,0 +1,228 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "common.h"
+#include "util/Affinity.h"
+
+#define SYSFS_NODE_PATH "/sys/devices/system/node"
+
+/**
+ * @brief Field of /proc/<pid>/task/<tid>/stat holding the CPU the thread last ran on, counted from the state field
+ * right after the command name.
+ */
+#define STAT_PROCESSOR_FIELD 36
+
+/**
+ * @brief Reads the first line of a file, e.g. of a sysfs attribute.
+ *
+ * @returns Whether the file could be read.
+ */
+static bool read_line(const std::string &path, std::string &line)
+{
+    std::ifstream file(path);
+    return (bool) std::getline(file, line);
+}
+
+CpuSet::CpuSet()
+{
+    CPU_ZERO(&cpus);
+}
+
+bool CpuSet::Parse(const std::string &list, CpuSet &set)
+{
+    CPU_ZERO(&set.cpus);
+
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        // sysfs and /proc end their lists with a newline, people put spaces after the commas
+        size_t first = range.find_first_not_of(" \t\n");
+        if (first == std::string::npos)
+            continue;
+        const char *begin = range.c_str() + first;
+
+        char *end;
+        unsigned long low = strtoul(begin, &end, 10);
+        unsigned long high = low;
+        if (end == begin)
+            return false;
+        if (*end == '-') {
+            begin = end + 1;
+            high = strtoul(begin, &end, 10);
+            if (end == begin)
+                return false;
+        }
+        while (*end == ' ' || *end == '\t' || *end == '\n')
+            end++;
+        if (*end != '\0' || low > high || high >= CPU_SETSIZE)
+            return false;
+
+        for (unsigned long cpu = low; cpu <= high; cpu++)
+            CPU_SET(cpu, &set.cpus);
+    }
+    return true;
+}
+
+CpuSet CpuSet::NumaNode(int node)
+{
+    CpuSet set;
+    std::string line;
+    if (node >= 0 && read_line(SYSFS_NODE_PATH "/node" + std::to_string(node) + "/cpulist", line))
+        Parse(line, set);
+    return set;
+}
+
+bool CpuSet::Empty() const
+{
+    return CPU_COUNT(&cpus) == 0;
+}
+
+int CpuSet::Count() const
+{
+    return CPU_COUNT(&cpus);
+}
+
+bool CpuSet::Contains(int cpu) const
+{
+    return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpus);
+}
+
+CpuSet CpuSet::Intersect(const CpuSet &other) const
+{
+    CpuSet set;
+    CPU_AND(&set.cpus, &cpus, &other.cpus);
+    return set;
+}
+
+std::string CpuSet::ToString() const
+{
+    std::stringstream ss;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!Contains(cpu))
+            continue;
+        int last = cpu;
+        while (Contains(last + 1))
+            last++;
+        if (ss.tellp() > 0)
+            ss << ",";
+        ss << cpu;
+        if (last > cpu)
+            ss << "-" << last;
+        cpu = last;
+    }
+    return ss.str();
+}
+
+bool CpuSet::Apply(pthread_t thread) const
+{
+    if (Empty())
+        return true;
+
+    int ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (ret != 0) {
+        LOG(WARNING) << "Could not pin thread to CPUs " << ToString() << ": " << strerror(ret);
+        return false;
+    }
+    return true;
+}
+
+ScopedAffinity::ScopedAffinity(const CpuSet &cpus) : pinned(false)
+{
+    if (cpus.Empty() || pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0)
+        return;
+    pinned = cpus.Apply(pthread_self());
+}
+
+ScopedAffinity::~ScopedAffinity()
+{
+    if (pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+}
+
+int numa_node_of_process(pid_t pid)
+{
+    CpuSet online;
+    std::string line;
+    if (!read_line(SYSFS_NODE_PATH "/online", line) || !CpuSet::Parse(line, online) || online.Count() < 2)
+        return -1;
+
+    std::vector<std::pair<int, CpuSet>> nodes;
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+        if (online.Contains(node))
+            nodes.push_back(std::make_pair(node, CpuSet::NumaNode(node)));
+    }
+
+    std::string proc = "/proc/" + std::to_string(pid);
+
+    // memory bound to a node, by numactl --membind or a cpuset, is where the VM's framebuffer ends up too
+    std::ifstream status(proc + "/status");
+    const std::string mems_key = "Mems_allowed_list:";
+    while (std::getline(status, line)) {
+        CpuSet mems;
+        if (line.compare(0, mems_key.size(), mems_key) == 0 && CpuSet::Parse(line.substr(mems_key.size()), mems)) {
+            CpuSet bound = mems.Intersect(online);
+            for (auto &node : nodes) {
+                if (bound.Count() == 1 && bound.Contains(node.first))
+                    return node.first;
+            }
+            break;
+        }
+    }
+
+    // otherwise go where the vCPUs run, which is where the framebuffer's pages got touched first
+    DIR *tasks = opendir((proc + "/task").c_str());
+    if (!tasks)
+        return -1;
+    std::map<int, int> votes;
+    while (struct dirent *task = readdir(tasks)) {
+        if (task->d_name[0] == '.')
+            continue;
+        if (!read_line(proc + "/task/" + task->d_name + "/stat", line))
+            continue;
+
+        // the command name may contain spaces and parentheses of its own, so the fields start after the last one
+        size_t comm_end = line.rfind(')');
+        if (comm_end == std::string::npos)
+            continue;
+        std::stringstream fields(line.substr(comm_end + 1));
+        std::string field;
+        bool found = true;
+        for (int i = 0; i <= STAT_PROCESSOR_FIELD && found; i++)
+            found = (bool) (fields >> field);
+        if (!found)
+            continue;
+        int cpu = atoi(field.c_str());
+        for (auto &node : nodes) {
+            if (node.second.Contains(cpu))
+                votes[node.first]++;
+        }
+    }
+    closedir(tasks);
+
+    int best = -1;
+    for (auto &vote : votes) {
+        if (best < 0 || vote.second > votes[best])
+            best = vote.first;
+    }
+    return best;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fstream>
+#include <zmq.h>
+#include "common.h"
+#include "util/CurveKeys.h"
+
+/**
+ * @brief Length of a Z85 encoded CURVE key.
+ */
+#define Z85_KEY_LENGTH 40
+
+/**
+ * @brief Length of a binary CURVE key.
+ */
+#define BINARY_KEY_LENGTH 32
+
+/**
+ * @brief Decodes a Z85 encoded CURVE key.
+ *
+ * @returns Whether the key was valid.
+ */
+static bool decode_key(const std::string &text, std::string &key)
+{
+    uint8_t binary[BINARY_KEY_LENGTH];
+
+    if (text.size() != Z85_KEY_LENGTH || !zmq_z85_decode(binary, text.c_str()))
+        return false;
+    key.assign((const char *) binary, sizeof(binary));
+    return true;
+}
+
+/**
+ * @brief Strips the whitespace keys tend to be surrounded by when pasted into a file.
+ */
+static std::string trim(const std::string &line)
+{
+    size_t begin = line.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return std::string();
+    return line.substr(begin, line.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+bool CurveKeys::Load(const std::string &secret_file, const std::string &clients_file, CurveKeys &keys)
+{
+    std::string line, key;
+
+    std::ifstream secret(secret_file);
+    if (!secret || !std::getline(secret, line) || !decode_key(trim(line), key)) {
+        LOG(WARNING) << "No valid CURVE secret key in " << secret_file;
+        return false;
+    }
+    keys.secret_key = trim(line);
+
+    std::ifstream clients(clients_file);
+    if (!clients) {
+        LOG(WARNING) << "Could not read CURVE client keys from " << clients_file;
+        return false;
+    }
+    keys.client_keys.clear();
+    for (int number = 1; std::getline(clients, line); number++) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (!decode_key(line, key)) {
+            LOG(WARNING) << "Invalid CURVE public key on line " << number << " of " << clients_file;
+            return false;
+        }
+        keys.client_keys.insert(key);
+    }
+
+    if (keys.client_keys.empty()) {
+        LOG(WARNING) << "No CURVE client keys in " << clients_file << ", nobody could connect";
+        return false;
+    }
+    return true;
+}
+
+bool CurveKeys::Enabled() const
+{
+    return !secret_key.empty();
+}
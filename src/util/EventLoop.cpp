@@ -0,0 +1,328 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <winpr/sysinfo.h>
+#include "common.h"
+#include "util/EventLoop.h"
+
+/**
+ * @brief Maximum number of ready descriptors taken from epoll at once.
+ */
+#define MAX_READY_EVENTS 64
+
+const uint64_t EventLoop::NO_DEADLINE;
+
+EventLoop::EventLoop(const CpuSet &cpus) : stop(false), running(true), load(0)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wakeup_fd < 0) {
+        LOG(FATAL) << "EVENTLOOP " << this << ": Could not set up epoll, exiting.";
+    }
+
+    // the wakeup descriptor is the only one without a source
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+
+    thread = std::thread(&EventLoop::run, this);
+    cpus.Apply(thread.native_handle());
+}
+
+EventLoop::~EventLoop()
+{
+    stop = true;
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+        LOG(WARNING) << "EVENTLOOP " << this << ": Could not wake up loop thread";
+    }
+    thread.join();
+    running = false;
+
+    // what's dropped here may hold on to objects whose destructors come back to Remove() their tasks, so the sources
+    // have to stay intact until all of it is gone
+    std::vector<std::function<void()>> orphans;
+    {
+        std::lock_guard<std::mutex> lock(posted_lock);
+        orphans.swap(posted);
+    }
+    for (auto &source : sources)
+        orphans.push_back(std::move(source->callback));
+    orphans.clear();
+    sources.clear();
+
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::Post(std::function<void()> fn)
+{
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(posted_lock);
+        first = posted.empty();
+        posted.push_back(std::move(fn));
+    }
+
+    // the loop drains everything in one go, so only the first function needs to wake it up
+    uint64_t one = 1;
+    if (first && write(wakeup_fd, &one, sizeof(one)) < 0) {
+        LOG(WARNING) << "EVENTLOOP " << this << ": Could not wake up loop thread";
+    }
+}
+
+void EventLoop::OnSignal(HANDLE event, std::function<void()> fn)
+{
+    Post([this, event, fn]() { addSource(nullptr, fn, {event}); });
+}
+
+void EventLoop::Add(LoopTask *task)
+{
+    if (ownsSources()) {
+        addSource(task, nullptr, {});
+        return;
+    }
+    Post([this, task]() { addSource(task, nullptr, {}); });
+}
+
+void EventLoop::Remove(LoopTask *task)
+{
+    auto remove = [this, task]() {
+        for (auto &source : sources) {
+            if (source->task == task && !source->dead)
+                unwatch(source.get());
+        }
+    };
+
+    if (ownsSources()) {
+        remove();
+        return;
+    }
+
+    std::promise<void> done;
+    Post([&remove, &done]() {
+        remove();
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+size_t EventLoop::Load() const
+{
+    return load;
+}
+
+bool EventLoop::ownsSources() const
+{
+    return !running || std::this_thread::get_id() == thread.get_id();
+}
+
+void EventLoop::addSource(LoopTask *task, std::function<void()> callback, const std::vector<HANDLE> &events)
+{
+    std::unique_ptr<Source> source(new Source());
+    source->task = task;
+    source->callback = std::move(callback);
+    source->deadline = NO_DEADLINE;
+    source->ready = false;
+    source->dead = false;
+    Source *added = source.get();
+    sources.push_back(std::move(source));
+    load++;
+
+    if (task) {
+        prepare(added);
+        return;
+    }
+
+    std::vector<int> fds;
+    for (HANDLE event : events)
+        fds.push_back(GetEventFileDescriptor(event));
+    watch(added, fds);
+}
+
+void EventLoop::prepare(Source *source)
+{
+    std::vector<HANDLE> events;
+    DWORD timeout = source->task->Prepare(events);
+
+    std::vector<int> fds;
+    for (HANDLE event : events)
+        fds.push_back(GetEventFileDescriptor(event));
+    watch(source, fds);
+
+    source->deadline = timeout == INFINITE ? NO_DEADLINE : GetTickCount64() + timeout;
+}
+
+void EventLoop::watch(Source *source, std::vector<int> fds)
+{
+    std::sort(fds.begin(), fds.end());
+    fds.erase(std::unique(fds.begin(), fds.end()), fds.end());
+
+    // most of the time a task waits for the same events as last time, so only the difference goes through epoll
+    for (int fd : source->fds) {
+        if (!std::binary_search(fds.begin(), fds.end(), fd))
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    std::vector<int> watched;
+    for (int fd : fds) {
+        if (std::binary_search(source->fds.begin(), source->fds.end(), fd)) {
+            watched.push_back(fd);
+            continue;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = source;
+        if (fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOG(WARNING) << "EVENTLOOP " << this << ": Could not wait for descriptor " << fd;
+            continue;
+        }
+        watched.push_back(fd);
+    }
+
+    source->fds.swap(watched);
+}
+
+void EventLoop::unwatch(Source *source)
+{
+    watch(source, {});
+    source->deadline = NO_DEADLINE;
+    source->dead = true;
+    load--;
+}
+
+void EventLoop::dispatch(Source *source)
+{
+    source->ready = false;
+    if (source->dead)
+        return; // removed by a source run before it in the same pass
+
+    if (!source->task) {
+        // watches only fire once, and the function goes away right after it ran
+        unwatch(source);
+        std::function<void()> callback = std::move(source->callback);
+        callback();
+        return;
+    }
+
+    if (!source->task->Dispatch()) {
+        unwatch(source);
+        return;
+    }
+    prepare(source);
+}
+
+void EventLoop::runPosted()
+{
+    std::vector<std::function<void()>> fns;
+    {
+        std::lock_guard<std::mutex> lock(posted_lock);
+        fns.swap(posted);
+    }
+    for (auto &fn : fns)
+        fn();
+}
+
+void EventLoop::run()
+{
+    struct epoll_event ready[MAX_READY_EVENTS];
+    std::vector<Source *> due;
+
+    while (!stop) {
+        uint64_t now = GetTickCount64();
+        uint64_t next = NO_DEADLINE;
+        for (auto &source : sources)
+            next = std::min(next, source->deadline);
+
+        int timeout = -1;
+        if (next != NO_DEADLINE)
+            timeout = next > now ? (int) std::min<uint64_t>(next - now, INT32_MAX) : 0;
+
+        int count = epoll_wait(epoll_fd, ready, MAX_READY_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(WARNING) << "EVENTLOOP " << this << ": epoll_wait failed, exiting loop: " << strerror(errno);
+            break;
+        }
+
+        bool woken = false;
+        for (int i = 0; i < count; i++) {
+            Source *source = (Source *) ready[i].data.ptr;
+            if (!source) {
+                woken = true;
+            } else if (!source->ready) {
+                source->ready = true;
+                due.push_back(source);
+            }
+        }
+
+        if (woken) {
+            uint64_t value;
+            if (read(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                LOG(WARNING) << "EVENTLOOP " << this << ": Could not reset wakeup descriptor";
+            }
+            runPosted();
+        }
+
+        now = GetTickCount64();
+        for (auto &source : sources) {
+            if (!source->ready && source->deadline <= now) {
+                source->ready = true;
+                due.push_back(source.get());
+            }
+        }
+
+        // sources may be added while these run, but none is freed before the pass is over
+        for (Source *source : due)
+            dispatch(source);
+        due.clear();
+
+        sources.erase(std::remove_if(sources.begin(), sources.end(),
+                                     [](const std::unique_ptr<Source> &source) { return source->dead; }),
+                      sources.end());
+    }
+
+    running = false;
+}
+
+EventLoopPool::EventLoopPool(unsigned int threads, const CpuSet &cpus) : next(0)
+{
+    for (unsigned int i = 0; i < std::max(threads, 1u); i++)
+        loops.emplace_back(new EventLoop(cpus));
+}
+
+EventLoop &EventLoopPool::Pick()
+{
+    // a loop only counts a listener once it started, so a burst of them is spread round-robin
+    size_t start = next++ % loops.size();
+    EventLoop *picked = loops[start].get();
+    for (size_t i = 1; i < loops.size(); i++) {
+        EventLoop *loop = loops[(start + i) % loops.size()].get();
+        if (loop->Load() < picked->Load())
+            picked = loop;
+    }
+    return *picked;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/InputQueue.h"
+
+InputQueue::InputQueue(size_t capacity) : enqueue_pos(0), dequeue_pos(0), pending(0)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    cells = new Cell[size];
+    mask = size - 1;
+
+    // a cell is free for the producer whose position matches its sequence number
+    for (size_t i = 0; i < size; i++)
+        cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+InputQueue::~InputQueue()
+{
+    delete[] cells;
+}
+
+bool InputQueue::push(const InputRecord &record, bool &first)
+{
+    // counted before the record is published, so the consumer can never release more than was pushed
+    first = pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the consumer hasn't gotten around to this cell since the last lap, we're full
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+            first = false;
+            return false;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->record = record;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool InputQueue::pop(InputRecord &record)
+{
+    Cell *cell = &cells[dequeue_pos & mask];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+
+    if (seq != dequeue_pos + 1)
+        return false; // empty, or the producer holding this cell hasn't finished writing it
+
+    record = cell->record;
+    // hand the cell to the producer one lap ahead
+    cell->seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+    dequeue_pos++;
+    return true;
+}
+
+bool InputQueue::release(size_t count)
+{
+    return pending.fetch_sub(count, std::memory_order_acq_rel) > count;
+}
+
+size_t InputQueue::size() const
+{
+    return pending.load(std::memory_order_relaxed);
+}
@@ -15,13 +15,59 @@
  */
 
 #include "util/MessageQueue.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+MessageQueue::MessageQueue()
+{
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0) {
+        LOG(WARNING) << "Could not create queue eventfd: " << strerror(errno);
+    }
+}
+
+MessageQueue::~MessageQueue()
+{
+    if (event_fd_ >= 0)
+        close(event_fd_);
+}
 
 void MessageQueue::enqueue(QueueItem item)
 {
     std::unique_lock<std::mutex> lock(mutex_);
-    queue_.push(item);
+    bool was_empty = queue_.empty();
+    queue_.push(std::move(item));
     lock.unlock();
     cond_push_.notify_one();
+
+    // only the first item needs to wake the consumer, the rest are picked up by the same dequeueAll()
+    if (was_empty)
+        wake();
+}
+
+std::queue<QueueItem> MessageQueue::dequeueAll()
+{
+    std::queue<QueueItem> items;
+    uint64_t count;
+
+    // reset before taking the items: anything queued after the swap below finds the queue empty and wakes us again
+    if (event_fd_ >= 0 && read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG(WARNING) << "Could not read queue eventfd: " << strerror(errno);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    items.swap(queue_);
+    return items;
+}
+
+void MessageQueue::wake()
+{
+    uint64_t one = 1;
+    if (event_fd_ >= 0 && write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG(WARNING) << "Could not write queue eventfd: " << strerror(errno);
+    }
 }
 
 // should block until a message is waiting in the queue,
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <sstream>
+#include "util/Metrics.h"
+
+uint64_t metrics_now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t HistogramSnapshot::Percentile(double p) const
+{
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return Histogram::UpperBound(i);
+    }
+    return Histogram::UpperBound(buckets.size() - 1);
+}
+
+Histogram::Histogram() : count(0), sum(0)
+{
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::Record(uint64_t value)
+{
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && value > UpperBound(bucket))
+        bucket++;
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+HistogramSnapshot Histogram::Snapshot() const
+{
+    HistogramSnapshot snapshot;
+    snapshot.count = count.load(std::memory_order_relaxed);
+    snapshot.sum = sum.load(std::memory_order_relaxed);
+    for (auto &bucket : buckets)
+        snapshot.buckets.push_back(bucket.load(std::memory_order_relaxed));
+    return snapshot;
+}
+
+uint64_t Histogram::UpperBound(int bucket)
+{
+    if (bucket >= BUCKETS - 1)
+        return UINT64_MAX;
+    return (uint64_t) 1 << bucket;
+}
+
+/**
+ * @brief Escapes a label value as the exposition format wants it.
+ */
+static std::string escape_label(const std::string &value)
+{
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"')
+            escaped += '\\';
+        if (c == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+PrometheusWriter::PrometheusWriter(std::ostream &out) : out(out)
+{
+    out.precision(15);
+}
+
+void PrometheusWriter::Family(const std::string &name, const char *type, const char *help)
+{
+    family = "rdpmux_" + name;
+    out << "# HELP " << family << " " << help << "\n";
+    out << "# TYPE " << family << " " << type << "\n";
+}
+
+void PrometheusWriter::Sample(const std::vector<std::string> &labels, double value)
+{
+    sample(family, labels, nullptr, std::string(), value);
+}
+
+void PrometheusWriter::Sample(const std::vector<std::string> &labels, const HistogramSnapshot &histogram,
+                              double scale)
+{
+    // buckets are cumulative in the exposition format
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < histogram.buckets.size(); i++) {
+        cumulative += histogram.buckets[i];
+
+        std::ostringstream bound;
+        bound.precision(out.precision());
+        if (i + 1 == histogram.buckets.size())
+            bound << "+Inf";
+        else
+            bound << Histogram::UpperBound(i) * scale;
+        sample(family + "_bucket", labels, "le", bound.str(), cumulative);
+    }
+    sample(family + "_sum", labels, nullptr, std::string(), histogram.sum * scale);
+    sample(family + "_count", labels, nullptr, std::string(), histogram.count);
+}
+
+void PrometheusWriter::sample(const std::string &name, const std::vector<std::string> &labels,
+                              const char *extra_name, const std::string &extra_value, double value)
+{
+    out << name;
+    if (!labels.empty() || extra_name) {
+        out << "{";
+        for (size_t i = 0; i + 1 < labels.size(); i += 2) {
+            if (i > 0)
+                out << ",";
+            out << labels[i] << "=\"" << escape_label(labels[i + 1]) << "\"";
+        }
+        if (extra_name)
+            out << (labels.empty() ? "" : ",") << extra_name << "=\"" << extra_value << "\"";
+        out << "}";
+    }
+    out << " " << value << "\n";
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "common.h"
+#include "util/MetricsExporter.h"
+
+/**
+ * @brief How long the accept loop sleeps before checking whether it should stop, in ms.
+ */
+#define POLL_TIMEOUT 500
+
+/**
+ * @brief Largest request we read. Anything past that is ignored, we answer every request the same anyway.
+ */
+#define MAX_REQUEST_SIZE 4096
+
+MetricsExporter::MetricsExporter(Collector collect) : collect(collect), sock(-1), stop(false)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stop = true;
+    if (thread.joinable())
+        thread.join();
+    if (sock >= 0)
+        close(sock);
+}
+
+bool MetricsExporter::Start(const std::string &address, uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        LOG(WARNING) << "Invalid metrics address " << address;
+        return false;
+    }
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        LOG(WARNING) << "Could not create metrics socket: " << strerror(errno);
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+        LOG(WARNING) << "Could not bind metrics socket to " << address << ":" << port << ": " << strerror(errno);
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    thread = std::thread(&MetricsExporter::run, this);
+    return true;
+}
+
+void MetricsExporter::run()
+{
+    struct pollfd item = {sock, POLLIN, 0};
+
+    while (!stop) {
+        int ret = poll(&item, 1, POLL_TIMEOUT);
+        if (ret < 0 && errno != EINTR) {
+            LOG(WARNING) << "Error polling metrics socket: " << strerror(errno);
+            return;
+        }
+        if (ret <= 0)
+            continue;
+
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+            continue;
+        serve(conn);
+        close(conn);
+    }
+}
+
+void MetricsExporter::serve(int conn)
+{
+    // a scraper that connects and then goes quiet shouldn't hold up the next one for long
+    struct timeval timeout = {1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // wait for the end of the headers, there is no request body to speak of
+    std::string request;
+    char buf[512];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_REQUEST_SIZE) {
+        ssize_t len = recv(conn, buf, sizeof(buf), 0);
+        if (len <= 0)
+            return;
+        request.append(buf, len);
+    }
+
+    std::ostringstream body;
+    std::string status = "200 OK";
+    if (request.compare(0, 4, "GET ") != 0) {
+        status = "405 Method Not Allowed";
+    } else {
+        collect(body);
+    }
+
+    std::ostringstream response;
+    response << "HTTP/1.0 " << status << "\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.str().size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body.str();
+
+    std::string data = response.str();
+    size_t pos = 0;
+    while (pos < data.size()) {
+        ssize_t len = send(conn, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+        if (len <= 0)
+            return;
+        pos += len;
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "util/PortAllocator.h"
+
+#define PORT_COUNT 65536
+#define WORD_BITS 64
+
+PortAllocator::PortAllocator(uint16_t first, uint16_t last) : used(PORT_COUNT / WORD_BITS, 0),
+                                                               first(std::max<uint16_t>(first, 1)),
+                                                               last(std::max(last, first)),
+                                                               in_use(0)
+{
+}
+
+uint16_t PortAllocator::Acquire(int &probe)
+{
+    // ports some other process holds stay marked until we're done, so each gets one try at most and a host with all of
+    // them taken fails instead of spinning
+    std::vector<uint16_t> taken;
+    uint16_t found = 0;
+    probe = -1;
+
+    while (true) {
+        int port;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            port = findFree(first, last);
+            if (port < 0)
+                break;
+
+            // taken while it's checked, so concurrent registrations don't end up checking and picking the same port
+            used[port / WORD_BITS] |= 1ull << (port % WORD_BITS);
+            in_use++;
+        }
+
+        probe = bindProbe((uint16_t) port);
+        if (probe >= 0) {
+            found = (uint16_t) port;
+            break;
+        }
+        taken.push_back((uint16_t) port);
+    }
+
+    for (uint16_t port : taken)
+        Release(port);
+    return found;
+}
+
+bool PortAllocator::Reserve(uint16_t port)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t bit = 1ull << (port % WORD_BITS);
+    if (port == 0 || used[port / WORD_BITS] & bit)
+        return false;
+    used[port / WORD_BITS] |= bit;
+    in_use++;
+    return true;
+}
+
+void PortAllocator::Release(uint16_t port)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t bit = 1ull << (port % WORD_BITS);
+    if (used[port / WORD_BITS] & bit) {
+        used[port / WORD_BITS] &= ~bit;
+        in_use--;
+    }
+}
+
+size_t PortAllocator::InUse()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return in_use;
+}
+
+bool PortAllocator::InRange(uint16_t port) const
+{
+    return port >= first && port <= last;
+}
+
+int PortAllocator::findFree(uint32_t from, uint32_t to)
+{
+    if (from > to)
+        return -1;
+
+    for (uint32_t word = from / WORD_BITS; word <= to / WORD_BITS; word++) {
+        uint64_t free = ~used[word];
+        if (word == from / WORD_BITS)
+            free &= ~0ull << (from % WORD_BITS);
+        if (word == to / WORD_BITS && to % WORD_BITS != WORD_BITS - 1)
+            free &= (1ull << (to % WORD_BITS + 1)) - 1;
+        if (free)
+            return (int) (word * WORD_BITS + __builtin_ctzll(free));
+    }
+    return -1;
+}
+
+int PortAllocator::bindProbe(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    // the listener sets SO_REUSEADDR too, so a port a listener just let go of is fine even while in TIME_WAIT
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // bound but not listening, so clients trying the port early are refused instead of left hanging
+    return fd;
+}
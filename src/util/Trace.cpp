@@ -0,0 +1,145 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include "util/Trace.h"
+
+std::atomic<bool> trace_enabled(false);
+
+namespace {
+    /**
+     * @brief Events of a single thread. Written by that thread alone, read by trace_dump().
+     */
+    struct TraceRing
+    {
+        TraceEvent events[TRACE_RING_SIZE];
+        std::atomic<uint64_t> head;     ///< Number of events ever recorded, the latest in slot (head - 1) % size.
+        std::atomic<bool> owned;        ///< Whether a live thread records into the ring.
+
+        TraceRing() : head(0), owned(true)
+        {
+        }
+    };
+
+    /**
+     * @brief Every ring ever handed out. Rings are never freed, but passed on to new threads once their thread exits,
+     * so there are only ever as many as threads were alive at once.
+     */
+    std::mutex rings_lock;
+    std::vector<TraceRing *> rings;
+
+    /**
+     * @brief The calling thread's ring, given up when the thread exits.
+     */
+    struct RingHandle
+    {
+        TraceRing *ring = nullptr;
+
+        ~RingHandle()
+        {
+            if (ring)
+                ring->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    thread_local RingHandle ring_handle;
+
+    TraceRing *acquire_ring()
+    {
+        std::lock_guard<std::mutex> lock(rings_lock);
+        for (TraceRing *ring : rings) {
+            bool owned = false;
+            if (ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+                return ring;
+        }
+        rings.push_back(new TraceRing());
+        return rings.back();
+    }
+
+    const char *point_name(uint16_t point)
+    {
+        switch (point) {
+            case TRACE_VM_REFRESH:
+                return "vm_refresh";
+            case TRACE_VM_SENT:
+                return "vm_sent";
+            case TRACE_RECEIVED:
+                return "received";
+            case TRACE_FRAME_START:
+                return "frame_start";
+            case TRACE_FRAME_COPIED:
+                return "frame_copied";
+            case TRACE_FRAME_SENT:
+                return "frame_sent";
+            default:
+                return "unknown";
+        }
+    }
+} // anonymous namespace
+
+void trace_record(trace_point point, uint32_t vm, uint32_t seq, uint64_t time_us)
+{
+    TraceRing *ring = ring_handle.ring;
+    if (!ring)
+        ring = ring_handle.ring = acquire_ring();
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent &event = ring->events[head % TRACE_RING_SIZE];
+    event.time_us = time_us;
+    event.vm = vm;
+    event.seq = seq;
+    event.point = point;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool trace_dump(const std::string &path)
+{
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(rings_lock);
+        for (TraceRing *ring : rings) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+            size_t start = events.size();
+            for (uint64_t i = first; i < head; i++)
+                events.push_back(ring->events[i % TRACE_RING_SIZE]);
+
+            // the owner kept going while the slots were copied, and may be overwriting the slot of event now - size
+            // right now, so that one and everything before it is garbage
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t now = ring->head.load(std::memory_order_relaxed);
+            if (now + 1 > first + TRACE_RING_SIZE) {
+                uint64_t lost = std::min(now + 1 - first - TRACE_RING_SIZE, head - first);
+                events.erase(events.begin() + start, events.begin() + start + lost);
+            }
+        }
+    }
+
+    std::sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) {
+        return a.time_us < b.time_us;
+    });
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out)
+        return false;
+    out << "# time_us vm point seq\n";
+    for (auto &event : events)
+        out << event.time_us << " " << event.vm << " " << point_name(event.point) << " " << event.seq << "\n";
+    return (bool) out.flush();
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2016 Datto Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <cstring>
+#include <msgpack/pack.hpp>
+#include "util/WireFormat.h"
+
+bool wire_is_binary(const char *data, size_t size)
+{
+    return size >= sizeof(MuxWireHeader) && (static_cast<uint8_t>(data[0]) & 0x80) == 0;
+}
+
+/**
+ * @brief Writes the header of a binary message.
+ *
+ * @returns Pointer to the first byte after the header.
+ */
+static char *wire_write_header(char *buf, uint16_t type, uint16_t count)
+{
+    MuxWireHeader header;
+    header.type = htole16(type);
+    header.count = htole16(count);
+    memcpy(buf, &header, sizeof(header));
+    return buf + sizeof(header);
+}
+
+/**
+ * @brief Writes a single input event of a binary message.
+ *
+ * @returns Pointer to the first byte after the event.
+ */
+static char *wire_write_input(char *buf, uint16_t type, uint16_t a, uint16_t b, uint16_t c)
+{
+    MuxWireInput input;
+    input.type = htole16(type);
+    input.a = htole16(a);
+    input.b = htole16(b);
+    input.c = htole16(c);
+    memcpy(buf, &input, sizeof(input));
+    return buf + sizeof(input);
+}
+
+uint16_t wire_type(const char *data)
+{
+    MuxWireHeader header;
+    memcpy(&header, data, sizeof(header));
+    return le16toh(header.type);
+}
+
+bool wire_decode_tiles(const char *data, size_t size, std::vector<WireTile> &tiles)
+{
+    MuxWireHeader header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    size -= sizeof(header);
+
+    uint16_t count = le16toh(header.count);
+    tiles.clear();
+    if (le16toh(header.type) != DISPLAY_TILES || count < 1 || count > MUX_REMOTE_MAX_TILES)
+        return false;
+
+    for (uint16_t i = 0; i < count; i++) {
+        MuxWireTile tile;
+        if (size < sizeof(tile))
+            return false;
+        memcpy(&tile, data, sizeof(tile));
+        data += sizeof(tile);
+        size -= sizeof(tile);
+
+        WireTile decoded;
+        decoded.head = le32toh(tile.head);
+        decoded.x = le32toh(tile.x);
+        decoded.y = le32toh(tile.y);
+        decoded.w = le32toh(tile.w);
+        decoded.h = le32toh(tile.h);
+        decoded.size = le32toh(tile.size);
+        decoded.data = data;
+        if (decoded.size > size)
+            return false;
+        data += decoded.size;
+        size -= decoded.size;
+        tiles.push_back(decoded);
+    }
+    return true;
+}
+
+bool wire_decode(const char *data, size_t size, std::vector<uint32_t> &vec)
+{
+    MuxWireHeader header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    size -= sizeof(header);
+
+    uint16_t type = le16toh(header.type);
+    uint16_t count = le16toh(header.count);
+
+    vec.clear();
+    vec.push_back(type);
+
+    switch (type) {
+        case DISPLAY_UPDATE:
+        case DISPLAY_UPDATE_RECTS: {
+            if (count < 1 || size < count * sizeof(MuxWireRect) || (type == DISPLAY_UPDATE && count != 1))
+                return false;
+            if (type == DISPLAY_UPDATE_RECTS)
+                vec.push_back(count);
+            for (uint16_t i = 0; i < count; i++) {
+                MuxWireRect rect;
+                memcpy(&rect, data + i * sizeof(rect), sizeof(rect));
+                vec.push_back(le32toh(rect.x));
+                vec.push_back(le32toh(rect.y));
+                vec.push_back(le32toh(rect.w));
+                vec.push_back(le32toh(rect.h));
+            }
+
+            // newer VMs tell when they found and sent the damage, after the rects
+            size -= count * sizeof(MuxWireRect);
+            if (type == DISPLAY_UPDATE_RECTS && size >= sizeof(MuxWireTrace)) {
+                MuxWireTrace trace;
+                memcpy(&trace, data + count * sizeof(MuxWireRect), sizeof(trace));
+                vec.push_back(le32toh(trace.seq));
+                vec.push_back(le32toh(trace.refresh_us));
+                vec.push_back(le32toh(trace.sent_us));
+            }
+            return true;
+        }
+        case DISPLAY_SWITCH: {
+            MuxWireSwitch sw;
+            if (count != 1 || size < sizeof(sw))
+                return false;
+            memcpy(&sw, data, sizeof(sw));
+            vec.push_back(le32toh(sw.format));
+            vec.push_back(le32toh(sw.w));
+            vec.push_back(le32toh(sw.h));
+            vec.push_back(le32toh(sw.shm_size));
+            return true;
+        }
+        case HEAD_SWITCH: {
+            // laid out like a display switch with the head and its position appended, so it's processed the same way
+            MuxWireHeadSwitch sw;
+            if (count != 1 || size < sizeof(sw))
+                return false;
+            memcpy(&sw, data, sizeof(sw));
+            vec.push_back(le32toh(sw.format));
+            vec.push_back(le32toh(sw.w));
+            vec.push_back(le32toh(sw.h));
+            vec.push_back(le32toh(sw.shm_size));
+            vec.push_back(le32toh(sw.head));
+            vec.push_back(le32toh(sw.x));
+            vec.push_back(le32toh(sw.y));
+            return true;
+        }
+        case CURSOR_DEFINE: {
+            MuxWireCursor cursor;
+            if (count != 1 || size < sizeof(cursor))
+                return false;
+            memcpy(&cursor, data, sizeof(cursor));
+            uint32_t w = le32toh(cursor.w), h = le32toh(cursor.h);
+            if (w > MUX_CURSOR_MAX_SIZE || h > MUX_CURSOR_MAX_SIZE || size - sizeof(cursor) < w * h * sizeof(uint32_t))
+                return false;
+            vec.push_back(le32toh(cursor.hot_x));
+            vec.push_back(le32toh(cursor.hot_y));
+            vec.push_back(w);
+            vec.push_back(h);
+            data += sizeof(cursor);
+            for (uint32_t i = 0; i < w * h; i++) {
+                uint32_t pixel;
+                memcpy(&pixel, data + i * sizeof(pixel), sizeof(pixel));
+                vec.push_back(le32toh(pixel));
+            }
+            return true;
+        }
+        case DISPLAY_COPY: {
+            if (count < 1 || count > MUX_MAX_COPY_RECTS || size < count * sizeof(MuxWireCopy))
+                return false;
+            vec.push_back(count);
+            for (uint16_t i = 0; i < count; i++) {
+                MuxWireCopy copy;
+                memcpy(&copy, data + i * sizeof(copy), sizeof(copy));
+                vec.push_back(le32toh(copy.src_x));
+                vec.push_back(le32toh(copy.src_y));
+                vec.push_back(le32toh(copy.dst_x));
+                vec.push_back(le32toh(copy.dst_y));
+                vec.push_back(le32toh(copy.w));
+                vec.push_back(le32toh(copy.h));
+            }
+            return true;
+        }
+        case CURSOR_MOVE: {
+            MuxWireCursorPos pos;
+            if (count != 1 || size < sizeof(pos))
+                return false;
+            memcpy(&pos, data, sizeof(pos));
+            vec.push_back(le32toh(pos.x));
+            vec.push_back(le32toh(pos.y));
+            vec.push_back(le32toh(pos.visible));
+            return true;
+        }
+        case REMOTE_REGISTER: {
+            MuxWireRemoteRegister reg;
+            if (count != 1 || size < sizeof(reg))
+                return false;
+            memcpy(&reg, data, sizeof(reg));
+            vec.push_back(le32toh(reg.version));
+            vec.push_back(le32toh(reg.id));
+            vec.push_back(le32toh(reg.port));
+            vec.push_back(le32toh(reg.flags));
+            return true;
+        }
+        case SHUTDOWN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+size_t wire_encode(const std::vector<uint16_t> &vec, char *buf, size_t size)
+{
+    char *pos = buf;
+
+    if (vec.empty() || size < sizeof(MuxWireHeader) + sizeof(MuxWireInput))
+        return 0;
+
+    if (vec[0] == KEYBOARD && vec.size() >= 3) {
+        pos = wire_write_header(pos, KEYBOARD, 1);
+        pos = wire_write_input(pos, KEYBOARD, vec[1], vec[2], 0);
+    } else if (vec[0] == MOUSE && vec.size() >= 4) {
+        pos = wire_write_header(pos, MOUSE, 1);
+        pos = wire_write_input(pos, MOUSE, vec[1], vec[2], vec[3]);
+    } else if (vec[0] == DISPLAY_UPDATE_COMPLETE && vec.size() >= 3) {
+        MuxWireAck ack;
+        ack.success = htole32(vec[1]);
+        ack.framerate = htole32(vec[2]);
+        pos = wire_write_header(pos, DISPLAY_UPDATE_COMPLETE, 1);
+        memcpy(pos, &ack, sizeof(ack));
+        pos += sizeof(ack);
+    } else if ((vec[0] == REMOTE_CREDIT || vec[0] == REMOTE_RESYNC) && vec.size() >= 2) {
+        MuxWireCredit credit;
+        credit.credits = htole32(vec[1]);
+        pos = wire_write_header(pos, vec[0], 1);
+        memcpy(pos, &credit, sizeof(credit));
+        pos += sizeof(credit);
+    } else {
+        return 0;
+    }
+
+    return pos - buf;
+}
+
+size_t wire_encode_handle(uint32_t handle, char *buf, size_t size)
+{
+    MuxWireHandle body;
+
+    if (size < sizeof(MuxWireHeader) + sizeof(body))
+        return 0;
+
+    body.handle = htole32(handle);
+    char *pos = wire_write_header(buf, VM_HANDLE, 1);
+    memcpy(pos, &body, sizeof(body));
+    return sizeof(MuxWireHeader) + sizeof(body);
+}
+
+size_t wire_encode_input(const InputRecord *records, size_t count, char *buf, size_t size)
+{
+    if (count == 0 || count > UINT16_MAX || size < sizeof(MuxWireHeader) + count * sizeof(MuxWireInput))
+        return 0;
+
+    // a lone event goes out as the message type of the event itself, same as in msgpack
+    char *pos = wire_write_header(buf, count == 1 ? records[0].type : INPUT_BATCH, count);
+    for (size_t i = 0; i < count; i++) {
+        const InputRecord &record = records[i];
+        if (record.type == KEYBOARD)
+            pos = wire_write_input(pos, KEYBOARD, record.code, record.flags, 0);
+        else
+            pos = wire_write_input(pos, MOUSE, record.x, record.y, record.flags);
+    }
+
+    return pos - buf;
+}
+
+void msgpack_encode_input(const InputRecord *records, size_t count, msgpack::sbuffer &buf)
+{
+    buf.clear();
+    msgpack::packer<msgpack::sbuffer> packer(&buf);
+
+    if (count == 1) {
+        // same layout the msgpack'd std::vector<uint16_t> of the slow path has
+        const InputRecord &record = records[0];
+        if (record.type == KEYBOARD) {
+            packer.pack_array(3);
+            packer.pack_uint16(record.type);
+            packer.pack_uint16(record.code);
+            packer.pack_uint16(record.flags);
+        } else {
+            packer.pack_array(4);
+            packer.pack_uint16(record.type);
+            packer.pack_uint16(record.x);
+            packer.pack_uint16(record.y);
+            packer.pack_uint16(record.flags);
+        }
+        return;
+    }
+
+    // [INPUT_BATCH, count, type, a, b, c, type, a, b, c, ...], with (code, flags, 0) as a, b, c for keyboard events and
+    // (x, y, flags) for mouse events
+    packer.pack_array(2 + 4 * count);
+    packer.pack_uint16(INPUT_BATCH);
+    packer.pack_uint32(count);
+    for (size_t i = 0; i < count; i++) {
+        const InputRecord &record = records[i];
+        packer.pack_uint16(record.type);
+        if (record.type == KEYBOARD) {
+            packer.pack_uint16(record.code);
+            packer.pack_uint16(record.flags);
+            packer.pack_uint16(0);
+        } else {
+            packer.pack_uint16(record.x);
+            packer.pack_uint16(record.y);
+            packer.pack_uint16(record.flags);
+        }
+    }
+}